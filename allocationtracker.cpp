@@ -0,0 +1,340 @@
+#include "allocationtracker.hpp"
+#include "simulation.hpp"
+
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <algorithm>
+
+#include <boost/bind.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifndef _WIN32
+#include <execinfo.h>
+#endif
+#ifdef __GNUC__
+#include <cxxabi.h>
+#endif
+
+/// define boost logging stuff.
+BOOST_DEFINE_LOG(allocationtracker, "allocationtracker")
+
+/**
+\file
+Implementation of the allocation tracker, and the allocation hooks.
+*/
+
+const size_t AllocationTracker::MaxFrames;
+
+#ifdef _MSC_VER
+#define TEMSIM_THREAD_LOCAL __declspec(thread)
+#define TEMSIM_NOINLINE __declspec(noinline)
+#define TEMSIM_RETURN_ADDRESS() _ReturnAddress()
+#else
+#define TEMSIM_THREAD_LOCAL __thread
+#define TEMSIM_NOINLINE __attribute__((noinline))
+#define TEMSIM_RETURN_ADDRESS() __builtin_return_address(0)
+#endif
+
+/// true while the thread's allocations are being recorded
+static TEMSIM_THREAD_LOCAL bool tWatching = false;
+/// true while the tracker itself is allocating, which isn't recorded
+static TEMSIM_THREAD_LOCAL bool tInTracker = false;
+
+/// most frames of the hooks themselves at the top of a captured stack:
+/// CaptureFrames(), NoteAllocation(), TrackedAllocate() and operator new,
+/// though the compiler may inline or tail call some of them
+static const int gHookFrames = 4;
+
+// the return addresses of the calling thread's stack
+static int CaptureFrames(void** apFrames, int aMax) {
+#ifdef _WIN32
+    return CaptureStackBackTrace(0, aMax, apFrames, NULL);
+#else
+    return backtrace(apFrames, aMax);
+#endif
+}
+
+// a readable name for a return address
+static string FrameName(void* apFrame) {
+    std::ostringstream name;
+#ifdef _WIN32
+    name << apFrame;
+#else
+    char** symbols = backtrace_symbols(&apFrame, 1);
+    string symbol = symbols ? symbols[0] : "";
+    free(symbols);
+#ifdef __GNUC__
+    // module(mangled+offset) [address]
+    size_t open = symbol.find('(');
+    size_t plus = symbol.find('+', open);
+    if (open != string::npos && plus != string::npos && plus > open + 1) {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(
+            symbol.substr(open + 1, plus - open - 1).c_str(), 0, 0, &status);
+        if (status == 0 && demangled) {
+            symbol = symbol.substr(0, open + 1) + demangled + symbol.substr(plus);
+        }
+        free(demangled);
+    }
+#endif
+    name << symbol;
+#endif
+    return name.str();
+}
+
+// one line per frame of a call stack
+static void WriteFrames(std::ostream& arOut, const vector<void*>& arFrames) {
+    for (size_t f = 0; f < arFrames.size(); ++f) {
+        arOut << "    " << FrameName(arFrames[f]) << "\n";
+    }
+}
+
+AllocationTracker::AllocationTracker()
+:   mMode(eOff),
+    mRep(0),
+    mStep(0),
+    mAllocations(0),
+    mStepAllocations(0),
+    mStepsWatched(0),
+    mStepsAllocating(0)
+{
+}
+
+AllocationTracker& AllocationTracker::Instance() {
+    static AllocationTracker tracker;
+    return tracker;
+}
+
+bool AllocationTracker::HooksEnabled() {
+#ifdef TEMSIM_TRACK_ALLOCATIONS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void AllocationTracker::Register(Simulation& arSim) {
+    Event::Ptr start_of_rep = arSim.PreDispatchEvents()->FindEvent("start_of_rep");
+    start_of_rep->AddAction(MakeVoidAction(
+        boost::bind(
+            &AllocationTracker::StartOfRep,
+            this,
+            boost::ref(
+                arSim.RepControl().RefCurrentRep()
+            )
+        )
+    ));
+}
+
+void AllocationTracker::SetMode(Mode aMode) {
+    if (aMode != eOff && !HooksEnabled()) {
+        BOOST_LOGL(allocationtracker, info) << "Allocation tracking asked for, "
+            "but not built in (define TEMSIM_TRACK_ALLOCATIONS)" << std::endl;
+    }
+    // the first stack capture can allocate as it loads the unwinder
+    tInTracker = true;
+    void* frames[2];
+    CaptureFrames(frames, 2);
+    tInTracker = false;
+    mMode = aMode;
+}
+
+void AllocationTracker::StartOfRep(int aRep) {
+    mRep = aRep;
+    mStep = 0;
+}
+
+void AllocationTracker::BeginStep() {
+    if (mStep++ == 0 || mMode == eOff) {
+        return;
+    }
+    mStepAllocations = 0;
+    ++mStepsWatched;
+    tWatching = true;
+}
+
+void AllocationTracker::EndStep() {
+    if (!tWatching) {
+        return;
+    }
+    tWatching = false;
+    if (mStepAllocations == 0) {
+        return;
+    }
+    ++mStepsAllocating;
+    if (mMode == eStrict) {
+        bool in_tracker = tInTracker;
+        tInTracker = true;
+        vector<void*> stack;
+        {
+            boost::mutex::scoped_lock lock(mMutex);
+            stack = mStepFirstStack;
+        }
+        std::ostringstream message;
+        message << mStepAllocations << " allocations in step " << mStep - 1
+            << " of replicate " << mRep << ", the first from\n";
+        WriteFrames(message, stack);
+        tInTracker = in_tracker;
+        throw TemsimException(message.str(), "AllocationTracker");
+    }
+}
+
+TEMSIM_NOINLINE void AllocationTracker::NoteAllocation(size_t aBytes, void* apCaller) {
+    tInTracker = true;
+    void* frames[MaxFrames + gHookFrames];
+    int count = CaptureFrames(frames, (int)(MaxFrames + gHookFrames));
+    // the hooks' frames are those above the caller of operator new; how
+    // many there are depends on what the compiler inlined
+    int skip = 0;
+    while (skip < count && frames[skip] != apCaller) {
+        ++skip;
+    }
+    if (skip == count) {
+        skip = std::min(gHookFrames, count);
+    }
+    vector<void*> stack(frames + skip, frames + count);
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        Site& site = mSites[stack];
+        if (site.Count == 0) {
+            site.Frames = stack;
+            site.FirstStep = mStep - 1;
+            site.FirstRep = mRep;
+        }
+        ++site.Count;
+        site.Bytes += aBytes;
+        if (mStepAllocations == 0) {
+            mStepFirstStack = stack;
+        }
+        ++mAllocations;
+        ++mStepAllocations;
+    }
+    tInTracker = false;
+}
+
+// most allocations first, then most bytes
+static bool MoreAllocations(const AllocationTracker::Site& a,
+                            const AllocationTracker::Site& b) {
+    if (a.Count != b.Count) {
+        return a.Count > b.Count;
+    }
+    return a.Bytes > b.Bytes;
+}
+
+vector<AllocationTracker::Site> AllocationTracker::Sites(size_t aTop) const {
+    bool in_tracker = tInTracker;
+    tInTracker = true;
+    vector<Site> sites;
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        for (map<vector<void*>, Site>::const_iterator i = mSites.begin();
+             i != mSites.end(); ++i) {
+            sites.push_back(i->second);
+        }
+    }
+    std::stable_sort(sites.begin(), sites.end(), MoreAllocations);
+    if (aTop > 0 && sites.size() > aTop) {
+        sites.resize(aTop);
+    }
+    tInTracker = in_tracker;
+    return sites;
+}
+
+string AllocationTracker::Report(size_t aTop) const {
+    bool in_tracker = tInTracker;
+    tInTracker = true;
+    vector<Site> sites = Sites(aTop);
+    std::ostringstream report;
+    report << mAllocations << " allocations in " << mStepsAllocating << " of "
+        << mStepsWatched << " steps watched, from " << mSites.size()
+        << " call stacks\n";
+    for (size_t s = 0; s < sites.size(); ++s) {
+        report << "#" << s + 1 << ": " << sites[s].Count << " allocations, "
+            << sites[s].Bytes << " bytes (first in step " << sites[s].FirstStep
+            << " of replicate " << sites[s].FirstRep << ")\n";
+        WriteFrames(report, sites[s].Frames);
+    }
+    tInTracker = in_tracker;
+    return report.str();
+}
+
+void AllocationTracker::LogReport(size_t aTop) const {
+    BOOST_LOGL(allocationtracker, info) << Report(aTop) << std::endl;
+}
+
+void AllocationTracker::Clear() {
+    boost::mutex::scoped_lock lock(mMutex);
+    bool in_tracker = tInTracker;
+    tInTracker = true;
+    mSites.clear();
+    tInTracker = in_tracker;
+    mAllocations = 0;
+    mStepsWatched = 0;
+    mStepsAllocating = 0;
+}
+
+#ifdef TEMSIM_TRACK_ALLOCATIONS
+
+#if __cplusplus >= 201103L
+#define TEMSIM_NOTHROW noexcept
+#else
+#define TEMSIM_NOTHROW throw()
+#endif
+
+// allocate, telling the tracker if the thread is being watched
+// @param apCaller the return address in the code that called operator new
+static void* TrackedAllocate(size_t aBytes, void* apCaller) {
+    void* p = malloc(aBytes ? aBytes : 1);
+    if (tWatching && !tInTracker) {
+        AllocationTracker::Instance().NoteAllocation(aBytes, apCaller);
+    }
+    return p;
+}
+
+void* operator new(size_t aBytes) {
+    void* p = TrackedAllocate(aBytes, TEMSIM_RETURN_ADDRESS());
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t aBytes) {
+    void* p = TrackedAllocate(aBytes, TEMSIM_RETURN_ADDRESS());
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(size_t aBytes, const std::nothrow_t&) TEMSIM_NOTHROW {
+    return TrackedAllocate(aBytes, TEMSIM_RETURN_ADDRESS());
+}
+
+void* operator new[](size_t aBytes, const std::nothrow_t&) TEMSIM_NOTHROW {
+    return TrackedAllocate(aBytes, TEMSIM_RETURN_ADDRESS());
+}
+
+void operator delete(void* p) TEMSIM_NOTHROW {
+    free(p);
+}
+
+void operator delete[](void* p) TEMSIM_NOTHROW {
+    free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) TEMSIM_NOTHROW {
+    free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) TEMSIM_NOTHROW {
+    free(p);
+}
+
+#endif
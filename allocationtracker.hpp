@@ -0,0 +1,146 @@
+#ifndef _ALLOCATIONTRACKER_HPP_
+#define _ALLOCATIONTRACKER_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <boost/utility.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/log/log.hpp>
+
+#include "logging.hpp"
+#include "temsimexception.hpp"
+
+using std::string;
+using std::vector;
+using std::map;
+
+/// declare the boost logging stuff.
+BOOST_DECLARE_LOG(allocationtracker)
+
+/**
+\file
+Verification that the step loop doesn't allocate. Outside the model's own
+work, much of the cost of a step can be heap churn: string keys built by
+RegisterString, boost::function copies, boost::format in lookups, map
+inserts through operator[]. Building with TEMSIM_TRACK_ALLOCATIONS defined
+replaces the global operator new and delete with versions that report to
+the AllocationTracker; without it the tracker is there but never sees an
+allocation, and the program's allocations cost nothing extra.
+
+The step loop marks each step:
+@code
+AllocationTracker& tracker = AllocationTracker::Instance();
+tracker.SetMode(AllocationTracker::eRecord);
+for (...) {
+    tracker.BeginStep();
+    // ... the step ...
+    tracker.EndStep();
+}
+tracker.LogReport(20);
+@endcode
+
+The first step of each replicate (after StartOfRep(), which Register()
+arranges to be called at the start of every rep) is allowed to allocate,
+as it fills caches and sizes buffers. Every allocation made by the step
+loop's thread during a later step is recorded with its call stack. The
+allocations are grouped by call stack, and the report ranks the groups by
+the number of allocations.
+
+In strict mode EndStep() throws if the step allocated, so that a model
+whose steps have been made allocation free stays that way.
+*/
+
+class Simulation;
+
+/// Records the allocations made in the steps of a simulation.
+class AllocationTracker : boost::noncopyable {
+public:
+    /// What to do with allocations made during a step.
+    enum Mode {
+        eOff,       ///< nothing
+        eRecord,    ///< record them
+        eStrict     ///< record them, and fail the step
+    };
+
+    /// Most frames of call stack kept for an allocation.
+    static const size_t MaxFrames = 24;
+
+    /// The allocations made from one call stack.
+    struct Site {
+        vector<void*>       Frames;     ///< return addresses, innermost first
+        unsigned long long  Count;      ///< number of allocations
+        unsigned long long  Bytes;      ///< total size
+        long long           FirstStep;  ///< step of the first allocation
+        int                 FirstRep;   ///< replicate of the first allocation
+    };
+
+    /// The tracker (there is one per process, as there is one heap.)
+    static AllocationTracker& Instance();
+
+    /// True if the allocation hooks were built in.
+    static bool HooksEnabled();
+
+    /// Have StartOfRep() called at the start of each rep of a simulation.
+    void Register(Simulation& arSim);
+
+    /// Set what to do with allocations made during a step.
+    void SetMode(Mode aMode);
+    /// What is done with allocations made during a step.
+    Mode GetMode() const { return mMode; }
+
+    /// Note the start of a replicate; its first step isn't watched.
+    void StartOfRep(int aRep);
+
+    /// Start watching the calling thread's allocations, unless this is the
+    /// first step of a replicate.
+    void BeginStep();
+
+    /// Stop watching.
+    /// In strict mode, throws if the step allocated, giving the call stack
+    /// of the step's first allocation.
+    void EndStep();
+
+    /// Number of allocations recorded.
+    unsigned long long Allocations() const { return mAllocations; }
+    /// Number of steps watched.
+    unsigned long long StepsWatched() const { return mStepsWatched; }
+    /// Number of watched steps that allocated.
+    unsigned long long StepsAllocating() const { return mStepsAllocating; }
+
+    /// The call stacks allocations were made from, most allocations first.
+    /// @param aTop the most sites to give, or 0 for all.
+    vector<Site> Sites(size_t aTop = 0) const;
+
+    /// A readable report of the sites, with symbols where they can be found.
+    string Report(size_t aTop = 20) const;
+
+    /// Write the report to the log.
+    void LogReport(size_t aTop = 20) const;
+
+    /// Forget everything recorded.
+    void Clear();
+
+    /// Called by the allocation hooks.
+    /// @param aBytes the size allocated.
+    /// @param apCaller the return address in the code that called
+    /// operator new, where the recorded call stack starts.
+    void NoteAllocation(size_t aBytes, void* apCaller);
+
+private:
+    AllocationTracker();
+
+    Mode                mMode;
+    int                 mRep;
+    long long           mStep;          ///< steps begun since the start of the rep
+    unsigned long long  mAllocations;
+    unsigned long long  mStepAllocations; ///< allocations in the current step
+    vector<void*>       mStepFirstStack; ///< call stack of the current step's first allocation
+    unsigned long long  mStepsWatched;
+    unsigned long long  mStepsAllocating;
+    map<vector<void*>, Site> mSites;    ///< by call stack
+    mutable boost::mutex mMutex;
+};
+
+#endif
@@ -0,0 +1,378 @@
+#include "archivefilesystem.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/stream.hpp>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+#include "fileadvice.hpp"
+
+/// define boost logging stuff.
+BOOST_DEFINE_LOG(archivefilesystem, "archivefilesystem")
+
+/**
+\file
+Implementation of the archive file system and the archive packer.
+*/
+
+const char* gArchiveMagic = "TARCHIV1";
+
+/// current archive format version
+static const unsigned gArchiveVersion = 1;
+/// file contents start on multiples of this
+static const size_t gArchiveAlignment = 8;
+
+namespace {
+
+// 64 bit FNV-1a hash of a file's contents
+unsigned long long HashContents(const char* apData, size_t aSize) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i < aSize; ++i) {
+        h = (h ^ (unsigned char)apData[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+template<class T>
+void WriteField(std::ostream& arOut, const T& arValue) {
+    arOut.write((const char*)&arValue, sizeof(arValue));
+}
+
+// read a field from the index, if it's there
+template<class T>
+bool ReadField(const char*& arP, const char* apEnd, T& arValue) {
+    if ((size_t)(apEnd - arP) < sizeof(T)) {
+        return false;
+    }
+    memcpy(&arValue, arP, sizeof(T));
+    arP += sizeof(T);
+    return true;
+}
+
+/// removes a file when it goes out of scope, unless told to keep it
+class RemoveUnlessKept {
+public:
+    RemoveUnlessKept(const string& arFileName) : mFileName(arFileName), mKeep(false) {}
+    ~RemoveUnlessKept() {
+        if (!mKeep) {
+            std::remove(mFileName.c_str());
+        }
+    }
+    void Keep() { mKeep = true; }
+
+private:
+    string  mFileName;
+    bool    mKeep;
+};
+
+/// a file's entry in the index of an archive being packed
+struct PackedFile {
+    string              Name;
+    unsigned long long  Offset;
+    unsigned long long  Size;
+    unsigned long long  Hash;
+    bool operator<(const PackedFile& arOther) const { return Name < arOther.Name; }
+};
+
+/// a stream over part of an archive's mapping, which keeps the mapping open
+class ArchiveStream : public boost::iostreams::stream<boost::iostreams::array_source> {
+public:
+    ArchiveStream(boost::shared_ptr<boost::iostreams::mapped_file_source> apFile,
+                  const char* apData, size_t aSize)
+    :   boost::iostreams::stream<boost::iostreams::array_source>(apData, aSize),
+        mpFile(apFile) {}
+
+private:
+    boost::shared_ptr<boost::iostreams::mapped_file_source> mpFile;
+};
+
+// add the files under a directory to a list
+void ListFiles(const string& arRoot, const string& arPrefix, vector<string>& arFiles) {
+    string directory = arPrefix.empty() ? arRoot : arRoot + "/" + arPrefix;
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    HANDLE search = FindFirstFileA((directory + "/*").c_str(), &found);
+    if (search == INVALID_HANDLE_VALUE) {
+        throw TemsimException("Couldn't list " + directory, "ArchiveFileSystem");
+    }
+    do {
+        string name = found.cFileName;
+        if (name == "." || name == "..") {
+            continue;
+        }
+        string path = arPrefix.empty() ? name : arPrefix + "/" + name;
+        if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            ListFiles(arRoot, path, arFiles);
+        } else {
+            arFiles.push_back(path);
+        }
+    } while (FindNextFileA(search, &found));
+    FindClose(search);
+#else
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) {
+        throw TemsimException("Couldn't list " + directory, "ArchiveFileSystem");
+    }
+    while (dirent* entry = readdir(dir)) {
+        string name = entry->d_name;
+        if (name == "." || name == "..") {
+            continue;
+        }
+        string path = arPrefix.empty() ? name : arPrefix + "/" + name;
+        struct stat info;
+        if (stat((arRoot + "/" + path).c_str(), &info) != 0) {
+            continue;
+        }
+        if (S_ISDIR(info.st_mode)) {
+            ListFiles(arRoot, path, arFiles);
+        } else if (S_ISREG(info.st_mode)) {
+            arFiles.push_back(path);
+        }
+    }
+    closedir(dir);
+#endif
+}
+
+} // namespace
+
+string NormaliseArchivePath(const string& arFileName) {
+    string name = arFileName;
+    std::replace(name.begin(), name.end(), '\\', '/');
+    vector<string> parts;
+    size_t start = 0;
+    while (start <= name.size()) {
+        size_t end = name.find('/', start);
+        if (end == string::npos) {
+            end = name.size();
+        }
+        string part = name.substr(start, end - start);
+        if (part == "..") {
+            if (!parts.empty() && parts.back() != "..") {
+                parts.pop_back();
+            } else {
+                parts.push_back(part);
+            }
+        } else if (!part.empty() && part != ".") {
+            parts.push_back(part);
+        }
+        start = end + 1;
+    }
+    // an absolute name keeps its leading slash, so it can't be mistaken for
+    // one in the archive
+    string normalised = !name.empty() && name[0] == '/' ? "/" : "";
+    for (size_t i = 0; i < parts.size(); ++i) {
+        normalised += (i > 0 ? "/" : "") + parts[i];
+    }
+    return normalised;
+}
+
+vector<string> ListArchiveFiles(const string& arRoot) {
+    vector<string> files;
+    ListFiles(arRoot, "", files);
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+unsigned long long PackArchive(const string& arArchive, const string& arRoot,
+                               const vector<string>& arFiles) {
+    string temporary = arArchive + ".tmp";
+    // declared first, so the file is closed before it is removed
+    RemoveUnlessKept cleanup(temporary);
+    std::ofstream out(temporary.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw TemsimException("Couldn't write archive " + temporary, "ArchiveFileSystem");
+    }
+    ArchiveHeader header;
+    memset(&header, 0, sizeof(header));
+    out.write((const char*)&header, sizeof(header));
+
+    vector<PackedFile> index;
+    unsigned long long bytes = 0;
+    vector<char> contents;
+    for (size_t f = 0; f < arFiles.size(); ++f) {
+        PackedFile packed;
+        packed.Name = NormaliseArchivePath(arFiles[f]);
+        string path = arRoot.empty() ? arFiles[f] : arRoot + "/" + arFiles[f];
+        std::ifstream in(path.c_str(), std::ios::binary);
+        if (!in) {
+            throw TemsimException("Couldn't read " + path, "ArchiveFileSystem");
+        }
+        contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        while (out.tellp() % gArchiveAlignment != 0) {
+            out.put('\0');
+        }
+        packed.Offset = (unsigned long long)out.tellp();
+        packed.Size = contents.size();
+        packed.Hash = HashContents(contents.empty() ? "" : &contents[0], contents.size());
+        if (!contents.empty()) {
+            out.write(&contents[0], contents.size());
+        }
+        bytes += contents.size();
+        index.push_back(packed);
+    }
+
+    std::sort(index.begin(), index.end());
+    for (size_t i = 1; i < index.size(); ++i) {
+        if (index[i].Name == index[i - 1].Name) {
+            throw TemsimException("File " + index[i].Name
+                + " is packed twice", "ArchiveFileSystem");
+        }
+    }
+    header.IndexOffset = (unsigned long long)out.tellp();
+    for (size_t i = 0; i < index.size(); ++i) {
+        WriteField(out, (unsigned)index[i].Name.size());
+        out.write(index[i].Name.data(), index[i].Name.size());
+        WriteField(out, index[i].Offset);
+        WriteField(out, index[i].Size);
+        WriteField(out, index[i].Hash);
+    }
+    memcpy(header.Magic, gArchiveMagic, sizeof(header.Magic));
+    header.Version = gArchiveVersion;
+    header.Files = (unsigned)index.size();
+    header.IndexSize = (unsigned long long)out.tellp() - header.IndexOffset;
+    out.seekp(0);
+    out.write((const char*)&header, sizeof(header));
+    out.close();
+    if (!out) {
+        throw TemsimException("Error writing archive " + temporary, "ArchiveFileSystem");
+    }
+    std::remove(arArchive.c_str());
+    if (std::rename(temporary.c_str(), arArchive.c_str()) != 0) {
+        throw TemsimException("Couldn't replace archive " + arArchive, "ArchiveFileSystem");
+    }
+    cleanup.Keep();
+    BOOST_LOGL(archivefilesystem, info) << "Packed " << index.size() << " files ("
+        << bytes << " bytes) into " << arArchive << std::endl;
+    return bytes;
+}
+
+ArchiveFileSystem::ArchiveFileSystem(const string& arArchive, FileSystem* apFallback)
+:   mArchive(arArchive),
+    mpFile(new boost::iostreams::mapped_file_source()),
+    mpFallback(apFallback)
+{
+    try {
+        mpFile->open(arArchive);
+    } catch (std::exception& e) {
+        throw TemsimException("Couldn't map archive " + arArchive
+            + " (" + e.what() + ")", "ArchiveFileSystem");
+    }
+    ArchiveHeader header;
+    if (mpFile->size() < sizeof(header)) {
+        throw TemsimException("Archive " + arArchive + " is too short",
+            "ArchiveFileSystem");
+    }
+    memcpy(&header, mpFile->data(), sizeof(header));
+    if (memcmp(header.Magic, gArchiveMagic, sizeof(header.Magic)) != 0
+        || header.Version != gArchiveVersion) {
+        throw TemsimException("Archive " + arArchive + " has the wrong format",
+            "ArchiveFileSystem");
+    }
+    if (header.IndexOffset > mpFile->size()
+        || header.IndexSize > mpFile->size() - header.IndexOffset) {
+        throw TemsimException("Archive " + arArchive + " is truncated",
+            "ArchiveFileSystem");
+    }
+    // each entry takes at least its name length, offset, size and hash, so
+    // a count the index can't hold is damage, not a reason to allocate
+    const size_t smallest_entry = sizeof(unsigned) + 3 * sizeof(unsigned long long);
+    if (header.Files > header.IndexSize / smallest_entry) {
+        throw TemsimException("Archive " + arArchive + " has a bad index",
+            "ArchiveFileSystem");
+    }
+
+    // read the whole archive in one go, as the model will read most of it
+    AdviseWillNeed(mpFile->data(), mpFile->size());
+
+    const char* p = mpFile->data() + header.IndexOffset;
+    const char* end = p + header.IndexSize;
+    mEntries.resize(header.Files);
+    for (size_t i = 0; i < mEntries.size(); ++i) {
+        Entry& entry = mEntries[i];
+        unsigned length;
+        bool ok = ReadField(p, end, length) && (size_t)(end - p) >= length;
+        if (ok) {
+            entry.Name.assign(p, length);
+            p += length;
+            ok = ReadField(p, end, entry.Offset) && ReadField(p, end, entry.Size)
+                && ReadField(p, end, entry.Hash);
+        }
+        if (!ok || entry.Offset > header.IndexOffset
+            || entry.Size > header.IndexOffset - entry.Offset
+            || (i > 0 && !(mEntries[i - 1] < entry))) {
+            throw TemsimException("Archive " + arArchive + " has a bad index",
+                "ArchiveFileSystem");
+        }
+    }
+    BOOST_LOGL(archivefilesystem, info) << "Mapped archive " << arArchive
+        << " of " << mEntries.size() << " files" << std::endl;
+}
+
+const ArchiveFileSystem::Entry* ArchiveFileSystem::Lookup(const string& arFileName) const {
+    Entry key;
+    key.Name = NormaliseArchivePath(arFileName);
+    vector<Entry>::const_iterator i = std::lower_bound(mEntries.begin(), mEntries.end(), key);
+    if (i == mEntries.end() || i->Name != key.Name) {
+        return NULL;
+    }
+    return &*i;
+}
+
+bool ArchiveFileSystem::Find(const string& arFileName, const char*& arData,
+                             size_t& arSize) const {
+    const Entry* entry = Lookup(arFileName);
+    if (!entry) {
+        return false;
+    }
+    arData = mpFile->data() + entry->Offset;
+    arSize = (size_t)entry->Size;
+    return true;
+}
+
+boost::shared_ptr<std::istream> ArchiveFileSystem::OpenInput(const string& arFileName) {
+    const char* data;
+    size_t size;
+    if (Find(arFileName, data, size)) {
+        return boost::shared_ptr<std::istream>(new ArchiveStream(mpFile, data, size));
+    }
+    if (mpFallback) {
+        return mpFallback->OpenInput(arFileName);
+    }
+    throw TemsimException("No file " + arFileName + " in archive " + mArchive,
+        "ArchiveFileSystem");
+}
+
+bool ArchiveFileSystem::Exists(const string& arFileName) {
+    return Lookup(arFileName) != NULL || (mpFallback && mpFallback->Exists(arFileName));
+}
+
+vector<string> ArchiveFileSystem::Verify() const {
+    vector<string> damaged;
+    for (size_t i = 0; i < mEntries.size(); ++i) {
+        const Entry& entry = mEntries[i];
+        if (HashContents(mpFile->data() + entry.Offset, (size_t)entry.Size) != entry.Hash) {
+            damaged.push_back(entry.Name);
+        }
+    }
+    return damaged;
+}
+
+vector<string> ArchiveFileSystem::FileNames() const {
+    vector<string> names;
+    for (size_t i = 0; i < mEntries.size(); ++i) {
+        names.push_back(mEntries[i].Name);
+    }
+    return names;
+}
@@ -0,0 +1,131 @@
+#ifndef _ARCHIVEFILESYSTEM_HPP_
+#define _ARCHIVEFILESYSTEM_HPP_
+
+#include <string>
+#include <vector>
+#include <istream>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/log/log.hpp>
+
+#include "filesystem.hpp"
+#include "logging.hpp"
+#include "temsimexception.hpp"
+
+using std::string;
+using std::vector;
+
+/// declare the boost logging stuff.
+BOOST_DECLARE_LOG(archivefilesystem)
+
+/**
+\file
+Models packed into a single archive. A model spread over thousands of small
+INI and data files spends most of a cold start opening and reading them one
+by one. An archive holds all of them in one file, with an index, and an
+ArchiveFileSystem serves them from a memory mapping of it: opening a file is
+a lookup in the index, and the stream returned reads straight from the
+mapping without copying. The whole archive is read ahead when it is opened,
+so the files are read from disk with one sequential read.
+@code
+ArchiveFileSystem files("model.tpk");      // packed with packarchive
+boost::shared_ptr<std::istream> main = files.OpenInput("main.ini");
+MakeObjectsFromIniFile(factory, main.get(), "main.ini", files, reg);
+@endcode
+
+Names are looked up relative to the directory the archive was packed from,
+with either kind of slash and with "." and ".." taken out. A file that isn't
+in the archive is opened through a fallback file system, if one is given.
+
+ArchiveFileSystem implements the FileSystem reading interface (OpenInput()
+and Exists()) through which EnhancedIniFile opens a model and its includes.
+
+Archive layout (integers as laid out by the host):
+- ArchiveHeader
+- the files' contents, each starting on an 8 byte boundary, in the order
+  they were packed (packing them in the order the model reads them makes
+  the start-up reads sequential)
+- the index: for each file, sorted by name, a 32 bit name length, the name,
+  and the 64 bit offset, size and FNV-1a hash of its contents
+*/
+
+/// header of an archive file
+struct ArchiveHeader {
+    char        Magic[8];           ///< "TARCHIV1"
+    unsigned    Version;            ///< format version
+    unsigned    Files;              ///< number of files
+    unsigned long long IndexOffset; ///< file offset of the index
+    unsigned long long IndexSize;   ///< bytes in the index
+};
+
+/// magic string at the start of an archive
+extern const char* gArchiveMagic;
+
+/// A file name as it is stored in an archive: forward slashes, no "." or
+/// ".." parts and no repeated slashes.
+string NormaliseArchivePath(const string& arFileName);
+
+/// The files under a directory, relative to it, sorted by name.
+vector<string> ListArchiveFiles(const string& arRoot);
+
+/// Pack files into an archive, replacing it if it exists.
+/// @param arArchive the archive to write.
+/// @param arRoot the directory the file names are relative to.
+/// @param arFiles the files to pack, in the order they are to be stored.
+/// @returns the number of bytes of file contents packed.
+unsigned long long PackArchive(const string& arArchive, const string& arRoot,
+                               const vector<string>& arFiles);
+
+/// A FileSystem that reads the files of an archive.
+class ArchiveFileSystem : public FileSystem {
+public:
+    typedef boost::shared_ptr<ArchiveFileSystem> Ptr;
+
+    /// Map an archive.
+    /// @param arArchive the archive file.
+    /// @param apFallback opens files that aren't in the archive, or NULL.
+    ArchiveFileSystem(const string& arArchive, FileSystem* apFallback = NULL);
+
+    virtual ~ArchiveFileSystem() {}
+
+    /// Open a file for reading. The stream reads from the archive's mapping,
+    /// which it keeps open.
+    virtual boost::shared_ptr<std::istream> OpenInput(const string& arFileName);
+
+    /// True if the file is in the archive, or the fallback has it.
+    virtual bool Exists(const string& arFileName);
+
+    /// Find a file's contents in the mapping.
+    /// @returns false if the file isn't in the archive.
+    bool Find(const string& arFileName, const char*& arData, size_t& arSize) const;
+
+    /// Check the contents of every file against its hash.
+    /// @returns the names of the files that don't match.
+    vector<string> Verify() const;
+
+    /// Number of files in the archive.
+    size_t Files() const { return mEntries.size(); }
+    /// The names of the files in the archive, sorted.
+    vector<string> FileNames() const;
+
+private:
+    /// a file in the archive
+    struct Entry {
+        string              Name;
+        unsigned long long  Offset;
+        unsigned long long  Size;
+        unsigned long long  Hash;
+        bool operator<(const Entry& arOther) const { return Name < arOther.Name; }
+    };
+
+    /// the entry for a name, or NULL
+    const Entry* Lookup(const string& arFileName) const;
+
+    string          mArchive;
+    boost::shared_ptr<boost::iostreams::mapped_file_source> mpFile;
+    vector<Entry>   mEntries;   ///< sorted by name
+    FileSystem*     mpFallback;
+};
+
+#endif
@@ -0,0 +1,409 @@
+#include "arrowexport.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+/// define boost logging stuff.
+BOOST_DEFINE_LOG(arrowexport, "arrowexport")
+
+/**
+\file
+Implementation of the Arrow IPC file writer.
+*/
+
+namespace {
+
+/// magic string at the start and end of an Arrow file
+const char gArrowMagic[] = "ARROW1";
+/// precedes each message's metadata length
+const unsigned gContinuation = 0xFFFFFFFFU;
+/// message bodies and buffers start on multiples of this
+const size_t gArrowAlignment = 64;
+
+// values from the Arrow flatbuffer schema (Schema.fbs, Message.fbs)
+const unsigned short gMetadataV5 = 4;
+const unsigned char gHeaderSchema = 1;
+const unsigned char gHeaderRecordBatch = 3;
+const unsigned char gTypeFloatingPoint = 3;
+const unsigned char gTypeTimestamp = 10;
+const unsigned short gPrecisionDouble = 2;
+const unsigned short gUnitMicrosecond = 2;
+const unsigned short gLittleEndian = 0;
+
+/// a field of a flatbuffer table: a scalar, or an offset to an object that
+/// is written after the table
+struct FlatField {
+    unsigned            Id;
+    size_t              Size;
+    unsigned long long  Value;
+    bool                Offset;
+
+    bool operator<(const FlatField& arOther) const { return Size > arOther.Size; }
+};
+
+/// the fields of a flatbuffer table
+class FlatTable {
+public:
+    FlatTable& Scalar(unsigned aId, size_t aSize, unsigned long long aValue) {
+        return Add(aId, aSize, aValue, false);
+    }
+    FlatTable& Offset(unsigned aId) {
+        return Add(aId, sizeof(unsigned), 0, true);
+    }
+    const vector<FlatField>& Fields() const { return mFields; }
+
+private:
+    FlatTable& Add(unsigned aId, size_t aSize, unsigned long long aValue, bool aOffset) {
+        FlatField field;
+        field.Id = aId;
+        field.Size = aSize;
+        field.Value = aValue;
+        field.Offset = aOffset;
+        mFields.push_back(field);
+        return *this;
+    }
+
+    vector<FlatField> mFields;
+};
+
+/**
+Builds a flatbuffer front to back, which is all the Arrow metadata needs.
+Offsets in a flatbuffer must point forwards, so an object is written first
+with a slot for each offset it holds, and the objects they refer to are
+written after it and patched into the slots. Scalars are aligned to their
+size relative to the start of the buffer, which is how they are checked.
+*/
+class FlatBuilder {
+public:
+    /// starts with the slot for the root table's offset
+    FlatBuilder() : mBytes(sizeof(unsigned), 0) {}
+
+    const vector<char>& Bytes() const { return mBytes; }
+
+    /// point the root slot at a table
+    void SetRoot(size_t aTable) {
+        Patch(0, aTable);
+    }
+
+    /// point a slot at an object written after it
+    void Patch(size_t aSlot, size_t aTarget) {
+        unsigned offset = (unsigned)(aTarget - aSlot);
+        memcpy(&mBytes[aSlot], &offset, sizeof(offset));
+    }
+
+    /// write a table and its vtable
+    /// @param arSlots receives the position of each offset field's slot, by
+    /// field id.
+    /// @returns the table's position.
+    size_t Table(const FlatTable& arTable, vector<size_t>& arSlots) {
+        vector<FlatField> fields = arTable.Fields();
+        unsigned ids = 0;
+        for (size_t f = 0; f < fields.size(); ++f) {
+            ids = std::max(ids, fields[f].Id + 1);
+        }
+        // largest first, after the 32 bit vtable offset; the table starts
+        // 4 bytes past a multiple of 8, so every field is aligned
+        std::stable_sort(fields.begin(), fields.end());
+        vector<unsigned short> vtable(2 + ids, 0);
+        unsigned short inline_size = sizeof(int);
+        for (size_t f = 0; f < fields.size(); ++f) {
+            vtable[2 + fields[f].Id] = inline_size;
+            inline_size += (unsigned short)fields[f].Size;
+        }
+        vtable[0] = (unsigned short)(vtable.size() * sizeof(unsigned short));
+        vtable[1] = inline_size;
+
+        Align(sizeof(unsigned short));
+        size_t vtable_position = mBytes.size();
+        Put(&vtable[0], vtable[0]);
+        Align(8, 4);
+        size_t table = mBytes.size();
+        int vtable_offset = (int)(table - vtable_position);
+        Put(&vtable_offset, sizeof(vtable_offset));
+        arSlots.assign(ids, 0);
+        for (size_t f = 0; f < fields.size(); ++f) {
+            if (fields[f].Offset) {
+                arSlots[fields[f].Id] = mBytes.size();
+            }
+            // the low bytes, as the host is little-endian
+            Put(&fields[f].Value, fields[f].Size);
+        }
+        return table;
+    }
+
+    /// write a string
+    /// @returns its position.
+    size_t String(const string& arString) {
+        Align(sizeof(unsigned));
+        size_t position = mBytes.size();
+        unsigned length = (unsigned)arString.size();
+        Put(&length, sizeof(length));
+        Put(arString.data(), arString.size());
+        mBytes.push_back('\0');
+        return position;
+    }
+
+    /// write a vector of structs whose largest member is 64 bits
+    /// @returns its position.
+    size_t Structs(const vector<char>& arStructs, size_t aStructSize) {
+        Align(8, 4);
+        size_t position = mBytes.size();
+        unsigned count = (unsigned)(arStructs.size() / aStructSize);
+        Put(&count, sizeof(count));
+        if (!arStructs.empty()) {
+            Put(&arStructs[0], arStructs.size());
+        }
+        return position;
+    }
+
+    /// write a vector of offsets to tables
+    /// @param arSlots receives the position of each element's slot.
+    /// @returns its position.
+    size_t Offsets(size_t aCount, vector<size_t>& arSlots) {
+        Align(sizeof(unsigned));
+        size_t position = mBytes.size();
+        unsigned count = (unsigned)aCount;
+        Put(&count, sizeof(count));
+        arSlots.resize(aCount);
+        for (size_t i = 0; i < aCount; ++i) {
+            arSlots[i] = mBytes.size();
+            mBytes.resize(mBytes.size() + sizeof(unsigned), 0);
+        }
+        return position;
+    }
+
+private:
+    void Put(const void* apData, size_t aSize) {
+        const char* data = (const char*)apData;
+        mBytes.insert(mBytes.end(), data, data + aSize);
+    }
+
+    void Align(size_t aAlignment, size_t aRemainder = 0) {
+        while (mBytes.size() % aAlignment != aRemainder) {
+            mBytes.push_back('\0');
+        }
+    }
+
+    vector<char> mBytes;
+};
+
+/// append a value to a vector of structs
+template<class T>
+void AppendStructField(vector<char>& arStructs, const T& arValue) {
+    const char* value = (const char*)&arValue;
+    arStructs.insert(arStructs.end(), value, value + sizeof(arValue));
+}
+
+/// bytes a column of values takes in a record batch body
+size_t PaddedColumnBytes(size_t aSteps, size_t aValueSize) {
+    return (aSteps * aValueSize + gArrowAlignment - 1) / gArrowAlignment * gArrowAlignment;
+}
+
+/// write a Schema table: a timestamp column and a double column per channel
+size_t WriteSchema(FlatBuilder& arBuilder, const vector<string>& arChannels) {
+    vector<size_t> slots;
+    size_t schema = arBuilder.Table(
+        FlatTable().Scalar(0, 2, gLittleEndian).Offset(1), slots);
+    vector<size_t> fields;
+    arBuilder.Patch(slots[1], arBuilder.Offsets(arChannels.size() + 1, fields));
+    for (size_t c = 0; c <= arChannels.size(); ++c) {
+        bool time = c == 0;
+        vector<size_t> field_slots;
+        // name, nullable, type_type, type and children
+        size_t field = arBuilder.Table(FlatTable()
+            .Offset(0)
+            .Scalar(1, 1, 0)
+            .Scalar(2, 1, time ? gTypeTimestamp : gTypeFloatingPoint)
+            .Offset(3)
+            .Offset(5), field_slots);
+        arBuilder.Patch(fields[c], field);
+        arBuilder.Patch(field_slots[0], arBuilder.String(time ? "Time" : arChannels[c - 1]));
+        vector<size_t> type_slots;
+        arBuilder.Patch(field_slots[3], arBuilder.Table(FlatTable()
+            .Scalar(0, 2, time ? gUnitMicrosecond : gPrecisionDouble), type_slots));
+        vector<size_t> children;
+        arBuilder.Patch(field_slots[5], arBuilder.Offsets(0, children));
+    }
+    return schema;
+}
+
+/// start a Message table
+/// @returns the slot for its header.
+size_t WriteMessageTable(FlatBuilder& arBuilder, unsigned char aHeaderType,
+                         unsigned long long aBodyLength) {
+    vector<size_t> slots;
+    arBuilder.SetRoot(arBuilder.Table(FlatTable()
+        .Scalar(0, 2, gMetadataV5)
+        .Scalar(1, 1, aHeaderType)
+        .Offset(2)
+        .Scalar(3, 8, aBodyLength), slots));
+    return slots[2];
+}
+
+} // namespace
+
+ArrowResultWriter::ArrowResultWriter(const string& arFileName,
+                                     const vector<string>& arChannels,
+                                     unsigned aBatchSteps)
+:   mFileName(arFileName),
+    mFile(arFileName.c_str(), std::ios::binary),
+    mChannels(arChannels),
+    mBatchSteps(aBatchSteps),
+    mEpoch(1970, 1, 1),
+    mBatchFill(0),
+    mSteps(0),
+    mClosed(false)
+{
+    if (!mFile) {
+        throw TemsimException("Couldn't write Arrow file " + arFileName,
+            "ArrowExport");
+    }
+    if (mBatchSteps == 0) {
+        throw TemsimException("Arrow file " + arFileName
+            + " needs a batch size", "ArrowExport");
+    }
+    mTimes.resize(mBatchSteps);
+    mValues.resize(mChannels.size() * mBatchSteps);
+
+    mFile.write(gArrowMagic, 6);
+    mFile.write("\0\0", 2);
+    FlatBuilder builder;
+    size_t header = WriteMessageTable(builder, gHeaderSchema, 0);
+    builder.Patch(header, WriteSchema(builder, mChannels));
+    WriteMessage(builder.Bytes());
+}
+
+ArrowResultWriter::~ArrowResultWriter() {
+    if (!mClosed) {
+        try {
+            Close();
+        } catch (std::exception& e) {
+            BOOST_LOGL(arrowexport, err) << "Error closing " << mFileName
+                << ": " << e.what() << std::endl;
+        }
+    }
+}
+
+void ArrowResultWriter::Record(const DateTime& arTime, const double* apValues) {
+    mTimes[mBatchFill] = (arTime - mEpoch).total_microseconds();
+    const size_t channels = mChannels.size();
+    for (size_t c = 0; c < channels; ++c) {
+        mValues[c * mBatchSteps + mBatchFill] = apValues[c];
+    }
+    ++mSteps;
+    if (++mBatchFill == mBatchSteps) {
+        FlushBatch();
+    }
+}
+
+int ArrowResultWriter::WriteMessage(const vector<char>& arMetadata) {
+    long long start = (long long)mFile.tellp();
+    // the metadata is padded so the body starts on the alignment
+    size_t length = arMetadata.size();
+    while ((start + 8 + length) % gArrowAlignment != 0) {
+        ++length;
+    }
+    int metadata_length = (int)length;
+    mFile.write((const char*)&gContinuation, sizeof(gContinuation));
+    mFile.write((const char*)&metadata_length, sizeof(metadata_length));
+    mFile.write(&arMetadata[0], arMetadata.size());
+    for (size_t i = arMetadata.size(); i < length; ++i) {
+        mFile.put('\0');
+    }
+    return 8 + metadata_length;
+}
+
+void ArrowResultWriter::FlushBatch() {
+    if (mBatchFill == 0) {
+        return;
+    }
+    const size_t columns = mChannels.size() + 1;
+    const size_t column_bytes = PaddedColumnBytes(mBatchFill, sizeof(double));
+
+    // each column has one node and two buffers, the validity bitmap (empty,
+    // as there are no nulls) and the values
+    vector<char> nodes;
+    vector<char> buffers;
+    long long zero = 0;
+    for (size_t c = 0; c < columns; ++c) {
+        AppendStructField(nodes, (long long)mBatchFill);
+        AppendStructField(nodes, zero);
+        long long offset = (long long)(c * column_bytes);
+        AppendStructField(buffers, offset);
+        AppendStructField(buffers, zero);
+        AppendStructField(buffers, offset);
+        AppendStructField(buffers, (long long)mBatchFill * (long long)sizeof(double));
+    }
+    Block block;
+    block.BodyLength = (long long)(columns * column_bytes);
+
+    FlatBuilder builder;
+    size_t header = WriteMessageTable(builder, gHeaderRecordBatch, block.BodyLength);
+    vector<size_t> slots;
+    // length, nodes and buffers
+    builder.Patch(header, builder.Table(FlatTable()
+        .Scalar(0, 8, mBatchFill)
+        .Offset(1)
+        .Offset(2), slots));
+    builder.Patch(slots[1], builder.Structs(nodes, 2 * sizeof(long long)));
+    builder.Patch(slots[2], builder.Structs(buffers, 2 * sizeof(long long)));
+
+    block.Offset = (long long)mFile.tellp();
+    block.MetadataLength = WriteMessage(builder.Bytes());
+
+    const size_t padding = column_bytes - mBatchFill * sizeof(double);
+    const char zeros[gArrowAlignment] = {0};
+    mFile.write((const char*)&mTimes[0], mBatchFill * sizeof(long long));
+    mFile.write(zeros, padding);
+    for (size_t c = 0; c < mChannels.size(); ++c) {
+        mFile.write((const char*)&mValues[c * mBatchSteps], mBatchFill * sizeof(double));
+        mFile.write(zeros, padding);
+    }
+    mBatches.push_back(block);
+    mBatchFill = 0;
+}
+
+void ArrowResultWriter::Close() {
+    if (mClosed) {
+        return;
+    }
+    mClosed = true;
+    FlushBatch();
+
+    // end of stream marker
+    unsigned end_of_stream = 0;
+    mFile.write((const char*)&gContinuation, sizeof(gContinuation));
+    mFile.write((const char*)&end_of_stream, sizeof(end_of_stream));
+
+    vector<char> blocks;
+    for (size_t b = 0; b < mBatches.size(); ++b) {
+        AppendStructField(blocks, mBatches[b].Offset);
+        AppendStructField(blocks, mBatches[b].MetadataLength);
+        AppendStructField(blocks, (int)0);
+        AppendStructField(blocks, mBatches[b].BodyLength);
+    }
+    FlatBuilder builder;
+    vector<size_t> slots;
+    // version, schema, dictionaries and record batches
+    builder.SetRoot(builder.Table(FlatTable()
+        .Scalar(0, 2, gMetadataV5)
+        .Offset(1)
+        .Offset(2)
+        .Offset(3), slots));
+    builder.Patch(slots[1], WriteSchema(builder, mChannels));
+    builder.Patch(slots[2], builder.Structs(vector<char>(), 24));
+    builder.Patch(slots[3], builder.Structs(blocks, 24));
+    const vector<char>& footer = builder.Bytes();
+    int footer_length = (int)footer.size();
+    mFile.write(&footer[0], footer.size());
+    mFile.write((const char*)&footer_length, sizeof(footer_length));
+    mFile.write(gArrowMagic, 6);
+    mFile.close();
+    if (!mFile) {
+        throw TemsimException("Error writing Arrow file " + mFileName,
+            "ArrowExport");
+    }
+    BOOST_LOGL(arrowexport, info) << "Wrote " << mSteps << " steps of "
+        << mChannels.size() << " channels in " << mBatches.size()
+        << " record batches to " << mFileName << std::endl;
+}
@@ -0,0 +1,123 @@
+#ifndef _ARROWEXPORT_HPP_
+#define _ARROWEXPORT_HPP_
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/log/log.hpp>
+
+#include "datetime.hpp"
+#include "hugepagealloc.hpp"
+#include "logging.hpp"
+#include "temsimexception.hpp"
+
+using std::string;
+using std::vector;
+
+/// declare the boost logging stuff.
+BOOST_DECLARE_LOG(arrowexport)
+
+/**
+\file
+Bookkeeping channels exported in the Arrow IPC file format (also known as
+Feather version 2), which dataframe tools (pyarrow, pandas, polars, R's
+arrow package) can memory-map and use directly, with no parsing. The file
+has a "Time" column of timestamps and one column of doubles per channel,
+named as the channel is, eg. "Storage.Great_Lake.Volume". Steps are written
+in record batches as the run proceeds, so memory use is one batch however
+long the run.
+@code
+ArrowResultWriter arrow("replicate-7.arrow", channels);
+for (...) {
+    arrow.Record(time, values);
+}
+arrow.Close();
+@endcode
+@code
+# python
+import pyarrow as pa
+table = pa.ipc.open_file(pa.memory_map("replicate-7.arrow")).read_all()
+@endcode
+
+The file is written without an Arrow library. The format is:
+- "ARROW1" and two bytes of padding
+- the schema message
+- one record batch message per batch
+- the end of stream marker
+- the footer: the schema again and the position of each record batch
+- the footer's 32 bit length and "ARROW1"
+
+Each message is a 0xFFFFFFFF continuation marker, the 32 bit length of its
+metadata, the metadata (a Message flatbuffer, padded to a multiple of 8)
+and then the message body. The columns of a record batch have no nulls, so
+each is a single buffer of values; the bodies are laid out so every buffer
+starts on a 64 byte boundary in the file, which suits vectorised readers.
+Times are microseconds since 1970-01-01, with no time zone; numbers are
+little-endian, so the writer must run on a little-endian host.
+*/
+
+/**
+Writes bookkeeping channels to an Arrow IPC file. Values are buffered a
+batch at a time, so memory use is Channels x BatchSteps values however long
+the run.
+*/
+class ArrowResultWriter : boost::noncopyable {
+public:
+    typedef boost::shared_ptr<ArrowResultWriter> Ptr;
+
+    /// Create the file and write its schema.
+    /// @param arFileName the file to write.
+    /// @param arChannels the channel names, eg. "Storage.Great_Lake.Volume".
+    /// @param aBatchSteps steps per record batch.
+    ArrowResultWriter(const string& arFileName,
+                      const vector<string>& arChannels,
+                      unsigned aBatchSteps = 65536);
+
+    /// Closes the file if Close() hasn't been called.
+    ~ArrowResultWriter();
+
+    /// Record one step.
+    /// @param arTime the time of the step.
+    /// @param apValues one value per channel, in channel order.
+    void Record(const DateTime& arTime, const double* apValues);
+
+    /// Write any buffered steps and the footer and close the file.
+    void Close();
+
+    /// Number of steps recorded so far.
+    unsigned long long Steps() const { return mSteps; }
+    /// Number of record batches written so far.
+    size_t Batches() const { return mBatches.size(); }
+
+private:
+    /// where a message is in the file, as listed in the footer
+    struct Block {
+        long long   Offset;         ///< of the continuation marker
+        int         MetadataLength; ///< including the marker and length
+        long long   BodyLength;
+    };
+
+    /// write a message: the marker, length, metadata and padding, so that
+    /// the body, which the caller writes, starts on a 64 byte boundary
+    /// @returns the message's length up to the body.
+    int WriteMessage(const vector<char>& arMetadata);
+    /// write the buffered steps as a record batch
+    void FlushBatch();
+
+    string          mFileName;
+    std::ofstream   mFile;
+    vector<string>  mChannels;
+    unsigned        mBatchSteps;    ///< steps per batch
+    DateTime        mEpoch;         ///< 1970-01-01
+    vector<long long, HugePageAllocator<long long> > mTimes; ///< buffered times, in microseconds
+    vector<double, HugePageAllocator<double> > mValues; ///< channel-major buffer for one batch
+    unsigned        mBatchFill;     ///< steps in the buffer
+    unsigned long long mSteps;      ///< steps recorded
+    vector<Block>   mBatches;       ///< the record batches written
+    bool            mClosed;
+};
+
+#endif
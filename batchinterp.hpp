@@ -0,0 +1,306 @@
+#ifndef _BATCHINTERP_HPP_
+#define _BATCHINTERP_HPP_
+
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "interp.hpp"
+#include "datetime.hpp"
+#include "temsimexception.hpp"
+
+using std::map;
+using std::vector;
+
+/**
+\file
+Batched linear interpolation across many small series. Each step a model
+looks up a level-from-volume curve for every storage and an efficiency curve
+for every unit: many different series, each at its own key. Done one at a
+time that is a virtual Interpolator::Value call and a tree search per
+lookup. A BatchInterpolator instead holds flat copies of the series and
+evaluates a whole array of (series, key) pairs at once:
+@code
+BatchInterpolator<double> curves;
+for (size_t i = 0; i < storages.size(); ++i) {
+    handles.push_back(curves.AddSeries(storages[i]->LevelCurve()));
+}
+...
+curves.Evaluate(&handles[0], &volumes[0], handles.size(), &levels[0]);
+@endcode
+
+Series with the same number of points are stored together, and the pairs
+are grouped by series size before evaluation, so every lookup in a group
+takes the same number of steps of a branchless binary search. When compiled
+for AVX2 four lookups are done at once with gathers from the flat arrays;
+otherwise the same algorithm runs one lookup at a time.
+
+Results are identical to LinearInterp::Value on the same points: the same
+pair of points is chosen (extrapolating from the end pairs), exact keys
+return the stored value, and the interpolation is calculated in the same
+order. Keys are converted to double for the search, so KeyType must convert
+exactly: doubles do, and DateTime keys are converted to ticks since 1970,
+which is exact for microsecond ticks until well past 2200.
+
+Evaluate() uses scratch space held by the interpolator, so an instance must
+not be used from several threads at once.
+*/
+
+/// Conversion of keys to double for batched interpolation.
+template <typename KeyType>
+struct BatchKeyTraits {
+    static double ToDouble(const KeyType& arKey) { return (double)arKey; }
+};
+
+/// DateTime keys become ticks since 1970, which LinearInterp's arithmetic
+/// on tick differences gives the same results for.
+template <>
+struct BatchKeyTraits<DateTime> {
+    static double ToDouble(const DateTime& arKey) {
+        static const DateTime epoch(1970, 1, 1);
+        return (double)(arKey - epoch).ticks();
+    }
+};
+
+template <typename KeyType>
+class BatchInterpolator {
+public:
+    typedef boost::shared_ptr<BatchInterpolator<KeyType> > Ptr;
+    typedef map<KeyType, double> TSMap;
+    /// Identifies a series added to the interpolator.
+    typedef unsigned Handle;
+
+    /// Add a series.
+    /// @returns the handle to evaluate it by.
+    Handle AddSeries(const TSMap& arPoints) {
+        vector<double> keys, values;
+        keys.reserve(arPoints.size());
+        values.reserve(arPoints.size());
+        for (typename TSMap::const_iterator iter = arPoints.begin();
+             iter != arPoints.end(); ++iter) {
+            keys.push_back(BatchKeyTraits<KeyType>::ToDouble(iter->first));
+            values.push_back(iter->second);
+        }
+        return AddFlat(keys, values);
+    }
+
+    /// Add a series held in flat arrays.
+    /// @param apKeys the keys, in ascending order.
+    /// @param apValues the value for each key.
+    /// @param aCount the number of points.
+    Handle AddSeries(const KeyType* apKeys, const double* apValues, size_t aCount) {
+        vector<double> keys(aCount);
+        for (size_t i = 0; i < aCount; ++i) {
+            keys[i] = BatchKeyTraits<KeyType>::ToDouble(apKeys[i]);
+        }
+        return AddFlat(keys, vector<double>(apValues, apValues + aCount));
+    }
+
+    /// Number of series added.
+    size_t Series() const { return mSeries.size(); }
+
+    /// Evaluate one series at one key.
+    double Value(Handle aHandle, const KeyType& arKey) const {
+        const SeriesRef& ref = mSeries[aHandle];
+        const Group& group = mGroups[ref.Group];
+        return Evaluate1(&group.Keys[0], &group.Values[0], group.Points,
+            ref.Offset, BatchKeyTraits<KeyType>::ToDouble(arKey));
+    }
+
+    /// Evaluate many series, each at its own key.
+    /// @param apHandles the series to evaluate.
+    /// @param apKeys the key for each.
+    /// @param aCount the number of lookups.
+    /// @param apOut receives aCount values.
+    void Evaluate(const Handle* apHandles, const KeyType* apKeys, size_t aCount,
+                  double* apOut) const {
+        if (aCount == 0) {
+            return;
+        }
+        // bucket the lookups by group (a counting sort)
+        mStarts.assign(mGroups.size() + 1, 0);
+        for (size_t i = 0; i < aCount; ++i) {
+            ++mStarts[mSeries[apHandles[i]].Group + 1];
+        }
+        for (size_t g = 0; g < mGroups.size(); ++g) {
+            mStarts[g + 1] += mStarts[g];
+        }
+        mOrder.resize(aCount);
+        mOffsets.resize(aCount);
+        mX.resize(aCount);
+        mY.resize(aCount);
+        mFill.assign(mStarts.begin(), mStarts.end() - 1);
+        for (size_t i = 0; i < aCount; ++i) {
+            const SeriesRef& ref = mSeries[apHandles[i]];
+            size_t slot = mFill[ref.Group]++;
+            mOrder[slot] = i;
+            mOffsets[slot] = (long long)ref.Offset;
+            mX[slot] = BatchKeyTraits<KeyType>::ToDouble(apKeys[i]);
+        }
+
+        for (size_t g = 0; g < mGroups.size(); ++g) {
+            size_t first = mStarts[g];
+            size_t end = mStarts[g + 1];
+            if (first == end) {
+                continue;
+            }
+            const Group& group = mGroups[g];
+            EvaluateGroup(group, &mOffsets[first], &mX[first], end - first, &mY[first]);
+        }
+
+        for (size_t slot = 0; slot < aCount; ++slot) {
+            apOut[mOrder[slot]] = mY[slot];
+        }
+    }
+
+    /// Evaluate many series, each at its own key.
+    void Evaluate(const vector<Handle>& arHandles, const vector<KeyType>& arKeys,
+                  vector<double>& arValues) const {
+        if (arHandles.size() != arKeys.size()) {
+            throw TemsimException("Batch interpolation needs one key per series",
+                "BatchInterpolator");
+        }
+        arValues.resize(arHandles.size());
+        if (!arHandles.empty()) {
+            Evaluate(&arHandles[0], &arKeys[0], arHandles.size(), &arValues[0]);
+        }
+    }
+
+private:
+    /// all the series with a given number of points, end to end
+    struct Group {
+        size_t          Points;
+        vector<double>  Keys;
+        vector<double>  Values;
+    };
+
+    /// where a series is stored
+    struct SeriesRef {
+        size_t  Group;
+        size_t  Offset;     ///< index of its first point in the group
+    };
+
+    Handle AddFlat(const vector<double>& arKeys, const vector<double>& arValues) {
+        if (arKeys.size() <= 1) {
+            // don't have enough points to interpolate
+            throw TemsimException("Error evaluating time series - at most 1 point in time series.");
+        }
+        size_t g = 0;
+        while (g < mGroups.size() && mGroups[g].Points != arKeys.size()) {
+            ++g;
+        }
+        if (g == mGroups.size()) {
+            mGroups.push_back(Group());
+            mGroups.back().Points = arKeys.size();
+        }
+        Group& group = mGroups[g];
+        SeriesRef ref;
+        ref.Group = g;
+        ref.Offset = group.Keys.size();
+        group.Keys.insert(group.Keys.end(), arKeys.begin(), arKeys.end());
+        group.Values.insert(group.Values.end(), arValues.begin(), arValues.end());
+        mSeries.push_back(ref);
+        return (Handle)(mSeries.size() - 1);
+    }
+
+    /// LinearInterp on one series of a group
+    static double Evaluate1(const double* apKeys, const double* apValues,
+                            size_t aPoints, size_t aOffset, double aX) {
+        // branchless lower_bound: base ends at the last key < aX, if any
+        size_t base = aOffset;
+        size_t len = aPoints;
+        while (len > 1) {
+            size_t half = len / 2;
+            base += (apKeys[base + half - 1] < aX) ? half : 0;
+            len -= half;
+        }
+        size_t index = base - aOffset + ((apKeys[base] < aX) ? 1 : 0);
+        // the pair LinearInterp uses
+        size_t lower = index == 0 ? 0 : std::min(index - 1, aPoints - 2);
+        const double* k = apKeys + aOffset + lower;
+        const double* v = apValues + aOffset + lower;
+        if (k[0] == aX) {
+            return v[0];
+        }
+        if (k[1] == aX) {
+            return v[1];
+        }
+        return v[0] + ((v[1] - v[0]) * (aX - k[0]) / (k[1] - k[0]));
+    }
+
+    /// evaluate the lookups for one group
+    void EvaluateGroup(const Group& arGroup, const long long* apOffsets,
+                       const double* apX, size_t aCount, double* apY) const {
+        const double* keys = &arGroup.Keys[0];
+        const double* values = &arGroup.Values[0];
+        const size_t points = arGroup.Points;
+        size_t i = 0;
+#ifdef __AVX2__
+        const __m256i one = _mm256_set1_epi64x(1);
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i last_pair = _mm256_set1_epi64x((long long)points - 2);
+        for (; i + 4 <= aCount; i += 4) {
+            const __m256i offset = _mm256_loadu_si256((const __m256i*)(apOffsets + i));
+            const __m256d x = _mm256_loadu_pd(apX + i);
+
+            // the same branchless lower_bound, four lookups at a time; all
+            // the series have the same size so the lanes stay in step
+            __m256i base = offset;
+            size_t len = points;
+            while (len > 1) {
+                size_t half = len / 2;
+                __m256i probe = _mm256_add_epi64(base, _mm256_set1_epi64x((long long)half - 1));
+                __m256d key = _mm256_i64gather_pd(keys, probe, 8);
+                __m256i less = _mm256_castpd_si256(_mm256_cmp_pd(key, x, _CMP_LT_OQ));
+                base = _mm256_add_epi64(base,
+                    _mm256_and_si256(less, _mm256_set1_epi64x((long long)half)));
+                len -= half;
+            }
+            __m256d key = _mm256_i64gather_pd(keys, base, 8);
+            __m256i less = _mm256_castpd_si256(_mm256_cmp_pd(key, x, _CMP_LT_OQ));
+            // index - 1 = base - offset - 1 + (key < x), and less is -1 or 0
+            __m256i lower = _mm256_sub_epi64(_mm256_sub_epi64(base, offset),
+                _mm256_add_epi64(one, less));
+            lower = _mm256_blendv_epi8(lower, zero, _mm256_cmpgt_epi64(zero, lower));
+            lower = _mm256_blendv_epi8(lower, last_pair, _mm256_cmpgt_epi64(lower, last_pair));
+            __m256i at = _mm256_add_epi64(offset, lower);
+
+            __m256d k0 = _mm256_i64gather_pd(keys, at, 8);
+            __m256d v0 = _mm256_i64gather_pd(values, at, 8);
+            __m256i at1 = _mm256_add_epi64(at, one);
+            __m256d k1 = _mm256_i64gather_pd(keys, at1, 8);
+            __m256d v1 = _mm256_i64gather_pd(values, at1, 8);
+
+            __m256d y = _mm256_add_pd(v0, _mm256_div_pd(
+                _mm256_mul_pd(_mm256_sub_pd(v1, v0), _mm256_sub_pd(x, k0)),
+                _mm256_sub_pd(k1, k0)));
+            // exact keys give the stored value, the lower point first
+            y = _mm256_blendv_pd(y, v1, _mm256_cmp_pd(k1, x, _CMP_EQ_OQ));
+            y = _mm256_blendv_pd(y, v0, _mm256_cmp_pd(k0, x, _CMP_EQ_OQ));
+            _mm256_storeu_pd(apY + i, y);
+        }
+#endif
+        for (; i < aCount; ++i) {
+            apY[i] = Evaluate1(keys, values, points, (size_t)apOffsets[i], apX[i]);
+        }
+    }
+
+    vector<Group>       mGroups;
+    vector<SeriesRef>   mSeries;    ///< by handle
+
+    // scratch space for Evaluate
+    mutable vector<size_t>      mStarts;    ///< first slot of each group
+    mutable vector<size_t>      mFill;      ///< next slot of each group
+    mutable vector<size_t>      mOrder;     ///< lookup in each slot
+    mutable vector<long long>   mOffsets;   ///< series offset in each slot
+    mutable vector<double>      mX;         ///< key in each slot
+    mutable vector<double>      mY;         ///< value in each slot
+};
+
+#endif
@@ -0,0 +1,569 @@
+#include "distributedstudy.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "resultstore.hpp"
+
+/// define boost logging stuff.
+BOOST_DEFINE_LOG(distributedstudy, "distributedstudy")
+
+/**
+\file
+Implementation of the coordinator and workers of a distributed study.
+*/
+
+using boost::asio::ip::tcp;
+
+namespace {
+
+/// the messages between coordinator and workers
+enum MessageType {
+    eHello = 1,     ///< worker: study, name
+    eRequest,       ///< worker: wants replicates
+    eAssign,        ///< coordinator: count, replicate numbers
+    eResultData,    ///< worker: the next part of a result file
+    eDone,          ///< worker: replicate number, statistics
+    eAck,           ///< coordinator: number of the assigned replicates to run
+    eFinished,      ///< coordinator: no more replicates
+    eRefused        ///< coordinator: reason
+};
+
+/// longest message accepted
+const unsigned long long gLongestMessage = 1ULL << 30;
+/// result file bytes sent in each message
+const size_t gResultDataBytes = 1 << 20;
+
+template<class T>
+void WriteField(std::ostream& arOut, const T& arValue) {
+    arOut.write((const char*)&arValue, sizeof(arValue));
+}
+template<class T>
+void ReadField(std::istream& arIn, T& arValue) {
+    arIn.read((char*)&arValue, sizeof(arValue));
+}
+
+void WriteString(std::ostream& arOut, const string& arValue) {
+    WriteField(arOut, (unsigned)arValue.size());
+    arOut.write(arValue.data(), arValue.size());
+}
+bool ReadString(std::istream& arIn, string& arValue) {
+    unsigned length = 0;
+    ReadField(arIn, length);
+    if (!arIn || length > gLongestMessage) {
+        return false;
+    }
+    arValue.assign(length, '\0');
+    if (length > 0) {
+        arIn.read(&arValue[0], length);
+    }
+    return (bool)arIn;
+}
+
+void Send(tcp::socket& arSocket, MessageType aType, const string& arPayload = string()) {
+    char header[sizeof(unsigned) + sizeof(unsigned long long)];
+    unsigned type = aType;
+    unsigned long long length = arPayload.size();
+    memcpy(header, &type, sizeof(type));
+    memcpy(header + sizeof(type), &length, sizeof(length));
+    vector<boost::asio::const_buffer> buffers;
+    buffers.push_back(boost::asio::buffer(header, sizeof(header)));
+    buffers.push_back(boost::asio::buffer(arPayload));
+    boost::asio::write(arSocket, buffers);
+}
+
+MessageType Receive(tcp::socket& arSocket, string& arPayload) {
+    char header[sizeof(unsigned) + sizeof(unsigned long long)];
+    boost::asio::read(arSocket, boost::asio::buffer(header, sizeof(header)));
+    unsigned type;
+    unsigned long long length;
+    memcpy(&type, header, sizeof(type));
+    memcpy(&length, header + sizeof(type), sizeof(length));
+    if (length > gLongestMessage) {
+        throw TemsimException("Message too long", "DistributedStudy");
+    }
+    arPayload.resize((size_t)length);
+    if (length > 0) {
+        boost::asio::read(arSocket, boost::asio::buffer(&arPayload[0], (size_t)length));
+    }
+    return (MessageType)type;
+}
+
+string Path(const string& arDirectory, const string& arName) {
+    if (arDirectory.empty()) {
+        return arName;
+    }
+    return arDirectory + "/" + arName;
+}
+
+// the id of the chunk pool a result file refers to, or 0 if it doesn't use
+// one (or isn't a result file)
+unsigned long long ResultPoolId(const string& arFileName) {
+    std::ifstream in(arFileName.c_str(), std::ios::binary);
+    ResultFileHeader header;
+    in.read((char*)&header, sizeof(header));
+    if (!in || memcmp(header.Magic, gResultFileMagic, sizeof(header.Magic)) != 0) {
+        return 0;
+    }
+    return header.PoolId;
+}
+
+/// why a result file can't be sent
+const char* gPooledResultReason = "Result files written with a chunk pool "
+    "refer to the worker's pool, so can't be sent to the coordinator";
+
+// throw if the coordinator has refused the worker
+void CheckRefused(MessageType aType, const string& arPayload) {
+    if (aType == eRefused) {
+        std::istringstream in(arPayload);
+        string reason;
+        ReadString(in, reason);
+        throw TemsimException("Coordinator refused worker: " + reason,
+            "DistributedStudy");
+    }
+}
+
+} // namespace
+
+/// a worker's connection, and the replicates it has been given
+struct StudyCoordinator::Connection {
+    Connection(boost::asio::io_service& arService, size_t aId)
+    :   Socket(arService), Id(aId), Next(0), Keep(0), Busy(false) {}
+
+    tcp::socket         Socket;
+    size_t              Id;
+    string              Name;
+    vector<long long>   Assignment; ///< replicates given, run in order
+    size_t              Next;       ///< the one being run
+    size_t              Keep;       ///< how many of them to run
+    bool                Busy;       ///< true if it has replicates to run
+};
+
+StudyCoordinator::StudyCoordinator(StudyJournal& arJournal,
+                                   const vector<long long>& arReplicates,
+                                   unsigned short aPort,
+                                   size_t aRangeSize)
+:   mrJournal(arJournal),
+    mReplicates(arReplicates),
+    mRangeSize(aRangeSize),
+    mAcceptor(mService),
+    mToRun(0),
+    mFinished(false),
+    mWorkers(0),
+    mStolen(0),
+    mReassigned(0),
+    mDuplicates(0)
+{
+    try {
+        tcp::endpoint endpoint(tcp::v4(), aPort);
+        mAcceptor.open(endpoint.protocol());
+        mAcceptor.set_option(tcp::acceptor::reuse_address(true));
+        mAcceptor.bind(endpoint);
+        mAcceptor.listen();
+        mPort = mAcceptor.local_endpoint().port();
+    } catch (std::exception& e) {
+        throw TemsimException(string("Couldn't listen for workers (") + e.what() + ")",
+            "DistributedStudy");
+    }
+}
+
+StudyCoordinator::~StudyCoordinator() {
+    boost::system::error_code error;
+    mAcceptor.close(error);
+}
+
+const StudyStatistics& StudyCoordinator::Run() {
+    vector<long long> todo = mrJournal.Resume(mReplicates, mTotals);
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        mPending.assign(todo.begin(), todo.end());
+        mToRun = todo.size();
+        mFinished = todo.empty();
+        if (mRangeSize == 0) {
+            mRangeSize = std::max((size_t)1, todo.size() / 64);
+        }
+    }
+    if (todo.empty()) {
+        return mTotals;
+    }
+    BOOST_LOGL(distributedstudy, info) << "Coordinating " << todo.size()
+        << " replicates on port " << mPort << std::endl;
+
+    boost::thread accept(boost::bind(&StudyCoordinator::Accept, this));
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        while (mDone.size() < mToRun) {
+            mChanged.wait(lock);
+        }
+        mFinished = true;
+        mChanged.notify_all();
+        // workers still running a replicate someone else finished are cut off
+        for (size_t i = 0; i < mConnections.size(); ++i) {
+            boost::system::error_code error;
+            mConnections[i]->Socket.shutdown(tcp::socket::shutdown_both, error);
+        }
+    }
+    // wake the accepting thread with a connection of our own
+    try {
+        tcp::socket wake(mService);
+        wake.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), mPort));
+    } catch (std::exception&) {
+    }
+    accept.join();
+    mThreads.join_all();
+
+    BOOST_LOGL(distributedstudy, info) << "Study done: " << mToRun
+        << " replicates from " << mWorkers << " workers, " << mStolen
+        << " ranges stolen, " << mReassigned << " replicates reassigned, "
+        << mDuplicates << " duplicate results" << std::endl;
+    return mTotals;
+}
+
+void StudyCoordinator::Accept() {
+    for (size_t id = 1; ; ++id) {
+        ConnectionPtr connection(new Connection(mService, id));
+        boost::system::error_code error;
+        mAcceptor.accept(connection->Socket, error);
+        boost::mutex::scoped_lock lock(mMutex);
+        if (mFinished) {
+            return;
+        }
+        if (error) {
+            BOOST_LOGL(distributedstudy, err) << "Couldn't accept a worker: "
+                << error.message() << std::endl;
+            continue;
+        }
+        mConnections.push_back(connection);
+        mThreads.create_thread(boost::bind(&StudyCoordinator::Serve, this, connection));
+    }
+}
+
+void StudyCoordinator::Serve(ConnectionPtr apConnection) {
+    Connection& connection = *apConnection;
+    string incoming = Path(mrJournal.Directory(),
+        "incoming-" + boost::lexical_cast<string>(connection.Id) + ".part");
+    std::ofstream data;
+    try {
+        string payload;
+        if (Receive(connection.Socket, payload) != eHello) {
+            throw TemsimException("Expected a hello", "DistributedStudy");
+        }
+        std::istringstream hello(payload);
+        string study;
+        if (!ReadString(hello, study) || !ReadString(hello, connection.Name)) {
+            throw TemsimException("Bad hello", "DistributedStudy");
+        }
+        if (study != mrJournal.Study()) {
+            std::ostringstream reason;
+            WriteString(reason, "Worker is running another study");
+            Send(connection.Socket, eRefused, reason.str());
+            throw TemsimException("Worker " + connection.Name
+                + " is running another study", "DistributedStudy");
+        }
+        {
+            boost::mutex::scoped_lock lock(mMutex);
+            ++mWorkers;
+        }
+        BOOST_LOGL(distributedstudy, info) << "Worker " << connection.Name
+            << " connected" << std::endl;
+
+        for (;;) {
+            MessageType type = Receive(connection.Socket, payload);
+            if (type == eRequest) {
+                vector<long long> replicates;
+                if (!HandOut(connection, replicates)) {
+                    Send(connection.Socket, eFinished);
+                    break;
+                }
+                std::ostringstream assign;
+                WriteField(assign, (unsigned long long)replicates.size());
+                assign.write((const char*)&replicates[0],
+                    replicates.size() * sizeof(long long));
+                Send(connection.Socket, eAssign, assign.str());
+            } else if (type == eResultData) {
+                if (!data.is_open()) {
+                    data.open(incoming.c_str(), std::ios::binary | std::ios::trunc);
+                }
+                data.write(payload.data(), payload.size());
+                if (!data) {
+                    throw TemsimException("Couldn't write " + incoming,
+                        "DistributedStudy");
+                }
+            } else if (type == eDone) {
+                std::istringstream done(payload);
+                long long replicate;
+                StudyStatistics contribution;
+                ReadField(done, replicate);
+                if (!done || !ReadStudyStatistics(done, contribution)) {
+                    throw TemsimException("Bad result", "DistributedStudy");
+                }
+                if (!IsRunning(connection, replicate)) {
+                    throw TemsimException("Result for replicate "
+                        + boost::lexical_cast<string>(replicate)
+                        + " wasn't assigned to worker " + connection.Name,
+                        "DistributedStudy");
+                }
+                string result_file;
+                if (data.is_open()) {
+                    data.close();
+                    result_file = incoming;
+                    if (ResultPoolId(result_file) != 0) {
+                        std::ostringstream reason;
+                        WriteString(reason, gPooledResultReason);
+                        Send(connection.Socket, eRefused, reason.str());
+                        throw TemsimException(string(gPooledResultReason)
+                            + " (worker " + connection.Name + ")", "DistributedStudy");
+                    }
+                }
+                CommitResult(replicate, result_file, contribution);
+                std::ostringstream ack;
+                WriteField(ack, (unsigned long long)Acknowledge(connection));
+                Send(connection.Socket, eAck, ack.str());
+            } else {
+                throw TemsimException("Unexpected message", "DistributedStudy");
+            }
+        }
+    } catch (std::exception& e) {
+        boost::mutex::scoped_lock lock(mMutex);
+        if (!mFinished) {
+            BOOST_LOGL(distributedstudy, err) << "Lost worker " << connection.Name
+                << ": " << e.what() << std::endl;
+        }
+    }
+    if (data.is_open()) {
+        data.close();
+    }
+    std::remove(incoming.c_str());
+    Release(connection);
+}
+
+bool StudyCoordinator::HandOut(Connection& arConnection, vector<long long>& arReplicates) {
+    boost::mutex::scoped_lock lock(mMutex);
+    for (;;) {
+        if (mFinished || mDone.size() >= mToRun) {
+            return false;
+        }
+        while (!mPending.empty() && mDone.count(mPending.front())) {
+            mPending.pop_front();
+        }
+
+        Connection* victim = 0;
+        size_t most = 0;
+        for (size_t i = 0; i < mConnections.size(); ++i) {
+            Connection& other = *mConnections[i];
+            if (&other != &arConnection && other.Busy && other.Keep > other.Next + 1
+                && other.Keep - other.Next - 1 > most) {
+                victim = &other;
+                most = other.Keep - other.Next - 1;
+            }
+        }
+
+        arReplicates.clear();
+        if (!mPending.empty()) {
+            // a new range
+            while (!mPending.empty() && arReplicates.size() < mRangeSize) {
+                if (!mDone.count(mPending.front())) {
+                    arReplicates.push_back(mPending.front());
+                }
+                mPending.pop_front();
+            }
+        } else if (victim) {
+            // the second half of what another worker hasn't started
+            size_t steal = (most + 1) / 2;
+            arReplicates.assign(victim->Assignment.begin() + (victim->Keep - steal),
+                victim->Assignment.begin() + victim->Keep);
+            victim->Keep -= steal;
+            ++mStolen;
+        } else {
+            // the replicate a straggler is running
+            for (size_t i = 0; i < mConnections.size() && arReplicates.empty(); ++i) {
+                Connection& other = *mConnections[i];
+                if (&other == &arConnection || !other.Busy) {
+                    continue;
+                }
+                long long replicate = other.Assignment[other.Next];
+                if (!mDone.count(replicate) && !mDuplicated.count(replicate)) {
+                    mDuplicated.insert(replicate);
+                    arReplicates.push_back(replicate);
+                    ++mReassigned;
+                }
+            }
+        }
+
+        if (!arReplicates.empty()) {
+            arConnection.Assignment = arReplicates;
+            arConnection.Next = 0;
+            arConnection.Keep = arReplicates.size();
+            arConnection.Busy = true;
+            return true;
+        }
+        mChanged.wait(lock);
+    }
+}
+
+bool StudyCoordinator::IsRunning(Connection& arConnection, long long aReplicate) {
+    boost::mutex::scoped_lock lock(mMutex);
+    return arConnection.Busy && arConnection.Next < arConnection.Keep
+        && arConnection.Assignment[arConnection.Next] == aReplicate;
+}
+
+size_t StudyCoordinator::Acknowledge(Connection& arConnection) {
+    boost::mutex::scoped_lock lock(mMutex);
+    ++arConnection.Next;
+    if (arConnection.Next >= arConnection.Keep) {
+        arConnection.Busy = false;
+    }
+    mChanged.notify_all();
+    return arConnection.Keep;
+}
+
+void StudyCoordinator::Release(Connection& arConnection) {
+    boost::mutex::scoped_lock lock(mMutex);
+    if (arConnection.Busy) {
+        for (size_t i = arConnection.Keep; i > arConnection.Next; --i) {
+            long long replicate = arConnection.Assignment[i - 1];
+            if (!mDone.count(replicate)) {
+                mPending.push_front(replicate);
+            }
+        }
+        arConnection.Busy = false;
+    }
+    mChanged.notify_all();
+}
+
+void StudyCoordinator::CommitResult(long long aReplicate, const string& arResultFile,
+                                    const StudyStatistics& arContribution) {
+    boost::mutex::scoped_lock commit(mCommitMutex);
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        if (mDone.count(aReplicate)) {
+            ++mDuplicates;
+            if (!arResultFile.empty()) {
+                std::remove(arResultFile.c_str());
+            }
+            return;
+        }
+    }
+    string pending = mrJournal.Begin(aReplicate);
+    if (!arResultFile.empty() && std::rename(arResultFile.c_str(), pending.c_str()) != 0) {
+        throw TemsimException("Couldn't move " + arResultFile + " to " + pending,
+            "DistributedStudy");
+    }
+    mrJournal.Commit(aReplicate, arContribution);
+
+    boost::mutex::scoped_lock lock(mMutex);
+    MergeStudyStatistics(mTotals, arContribution);
+    mDone.insert(aReplicate);
+    mChanged.notify_all();
+}
+
+StudyWorker::StudyWorker(const string& arHost, unsigned short aPort,
+                         const string& arStudy, const string& arScratchDirectory,
+                         Runner aRunner, const string& arName)
+:   mHost(arHost),
+    mPort(aPort),
+    mStudy(arStudy),
+    mScratchDirectory(arScratchDirectory),
+    mRunner(aRunner),
+    mName(arName)
+{
+}
+
+size_t StudyWorker::Run() {
+    boost::asio::io_service service;
+    tcp::socket socket(service);
+    try {
+        tcp::resolver resolver(service);
+        tcp::resolver::query query(mHost, boost::lexical_cast<string>(mPort));
+        boost::asio::connect(socket, resolver.resolve(query));
+        std::ostringstream hello;
+        WriteString(hello, mStudy);
+        WriteString(hello, mName);
+        Send(socket, eHello, hello.str());
+    } catch (std::exception& e) {
+        throw TemsimException("Couldn't connect to the coordinator at " + mHost
+            + " (" + e.what() + ")", "DistributedStudy");
+    }
+
+    size_t run = 0;
+    try {
+        vector<char> buffer(gResultDataBytes);
+        for (;;) {
+            Send(socket, eRequest);
+            string payload;
+            MessageType type = Receive(socket, payload);
+            if (type == eFinished) {
+                break;
+            }
+            CheckRefused(type, payload);
+            if (type != eAssign) {
+                throw TemsimException("Unexpected message from the coordinator",
+                    "DistributedStudy");
+            }
+            std::istringstream assign(payload);
+            unsigned long long count = 0;
+            ReadField(assign, count);
+            if (!assign || count > (payload.size() - sizeof(count)) / sizeof(long long)) {
+                throw TemsimException("Bad assignment from the coordinator",
+                    "DistributedStudy");
+            }
+            vector<long long> replicates((size_t)count);
+            if (count > 0 && !assign.read((char*)&replicates[0], count * sizeof(long long))) {
+                throw TemsimException("Bad assignment from the coordinator",
+                    "DistributedStudy");
+            }
+
+            // the coordinator may take the later ones away as we go
+            size_t keep = replicates.size();
+            for (size_t i = 0; i < keep; ++i) {
+                string file = Path(mScratchDirectory, mName + "-replicate-"
+                    + boost::lexical_cast<string>(replicates[i]) + ".result");
+                std::remove(file.c_str());
+                StudyStatistics contribution;
+                mRunner(replicates[i], file, contribution);
+                ++run;
+                if (ResultPoolId(file) != 0) {
+                    throw TemsimException(gPooledResultReason, "DistributedStudy");
+                }
+
+                std::ifstream result(file.c_str(), std::ios::binary);
+                while (result) {
+                    result.read(&buffer[0], buffer.size());
+                    if (result.gcount() > 0) {
+                        Send(socket, eResultData, string(&buffer[0], (size_t)result.gcount()));
+                    }
+                }
+                result.close();
+                std::remove(file.c_str());
+
+                std::ostringstream done;
+                WriteField(done, replicates[i]);
+                WriteStudyStatistics(done, contribution);
+                Send(socket, eDone, done.str());
+                type = Receive(socket, payload);
+                CheckRefused(type, payload);
+                if (type != eAck) {
+                    throw TemsimException("Unexpected message from the coordinator",
+                        "DistributedStudy");
+                }
+                std::istringstream ack(payload);
+                unsigned long long allowed = keep;
+                ReadField(ack, allowed);
+                keep = std::min(keep, (size_t)allowed);
+            }
+        }
+    } catch (boost::system::system_error& e) {
+        // the coordinator closes the connections of workers still busy once
+        // the study is done
+        BOOST_LOGL(distributedstudy, info) << "Worker " << mName
+            << " disconnected: " << e.what() << std::endl;
+    }
+    BOOST_LOGL(distributedstudy, info) << "Worker " << mName << " ran " << run
+        << " replicates" << std::endl;
+    return run;
+}
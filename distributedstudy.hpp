@@ -0,0 +1,187 @@
+#ifndef _DISTRIBUTEDSTUDY_HPP_
+#define _DISTRIBUTEDSTUDY_HPP_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/utility.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/asio.hpp>
+#include <boost/log/log.hpp>
+
+#include "studyjournal.hpp"
+#include "logging.hpp"
+#include "temsimexception.hpp"
+
+using std::string;
+using std::vector;
+using std::deque;
+using std::set;
+
+/// declare the boost logging stuff.
+BOOST_DECLARE_LOG(distributedstudy)
+
+/**
+\file
+Studies spread over several machines. A StudyCoordinator hands out ranges
+of a study's replicates over TCP to StudyWorker processes, which load the
+model from the same inputs, run their replicates and send back each one's
+result file and statistics as soon as it is finished. The coordinator
+commits each replicate to a StudyJournal, so a distributed study can be
+resumed like any other, and merges the statistics; as those are exact sums
+(see ReplicateStatistics) the totals are the same however the replicates
+were spread.
+
+Stragglers are dealt with as follows:
+- a worker with nothing to do takes the second half of the replicates
+  another worker has been given but not started (work stealing);
+- when there is nothing left to steal, it runs a replicate another worker is
+  still busy with, and whichever result arrives first is kept (replicates are
+  seeded from their own number, so both give the same result);
+- the unfinished replicates of a worker that disconnects are handed out again.
+
+Everything runs over plain TCP, so a study can be tried on one machine with
+several worker processes connected to localhost:
+@code
+// coordinator
+StudyJournal journal("results", study);
+StudyCoordinator coordinator(journal, replicates, 5417);
+StudyStatistics totals = coordinator.Run();
+
+// each worker
+StudyWorker worker("localhost", 5417, study, "scratch",
+    boost::bind(&RunReplicate, boost::ref(model), _1, _2, _3));
+worker.Run();
+@endcode
+
+Messages are a 32 bit type and a 64 bit length followed by that many bytes,
+with numbers as laid out by the host; the coordinator and workers are
+expected to be the same build.
+*/
+
+/// Hands out a study's replicates to workers and collects their results.
+class StudyCoordinator : boost::noncopyable {
+public:
+    /// Listen for workers.
+    /// @param arJournal the journal the results are committed to.
+    /// @param arReplicates the replicates of the study; those already in the
+    /// journal aren't run again.
+    /// @param aPort the port to listen on, or 0 for any free port.
+    /// @param aRangeSize replicates handed out at a time, or 0 for a 64th of
+    /// the study.
+    StudyCoordinator(StudyJournal& arJournal,
+                     const vector<long long>& arReplicates,
+                     unsigned short aPort = 0,
+                     size_t aRangeSize = 0);
+
+    ~StudyCoordinator();
+
+    /// The port listened on.
+    unsigned short Port() const { return mPort; }
+
+    /// Hand out the replicates until every one has been committed.
+    /// @returns the statistics of the whole study, including replicates
+    /// committed before.
+    const StudyStatistics& Run();
+
+    /// Number of workers that have connected.
+    size_t Workers() const { return mWorkers; }
+    /// Number of ranges taken from one worker and given to another.
+    size_t Stolen() const { return mStolen; }
+    /// Number of replicates given to a second worker while the first was
+    /// still running them.
+    size_t Reassigned() const { return mReassigned; }
+    /// Number of results discarded because the replicate was already done.
+    size_t Duplicates() const { return mDuplicates; }
+
+private:
+    struct Connection;
+    typedef boost::shared_ptr<Connection> ConnectionPtr;
+
+    /// accept workers until the study is done
+    void Accept();
+    /// talk to a worker until it or the study is done
+    void Serve(ConnectionPtr apConnection);
+    /// choose replicates for a worker, waiting if there are none to give
+    /// @returns false if the study is done.
+    bool HandOut(Connection& arConnection, vector<long long>& arReplicates);
+    /// true if the replicate is the one the worker should be running
+    bool IsRunning(Connection& arConnection, long long aReplicate);
+    /// note that a worker finished a replicate
+    /// @returns the number of its replicates the worker should run.
+    size_t Acknowledge(Connection& arConnection);
+    /// put back the unfinished replicates of a worker that has gone
+    void Release(Connection& arConnection);
+    /// commit a replicate's results, unless they already have been
+    void CommitResult(long long aReplicate, const string& arResultFile,
+                      const StudyStatistics& arContribution);
+
+    StudyJournal&       mrJournal;
+    StudyStatistics     mTotals;
+    vector<long long>   mReplicates;
+    size_t              mRangeSize;
+    unsigned short      mPort;
+
+    boost::asio::io_service         mService;
+    boost::asio::ip::tcp::acceptor  mAcceptor;
+    boost::thread_group             mThreads;
+
+    boost::mutex                mMutex;     ///< guards everything below
+    boost::condition_variable   mChanged;   ///< replicates done or handed back
+    boost::mutex                mCommitMutex;
+    vector<ConnectionPtr>       mConnections;
+    deque<long long>            mPending;   ///< replicates not handed out
+    set<long long>              mDone;
+    set<long long>              mDuplicated; ///< replicates given to two workers
+    size_t                      mToRun;     ///< replicates this run commits
+    bool                        mFinished;
+    size_t                      mWorkers;
+    size_t                      mStolen;
+    size_t                      mReassigned;
+    size_t                      mDuplicates;
+};
+
+/// Runs the replicates handed out by a StudyCoordinator.
+class StudyWorker : boost::noncopyable {
+public:
+    /// Runs one replicate.
+    /// @param aReplicate the replicate number.
+    /// @param arResultFile the file to write its results to, if it has any.
+    /// A ReplicateResultWriter writing it mustn't use a ResultChunkPool, as
+    /// the pool stays with the worker; such files are refused.
+    /// @param arContribution receives its statistics.
+    typedef boost::function<void (long long aReplicate,
+                                  const string& arResultFile,
+                                  StudyStatistics& arContribution)> Runner;
+
+    /// @param arHost the coordinator's host.
+    /// @param aPort the coordinator's port.
+    /// @param arStudy identifies the study, as for StudyJournal.
+    /// @param arScratchDirectory where result files are written before they
+    /// are sent.
+    /// @param aRunner runs a replicate.
+    /// @param arName names the worker in the coordinator's log.
+    StudyWorker(const string& arHost, unsigned short aPort,
+                const string& arStudy, const string& arScratchDirectory,
+                Runner aRunner, const string& arName = "worker");
+
+    /// Run replicates until the coordinator has no more.
+    /// @returns the number of replicates run.
+    size_t Run();
+
+private:
+    string          mHost;
+    unsigned short  mPort;
+    string          mStudy;
+    string          mScratchDirectory;
+    Runner          mRunner;
+    string          mName;
+};
+
+#endif
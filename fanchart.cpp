@@ -0,0 +1,293 @@
+#include "fanchart.hpp"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+
+#include "temsimexception.hpp"
+#include "statistics.hpp"
+
+using boost::format;
+
+/// define boost logging stuff.
+BOOST_DEFINE_LOG(fanchart, "fanchart")
+
+/**
+\file
+Implementation of the fan chart query.
+*/
+
+// true for NaN, which is the only value not equal to itself
+static bool IsNan(double aValue) {
+    return aValue != aValue;
+}
+
+void FanChart::WriteCsv(std::ostream& arOut) const {
+    arOut << "channel,bucket,first_step";
+    for (size_t p = 0; p < mPercentiles.size(); ++p) {
+        arOut << ",p" << mPercentiles[p];
+    }
+    arOut << ",mean,sd\n";
+    for (size_t c = 0; c < mChannels.size(); ++c) {
+        for (size_t b = 0; b < mBuckets; ++b) {
+            arOut << mChannels[c] << "," << b << "," << b * mBucketSteps;
+            for (size_t p = 0; p < mPercentiles.size(); ++p) {
+                arOut << "," << Value(c, p, b);
+            }
+            arOut << "," << Mean(c, b) << "," << StdDev(c, b) << "\n";
+        }
+    }
+}
+
+FanChartQuery::FanChartQuery(const vector<string>& arReplicateFiles,
+                             const string& arPoolFile)
+:   mFiles(arReplicateFiles),
+    mBucketSteps(1),
+    mThreads(0),
+    mWorkingSetBytes(4 << 20),
+    mpChart(0),
+    mNextTask(0)
+{
+    if (mFiles.empty()) {
+        throw TemsimException("Fan chart query needs at least one replicate",
+            "FanChart");
+    }
+    MappedResultPool::Ptr pool;
+    if (!arPoolFile.empty()) {
+        pool.reset(new MappedResultPool(arPoolFile));
+    }
+    for (size_t r = 0; r < mFiles.size(); ++r) {
+        mReaders.push_back(ReplicateResultReader::Ptr(
+            new ReplicateResultReader(mFiles[r], pool)));
+        if (mReaders[r]->Steps() != mReaders[0]->Steps()) {
+            throw TemsimException(str(format(
+                "Replicate %s has %d steps, but %s has %d") % mFiles[r]
+                % mReaders[r]->Steps() % mFiles[0] % mReaders[0]->Steps()),
+                "FanChart");
+        }
+    }
+    mPercentiles.push_back(5.0);
+    mPercentiles.push_back(50.0);
+    mPercentiles.push_back(95.0);
+}
+
+void FanChartQuery::AddAllChannels() {
+    const vector<string>& names = mReaders[0]->ChannelNames();
+    mChannels.insert(mChannels.end(), names.begin(), names.end());
+}
+
+void FanChartQuery::SetPercentiles(const vector<double>& arPercentiles) {
+    for (size_t p = 0; p < arPercentiles.size(); ++p) {
+        if (!(arPercentiles[p] >= 0.0 && arPercentiles[p] <= 100.0)) {
+            throw TemsimException(str(format(
+                "Percentile %g is not between 0 and 100") % arPercentiles[p]),
+                "FanChart");
+        }
+    }
+    mPercentiles = arPercentiles;
+    std::sort(mPercentiles.begin(), mPercentiles.end());
+}
+
+void FanChartQuery::SetBucketSteps(size_t aSteps) {
+    if (aSteps == 0) {
+        throw TemsimException("Fan chart buckets must be at least one step",
+            "FanChart");
+    }
+    mBucketSteps = aSteps;
+}
+
+void FanChartQuery::Run(FanChart& arChart) {
+    const size_t replicates = mReaders.size();
+    const size_t steps = mReaders[0]->Steps();
+    const size_t channels = mChannels.size();
+
+    // a channel may be in a different place in each replicate
+    mChannelIndex.assign(replicates, vector<size_t>(channels));
+    for (size_t r = 0; r < replicates; ++r) {
+        for (size_t c = 0; c < channels; ++c) {
+            mChannelIndex[r][c] = mReaders[r]->FindChannel(mChannels[c]);
+            if (mChannelIndex[r][c] == mReaders[r]->Channels()) {
+                throw TemsimException("Replicate " + mFiles[r]
+                    + " has no channel " + mChannels[c], "FanChart");
+            }
+        }
+    }
+
+    arChart.mChannels = mChannels;
+    arChart.mPercentiles = mPercentiles;
+    arChart.mBucketSteps = mBucketSteps;
+    arChart.mBuckets = (steps + mBucketSteps - 1) / mBucketSteps;
+    arChart.mValues.assign(channels * mPercentiles.size() * arChart.mBuckets,
+        std::numeric_limits<double>::quiet_NaN());
+    arChart.mMeans.assign(channels * arChart.mBuckets,
+        std::numeric_limits<double>::quiet_NaN());
+    arChart.mStdDevs.assign(channels * arChart.mBuckets,
+        std::numeric_limits<double>::quiet_NaN());
+    mpChart = &arChart;
+    if (channels == 0 || steps == 0) {
+        return;
+    }
+
+    // a window is a whole number of buckets covering at least one block
+    const size_t block_steps = mReaders[0]->BlockSteps();
+    const size_t window_buckets = (block_steps + mBucketSteps - 1) / mBucketSteps;
+
+    // size the tasks so each holds about mWorkingSetBytes of samples
+    size_t cells = std::max(mWorkingSetBytes / (replicates * sizeof(double)), (size_t)1);
+    size_t task_buckets = std::min(cells, window_buckets);
+    size_t task_channels = std::max(cells / task_buckets, (size_t)1);
+
+    unsigned threads = mThreads;
+    if (threads == 0) {
+        threads = std::max(boost::thread::hardware_concurrency(), 1u);
+    }
+
+    for (size_t first = 0; first < arChart.mBuckets; first += window_buckets) {
+        size_t end = std::min(first + window_buckets, arChart.mBuckets);
+
+        mTasks.clear();
+        for (size_t b = first; b < end; b += task_buckets) {
+            for (size_t c = 0; c < channels; c += task_channels) {
+                Task task;
+                task.FirstChannel = c;
+                task.EndChannel = std::min(c + task_channels, channels);
+                task.FirstBucket = b;
+                task.EndBucket = std::min(b + task_buckets, end);
+                mTasks.push_back(task);
+            }
+        }
+        mNextTask = 0;
+
+        unsigned window_threads = (unsigned)std::min((size_t)threads, mTasks.size());
+        if (window_threads <= 1) {
+            Worker();
+        } else {
+            boost::thread_group group;
+            for (unsigned i = 0; i < window_threads; ++i) {
+                group.create_thread(boost::bind(&FanChartQuery::Worker, this));
+            }
+            group.join_all();
+        }
+        if (!mError.empty()) {
+            string error;
+            error.swap(mError);
+            throw TemsimException(error, "FanChart");
+        }
+
+        // release the blocks this window has finished with; a block that
+        // straddles the end of the window is kept for the next one
+        size_t end_step = std::min(end * mBucketSteps, steps);
+        for (size_t r = 0; r < replicates; ++r) {
+            size_t first_block = first * mBucketSteps / mReaders[r]->BlockSteps();
+            size_t done_blocks = end_step == steps
+                ? mReaders[r]->Blocks() : end_step / mReaders[r]->BlockSteps();
+            if (done_blocks > first_block) {
+                mReaders[r]->Release(first_block, done_blocks - 1);
+            }
+        }
+    }
+
+    BOOST_LOGL(fanchart, info) << "Found " << mPercentiles.size()
+        << " percentiles of " << channels << " channels over "
+        << arChart.mBuckets << " buckets from " << replicates
+        << " replicates" << std::endl;
+}
+
+void FanChartQuery::Worker() {
+    vector<double> samples;
+    vector<double> steps;
+    try {
+        while (true) {
+            size_t task;
+            {
+                boost::mutex::scoped_lock lock(mMutex);
+                if (mNextTask == mTasks.size() || !mError.empty()) {
+                    return;
+                }
+                task = mNextTask++;
+            }
+            RunTask(mTasks[task], samples, steps);
+        }
+    } catch (std::exception& e) {
+        boost::mutex::scoped_lock lock(mMutex);
+        if (mError.empty()) {
+            mError = e.what();
+        }
+    }
+}
+
+void FanChartQuery::RunTask(const Task& arTask, vector<double>& arSamples,
+                            vector<double>& arSteps) {
+    const size_t replicates = mReaders.size();
+    const size_t total_steps = mReaders[0]->Steps();
+    const size_t buckets = arTask.EndBucket - arTask.FirstBucket;
+    const size_t first_step = arTask.FirstBucket * mBucketSteps;
+    const size_t step_count = std::min(arTask.EndBucket * mBucketSteps, total_steps)
+        - first_step;
+    const size_t percentiles = mPercentiles.size();
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+
+    // samples are held cell by cell, the replicates of each cell adjacent
+    arSamples.resize((arTask.EndChannel - arTask.FirstChannel) * buckets * replicates);
+    arSteps.resize(step_count);
+
+    for (size_t c = arTask.FirstChannel; c < arTask.EndChannel; ++c) {
+        double* cells = &arSamples[(c - arTask.FirstChannel) * buckets * replicates];
+
+        for (size_t r = 0; r < replicates; ++r) {
+            mReaders[r]->Read(mChannelIndex[r][c], first_step, step_count, &arSteps[0]);
+            for (size_t b = 0; b < buckets; ++b) {
+                size_t begin = b * mBucketSteps;
+                size_t end = std::min(begin + mBucketSteps, step_count);
+                double sum = 0.0;
+                size_t n = 0;
+                for (size_t s = begin; s < end; ++s) {
+                    if (!IsNan(arSteps[s])) {
+                        sum += arSteps[s];
+                        ++n;
+                    }
+                }
+                cells[b * replicates + r] = n == 0 ? nan : sum / (double)n;
+            }
+        }
+
+        for (size_t b = 0; b < buckets; ++b) {
+            double* begin = cells + b * replicates;
+            ReplicateStatistics statistics;
+            for (size_t r = 0; r < replicates; ++r) {
+                statistics.Add(begin[r]);
+            }
+            size_t cell = c * mpChart->mBuckets + arTask.FirstBucket + b;
+            mpChart->mMeans[cell] = statistics.Mean();
+            mpChart->mStdDevs[cell] = statistics.StdDev();
+
+            // drop the NaNs, which would upset the ordering
+            double* end = std::remove_if(begin, begin + replicates, IsNan);
+            size_t n = end - begin;
+            if (n == 0) {
+                continue;
+            }
+            // percentiles are ascending, so each selection only needs to
+            // look at what is above the previous one
+            double* from = begin;
+            for (size_t p = 0; p < percentiles; ++p) {
+                double h = (double)(n - 1) * mPercentiles[p] / 100.0;
+                size_t lo = std::min((size_t)h, n - 1);
+                double frac = h - (double)lo;
+                std::nth_element(from, begin + lo, end);
+                from = begin + lo;
+                double value = begin[lo];
+                if (frac > 0.0 && lo + 1 < n) {
+                    double upper = *std::min_element(begin + lo + 1, end);
+                    value += frac * (upper - value);
+                }
+                mpChart->mValues[(c * percentiles + p) * mpChart->mBuckets
+                    + arTask.FirstBucket + b] = value;
+            }
+        }
+    }
+}
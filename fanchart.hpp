@@ -0,0 +1,155 @@
+#ifndef _FANCHART_HPP_
+#define _FANCHART_HPP_
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/log/log.hpp>
+
+#include "resultstore.hpp"
+#include "logging.hpp"
+
+using std::string;
+using std::vector;
+
+/// declare the boost logging stuff.
+BOOST_DECLARE_LOG(fanchart)
+
+/**
+\file
+Cross-replicate percentiles of stored results, for fan charts. For each
+channel and each time bucket (a fixed number of steps), the bucket mean is
+taken in every replicate and the requested percentiles of those means are
+found:
+@code
+FanChartQuery query(replicate_files);
+query.AddChannel("Storage.Great_Lake.Volume");
+query.SetPercentiles(percentiles);      // eg. 5, 50, 95
+query.SetBucketSteps(24 * 7);           // weekly buckets of hourly steps
+FanChart chart;
+query.Run(chart);
+chart.WriteCsv(out);
+@endcode
+
+The replicate files are memory-mapped and read one time window (roughly one
+block of the files) at a time; pages are released once a window is done, so
+memory use doesn't grow with the length of the run. Within a window the work
+is split into tasks covering a few channels and buckets, sized so that a
+task's samples (one per replicate for each of its cells) fit the working set
+given to SetWorkingSetBytes(), and the tasks are shared between threads.
+Percentiles are found by selection (nth_element) rather than sorting, and
+interpolate linearly between order statistics. NaN values are ignored.
+
+The mean and standard deviation of the bucket means across replicates are
+found too, with ReplicateStatistics, so they are exact to the last bit and
+don't change with the order of the replicates or the number of threads.
+*/
+
+/// The result of a FanChartQuery.
+class FanChart {
+public:
+    FanChart() : mBucketSteps(0), mBuckets(0) {}
+
+    /// The channels, in the order they were added to the query.
+    const vector<string>& Channels() const { return mChannels; }
+    /// The percentiles, ascending.
+    const vector<double>& Percentiles() const { return mPercentiles; }
+    /// Steps per bucket.
+    size_t BucketSteps() const { return mBucketSteps; }
+    /// Number of buckets.
+    size_t Buckets() const { return mBuckets; }
+
+    /// One percentile of one channel in one bucket.
+    double Value(size_t aChannel, size_t aPercentile, size_t aBucket) const {
+        return mValues[(aChannel * mPercentiles.size() + aPercentile) * mBuckets + aBucket];
+    }
+
+    /// All the buckets of one percentile of one channel.
+    const double* Band(size_t aChannel, size_t aPercentile) const {
+        return &mValues[(aChannel * mPercentiles.size() + aPercentile) * mBuckets];
+    }
+
+    /// The mean across replicates of one channel in one bucket.
+    double Mean(size_t aChannel, size_t aBucket) const {
+        return mMeans[aChannel * mBuckets + aBucket];
+    }
+
+    /// The standard deviation across replicates of one channel in one bucket.
+    double StdDev(size_t aChannel, size_t aBucket) const {
+        return mStdDevs[aChannel * mBuckets + aBucket];
+    }
+
+    /// Write the chart as CSV: channel, bucket, first step, then one column
+    /// per percentile, then the mean and standard deviation.
+    void WriteCsv(std::ostream& arOut) const;
+
+private:
+    friend class FanChartQuery;
+
+    vector<string>  mChannels;
+    vector<double>  mPercentiles;
+    size_t          mBucketSteps;
+    size_t          mBuckets;
+    vector<double>  mValues;    ///< channel x percentile x bucket
+    vector<double>  mMeans;     ///< channel x bucket
+    vector<double>  mStdDevs;   ///< channel x bucket
+
+};
+
+/// Computes a FanChart from a set of replicate result files.
+class FanChartQuery {
+public:
+    /// @param arReplicateFiles one result file per replicate (see resultstore.hpp.)
+    /// @param arPoolFile the chunk pool the files were written with, if any.
+    FanChartQuery(const vector<string>& arReplicateFiles,
+                  const string& arPoolFile = "");
+
+    /// Add a channel to the query.
+    void AddChannel(const string& arName) { mChannels.push_back(arName); }
+    /// Add every channel of the first replicate.
+    void AddAllChannels();
+    /// The percentiles to find, between 0 and 100 (default 5, 50, 95.)
+    void SetPercentiles(const vector<double>& arPercentiles);
+    /// Steps per time bucket (default 1.)
+    void SetBucketSteps(size_t aSteps);
+    /// Number of threads, or 0 for one per core (the default.)
+    void SetThreads(unsigned aThreads) { mThreads = aThreads; }
+    /// Bytes of samples each task may hold (default 4MB, to suit the cache.)
+    void SetWorkingSetBytes(size_t aBytes) { mWorkingSetBytes = aBytes; }
+
+    /// Run the query.
+    void Run(FanChart& arChart);
+
+private:
+    /// one unit of work: a range of channels over a range of buckets
+    struct Task {
+        size_t FirstChannel, EndChannel;
+        size_t FirstBucket, EndBucket;
+    };
+
+    /// worker thread body: take tasks until there are none left
+    void Worker();
+    /// find the percentiles for one task
+    void RunTask(const Task& arTask, vector<double>& arSamples, vector<double>& arSteps);
+
+    vector<string>      mFiles;
+    vector<ReplicateResultReader::Ptr> mReaders;
+    vector<string>      mChannels;
+    vector<double>      mPercentiles;
+    size_t              mBucketSteps;
+    unsigned            mThreads;
+    size_t              mWorkingSetBytes;
+
+    // state shared by the workers during Run
+    FanChart*           mpChart;
+    vector<vector<size_t> > mChannelIndex;  ///< replicate x query channel -> file channel
+    vector<Task>        mTasks;
+    size_t              mNextTask;
+    string              mError;
+    boost::mutex        mMutex;
+};
+
+#endif
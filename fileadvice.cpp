@@ -0,0 +1,39 @@
+#include "fileadvice.hpp"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/**
+\file
+Implementation of the mapped file hints.
+*/
+
+#ifndef _WIN32
+// round the range out to whole pages and pass the advice to the kernel
+static void Advise(const char* apStart, size_t aLength, int aAdvice) {
+    if (aLength == 0) {
+        return;
+    }
+    static const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)apStart & ~(page_size - 1);
+    size_t end = (size_t)apStart + aLength;
+    // advice is only a hint, so we ignore any failure
+    madvise((void*)start, end - start, aAdvice);
+}
+#endif
+
+void AdviseWillNeed(const char* apStart, size_t aLength) {
+#ifndef _WIN32
+    Advise(apStart, aLength, MADV_WILLNEED);
+#endif
+}
+
+void AdviseDontNeed(const char* apStart, size_t aLength) {
+#ifndef _WIN32
+    // MADV_DONTNEED on a read-only file mapping just drops the pages, which
+    // will be read again from the file if they are touched.
+    Advise(apStart, aLength, MADV_DONTNEED);
+#endif
+}
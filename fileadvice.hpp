@@ -0,0 +1,19 @@
+#ifndef _FILEADVICE_HPP_
+#define _FILEADVICE_HPP_
+
+#include <cstddef>
+
+/**
+\file
+Hints to the OS about how a memory-mapped file will be read, shared by the
+modules that map their inputs (windowed series, result files, archives.)
+*/
+
+/// Tell the OS that a range of a mapped file will be read soon. The range
+/// does not need to be page aligned. Does nothing where unsupported.
+void AdviseWillNeed(const char* apStart, size_t aLength);
+
+/// Tell the OS that a range of a mapped file will not be read again soon.
+void AdviseDontNeed(const char* apStart, size_t aLength);
+
+#endif
@@ -0,0 +1,8 @@
+#include "forecaststore.hpp"
+
+/**
+\file
+Non-template parts of the forecast store.
+*/
+
+const char* gForecastFileMagic = "TFCUBE01";
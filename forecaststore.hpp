@@ -0,0 +1,306 @@
+#ifndef _FORECASTSTORE_HPP_
+#define _FORECASTSTORE_HPP_
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "interp.hpp"
+#include "datetime.hpp"
+#include "hugepagealloc.hpp"
+#include "temsimexception.hpp"
+
+using std::vector;
+using std::string;
+
+/**
+\file
+Storage for ensemble forecasts. A forecast issued at time t gives a value for
+each of a fixed set of lead times and for each ensemble member, so a set of
+forecasts is a cube indexed by issue time x lead time x member. The cube is
+held in one contiguous array with the members innermost, so all the members
+for one issue and lead are adjacent and can be processed together.
+
+Lead times are given in hours, and values between lead times are found with
+any of the interpolators from interp.hpp, through their flat-series
+interface:
+@code
+ForecastStore<double> inflows(lead_hours, 50);
+inflows.AddIssue(issue_time, values);   // lead_hours.size() * 50 values
+...
+LinearInterp<double, double> linear;
+vector<double> members(inflows.Members());
+inflows.MembersAt(now, 36.0, linear, &members[0]); // forecast 36h ahead
+@endcode
+
+A store can be saved to, and memory-mapped from, a binary cube file, which
+has the same layout as the store in memory preceded by a small header, the
+lead times and the issue times.
+*/
+
+/// header of a binary forecast cube file
+struct ForecastFileHeader {
+    char        Magic[8];   ///< "TFCUBE01"
+    unsigned    ValSize;    ///< sizeof(ValType) when written
+    unsigned    KeySize;    ///< sizeof(DateTime) when written
+    unsigned long long Issues;  ///< number of issue times
+    unsigned long long Leads;   ///< number of lead times
+    unsigned long long Members; ///< number of ensemble members
+};
+
+/// magic string at the start of a forecast cube file
+extern const char* gForecastFileMagic;
+
+template <typename ValType=double>
+class ForecastStore : boost::noncopyable {
+public:
+    typedef boost::shared_ptr<ForecastStore<ValType> > Ptr;
+
+    /// Construct an empty store.
+    /// @param arLeadHours the lead times of every forecast, in ascending order.
+    /// @param aMembers the number of ensemble members.
+    ForecastStore(const vector<double>& arLeadHours, size_t aMembers)
+    :   mLeadHours(arLeadHours),
+        mMembers(aMembers),
+        mpCube(0)
+    {
+        if (mLeadHours.empty() || mMembers == 0) {
+            throw TemsimException("Forecast store needs at least one lead "
+                "time and one member", "ForecastStore");
+        }
+        for (size_t i = 1; i < mLeadHours.size(); ++i) {
+            if (!(mLeadHours[i - 1] < mLeadHours[i])) {
+                throw TemsimException("Forecast lead times must be ascending",
+                    "ForecastStore");
+            }
+        }
+    }
+
+    /// Map a store from a binary cube file. The store is read-only.
+    static Ptr Map(const string& arFileName);
+
+    /// Save the store as a binary cube file.
+    void Save(const string& arFileName) const;
+
+    /// Add a forecast. Forecasts must be added in order of issue time.
+    /// @param arIssueTime the issue time.
+    /// @param apValues Leads() * Members() values, members innermost.
+    void AddIssue(const DateTime& arIssueTime, const ValType* apValues) {
+        if (mpFile) {
+            throw TemsimException("Can't add to a mapped forecast store",
+                "ForecastStore");
+        }
+        if (!mIssueTimes.empty() && !(mIssueTimes.back() < arIssueTime)) {
+            throw TemsimException(str(format(
+                "Forecast issued at %s added out of order") % arIssueTime),
+                "ForecastStore");
+        }
+        mIssueTimes.push_back(arIssueTime);
+        mCube.insert(mCube.end(), apValues, apValues + IssueSize());
+        mpCube = &mCube[0];
+    }
+
+    /// Number of forecasts in the store.
+    size_t Issues() const { return mIssueTimes.size(); }
+    /// Number of lead times in each forecast.
+    size_t Leads() const { return mLeadHours.size(); }
+    /// Number of ensemble members in each forecast.
+    size_t Members() const { return mMembers; }
+
+    /// Issue time of a forecast.
+    const DateTime& IssueTime(size_t aIssue) const { return mIssueTimes[aIssue]; }
+    /// Lead times, in hours.
+    const vector<double>& LeadHours() const { return mLeadHours; }
+
+    /// Index of the latest forecast issued at or before the given time.
+    size_t LatestIssue(const DateTime& arTime) const {
+        typename vector<DateTime>::const_iterator iter =
+            std::upper_bound(mIssueTimes.begin(), mIssueTimes.end(), arTime);
+        if (iter == mIssueTimes.begin()) {
+            throw TemsimException(str(format(
+                "No forecast issued at or before %s") % arTime), "ForecastStore");
+        }
+        return (iter - mIssueTimes.begin()) - 1;
+    }
+
+    /// All the members of one forecast at one of its lead times.
+    const ValType* Slice(size_t aIssue, size_t aLead) const {
+        return mpCube + (aIssue * Leads() + aLead) * mMembers;
+    }
+
+    /// Every member of a forecast at a lead time, interpolating between the
+    /// stored lead times. The bracketing lead times are found once and all
+    /// the members are then interpolated in one loop.
+    /// @param aIssue the forecast.
+    /// @param aLeadHours the lead time in hours.
+    /// @param arInterp the interpolation policy.
+    /// @param apOut receives Members() values.
+    void Members(size_t aIssue, double aLeadHours,
+                 const Interpolator<double, ValType>& arInterp,
+                 ValType* apOut) const {
+        size_t lower, upper;
+        arInterp.Bracket(&mLeadHours[0], Leads(), aLeadHours, lower, upper);
+        const ValType* low = Slice(aIssue, lower);
+        if (lower == upper) {
+            std::copy(low, low + mMembers, apOut);
+            return;
+        }
+        const ValType* high = Slice(aIssue, upper);
+        const double low_lead = mLeadHours[lower];
+        const double high_lead = mLeadHours[upper];
+        for (size_t m = 0; m < mMembers; ++m) {
+            apOut[m] = CalcInterpolatedValue<double, ValType>::Value(
+                low_lead, low[m], high_lead, high[m], aLeadHours);
+        }
+    }
+
+    /// Every member of the latest forecast issued at or before arTime, at
+    /// the given lead time after arTime's forecast was issued.
+    void MembersAt(const DateTime& arTime, double aLeadHours,
+                   const Interpolator<double, ValType>& arInterp,
+                   ValType* apOut) const {
+        Members(LatestIssue(arTime), aLeadHours, arInterp, apOut);
+    }
+
+    /// Every member of the latest forecast issued at or before arTime, for
+    /// the valid time arValidTime.
+    void MembersValidAt(const DateTime& arTime, const DateTime& arValidTime,
+                        const Interpolator<double, ValType>& arInterp,
+                        ValType* apOut) const {
+        size_t issue = LatestIssue(arTime);
+        double lead = (double)(arValidTime - mIssueTimes[issue]).ticks()
+            / (double)boost::posix_time::hours(1).ticks();
+        Members(issue, lead, arInterp, apOut);
+    }
+
+    /// One member of a forecast at a lead time.
+    ValType Value(size_t aIssue, double aLeadHours, size_t aMember,
+                  const Interpolator<double, ValType>& arInterp) const {
+        size_t lower, upper;
+        arInterp.Bracket(&mLeadHours[0], Leads(), aLeadHours, lower, upper);
+        ValType low = Slice(aIssue, lower)[aMember];
+        if (lower == upper) {
+            return low;
+        }
+        return CalcInterpolatedValue<double, ValType>::Value(
+            mLeadHours[lower], low, mLeadHours[upper],
+            Slice(aIssue, upper)[aMember], aLeadHours);
+    }
+
+private:
+    /// number of values in one forecast
+    size_t IssueSize() const { return Leads() * mMembers; }
+
+    vector<double>      mLeadHours;     ///< lead times in hours
+    size_t              mMembers;       ///< ensemble members
+    vector<DateTime>    mIssueTimes;    ///< issue times, ascending
+    vector<ValType, HugePageAllocator<ValType> > mCube; ///< the values, unless mapped
+
+    const ValType*      mpCube;         ///< the values
+    boost::shared_ptr<boost::iostreams::mapped_file_source> mpFile; ///< the mapping, if mapped
+};
+
+template <typename ValType>
+typename ForecastStore<ValType>::Ptr
+ForecastStore<ValType>::Map(const string& arFileName) {
+    boost::shared_ptr<boost::iostreams::mapped_file_source> file(
+        new boost::iostreams::mapped_file_source);
+    try {
+        file->open(arFileName);
+    } catch (std::exception& e) {
+        throw TemsimException("Couldn't map forecast file " + arFileName
+            + " (" + e.what() + ")", "ForecastStore");
+    }
+
+    ForecastFileHeader header;
+    if (file->size() < sizeof(header)) {
+        throw TemsimException("Forecast file " + arFileName + " is too short",
+            "ForecastStore");
+    }
+    memcpy(&header, file->data(), sizeof(header));
+    if (memcmp(header.Magic, gForecastFileMagic, sizeof(header.Magic)) != 0
+        || header.ValSize != sizeof(ValType)
+        || header.KeySize != sizeof(DateTime)) {
+        throw TemsimException("Forecast file " + arFileName
+            + " has the wrong format", "ForecastStore");
+    }
+    // check the sizes before using them, so a damaged header can't make
+    // the offsets below overflow or the copies run off the mapping
+    const unsigned long long max_values = file->size() / sizeof(ValType);
+    if (header.Leads == 0 || header.Members == 0
+        || header.Leads > file->size() / sizeof(double)
+        || header.Issues > file->size() / sizeof(DateTime)
+        || header.Members > max_values / header.Leads
+        || (header.Issues > 0
+            && header.Issues > max_values / (header.Leads * header.Members))) {
+        throw TemsimException("Forecast file " + arFileName
+            + " has a bad header", "ForecastStore");
+    }
+    size_t cube_offset = sizeof(header) + header.Leads * sizeof(double)
+        + header.Issues * sizeof(DateTime);
+    // the cube is aligned for its value type
+    cube_offset = (cube_offset + sizeof(ValType) - 1) / sizeof(ValType) * sizeof(ValType);
+    size_t cube_size = header.Issues * header.Leads * header.Members;
+    if (file->size() < cube_offset + cube_size * sizeof(ValType)) {
+        throw TemsimException("Forecast file " + arFileName + " is truncated",
+            "ForecastStore");
+    }
+
+    const char* p = file->data() + sizeof(header);
+    vector<double> leads((size_t)header.Leads);
+    memcpy(&leads[0], p, leads.size() * sizeof(double));
+    p += leads.size() * sizeof(double);
+
+    Ptr store(new ForecastStore<ValType>(leads, (size_t)header.Members));
+    store->mIssueTimes.resize((size_t)header.Issues);
+    for (size_t i = 0; i < store->mIssueTimes.size(); ++i) {
+        memcpy(&store->mIssueTimes[i], p, sizeof(DateTime));
+        p += sizeof(DateTime);
+    }
+    store->mpCube = (const ValType*)(file->data() + cube_offset);
+    store->mpFile = file;
+    return store;
+}
+
+template <typename ValType>
+void ForecastStore<ValType>::Save(const string& arFileName) const {
+    std::ofstream out(arFileName.c_str(), std::ios::binary);
+    if (!out) {
+        throw TemsimException("Couldn't write forecast file " + arFileName,
+            "ForecastStore");
+    }
+    ForecastFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.Magic, gForecastFileMagic, sizeof(header.Magic));
+    header.ValSize = sizeof(ValType);
+    header.KeySize = sizeof(DateTime);
+    header.Issues = Issues();
+    header.Leads = Leads();
+    header.Members = mMembers;
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)&mLeadHours[0], mLeadHours.size() * sizeof(double));
+    for (size_t i = 0; i < mIssueTimes.size(); ++i) {
+        out.write((const char*)&mIssueTimes[i], sizeof(DateTime));
+    }
+    size_t written = sizeof(header) + mLeadHours.size() * sizeof(double)
+        + mIssueTimes.size() * sizeof(DateTime);
+    while (written % sizeof(ValType) != 0) {
+        out.put('\0');
+        ++written;
+    }
+    if (Issues() > 0) {
+        out.write((const char*)mpCube, Issues() * IssueSize() * sizeof(ValType));
+    }
+    if (!out) {
+        throw TemsimException("Error writing forecast file " + arFileName,
+            "ForecastStore");
+    }
+}
+
+#endif
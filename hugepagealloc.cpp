@@ -0,0 +1,244 @@
+#include "hugepagealloc.hpp"
+
+#include <map>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <boost/thread/mutex.hpp>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+using std::map;
+using std::string;
+
+/// define boost logging stuff.
+BOOST_DEFINE_LOG(hugepagealloc, "hugepagealloc")
+
+/**
+\file
+Implementation of the huge page allocator.
+*/
+
+namespace {
+
+/// how a region ended up backed
+enum Backing {
+    eExplicit,  ///< MAP_HUGETLB
+    eAdvised,   ///< MADV_HUGEPAGE accepted
+    eFallback   ///< ordinary pages
+};
+
+/// a region mapped for a large allocation
+struct Region {
+    size_t  Bytes;      ///< bytes asked for
+    size_t  Length;     ///< bytes mapped
+    Backing How;
+};
+
+const size_t gHugePageSize = 2 << 20;
+
+boost::mutex gMutex;
+map<char*, Region> gRegions;                ///< live regions by address
+HugePageMode gMode = eTransparentHugePages;
+size_t gThreshold = gHugePageSize;
+/// smallest allocation ever mapped; anything smaller came from operator new
+size_t gSmallestRegion = (size_t)-1;
+
+}
+
+void SetHugePageMode(HugePageMode aMode) {
+    boost::mutex::scoped_lock lock(gMutex);
+    gMode = aMode;
+}
+
+HugePageMode GetHugePageMode() {
+    boost::mutex::scoped_lock lock(gMutex);
+    return gMode;
+}
+
+void SetHugePageThreshold(size_t aBytes) {
+    boost::mutex::scoped_lock lock(gMutex);
+    gThreshold = std::max(aBytes, (size_t)1);
+}
+
+size_t HugePageThreshold() {
+    boost::mutex::scoped_lock lock(gMutex);
+    return gThreshold;
+}
+
+void* AllocateHugePages(size_t aBytes) {
+#ifndef _WIN32
+    HugePageMode mode;
+    size_t threshold;
+    {
+        boost::mutex::scoped_lock lock(gMutex);
+        mode = gMode;
+        threshold = gThreshold;
+    }
+    if (mode != eNoHugePages && aBytes >= threshold) {
+        Region region;
+        region.Bytes = aBytes;
+        region.Length = (aBytes + gHugePageSize - 1) / gHugePageSize * gHugePageSize;
+        region.How = eFallback;
+        void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        if (mode == eExplicitHugePages) {
+            // fails if there aren't enough reserved huge pages
+            p = mmap(0, region.Length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) {
+                region.How = eExplicit;
+            }
+        }
+#endif
+        if (p == MAP_FAILED) {
+            // map an extra huge page so the region can be trimmed to start
+            // on a huge page boundary, which transparent huge pages need
+            char* raw = (char*)mmap(0, region.Length + gHugePageSize,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw == (char*)MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            char* start = (char*)(((size_t)raw + gHugePageSize - 1) & ~(gHugePageSize - 1));
+            if (start != raw) {
+                munmap(raw, start - raw);
+            }
+            size_t tail = (raw + region.Length + gHugePageSize) - (start + region.Length);
+            if (tail != 0) {
+                munmap(start + region.Length, tail);
+            }
+            p = start;
+#ifdef MADV_HUGEPAGE
+            if (madvise(p, region.Length, MADV_HUGEPAGE) == 0) {
+                region.How = eAdvised;
+            }
+#endif
+        }
+        boost::mutex::scoped_lock lock(gMutex);
+        gRegions[(char*)p] = region;
+        gSmallestRegion = std::min(gSmallestRegion, aBytes);
+        return p;
+    }
+#endif
+    return ::operator new(aBytes);
+}
+
+void FreeHugePages(void* apMemory, size_t aBytes) {
+    if (!apMemory) {
+        return;
+    }
+#ifndef _WIN32
+    size_t length = 0;
+    {
+        boost::mutex::scoped_lock lock(gMutex);
+        // anything smaller than every region came from operator new
+        if (aBytes >= gSmallestRegion) {
+            map<char*, Region>::iterator iter = gRegions.find((char*)apMemory);
+            if (iter != gRegions.end()) {
+                length = iter->second.Length;
+                gRegions.erase(iter);
+            }
+        }
+    }
+    if (length != 0) {
+        munmap(apMemory, length);
+        return;
+    }
+#endif
+    ::operator delete(apMemory);
+}
+
+#ifndef _WIN32
+// bytes of the given regions on huge pages, from /proc/self/smaps. The
+// kernel may merge our mappings with their neighbours, so a mapping's huge
+// page count is only credited up to the size of our regions within it.
+static unsigned long long CountHugeBytes(const map<char*, Region>& arRegions) {
+    std::ifstream smaps("/proc/self/smaps");
+    if (!smaps || arRegions.empty()) {
+        return 0;
+    }
+    unsigned long long total = 0;
+    unsigned long long overlap = 0;     // our bytes in the current mapping
+    unsigned long long huge = 0;        // huge page bytes in the current mapping
+    string line;
+    while (std::getline(smaps, line)) {
+        size_t dash = line.find('-');
+        size_t colon = line.find(':');
+        if (dash != string::npos && (colon == string::npos || dash < colon)) {
+            // "start-end perms ..." begins a new mapping
+            total += std::min(huge, overlap);
+            huge = overlap = 0;
+            std::istringstream in(line);
+            size_t start, end;
+            char sep;
+            if (!(in >> std::hex >> start >> sep >> end)) {
+                continue;
+            }
+            map<char*, Region>::const_iterator iter = arRegions.upper_bound((char*)end);
+            while (iter != arRegions.begin()) {
+                --iter;
+                size_t region_start = (size_t)iter->first;
+                size_t region_end = region_start + iter->second.Length;
+                if (region_end <= start) {
+                    break;
+                }
+                overlap += std::min(end, region_end) - std::max(start, region_start);
+            }
+        } else if (overlap != 0 && colon != string::npos) {
+            string field = line.substr(0, colon);
+            if (field == "AnonHugePages" || field == "Private_Hugetlb"
+                || field == "Shared_Hugetlb") {
+                unsigned long long kb = 0;
+                std::istringstream(line.substr(colon + 1)) >> kb;
+                huge += kb * 1024;
+            }
+        }
+    }
+    total += std::min(huge, overlap);
+    return total;
+}
+#endif
+
+HugePageStats GetHugePageStats() {
+    HugePageStats stats = HugePageStats();
+    map<char*, Region> regions;
+    {
+        boost::mutex::scoped_lock lock(gMutex);
+        regions = gRegions;
+    }
+    for (map<char*, Region>::const_iterator iter = regions.begin();
+         iter != regions.end(); ++iter) {
+        ++stats.Allocations;
+        stats.BytesRequested += iter->second.Bytes;
+        switch (iter->second.How) {
+        case eExplicit:
+            stats.BytesExplicit += iter->second.Bytes;
+            break;
+        case eAdvised:
+            stats.BytesAdvised += iter->second.Bytes;
+            break;
+        default:
+            stats.BytesFallback += iter->second.Bytes;
+            break;
+        }
+    }
+#ifndef _WIN32
+    stats.BytesHuge = CountHugeBytes(regions);
+#endif
+    return stats;
+}
+
+void LogHugePageStats() {
+    HugePageStats stats = GetHugePageStats();
+    const double mb = 1024.0 * 1024.0;
+    BOOST_LOGL(hugepagealloc, info) << stats.Allocations
+        << " large allocations, " << stats.BytesRequested / mb << "MB ("
+        << stats.BytesExplicit / mb << "MB explicit huge pages, "
+        << stats.BytesAdvised / mb << "MB advised, "
+        << stats.BytesFallback / mb << "MB ordinary pages), "
+        << stats.BytesHuge / mb << "MB on huge pages" << std::endl;
+}
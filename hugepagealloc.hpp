@@ -0,0 +1,130 @@
+#ifndef _HUGEPAGEALLOC_HPP_
+#define _HUGEPAGEALLOC_HPP_
+
+#include <new>
+#include <limits>
+#include <cstddef>
+
+#include <boost/log/log.hpp>
+
+#include "logging.hpp"
+
+/// declare the boost logging stuff.
+BOOST_DECLARE_LOG(hugepagealloc)
+
+/**
+\file
+Huge page backed memory for large, long-lived buffers such as the arrays
+behind input series and result buffers, which are scanned sequentially and
+otherwise take a TLB miss every 4KB.
+
+Allocations of at least HugePageThreshold() bytes are mapped directly from
+the OS, aligned to the huge page size, and either
+- advised with madvise(MADV_HUGEPAGE), so transparent huge pages are used
+  where the kernel can find them (eTransparentHugePages, the default); or
+- mapped with MAP_HUGETLB from the explicitly reserved huge page pool,
+  falling back to transparent huge pages if none are free
+  (eExplicitHugePages).
+
+Smaller allocations, and every allocation with eNoHugePages or on platforms
+without huge page support, come from operator new as usual. The containers
+that use HugePageAllocator are otherwise unchanged:
+@code
+vector<double, HugePageAllocator<double> > values;
+@endcode
+
+GetHugePageStats() reports how much was asked for and, from
+/proc/self/smaps, how much of it the kernel actually backed with huge pages.
+*/
+
+/// How large allocations are backed.
+enum HugePageMode {
+    eNoHugePages,           ///< ordinary pages only
+    eTransparentHugePages,  ///< madvise(MADV_HUGEPAGE)
+    eExplicitHugePages      ///< MAP_HUGETLB, then MADV_HUGEPAGE
+};
+
+/// Set how large allocations are backed. Only affects later allocations.
+void SetHugePageMode(HugePageMode aMode);
+/// How large allocations are backed.
+HugePageMode GetHugePageMode();
+
+/// Set the smallest allocation that is given huge pages (default 2MB.)
+void SetHugePageThreshold(size_t aBytes);
+/// The smallest allocation that is given huge pages.
+size_t HugePageThreshold();
+
+/// Allocate memory, using huge pages if it is large enough.
+/// @throws std::bad_alloc if there is no memory.
+void* AllocateHugePages(size_t aBytes);
+/// Free memory from AllocateHugePages; aBytes must be the size asked for.
+void FreeHugePages(void* apMemory, size_t aBytes);
+
+/// Counters for the huge page allocator.
+struct HugePageStats {
+    unsigned long long Allocations;     ///< large allocations live
+    unsigned long long BytesRequested;  ///< bytes in large allocations live
+    unsigned long long BytesExplicit;   ///< of which mapped with MAP_HUGETLB
+    unsigned long long BytesAdvised;    ///< of which advised MADV_HUGEPAGE
+    unsigned long long BytesFallback;   ///< of which got neither
+    unsigned long long BytesHuge;       ///< bytes actually on huge pages now
+};
+
+/// Current counters. BytesHuge is read from /proc/self/smaps (0 where that
+/// isn't available), so this is not cheap.
+HugePageStats GetHugePageStats();
+
+/// Log the counters.
+void LogHugePageStats();
+
+/**
+STL allocator using AllocateHugePages. All instances are equal, so containers
+using it can be swapped and spliced freely.
+*/
+template <typename T>
+class HugePageAllocator {
+public:
+    typedef T               value_type;
+    typedef T*              pointer;
+    typedef const T*        const_pointer;
+    typedef T&              reference;
+    typedef const T&        const_reference;
+    typedef std::size_t     size_type;
+    typedef std::ptrdiff_t  difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef HugePageAllocator<U> other;
+    };
+
+    HugePageAllocator() {}
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U>&) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+
+    pointer allocate(size_type n, const void* = 0) {
+        if (n > max_size()) {
+            throw std::bad_alloc();
+        }
+        return static_cast<pointer>(AllocateHugePages(n * sizeof(T)));
+    }
+    void deallocate(pointer p, size_type n) {
+        FreeHugePages(p, n * sizeof(T));
+    }
+
+    size_type max_size() const {
+        return std::numeric_limits<size_type>::max() / sizeof(T);
+    }
+
+    void construct(pointer p, const T& val) { new((void*)p) T(val); }
+    void destroy(pointer p) { p->~T(); }
+};
+
+template <typename T, typename U>
+bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return false; }
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef _INTERNING_HPP_
+#define _INTERNING_HPP_
+
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp>
+
+#include "objectregister.hpp"
+
+using std::map;
+using std::multimap;
+using std::vector;
+using std::string;
+
+/**
+\file
+Sharing of identical immutable data. Large models repeat the same curves and
+profiles in hundreds of objects; interning keeps one copy of each distinct
+value and hands out shared pointers to it:
+@code
+boost::shared_ptr<const vector<double> > profile = Intern(parsed_profile);
+boost::shared_ptr<const TSMap> inflow = Intern(loaded_series);
+@endcode
+
+Values are found by a hash of their contents and then compared in full, so
+only equal values are ever shared. The pools hold weak references, so a
+value is freed as soon as the last object using it lets go.
+
+Members registered as boost::shared_ptr<const vector<T> >* are interned when
+the register is Reset, and the parse of each distinct string is remembered,
+so a vector given by the same text in many objects is parsed once.
+
+Element and key types are hashed by their bytes, so they must be plain data
+without padding (double, the integer types and DateTime are.)
+*/
+
+/// Hashing of the contents of a value, for interning.
+template <typename T>
+struct InternHash {
+    /// FNV-1a over the bytes of a plain value
+    static size_t Add(size_t aHash, const T& arValue) {
+        const unsigned char* p = (const unsigned char*)&arValue;
+        for (size_t i = 0; i < sizeof(T); ++i) {
+            aHash = (aHash ^ p[i]) * (size_t)1099511628211ULL;
+        }
+        return aHash;
+    }
+};
+
+template <typename T>
+struct InternHash<vector<T> > {
+    static size_t Add(size_t aHash, const vector<T>& arValue) {
+        for (size_t i = 0; i < arValue.size(); ++i) {
+            aHash = InternHash<T>::Add(aHash, arValue[i]);
+        }
+        return aHash;
+    }
+};
+
+template <typename K, typename V>
+struct InternHash<map<K, V> > {
+    static size_t Add(size_t aHash, const map<K, V>& arValue) {
+        for (typename map<K, V>::const_iterator iter = arValue.begin();
+             iter != arValue.end(); ++iter) {
+            aHash = InternHash<K>::Add(aHash, iter->first);
+            aHash = InternHash<V>::Add(aHash, iter->second);
+        }
+        return aHash;
+    }
+};
+
+/// A pool of distinct values of type T. Safe to use from several threads.
+template <typename T>
+class InternPool {
+public:
+    typedef boost::shared_ptr<const T> ValuePtr;
+
+    InternPool() : mLookups(0), mHits(0), mParsedLimit(MinParsedLimit) {}
+
+    /// The pool's copy of a value, adding it if there isn't one yet.
+    ValuePtr Intern(const T& arValue) {
+        size_t hash = InternHash<T>::Add((size_t)14695981039346656037ULL, arValue);
+        boost::mutex::scoped_lock lock(mMutex);
+        ++mLookups;
+        std::pair<typename Entries::iterator, typename Entries::iterator> range =
+            mEntries.equal_range(hash);
+        for (typename Entries::iterator iter = range.first; iter != range.second; ) {
+            ValuePtr existing = iter->second.lock();
+            if (!existing) {
+                // nobody is using this one any more
+                mEntries.erase(iter++);
+                continue;
+            }
+            if (*existing == arValue) {
+                ++mHits;
+                return existing;
+            }
+            ++iter;
+        }
+        ValuePtr value(new T(arValue));
+        mEntries.insert(typename Entries::value_type(hash, value));
+        return value;
+    }
+
+    /// The pool's copy of the value parsed from a string, if that string
+    /// has been parsed before and the value is still in use.
+    ValuePtr FindParsed(const string& arText) {
+        boost::mutex::scoped_lock lock(mMutex);
+        typename map<string, boost::weak_ptr<const T> >::iterator iter = mParsed.find(arText);
+        if (iter == mParsed.end()) {
+            return ValuePtr();
+        }
+        ValuePtr value = iter->second.lock();
+        if (!value) {
+            mParsed.erase(iter);
+        }
+        return value;
+    }
+
+    /// Remember the value parsed from a string.
+    void AddParsed(const string& arText, const ValuePtr& apValue) {
+        boost::mutex::scoped_lock lock(mMutex);
+        mParsed[arText] = apValue;
+        if (mParsed.size() <= mParsedLimit) {
+            return;
+        }
+        // forget the texts whose values have gone; sweeping only when the
+        // map has doubled keeps the cost per insert constant
+        typedef typename map<string, boost::weak_ptr<const T> >::iterator Iter;
+        for (Iter iter = mParsed.begin(); iter != mParsed.end(); ) {
+            if (iter->second.expired()) {
+                mParsed.erase(iter++);
+            } else {
+                ++iter;
+            }
+        }
+        mParsedLimit = std::max(2 * mParsed.size(), MinParsedLimit);
+    }
+
+    /// Number of Intern() calls.
+    unsigned long long Lookups() const {
+        boost::mutex::scoped_lock lock(mMutex);
+        return mLookups;
+    }
+    /// Number of Intern() calls that found an existing copy.
+    unsigned long long Hits() const {
+        boost::mutex::scoped_lock lock(mMutex);
+        return mHits;
+    }
+    /// Number of distinct values in use.
+    size_t Size() {
+        boost::mutex::scoped_lock lock(mMutex);
+        size_t live = 0;
+        for (typename Entries::const_iterator iter = mEntries.begin();
+             iter != mEntries.end(); ++iter) {
+            if (!iter->second.expired()) {
+                ++live;
+            }
+        }
+        return live;
+    }
+
+private:
+    typedef multimap<size_t, boost::weak_ptr<const T> > Entries;
+
+    /// parsed texts remembered before the first sweep
+    static const size_t MinParsedLimit = 64;
+
+    Entries                 mEntries;   ///< values by hash
+    map<string, boost::weak_ptr<const T> > mParsed; ///< values by the text they were parsed from
+    unsigned long long      mLookups;
+    unsigned long long      mHits;
+    size_t                  mParsedLimit;   ///< sweep mParsed when it grows past this
+    mutable boost::mutex    mMutex;
+};
+
+template <typename T>
+const size_t InternPool<T>::MinParsedLimit;
+
+/// Makes the pool for values of type T the first time any thread asks for
+/// it. A function-local static isn't safely initialised by every compiler
+/// when two threads get there at once; the once_flag is initialised
+/// statically, before any code runs. The pool is never freed, so it
+/// outlives any static that might still use it at exit.
+template <typename T>
+struct GlobalInternPoolHolder {
+    static void Make() { spPool = new InternPool<T>; }
+
+    static boost::once_flag sOnce;
+    static InternPool<T>*   spPool;
+};
+
+template <typename T>
+boost::once_flag GlobalInternPoolHolder<T>::sOnce = BOOST_ONCE_INIT;
+template <typename T>
+InternPool<T>* GlobalInternPoolHolder<T>::spPool = 0;
+
+/// The pool for values of type T.
+template <typename T>
+InternPool<T>& GlobalInternPool() {
+    boost::call_once(GlobalInternPoolHolder<T>::sOnce, &GlobalInternPoolHolder<T>::Make);
+    return *GlobalInternPoolHolder<T>::spPool;
+}
+
+/// The shared copy of a value (a vector, a series or any other type with
+/// an InternHash.)
+template <typename T>
+boost::shared_ptr<const T> Intern(const T& arValue) {
+    return GlobalInternPool<T>().Intern(arValue);
+}
+
+/** Set a shared vector from a string representation, sharing it with every
+other object given the same values.
+@param arReg Ref to an object register.
+@param p Pointer to the shared vector to set.
+@param s String representation of the values in the vector, eg "[1.23, 4.56]"
+for a vector of floats.
+*/
+template <typename T>
+void ResetFromString(ObjectRegister& arReg,
+                     boost::shared_ptr<const vector<T> >* p, string s) {
+    InternPool<vector<T> >& pool = GlobalInternPool<vector<T> >();
+    boost::shared_ptr<const vector<T> > value = pool.FindParsed(s);
+    if (!value) {
+        vector<T> parsed;
+        ResetFromString(arReg, &parsed, s);
+        value = pool.Intern(parsed);
+        pool.AddParsed(s, value);
+    }
+    *p = value;
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define _INTERP_HPP_
 
 #include <map>
+#include <algorithm>
 
 #include <boost/format.hpp>
 
@@ -14,6 +15,9 @@ using std::map;
 using boost::format;
 using boost::str;
 
+template <typename KeyType, typename ValType>
+struct CalcInterpolatedValue; // forward decl.
+
 /// Generic base class for interpolated values
 template <typename KeyType, typename ValType>
 class Interpolator {
@@ -23,6 +27,38 @@ public:
     typedef typename TSMap::const_iterator TSMapIter;
 
     virtual ValType Value(const TSMap& arPoints, const KeyType& arKey) const=0;
+
+    /// Find the points of a flat series that the value at a key is made from.
+    /// If arLower == arUpper the value is the value of that point, otherwise
+    /// it is interpolated between the two points.
+    /// @param apKeys the keys of the series, in ascending order.
+    /// @param aCount the number of points in the series.
+    /// @param arKey the key to look up.
+    /// @param arLower receives the index of the lower point.
+    /// @param arUpper receives the index of the upper point.
+    virtual void Bracket(const KeyType* apKeys, size_t aCount, const KeyType& arKey,
+                         size_t& arLower, size_t& arUpper) const {
+        throw TemsimException("Interpolator doesn't support flat series.");
+    }
+
+    /// Get the value of a flat series (keys and values in separate arrays)
+    /// at the specified key. Gives the same result as Value() would for the
+    /// same points in a map.
+    /// @param apKeys the keys of the series, in ascending order.
+    /// @param apValues the value for each key.
+    /// @param aCount the number of points in the series.
+    /// @param arKey the key to look up.
+    /// @returns the value.
+    ValType FlatValue(const KeyType* apKeys, const ValType* apValues,
+                      size_t aCount, const KeyType& arKey) const {
+        size_t lower, upper;
+        Bracket(apKeys, aCount, arKey, lower, upper);
+        if (lower == upper) {
+            return apValues[lower];
+        }
+        return CalcInterpolatedValue<KeyType, ValType>::Value(
+            apKeys[lower], apValues[lower], apKeys[upper], apValues[upper], arKey);
+    }
 };
 
 /// Class implementing Linear Interpretation using map collection with general KeyType.
@@ -81,6 +117,40 @@ public:
         return value;
     }
 
+    /// Find the points of a flat series to interpolate between, choosing
+    /// the same points as Value() does for a map.
+    void Bracket(const KeyType* apKeys, size_t aCount, const KeyType& arKey,
+                 size_t& arLower, size_t& arUpper) const {
+
+        if (aCount <= 1) {
+            // don't have enough points to interpolate
+            throw TemsimException("Error evaluating time series - at most 1 point in time series.");
+        }
+
+        size_t index = std::lower_bound(apKeys, apKeys + aCount, arKey) - apKeys;
+        if (index == aCount) {
+            // key is past end of data, so extrapolate from last 2 values
+            arLower = aCount - 2;
+        }
+        else if (index == 0) {
+            // key is either before first point or equal to it
+            arLower = 0;
+        }
+        else {
+            // we are somewhere in the middle
+            arLower = index - 1;
+        }
+        arUpper = arLower + 1;
+
+        if (apKeys[arLower] == arKey) {
+            // actually on the exact key
+            arUpper = arLower;
+        }
+        else if (apKeys[arUpper] == arKey) {
+            arLower = arUpper;
+        }
+    }
+
     //ValType CalcInterpolatedValue(const TSMapIter& arLowerIter, const TSMapIter& arUpperIter, const KeyType& arKey);
 
 };
@@ -97,6 +167,15 @@ struct CalcInterpolatedValue {
                 * (arKey - arLowerIter->first) / 
                 (arUpperIter->first - arLowerIter->first));
     }
+
+    // same calculation for points held in flat arrays
+    static ValType Value(const KeyType& arLowerKey, const ValType& arLowerVal,
+                const KeyType& arUpperKey, const ValType& arUpperVal,
+                const KeyType& arKey) {
+        return arLowerVal + ((arUpperVal - arLowerVal)
+                * (arKey - arLowerKey) / 
+                (arUpperKey - arLowerKey));
+    }
 };
 
 // Specialised type for interpolating values from a (DateTime, value) map
@@ -112,6 +191,15 @@ struct CalcInterpolatedValue<DateTime, ValType> {
                     * (arKey - arLowerIter->first).ticks() / 
                     (arUpperIter->first - arLowerIter->first).ticks());
     }
+
+    // same calculation for points held in flat arrays
+    static ValType Value(const DateTime& arLowerKey, const ValType& arLowerVal,
+                const DateTime& arUpperKey, const ValType& arUpperVal,
+                const DateTime& arKey) {
+        return arLowerVal + ((arUpperVal - arLowerVal)
+                    * (arKey - arLowerKey).ticks() / 
+                    (arUpperKey - arLowerKey).ticks());
+    }
 };
 
 /// Class implementing Value in Next Interval TimeSeries type using map collection.
@@ -137,6 +225,18 @@ public:
         }
         return iter->second;
     }
+
+    /// Find the point of a flat series whose interval contains the key.
+    void Bracket(const KeyType* apKeys, size_t aCount, const KeyType& arKey,
+                 size_t& arLower, size_t& arUpper) const {
+        // the last point at or before the key
+        size_t index = std::upper_bound(apKeys, apKeys + aCount, arKey) - apKeys;
+        if (index == 0) {
+            throw TemsimException(str(format("can't find date %s in series") 
+                % arKey));
+        }
+        arLower = arUpper = index - 1;
+    }
 };
 
 /// Class implementing Value in Preceding Interval TimeSeries type using map collection.
@@ -161,6 +261,18 @@ public:
         }
         return iter->second;
     }
+
+    /// Find the point of a flat series whose interval contains the key.
+    void Bracket(const KeyType* apKeys, size_t aCount, const KeyType& arKey,
+                 size_t& arLower, size_t& arUpper) const {
+        // the first point at or after the key
+        size_t index = std::lower_bound(apKeys, apKeys + aCount, arKey) - apKeys;
+        if (index == aCount) {
+            throw TemsimException(str(format("can't find date %s in series") 
+                % arKey));
+        }
+        arLower = arUpper = index;
+    }
 };
 
 #endif
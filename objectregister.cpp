@@ -2,6 +2,7 @@
 #include "timer.hpp"
 #include "logging.hpp"
 #include "inifile.hpp"
+#include "steplatency.hpp"
 
 
 // define boost logging stuff.
@@ -75,6 +76,56 @@ std::string CollectionRegisterString(const std::string& aCollectionName) {
                             "");
 }
 
+// the finalise hooks, made on first use so modules can add theirs from
+// their static objects whatever order those are made in
+static vector<ObjectRegister::FinaliseHook>& FinaliseHooks() {
+    static vector<ObjectRegister::FinaliseHook> hooks;
+    return hooks;
+}
+
+void ObjectRegister::AddFinaliseHook(FinaliseHook aHook) {
+    FinaliseHooks().push_back(aHook);
+}
+
+void ObjectRegister::RunFinaliseHooks() {
+    vector<FinaliseHook>& hooks = FinaliseHooks();
+    for (size_t h = 0; h < hooks.size(); ++h) {
+        hooks[h](*this);
+    }
+}
+
+void ObjectRegister::DoVoidCallbacks(string aName) {
+    BOOST_LOGL(objectregister,info) << "VoidCallbacks " << aName << "..." << std::endl;
+    unsigned long long start = mpLatency ? LatencyNow() : 0;
+    typedef
+        multimap<string,boost::function<void (void)> >::iterator
+        iterator;
+    std::pair<iterator, iterator> range;
+    range = mVoidCallbacks.equal_range(aName);
+    for ( ; range.first != range.second; range.first++ ) {
+        ((*(range.first)).second)();
+    }
+    if (mpLatency) {
+        mpLatency->RecordCallbacks(aName, LatencyNow() - start);
+    }
+    //BOOST_LOGL(objectregister,info) << "Done!\n";
+}
+
+void ObjectRegister::DoTimeCallbacks(string aName, const DateTime& arTime) {
+    unsigned long long start = mpLatency ? LatencyNow() : 0;
+    typedef
+        multimap<string,boost::function<void (const DateTime&)> >::iterator
+        iterator;
+    std::pair<iterator, iterator> range;
+    range = mTimeCallbacks.equal_range(aName);
+    for ( ; range.first != range.second; range.first++ ) {
+        ((*(range.first)).second)(arTime);
+    }
+    if (mpLatency) {
+        mpLatency->RecordCallbacks(aName, LatencyNow() - start);
+    }
+}
+
 // This function takes object data in "inifile" form and makes the objects,
 // using an ObjectFactory object.
 void MakeObjectsFromIniFile(ObjectFactory& arFactory, 
@@ -106,6 +157,10 @@ void MakeObjectsFromIniFile(ObjectFactory& arFactory,
             }
         }
     }
+
+    // build the series indexes now that everything is registered, before
+    // the register is first Reset
+    arRegister.RunFinaliseHooks();
 }
 
 
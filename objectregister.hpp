@@ -5,12 +5,14 @@
 #include <string>
 #include <map>
 #include <sstream>
+#include <algorithm>
 
 #include <boost/shared_ptr.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/tokenizer.hpp>
 #include <boost/function.hpp>
 #include <boost/format.hpp>
+#include <boost/type_traits/is_convertible.hpp>
 #include <boost/log/log.hpp>
 
 #include "temsimexception.hpp"
@@ -33,6 +35,7 @@ BOOST_DECLARE_LOG(objectregister)
 
 class Simulation;
 class FileSystem;
+class StepLatencyRecorder;
 
 /**
 \file
@@ -244,6 +247,39 @@ std::string CollectionRegisterString(const std::string& aCollectionName);
 
 class ObjectRegister; // forward decl.
 
+/** Something held in the object register that must be finalised once the
+objects have been made and before the register is Reset, such as a series
+that builds indexes over its points (see seriesfinaliser.hpp.) Anything
+registered as a pointer to a Finalisable is found by
+ObjectRegister::CollectFinalisable. */
+class Finalisable {
+public:
+    virtual ~Finalisable() {}
+
+    /// Finalise. May be called from a worker thread, alongside other
+    /// objects being finalised, so must only touch the object itself.
+    /// @param apStageSeconds accumulates the seconds spent in each stage
+    /// (see FinaliseStage.)
+    virtual void Finalise(double* apStageSeconds)=0;
+
+    /// True if there is nothing to finalise, ie. nothing has changed since
+    /// the last Finalise().
+    virtual bool IsFinalised() const=0;
+};
+
+/// Add a registered value to a list of things to finalise, if it is a
+/// pointer to a Finalisable.
+template <typename T>
+void AddFinalisable(const T& arValue, vector<Finalisable*>& arList, boost::true_type) {
+    if (arValue) {
+        arList.push_back(arValue);
+    }
+}
+
+/// Values of other types have nothing to finalise.
+template <typename T>
+void AddFinalisable(const T&, vector<Finalisable*>&, boost::false_type) {}
+
 //---------------------------------------------------------------------
 // Object register implementation:
 // We have templated classes and functions so we can avoid specifying
@@ -269,6 +305,9 @@ public:
     the string representation */
     virtual void Reset(ObjectRegister&) {}
 
+    /** Add the values in the type register that need finalising to a list */
+    virtual void CollectFinalisable(vector<Finalisable*>&) {}
+
 };
 
 /// Our true Type register - template ensures we get one for each type.
@@ -360,6 +399,17 @@ public:
         }
     }
 
+    /** Add the values that need finalising to a list */
+    void CollectFinalisable(vector<Finalisable*>& arList) {
+        for (typename map<string, T>::const_iterator data = Data.begin();
+            data != Data.end();
+            ++data) {
+
+            AddFinalisable(data->second, arList,
+                boost::is_convertible<T, Finalisable*>());
+        }
+    }
+
 };
 
 /// Our overall Register class that keeps a collection of the type-specific
@@ -367,7 +417,7 @@ public:
 class ObjectRegister {
 public:
     /// Constructor.
-    ObjectRegister() : mpSimulation(NULL) {}
+    ObjectRegister() : mpSimulation(NULL), mpLatency(NULL) {}
 
     /// Check to see if a given var name is okay.
     /// a valid variable is of the form:
@@ -581,8 +631,34 @@ public:
 
             (*regs).second->Reset(*this);
         }
+        RunFinaliseHooks();
     }
 
+    /** Find everything registered that needs finalising (each only once.) */
+    void CollectFinalisable(vector<Finalisable*>& arList) {
+        for (map<string, BaseRegister::Ptr>::const_iterator regs
+                = Registers.begin();
+            regs != Registers.end();
+            ++regs) {
+
+            (*regs).second->CollectFinalisable(arList);
+        }
+        std::sort(arList.begin(), arList.end());
+        arList.erase(std::unique(arList.begin(), arList.end()), arList.end());
+    }
+
+    /// Called with the register once its objects have been made and after
+    /// each Reset(), to finalise what was registered or set from strings.
+    typedef boost::function<void (ObjectRegister&)> FinaliseHook;
+
+    /** Add a hook run for every register by RunFinaliseHooks(). The modules
+    that need finalising (eg. seriesfinaliser.cpp) add theirs from a static
+    object, so the register doesn't depend on them. */
+    static void AddFinaliseHook(FinaliseHook aHook);
+
+    /** Run the finalise hooks. Called by MakeObjectsFromIniFile and Reset(). */
+    void RunFinaliseHooks();
+
     //--------------------------------------
     // callback implemenation
 
@@ -616,30 +692,14 @@ public:
     }
 
     /// call the callbacks in the collection with the specified name
-    void DoVoidCallbacks(string aName) {
-        BOOST_LOGL(objectregister,info) << "VoidCallbacks " << aName << "..." << std::endl;
-        typedef
-            multimap<string,boost::function<void (void)> >::iterator
-            iterator;
-        std::pair<iterator, iterator> range;
-        range = mVoidCallbacks.equal_range(aName);
-        for ( ; range.first != range.second; range.first++ ) {
-            ((*(range.first)).second)();
-        }
-        //BOOST_LOGL(objectregister,info) << "Done!\n";
-    }
+    void DoVoidCallbacks(string aName);
 
     /// call the callbacks in the collection with the specified name
-    void DoTimeCallbacks(string aName, const DateTime& arTime) {
-        typedef
-            multimap<string,boost::function<void (const DateTime&)> >::iterator
-            iterator;
-        std::pair<iterator, iterator> range;
-        range = mTimeCallbacks.equal_range(aName);
-        for ( ; range.first != range.second; range.first++ ) {
-            ((*(range.first)).second)(arTime);
-        }
-    }
+    void DoTimeCallbacks(string aName, const DateTime& arTime);
+
+    /// Time each group of callbacks run by DoVoidCallbacks and
+    /// DoTimeCallbacks with a recorder, or stop timing them if NULL.
+    void SetLatencyRecorder(StepLatencyRecorder* apLatency) { mpLatency = apLatency; }
 
     /// Get the simulation associated with this object register
     Simulation* GetSimulation() { return mpSimulation; }
@@ -650,6 +710,9 @@ protected:
     /// The Simulation associated withthis object register
     Simulation* mpSimulation;
 
+    /// Times the callback groups, or NULL
+    StepLatencyRecorder* mpLatency;
+
 };
 
 /// Set the value of a pointer to function from a string rep.
@@ -751,6 +814,17 @@ void ResetFromString(ObjectRegister& arReg, vector<T>* v, string s) {
     }
 }
 
+/** Replace a curve function with a tabulated version of itself. The string
+representation is "tabulate <lower> <upper> <tolerance> [linear|cubic]"; the
+function must already have been set by its object. Defined in
+tabulatedfunction.cpp.
+@param arReg Ref to an object register.
+@param p Pointer to the function to tabulate.
+@param s String representation of the tabulation.
+*/
+void ResetFromString(ObjectRegister& arReg, boost::function<double (double)>* p, string s);
+
+
 /** Object Factory helper function. Takes a class name, instance name, an object
 register, and a collection of member variable data as strings. Need to
 instantiate this function for each type that the factory can make.
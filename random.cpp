@@ -1,6 +1,9 @@
 #include "random.hpp"
 #include "simulation.hpp"
 
+#include <boost/math/special_functions/erf.hpp>
+#include <boost/math/constants/constants.hpp>
+
 /// define boost logging stuff.
 BOOST_DEFINE_LOG(randomnumbergenerator, "randomnumbergenerator")
 
@@ -13,7 +16,10 @@ string RandomDouble::class_name("RandomDouble");
 
 RandomDouble::RandomDouble(const string& arName)
 :   instance_name(arName),
-    mRNG(0.0, 1.0)
+    mRNG(0.0, 1.0),
+    mFleet(false),
+    mpObjects(0),
+    mLane(0)
 {
 }
 
@@ -22,14 +28,16 @@ void RandomDouble::Register(Simulation& arSim) {
     arSim.RegisterInstanceForScripting(this);
 
     ObjectRegister& reg(arSim.Objects());
+    reg.Set(*this, "Fleet", &mFleet);
+    mpObjects = &reg;
 
     // seed the object with the replicate number at the start of
     // each rep
     Event::Ptr start_of_rep = arSim.PreDispatchEvents()->FindEvent("start_of_rep");
     start_of_rep->AddAction(MakeVoidAction(
         boost::bind(
-            &UniformFloatRNG<>::Seed,
-            boost::ref(mRNG),
+            &RandomDouble::StartOfRep,
+            this,
             boost::ref(
                 arSim.RepControl().RefCurrentRep()
             )
@@ -37,12 +45,62 @@ void RandomDouble::Register(Simulation& arSim) {
     ));
 }
 
+void RandomDouble::StartOfRep(int aRep) {
+    if (!mFleet) {
+        mRNG.Seed(aRep);
+    } else if (!mpFleet) {
+        mpFleet = RNGFleet::ForRegister(*mpObjects);
+        mLane = mpFleet->AddLane(aRep);
+    } else {
+        mpFleet->Seed(mLane, aRep);
+    }
+}
+
 // call the RNG and return the result
 double RandomDouble::Value() {
+    if (mpFleet) {
+        return mpFleet->Uniform(mLane);
+    }
     double result = mRNG();
     return result;
 }
 
+// call the RNG with the given range and return the result
+double RandomDouble::Value(double aMin, double aMax) {
+    if (mpFleet) {
+        return aMin + (aMax - aMin) * mpFleet->Uniform(mLane);
+    }
+    return mRNG(aMin, aMax);
+}
+
+// fill the vector from the RNG
+void RandomDouble::Fill(vector<double>& arValues) {
+    if (mpFleet) {
+        for (size_t i = 0; i < arValues.size(); ++i) {
+            arValues[i] = mpFleet->Uniform(mLane);
+        }
+    } else if (!arValues.empty()) {
+        mRNG.Fill(&arValues[0], arValues.size());
+    }
+}
+
+// fill the vector from the RNG, with a range per value
+void RandomDouble::Fill(vector<double>& arValues, const vector<double>& arMins,
+                        const vector<double>& arMaxs) {
+    if (arMins.size() != arMaxs.size()) {
+        throw TemsimException("RandomDouble '" + instance_name
+            + "' needs one maximum per minimum", "RandomDouble");
+    }
+    arValues.resize(arMins.size());
+    if (mpFleet) {
+        for (size_t i = 0; i < arValues.size(); ++i) {
+            arValues[i] = arMins[i] + (arMaxs[i] - arMins[i]) * mpFleet->Uniform(mLane);
+        }
+    } else if (!arValues.empty()) {
+        mRNG.Fill(&arValues[0], arValues.size(), &arMins[0], &arMaxs[0]);
+    }
+}
+
 
 //////////////////////////////////////////////////////
 
@@ -50,7 +108,10 @@ string RandomNormal::class_name("RandomNormal");
 
 RandomNormal::RandomNormal(const string& arName)
 :   instance_name(arName),
-    mRNG(0.0, 1.0)
+    mRNG(0.0, 1.0),
+    mFleet(false),
+    mpObjects(0),
+    mLane(0)
 {
 }
 
@@ -59,14 +120,16 @@ void RandomNormal::Register(Simulation& arSim) {
     arSim.RegisterInstanceForScripting(this);
 
     ObjectRegister& reg(arSim.Objects());
+    reg.Set(*this, "Fleet", &mFleet);
+    mpObjects = &reg;
 
     // seed the object with the replicate number at the start of
     // each rep
     Event::Ptr start_of_rep = arSim.PreDispatchEvents()->FindEvent("start_of_rep");
     start_of_rep->AddAction(MakeVoidAction(
         boost::bind(
-            &NormalRNG<>::Seed,
-            boost::ref(mRNG),
+            &RandomNormal::StartOfRep,
+            this,
             boost::ref(
                 arSim.RepControl().RefCurrentRep()
             )
@@ -74,9 +137,309 @@ void RandomNormal::Register(Simulation& arSim) {
     ));
 }
 
+void RandomNormal::StartOfRep(int aRep) {
+    if (!mFleet) {
+        mRNG.Seed(aRep);
+    } else if (!mpFleet) {
+        mpFleet = RNGFleet::ForRegister(*mpObjects);
+        mLane = mpFleet->AddLane(aRep);
+    } else {
+        mpFleet->Seed(mLane, aRep);
+    }
+}
+
+// a N(0, 1) value from one word of the fleet, through the inverse CDF
+double RandomNormal::FleetStandard() {
+    double u = ((double)mpFleet->Next(mLane) + 0.5) * (1.0 / 4294967296.0);
+    return -boost::math::constants::root_two<double>()
+        * boost::math::erfc_inv(2.0 * u);
+}
+
 // call the RNG and return the result
 double RandomNormal::Value() {
+    if (mpFleet) {
+        return FleetStandard();
+    }
+    double result = mRNG();
+    return result;
+}
+
+// call the RNG with the given parameters and return the result
+double RandomNormal::Value(double aMean, double aStdDev) {
+    if (mpFleet) {
+        return aMean + aStdDev * FleetStandard();
+    }
+    return mRNG(aMean, aStdDev);
+}
+
+// fill the vector from the RNG
+void RandomNormal::Fill(vector<double>& arValues) {
+    if (mpFleet) {
+        for (size_t i = 0; i < arValues.size(); ++i) {
+            arValues[i] = FleetStandard();
+        }
+    } else if (!arValues.empty()) {
+        mRNG.Fill(&arValues[0], arValues.size());
+    }
+}
+
+// fill the vector from the RNG, with parameters per value
+void RandomNormal::Fill(vector<double>& arValues, const vector<double>& arMeans,
+                        const vector<double>& arStdDevs) {
+    if (arMeans.size() != arStdDevs.size()) {
+        throw TemsimException("RandomNormal '" + instance_name
+            + "' needs one standard deviation per mean", "RandomNormal");
+    }
+    arValues.resize(arMeans.size());
+    if (mpFleet) {
+        for (size_t i = 0; i < arValues.size(); ++i) {
+            arValues[i] = arMeans[i] + arStdDevs[i] * FleetStandard();
+        }
+    } else if (!arValues.empty()) {
+        mRNG.Fill(&arValues[0], arValues.size(), &arMeans[0], &arStdDevs[0]);
+    }
+}
+
+
+//////////////////////////////////////////////////////
+
+string RandomEmpirical::class_name("RandomEmpirical");
+
+RandomEmpirical::RandomEmpirical(const string& arName)
+:   instance_name(arName)
+{
+}
+
+void RandomEmpirical::Register(Simulation& arSim) {
+    // make this object available for scripting
+    arSim.RegisterInstanceForScripting(this);
+
+    ObjectRegister& reg(arSim.Objects());
+    reg.Set(*this, "Data", &mData);
+    reg.Set(*this, "Probabilities", &mProbabilities);
+    reg.Set(*this, "Quantiles", &mQuantiles);
+
+    // build the distribution and seed the object with the replicate number
+    // at the start of each rep
+    Event::Ptr start_of_rep = arSim.PreDispatchEvents()->FindEvent("start_of_rep");
+    start_of_rep->AddAction(MakeVoidAction(
+        boost::bind(
+            &RandomEmpirical::StartOfRep,
+            this,
+            boost::ref(
+                arSim.RepControl().RefCurrentRep()
+            )
+        )
+    ));
+}
+
+void RandomEmpirical::StartOfRep(int aRep) {
+    Build();
+    mRNG.Seed(aRep);
+}
+
+void RandomEmpirical::Build() {
+    if (!mData.empty()) {
+        mRNG.SetData(mData);
+    } else if (!mQuantiles.empty()) {
+        if (mProbabilities.size() != mQuantiles.size()) {
+            throw TemsimException("RandomEmpirical '" + instance_name
+                + "' needs one probability per quantile", "RandomEmpirical");
+        }
+        EmpiricalRNG<double>::QuantileTable table;
+        for (size_t i = 0; i < mQuantiles.size(); ++i) {
+            table[mProbabilities[i]] = mQuantiles[i];
+        }
+        mRNG.SetQuantiles(table);
+    } else {
+        throw TemsimException("RandomEmpirical '" + instance_name
+            + "' has no Data or Quantiles", "RandomEmpirical");
+    }
+}
+
+// call the RNG and return the result
+double RandomEmpirical::Value() {
+    if (!mRNG.IsSet()) {
+        Build();
+    }
+    double result = mRNG();
+    return result;
+}
+
+// fill the vector from the RNG
+void RandomEmpirical::Fill(vector<double>& arValues) {
+    if (!mRNG.IsSet()) {
+        Build();
+    }
+    if (!arValues.empty()) {
+        mRNG.Fill(&arValues[0], arValues.size());
+    }
+}
+
+//////////////////////////////////////////////////////
+
+string RandomTruncatedNormal::class_name("RandomTruncatedNormal");
+
+RandomTruncatedNormal::RandomTruncatedNormal(const string& arName)
+:   instance_name(arName),
+    mRNG(0.0, 1.0, -std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity()),
+    mMean(0.0),
+    mStdDev(1.0),
+    mLower(-std::numeric_limits<double>::infinity()),
+    mUpper(std::numeric_limits<double>::infinity())
+{
+}
+
+void RandomTruncatedNormal::Register(Simulation& arSim) {
+    // make this object available for scripting
+    arSim.RegisterInstanceForScripting(this);
+
+    ObjectRegister& reg(arSim.Objects());
+    reg.Set(*this, "Mean", &mMean);
+    reg.Set(*this, "StdDev", &mStdDev);
+    reg.Set(*this, "Lower", &mLower);
+    reg.Set(*this, "Upper", &mUpper);
+
+    // apply the parameters and seed the object with the replicate number
+    // at the start of each rep
+    Event::Ptr start_of_rep = arSim.PreDispatchEvents()->FindEvent("start_of_rep");
+    start_of_rep->AddAction(MakeVoidAction(
+        boost::bind(
+            &RandomTruncatedNormal::StartOfRep,
+            this,
+            boost::ref(
+                arSim.RepControl().RefCurrentRep()
+            )
+        )
+    ));
+}
+
+void RandomTruncatedNormal::StartOfRep(int aRep) {
+    mRNG.SetParameters(mMean, mStdDev, mLower, mUpper);
+    mRNG.Seed(aRep);
+}
+
+// call the RNG and return the result
+double RandomTruncatedNormal::Value() {
+    double result = mRNG();
+    return result;
+}
+
+// fill the vector from the RNG
+void RandomTruncatedNormal::Fill(vector<double>& arValues) {
+    if (!arValues.empty()) {
+        mRNG.Fill(&arValues[0], arValues.size());
+    }
+}
+
+//////////////////////////////////////////////////////
+
+string RandomTruncatedLogNormal::class_name("RandomTruncatedLogNormal");
+
+RandomTruncatedLogNormal::RandomTruncatedLogNormal(const string& arName)
+:   instance_name(arName),
+    mRNG(0.0, 1.0, 0.0, std::numeric_limits<double>::infinity()),
+    mLogMean(0.0),
+    mLogStdDev(1.0),
+    mLower(0.0),
+    mUpper(std::numeric_limits<double>::infinity())
+{
+}
+
+void RandomTruncatedLogNormal::Register(Simulation& arSim) {
+    // make this object available for scripting
+    arSim.RegisterInstanceForScripting(this);
+
+    ObjectRegister& reg(arSim.Objects());
+    reg.Set(*this, "LogMean", &mLogMean);
+    reg.Set(*this, "LogStdDev", &mLogStdDev);
+    reg.Set(*this, "Lower", &mLower);
+    reg.Set(*this, "Upper", &mUpper);
+
+    // apply the parameters and seed the object with the replicate number
+    // at the start of each rep
+    Event::Ptr start_of_rep = arSim.PreDispatchEvents()->FindEvent("start_of_rep");
+    start_of_rep->AddAction(MakeVoidAction(
+        boost::bind(
+            &RandomTruncatedLogNormal::StartOfRep,
+            this,
+            boost::ref(
+                arSim.RepControl().RefCurrentRep()
+            )
+        )
+    ));
+}
+
+void RandomTruncatedLogNormal::StartOfRep(int aRep) {
+    mRNG.SetParameters(mLogMean, mLogStdDev, mLower, mUpper);
+    mRNG.Seed(aRep);
+}
+
+// call the RNG and return the result
+double RandomTruncatedLogNormal::Value() {
+    double result = mRNG();
+    return result;
+}
+
+// fill the vector from the RNG
+void RandomTruncatedLogNormal::Fill(vector<double>& arValues) {
+    if (!arValues.empty()) {
+        mRNG.Fill(&arValues[0], arValues.size());
+    }
+}
+
+//////////////////////////////////////////////////////
+
+string RandomTruncatedGamma::class_name("RandomTruncatedGamma");
+
+RandomTruncatedGamma::RandomTruncatedGamma(const string& arName)
+:   instance_name(arName),
+    mRNG(1.0, 1.0, 0.0, std::numeric_limits<double>::infinity()),
+    mShape(1.0),
+    mScale(1.0),
+    mLower(0.0),
+    mUpper(std::numeric_limits<double>::infinity())
+{
+}
+
+void RandomTruncatedGamma::Register(Simulation& arSim) {
+    // make this object available for scripting
+    arSim.RegisterInstanceForScripting(this);
+
+    ObjectRegister& reg(arSim.Objects());
+    reg.Set(*this, "Shape", &mShape);
+    reg.Set(*this, "Scale", &mScale);
+    reg.Set(*this, "Lower", &mLower);
+    reg.Set(*this, "Upper", &mUpper);
+
+    // apply the parameters and seed the object with the replicate number
+    // at the start of each rep
+    Event::Ptr start_of_rep = arSim.PreDispatchEvents()->FindEvent("start_of_rep");
+    start_of_rep->AddAction(MakeVoidAction(
+        boost::bind(
+            &RandomTruncatedGamma::StartOfRep,
+            this,
+            boost::ref(
+                arSim.RepControl().RefCurrentRep()
+            )
+        )
+    ));
+}
+
+void RandomTruncatedGamma::StartOfRep(int aRep) {
+    mRNG.SetParameters(mShape, mScale, mLower, mUpper);
+    mRNG.Seed(aRep);
+}
+
+// call the RNG and return the result
+double RandomTruncatedGamma::Value() {
     double result = mRNG();
     return result;
 }
 
+// fill the vector from the RNG
+void RandomTruncatedGamma::Fill(vector<double>& arValues) {
+    if (!arValues.empty()) {
+        mRNG.Fill(&arValues[0], arValues.size());
+    }
+}
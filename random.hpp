@@ -1,11 +1,22 @@
 #ifndef RANDOM_HPP
 #define RANDOM_HPP
 
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
 #include <boost/random.hpp>
+#include <boost/math/special_functions/gamma.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/log/log.hpp>
 
 #include "logging.hpp"
+#include "interp.hpp"
+#include "rngfleet.hpp"
+#include "temsimexception.hpp"
+
+using std::vector;
 
 /// declare the boost logging stuff.
 BOOST_DECLARE_LOG(randomnumbergenerator)
@@ -129,6 +140,24 @@ public:
 
     /// Return the next random number in the sequence.    
     FloatType operator()();
+
+    /// Fill an array with the next aCount random numbers in the sequence.
+    /// @param apOut the array to fill.
+    /// @param aCount the number of values to generate.
+    void Fill(FloatType* apOut, size_t aCount);
+
+    /// Return the next random number from the range [aMin, aMax) instead of
+    /// the range given at construction. Uses the same random source, so
+    /// calls can be mixed freely with operator()().
+    FloatType operator()(FloatType aMin, FloatType aMax);
+
+    /// Fill an array with random numbers, each from its own range.
+    /// @param apOut the array to fill.
+    /// @param aCount the number of values to generate.
+    /// @param apMins minimum for each value.
+    /// @param apMaxs maximum for each value.
+    void Fill(FloatType* apOut, size_t aCount,
+              const FloatType* apMins, const FloatType* apMaxs);
     
     /// Seed the contained random numner source.
     /// @param aSeed seed value for the RNG
@@ -137,10 +166,15 @@ public:
 private:
     boost::mt19937                  mRNG;   ///< the random source
     boost::uniform_real<FloatType>     mDistribution; ///< uniform distribution
+    boost::uniform_real<FloatType>     mUnit; ///< [0, 1) for per-call ranges
     boost::variate_generator<
         boost::mt19937, 
         boost::uniform_real< FloatType > 
     >*  mpVarGen;   ///< The link between the random number and the distibution.
+    boost::variate_generator<
+        boost::mt19937&,
+        boost::uniform_real< FloatType >
+    >*  mpUnitGen;  ///< mUnit on mpVarGen's random source, for per-call ranges
 
 };
 
@@ -149,15 +183,24 @@ template <typename T>
 UniformFloatRNG<T>::UniformFloatRNG(T aMin, T aMax, int aSeed) {
     mRNG.seed((boost::mt19937::result_type)aSeed);
     mDistribution = boost::uniform_real<T>(aMin, aMax);
+    mUnit = boost::uniform_real<T>(T(0), T(1));
     mpVarGen = new
         boost::variate_generator<boost::mt19937, 
                                 boost::uniform_real<T> >(mRNG,
                                                         mDistribution);
+    mpUnitGen = new
+        boost::variate_generator<boost::mt19937&,
+                                boost::uniform_real<T> >(mpVarGen->engine(),
+                                                        mUnit);
 };
 
-// destructor - deletes the variate_generator object created in the constructor
+// destructor - deletes the variate_generator objects created in the constructor
 template <typename T>
 UniformFloatRNG<T>::~UniformFloatRNG() {
+    if (mpUnitGen) {
+        delete mpUnitGen;
+        mpUnitGen = 0;
+    }
     if (mpVarGen) { 
         delete mpVarGen;
         mpVarGen = 0;
@@ -170,6 +213,33 @@ T UniformFloatRNG<T>::operator()() {
     return (*mpVarGen)();
 }
 
+// fill an array with random values
+template <typename T>
+void UniformFloatRNG<T>::Fill(T* apOut, size_t aCount) {
+    boost::variate_generator<boost::mt19937, boost::uniform_real<T> >&
+        generator = *mpVarGen;
+    for (size_t i = 0; i < aCount; ++i) {
+        apOut[i] = generator();
+    }
+}
+
+// returns the next random value scaled to the given range
+template <typename T>
+T UniformFloatRNG<T>::operator()(T aMin, T aMax) {
+    return aMin + (aMax - aMin) * (*mpUnitGen)();
+}
+
+// fill an array with random values, each scaled to its own range
+template <typename T>
+void UniformFloatRNG<T>::Fill(T* apOut, size_t aCount,
+                              const T* apMins, const T* apMaxs) {
+    boost::variate_generator<boost::mt19937&, boost::uniform_real<T> >&
+        unit = *mpUnitGen;
+    for (size_t i = 0; i < aCount; ++i) {
+        apOut[i] = apMins[i] + (apMaxs[i] - apMins[i]) * unit();
+    }
+}
+
 // seed the RNG
 template <typename T>
 void UniformFloatRNG<T>::Seed(int aSeed) {
@@ -202,6 +272,26 @@ public:
     
     /// returns the next random value
     T operator()();
+
+    /// Fill an array with the next aCount random values.
+    /// @param apOut the array to fill.
+    /// @param aCount the number of values to generate.
+    void Fill(T* apOut, size_t aCount);
+
+    /// Return the next random value from a normal distribution with the
+    /// given parameters instead of those given at construction. Uses the
+    /// same random source, so calls can be mixed freely with operator()().
+    /// @param aMean Mean of the distribution.
+    /// @param aStd Standard deviation of the distribution.
+    T operator()(T aMean, T aStd);
+
+    /// Fill an array with random values, each with its own parameters
+    /// (eg. a mean and standard deviation for each step.)
+    /// @param apOut the array to fill.
+    /// @param aCount the number of values to generate.
+    /// @param apMeans mean for each value.
+    /// @param apStds standard deviation for each value.
+    void Fill(T* apOut, size_t aCount, const T* apMeans, const T* apStds);
     
     /// Seed the contained random numner source.
     /// @param aSeed seed value for the RNG
@@ -210,10 +300,15 @@ public:
 private:
     boost::mt19937                  mRNG;           ///< the random source
     boost::normal_distribution<T>   mDistribution;  ///< normal distribution
+    boost::normal_distribution<T>   mStandard;      ///< N(0, 1) for per-call parameters
     boost::variate_generator<
         boost::mt19937, 
         boost::normal_distribution< T > 
     >*  mpVarGen;   ///< link between random source and distribution
+    boost::variate_generator<
+        boost::mt19937&,
+        boost::normal_distribution< T >
+    >*  mpStandardGen;  ///< mStandard on mpVarGen's random source
 
 };
 
@@ -222,16 +317,26 @@ template <typename T>
 NormalRNG<T>::NormalRNG(T aMean, T aStd, int aSeed) {
     mRNG.seed((boost::mt19937::result_type)aSeed);
     mDistribution = boost::normal_distribution<T>(aMean, aStd);
+    mStandard = boost::normal_distribution<T>(T(0), T(1));
     mpVarGen = 
         new boost::variate_generator<
                 boost::mt19937,
                 boost::normal_distribution< T > >(  mRNG,
                                                     mDistribution);
+    mpStandardGen =
+        new boost::variate_generator<
+                boost::mt19937&,
+                boost::normal_distribution< T > >(  mpVarGen->engine(),
+                                                    mStandard);
 };
 
 // destructor
 template <typename T>
 NormalRNG<T>::~NormalRNG() {
+    if (mpStandardGen) {
+        delete mpStandardGen;
+        mpStandardGen = 0;
+    }
     if (mpVarGen) { 
         delete mpVarGen;
         mpVarGen = 0;
@@ -244,18 +349,627 @@ T NormalRNG<T>::operator()() {
     return (*mpVarGen)();
 }
 
+// fill an array with random values
+template <typename T>
+void NormalRNG<T>::Fill(T* apOut, size_t aCount) {
+    boost::variate_generator<boost::mt19937, boost::normal_distribution<T> >&
+        generator = *mpVarGen;
+    for (size_t i = 0; i < aCount; ++i) {
+        apOut[i] = generator();
+    }
+}
+
+// returns next random value, scaling a standard normal draw
+template <typename T>
+T NormalRNG<T>::operator()(T aMean, T aStd) {
+    return aMean + aStd * (*mpStandardGen)();
+}
+
+// fill an array with random values, each with its own parameters
+template <typename T>
+void NormalRNG<T>::Fill(T* apOut, size_t aCount,
+                        const T* apMeans, const T* apStds) {
+    boost::variate_generator<boost::mt19937&, boost::normal_distribution<T> >&
+        standard = *mpStandardGen;
+    for (size_t i = 0; i < aCount; ++i) {
+        apOut[i] = apMeans[i] + apStds[i] * standard();
+    }
+}
+
 // seed the random number source
 template <typename T>
 void NormalRNG<T>::Seed(int aSeed) {
     BOOST_LOGL(randomnumbergenerator, info) << "Seeding with value " 
             << aSeed << std::endl;
     mpVarGen->engine().seed((boost::mt19937::result_type)aSeed);
+    // drop any value the per-call distribution has cached from the old seed
+    mpStandardGen->distribution().reset();
+}
+
+/**
+Floating point values drawn from an empirical distribution. The distribution
+is defined by a piecewise-linear inverse cumulative distribution function,
+built either from a set of data or from a table of quantiles, and each value
+is a uniform draw mapped through it.
+
+Between the knots the inverse CDF is interpolated exactly as LinearInterp
+interpolates the (probability, value) points. Rather than searching for the
+segment, the uniform draw indexes a guide table of equal-width probability
+buckets that gives the first segment to look at, so a draw costs (in the
+expected case) a single step of the guide plus one interpolation.
+*/
+template <typename T=double>
+class EmpiricalRNG : public BaseRNG {
+public:
+    /// float-type for the result value of the RNG
+    typedef T ResultType;
+
+    /// shared pointer for the EmpiricalRNG class
+    typedef boost::shared_ptr<EmpiricalRNG< T > > Ptr;
+
+    /// table of cumulative probability -> value
+    typedef typename Interpolator<T, T>::TSMap QuantileTable;
+
+    /** Construct an EmpiricalRNG with the initial seed value aSeed. The
+    distribution must be set with SetData or SetQuantiles before use.
+    @param aSeed Initial seed value for the RNG.
+    */
+    EmpiricalRNG(int aSeed = 1);
+
+    /** Set the distribution from a set of data. The sorted data become the
+    knots of the inverse CDF at equally spaced probabilities from 0 to 1, so
+    values are drawn between the smallest and largest data.
+    @param arData At least 2 data values, in any order.
+    */
+    void SetData(const vector<T>& arData);
+
+    /** Set the distribution from a table of quantiles. Probabilities below
+    the first or above the last quantile are extrapolated linearly from the
+    first or last two points, as LinearInterp does.
+    @param arTable At least 2 (probability, value) points. Values must not
+    decrease with probability.
+    */
+    void SetQuantiles(const QuantileTable& arTable);
+
+    /// True once the distribution has been set.
+    bool IsSet() const { return !mGuide.empty(); }
+
+    /// The value with the given cumulative probability (the inverse CDF.)
+    T Quantile(T aProbability) const;
+
+    /// returns the next random value
+    T operator()();
+
+    /// Fill an array with the next aCount random values.
+    /// @param apOut the array to fill.
+    /// @param aCount the number of values to generate.
+    void Fill(T* apOut, size_t aCount);
+
+    /// Seed the contained random numner source.
+    /// @param aSeed seed value for the RNG
+    void Seed(int aSeed);
+
+private:
+    /// build the guide table from mProbs
+    void BuildGuide();
+
+    /// map a uniform [0, 1) value through the inverse CDF
+    T Lookup(T aUniform) const;
+
+    UniformFloatRNG<T>  mUniform;   ///< the uniform [0, 1) source
+    vector<T>           mProbs;     ///< probability of each knot, ascending
+    vector<T>           mValues;    ///< value at each knot
+    vector<size_t>      mGuide;     ///< first segment for each bucket
+    LinearInterp<T, T>  mInterp;    ///< for Quantile
+};
+
+// constructor
+template <typename T>
+EmpiricalRNG<T>::EmpiricalRNG(int aSeed)
+:   mUniform(T(0), T(1), aSeed)
+{
+}
+
+// set the knots at equally spaced probabilities
+template <typename T>
+void EmpiricalRNG<T>::SetData(const vector<T>& arData) {
+    if (arData.size() < 2) {
+        throw TemsimException(
+            "At least 2 data values are needed for an empirical distribution",
+            "EmpiricalRNG");
+    }
+    mValues = arData;
+    std::sort(mValues.begin(), mValues.end());
+    mProbs.resize(mValues.size());
+    for (size_t i = 0; i < mProbs.size(); ++i) {
+        mProbs[i] = T(i) / T(mProbs.size() - 1);
+    }
+    BuildGuide();
+}
+
+// set the knots from the table
+template <typename T>
+void EmpiricalRNG<T>::SetQuantiles(const QuantileTable& arTable) {
+    if (arTable.size() < 2) {
+        throw TemsimException(
+            "At least 2 quantiles are needed for an empirical distribution",
+            "EmpiricalRNG");
+    }
+    mProbs.clear();
+    mValues.clear();
+    for (typename QuantileTable::const_iterator iter = arTable.begin();
+        iter != arTable.end();
+        ++iter) {
+        if (!mValues.empty() && iter->second < mValues.back()) {
+            throw TemsimException(
+                "Quantiles of an empirical distribution must not decrease",
+                "EmpiricalRNG");
+        }
+        mProbs.push_back(iter->first);
+        mValues.push_back(iter->second);
+    }
+    BuildGuide();
+}
+
+// For a table of n knots we use 2(n-1) buckets, so on average there is at
+// most one knot in a bucket.
+template <typename T>
+void EmpiricalRNG<T>::BuildGuide() {
+    size_t buckets = 2 * (mProbs.size() - 1);
+    mGuide.resize(buckets);
+    for (size_t j = 0; j < buckets; ++j) {
+        T bucket_start = T(j) / T(buckets);
+        // the segment containing the start of the bucket
+        size_t index = std::upper_bound(mProbs.begin(), mProbs.end(), bucket_start)
+            - mProbs.begin();
+        index = index > 0 ? index - 1 : 0;
+        mGuide[j] = std::min(index, mProbs.size() - 2);
+    }
+}
+
+template <typename T>
+T EmpiricalRNG<T>::Lookup(T aUniform) const {
+    size_t bucket = (size_t)(aUniform * T(mGuide.size()));
+    if (bucket >= mGuide.size()) {
+        bucket = mGuide.size() - 1;
+    }
+    size_t i = mGuide[bucket];
+    while (i + 2 < mProbs.size() && !(aUniform < mProbs[i + 1])) {
+        ++i;
+    }
+    if (mProbs[i] == aUniform) {
+        return mValues[i];
+    }
+    else if (mProbs[i + 1] == aUniform) {
+        return mValues[i + 1];
+    }
+    return CalcInterpolatedValue<T, T>::Value(
+        mProbs[i], mValues[i], mProbs[i + 1], mValues[i + 1], aUniform);
+}
+
+template <typename T>
+T EmpiricalRNG<T>::Quantile(T aProbability) const {
+    if (!IsSet()) {
+        throw TemsimException("Empirical distribution has not been set",
+            "EmpiricalRNG");
+    }
+    return mInterp.FlatValue(&mProbs[0], &mValues[0], mProbs.size(), aProbability);
+}
+
+// returns next random value
+template <typename T>
+T EmpiricalRNG<T>::operator()() {
+    return Lookup(mUniform());
+}
+
+// fill an array with random values - draw all the uniforms first
+template <typename T>
+void EmpiricalRNG<T>::Fill(T* apOut, size_t aCount) {
+    mUniform.Fill(apOut, aCount);
+    for (size_t i = 0; i < aCount; ++i) {
+        apOut[i] = Lookup(apOut[i]);
+    }
+}
+
+// seed the random number source
+template <typename T>
+void EmpiricalRNG<T>::Seed(int aSeed) {
+    mUniform.Seed(aSeed);
+}
+
+
+/**
+Normally distributed floating point values, truncated to the range
+[aLower, aUpper]. Either bound may be infinite.
+
+Values are drawn from the standard normal truncated to the standardised range
+[a, b] by the cheapest of three exact rejection methods (C. P. Robert,
+"Simulation of truncated normal variables", Statistics and Computing, 1995),
+chosen when the parameters are set:
+- a < 0 < b and the range is wide: draw from the normal until one lands in
+  the range.
+- the range is narrow: uniform proposals on [a, b].
+- otherwise (the range lies in one tail): Robert's translated exponential
+  proposal with the optimal rate, whose acceptance rate approaches 1 the
+  further out in the tail the range is.
+A range entirely below zero is handled by reflection. Unlike a rejection loop
+around an untruncated normal, the expected cost of a draw is bounded however
+little of the distribution lies inside the range.
+*/
+template <typename T=double>
+class TruncatedNormalRNG : public BaseRNG {
+public:
+    /// float-type for the result value of the RNG
+    typedef T ResultType;
+
+    /// shared pointer for the TruncatedNormalRNG class
+    typedef boost::shared_ptr<TruncatedNormalRNG< T > > Ptr;
+
+    /** Construct a TruncatedNormalRNG.
+    @param aMean Mean of the (untruncated) normal distribution.
+    @param aStd Standard deviation of the normal distribution.
+    @param aLower Lower bound, may be -infinity.
+    @param aUpper Upper bound, may be infinity.
+    @param aSeed Initial seed value for the RNG.
+    */
+    TruncatedNormalRNG(T aMean, T aStd, T aLower, T aUpper, int aSeed = 1);
+
+    /// Change the parameters of the distribution.
+    void SetParameters(T aMean, T aStd, T aLower, T aUpper);
+
+    /// returns the next random value
+    T operator()();
+
+    /// Fill an array with the next aCount random values.
+    void Fill(T* apOut, size_t aCount);
+
+    /// Seed the contained random numner source.
+    /// @param aSeed seed value for the RNG
+    void Seed(int aSeed);
+
+private:
+    /// sampling methods, see the class description
+    enum Method { eNormal, eUniform, eExponential };
+
+    /// draw from N(0, 1) truncated to [mA, mB]
+    T Standard();
+
+    boost::mt19937                  mRNG;       ///< the random source
+    boost::uniform_real<T>          mUnit;      ///< [0, 1)
+    boost::normal_distribution<T>   mStandard;  ///< N(0, 1)
+
+    T       mMean;          ///< mean of the untruncated normal
+    T       mStd;           ///< standard deviation of the untruncated normal
+    T       mA;             ///< standardised lower bound (after reflection)
+    T       mB;             ///< standardised upper bound (after reflection)
+    bool    mReflect;       ///< true if the range was reflected about 0
+    Method  mMethod;        ///< how to sample
+    T       mUniformShift;  ///< log of the uniform proposal's envelope
+    T       mRate;          ///< rate of the exponential proposal
+};
+
+// constructor
+template <typename T>
+TruncatedNormalRNG<T>::TruncatedNormalRNG(T aMean, T aStd, T aLower, T aUpper,
+                                          int aSeed)
+:   mUnit(T(0), T(1)),
+    mStandard(T(0), T(1))
+{
+    mRNG.seed((boost::mt19937::result_type)aSeed);
+    SetParameters(aMean, aStd, aLower, aUpper);
+}
+
+// standardise the range and choose the sampling method
+template <typename T>
+void TruncatedNormalRNG<T>::SetParameters(T aMean, T aStd, T aLower, T aUpper) {
+    if (!(aStd > T(0)) || !(aLower < aUpper)) {
+        throw TemsimException("Truncated normal needs a positive standard "
+            "deviation and lower bound below upper bound", "TruncatedNormalRNG");
+    }
+    mMean = aMean;
+    mStd = aStd;
+    mA = (aLower - aMean) / aStd;
+    mB = (aUpper - aMean) / aStd;
+    mReflect = false;
+    if (mB <= T(0)) {
+        // all in the lower tail - sample the reflected range and negate
+        T a = mA;
+        mA = -mB;
+        mB = -a;
+        mReflect = true;
+    }
+
+    if (mA < T(0)) {
+        // range includes the mode
+        mMethod = (mB - mA > std::sqrt(T(2) * T(3.14159265358979323846)))
+            ? eNormal : eUniform;
+        mUniformShift = T(0);
+    }
+    else {
+        T root = std::sqrt(mA * mA + T(4));
+        mRate = (mA + root) / T(2);
+        T uniform_limit = T(2) * std::sqrt(std::exp(T(1))) / (mA + root)
+            * std::exp((mA * mA - mA * root) / T(4));
+        mMethod = (mB - mA <= uniform_limit) ? eUniform : eExponential;
+        mUniformShift = mA * mA;
+    }
+}
+
+template <typename T>
+T TruncatedNormalRNG<T>::Standard() {
+    T z;
+    switch (mMethod) {
+    case eNormal:
+        do {
+            z = mStandard(mRNG);
+        } while (z < mA || z > mB);
+        break;
+    case eUniform:
+        // accept with probability exp((shift - z^2) / 2)
+        do {
+            z = mA + (mB - mA) * mUnit(mRNG);
+        } while (std::log(T(1) - mUnit(mRNG)) > (mUniformShift - z * z) / T(2));
+        break;
+    default:
+        // translated exponential proposal, accept with exp(-(z - rate)^2 / 2)
+        while (true) {
+            z = mA - std::log(T(1) - mUnit(mRNG)) / mRate;
+            if (z > mB) {
+                continue;
+            }
+            T d = z - mRate;
+            if (std::log(T(1) - mUnit(mRNG)) <= -d * d / T(2)) {
+                break;
+            }
+        }
+        break;
+    }
+    return mReflect ? -z : z;
+}
+
+// returns next random value
+template <typename T>
+T TruncatedNormalRNG<T>::operator()() {
+    return mMean + mStd * Standard();
+}
+
+// fill an array with random values
+template <typename T>
+void TruncatedNormalRNG<T>::Fill(T* apOut, size_t aCount) {
+    for (size_t i = 0; i < aCount; ++i) {
+        apOut[i] = mMean + mStd * Standard();
+    }
+}
+
+// seed the random number source
+template <typename T>
+void TruncatedNormalRNG<T>::Seed(int aSeed) {
+    BOOST_LOGL(randomnumbergenerator, info) << "Seeding with value " 
+            << aSeed << std::endl;
+    mRNG.seed((boost::mt19937::result_type)aSeed);
+}
+
+
+/**
+Log-normally distributed floating point values, truncated to the range
+[aLower, aUpper]. The parameters are those of the underlying normal
+distribution of log(x), and the values are exp() of a truncated normal draw
+on the log of the range, so the same efficient methods apply.
+*/
+template <typename T=double>
+class TruncatedLogNormalRNG : public BaseRNG {
+public:
+    /// float-type for the result value of the RNG
+    typedef T ResultType;
+
+    /// shared pointer for the TruncatedLogNormalRNG class
+    typedef boost::shared_ptr<TruncatedLogNormalRNG< T > > Ptr;
+
+    /** Construct a TruncatedLogNormalRNG.
+    @param aLogMean Mean of log(x).
+    @param aLogStd Standard deviation of log(x).
+    @param aLower Lower bound, 0 or less for none.
+    @param aUpper Upper bound, may be infinity.
+    @param aSeed Initial seed value for the RNG.
+    */
+    TruncatedLogNormalRNG(T aLogMean, T aLogStd, T aLower, T aUpper, int aSeed = 1)
+    :   mLogRNG(aLogMean, aLogStd, LogBound(aLower), LogBound(aUpper), aSeed) {}
+
+    /// Change the parameters of the distribution.
+    void SetParameters(T aLogMean, T aLogStd, T aLower, T aUpper) {
+        mLogRNG.SetParameters(aLogMean, aLogStd, LogBound(aLower), LogBound(aUpper));
+    }
+
+    /// returns the next random value
+    T operator()() { return std::exp(mLogRNG()); }
+
+    /// Fill an array with the next aCount random values.
+    void Fill(T* apOut, size_t aCount) {
+        mLogRNG.Fill(apOut, aCount);
+        for (size_t i = 0; i < aCount; ++i) {
+            apOut[i] = std::exp(apOut[i]);
+        }
+    }
+
+    /// Seed the contained random numner source.
+    /// @param aSeed seed value for the RNG
+    void Seed(int aSeed) { mLogRNG.Seed(aSeed); }
+
+private:
+    static T LogBound(T aBound) {
+        return aBound > T(0) ? std::log(aBound)
+                             : -std::numeric_limits<T>::infinity();
+    }
+
+    TruncatedNormalRNG<T> mLogRNG;  ///< draws log(x)
+};
+
+
+/**
+Gamma distributed floating point values, truncated to the range
+[aLower, aUpper].
+
+Values are drawn by inversion: a uniform draw is mapped onto the part of the
+cumulative distribution inside the range and through the inverse CDF, so each
+draw costs one inverse incomplete gamma function and nothing is rejected.
+Ranges in the upper tail are inverted through the complementary CDF so no
+accuracy is lost. If the range is so far out in the upper tail that its
+probability underflows, values are drawn by rejection from an exponential
+envelope fitted to the tail at the lower bound instead.
+*/
+template <typename T=double>
+class TruncatedGammaRNG : public BaseRNG {
+public:
+    /// float-type for the result value of the RNG
+    typedef T ResultType;
+
+    /// shared pointer for the TruncatedGammaRNG class
+    typedef boost::shared_ptr<TruncatedGammaRNG< T > > Ptr;
+
+    /** Construct a TruncatedGammaRNG.
+    @param aShape Shape (k) of the gamma distribution.
+    @param aScale Scale (theta) of the gamma distribution.
+    @param aLower Lower bound, 0 or less for none.
+    @param aUpper Upper bound, may be infinity.
+    @param aSeed Initial seed value for the RNG.
+    */
+    TruncatedGammaRNG(T aShape, T aScale, T aLower, T aUpper, int aSeed = 1);
+
+    /// Change the parameters of the distribution.
+    void SetParameters(T aShape, T aScale, T aLower, T aUpper);
+
+    /// returns the next random value
+    T operator()();
+
+    /// Fill an array with the next aCount random values.
+    void Fill(T* apOut, size_t aCount);
+
+    /// Seed the contained random numner source.
+    /// @param aSeed seed value for the RNG
+    void Seed(int aSeed);
+
+private:
+    /// sampling methods, see the class description
+    enum Method { eLower, eUpper, eTail };
+
+    boost::mt19937          mRNG;       ///< the random source
+    boost::uniform_real<T>  mUnit;      ///< [0, 1)
+
+    T       mShape;     ///< k
+    T       mScale;     ///< theta
+    T       mLower;     ///< lower bound (at least 0)
+    T       mUpper;     ///< upper bound
+    Method  mMethod;    ///< how to sample
+    T       mFrom;      ///< P (or Q) at the lower bound
+    T       mTo;        ///< P (or Q) at the upper bound
+    T       mTailRate;  ///< rate of the exponential tail envelope
+};
+
+// constructor
+template <typename T>
+TruncatedGammaRNG<T>::TruncatedGammaRNG(T aShape, T aScale, T aLower, T aUpper,
+                                        int aSeed)
+:   mUnit(T(0), T(1))
+{
+    mRNG.seed((boost::mt19937::result_type)aSeed);
+    SetParameters(aShape, aScale, aLower, aUpper);
+}
+
+// work out the probabilities at the bounds and choose the sampling method
+template <typename T>
+void TruncatedGammaRNG<T>::SetParameters(T aShape, T aScale, T aLower, T aUpper) {
+    if (!(aShape > T(0)) || !(aScale > T(0)) || !(aLower < aUpper)
+        || !(aUpper > T(0))) {
+        throw TemsimException("Truncated gamma needs positive shape and scale "
+            "and lower bound below a positive upper bound", "TruncatedGammaRNG");
+    }
+    mShape = aShape;
+    mScale = aScale;
+    mLower = std::max(aLower, T(0));
+    mUpper = aUpper;
+
+    T lower_p = boost::math::gamma_p(mShape, mLower / mScale);
+    if (lower_p <= T(0.5)) {
+        mMethod = eLower;
+        mFrom = lower_p;
+        mTo = (mUpper == std::numeric_limits<T>::infinity())
+            ? T(1) : boost::math::gamma_p(mShape, mUpper / mScale);
+    }
+    else {
+        mMethod = eUpper;
+        mFrom = boost::math::gamma_q(mShape, mLower / mScale);
+        mTo = (mUpper == std::numeric_limits<T>::infinity())
+            ? T(0) : boost::math::gamma_q(mShape, mUpper / mScale);
+        if (!(mFrom > mTo)) {
+            // the probability of the range underflows
+            mMethod = eTail;
+            mTailRate = T(1) / mScale;
+            if (mShape > T(1)) {
+                mTailRate -= (mShape - T(1)) / mLower;
+            }
+        }
+    }
+}
+
+template <typename T>
+T TruncatedGammaRNG<T>::operator()() {
+    T x;
+    switch (mMethod) {
+    case eLower:
+        x = mScale * boost::math::gamma_p_inv(mShape,
+            mFrom + (mTo - mFrom) * mUnit(mRNG));
+        break;
+    case eUpper:
+        // Q decreases from mFrom to mTo across the range; avoid Q = 0
+        x = mScale * boost::math::gamma_q_inv(mShape,
+            mFrom - (mFrom - mTo) * mUnit(mRNG));
+        break;
+    default:
+        // exponential envelope from the lower bound. The density relative
+        // to the envelope is (x/l)^(k-1) exp(-(k-1)(x/l - 1)) for k > 1
+        // and (x/l)^(k-1) for k <= 1, both at most 1.
+        while (true) {
+            x = mLower - std::log(T(1) - mUnit(mRNG)) / mTailRate;
+            if (x > mUpper) {
+                continue;
+            }
+            T ratio = x / mLower;
+            T log_accept = (mShape - T(1)) * std::log(ratio);
+            if (mShape > T(1)) {
+                log_accept -= (mShape - T(1)) * (ratio - T(1));
+            }
+            if (std::log(T(1) - mUnit(mRNG)) <= log_accept) {
+                break;
+            }
+        }
+        break;
+    }
+    // guard against rounding in the inverse pushing us out of range
+    return std::min(std::max(x, mLower), mUpper);
+}
+
+// fill an array with random values
+template <typename T>
+void TruncatedGammaRNG<T>::Fill(T* apOut, size_t aCount) {
+    for (size_t i = 0; i < aCount; ++i) {
+        apOut[i] = (*this)();
+    }
+}
+
+// seed the random number source
+template <typename T>
+void TruncatedGammaRNG<T>::Seed(int aSeed) {
+    BOOST_LOGL(randomnumbergenerator, info) << "Seeding with value " 
+            << aSeed << std::endl;
+    mRNG.seed((boost::mt19937::result_type)aSeed);
 }
 
 
 /**
 A Class that encapsulates a UniformFloatRNG<double> as an object
-available to the scripting environment.
+available to the scripting environment. If Fleet is set, the values are
+drawn from a lane of the simulation's RNGFleet instead, which gives the same
+values but advances all such generators together.
 */
 class RandomDouble {
 public:
@@ -278,18 +992,40 @@ public:
 
     double Value();
 
+    // Return a random value in the range [aMin, aMax).
+    double Value(double aMin, double aMax);
+
+    // Fill the vector with random values (as many as it has elements.)
+    void Fill(vector<double>& arValues);
+
+    // Fill the vector with one random value per element of arMins, each in
+    // the range [arMins[i], arMaxs[i]).
+    void Fill(vector<double>& arValues, const vector<double>& arMins,
+              const vector<double>& arMaxs);
+
 
     // -----------------------------------------------------------------
 
 protected:
+    // seed with the rep number, joining the fleet the first time if asked to
+    void StartOfRep(int aRep);
+
     UniformFloatRNG<double> mRNG;
+    bool                mFleet;     ///< draw from the simulation's RNGFleet
+    ObjectRegister*     mpObjects;  ///< where to find the fleet
+    RNGFleet::Ptr       mpFleet;    ///< the fleet, once joined
+    RNGFleet::Lane      mLane;      ///< this generator's lane in the fleet
 
 };
 
 
 /**
 A Class that encapsulates a NormalRNG<double> as an object
-available to the scripting environment.
+available to the scripting environment. If Fleet is set, the values are
+drawn through a lane of the simulation's RNGFleet instead, which advances all
+such generators together. Each value is then one word of the lane through the
+inverse normal CDF, so the lanes stay in step; the values are not those the
+generator gives outside the fleet.
 */
 class RandomNormal {
 public:
@@ -312,15 +1048,215 @@ public:
 
     double Value();
 
+    // Return a random value from a normal distribution with the given mean
+    // and standard deviation.
+    double Value(double aMean, double aStdDev);
+
+    // Fill the vector with random values (as many as it has elements.)
+    void Fill(vector<double>& arValues);
+
+    // Fill the vector with one random value per element of arMeans, each
+    // with mean arMeans[i] and standard deviation arStdDevs[i].
+    void Fill(vector<double>& arValues, const vector<double>& arMeans,
+              const vector<double>& arStdDevs);
+
 
     // -----------------------------------------------------------------
 
 protected:
+    // seed with the rep number, joining the fleet the first time if asked to
+    void StartOfRep(int aRep);
+
+    // a N(0, 1) value from the fleet
+    double FleetStandard();
+
     NormalRNG<double> mRNG;
+    bool                mFleet;     ///< draw from the simulation's RNGFleet
+    ObjectRegister*     mpObjects;  ///< where to find the fleet
+    RNGFleet::Ptr       mpFleet;    ///< the fleet, once joined
+    RNGFleet::Lane      mLane;      ///< this generator's lane in the fleet
 
 };
 
 
-#endif
+
+/**
+A Class that encapsulates an EmpiricalRNG<double> as an object
+available to the scripting environment. The distribution is given either
+as Data (a list of observed values) or as matching lists of Probabilities
+and Quantiles, and is rebuilt at the start of each rep.
+*/
+class RandomEmpirical {
+public:
+    // standard stuff for object register -----------------------------
+    static string class_name; // "Pump"
+    virtual const string& ClassName() const { return class_name; } 
+    string instance_name; // eg. "Turbine1"
+    const string& Name() { return instance_name; } 
+    
+    typedef boost::shared_ptr<RandomEmpirical> Ptr;
+
+    // constructor taking an instance name.
+    // @param arName the name of the instance.
+    RandomEmpirical(const string& arName="default");
+    
+    // Register the object's members.
+    // @param arSim The simulation to register
+    // the class instance with.
+    virtual void Register(Simulation& arSim);
+
+    double Value();
+
+    // Fill the vector with random values (as many as it has elements.)
+    void Fill(vector<double>& arValues);
+
+
+    // -----------------------------------------------------------------
+
+protected:
+    // build the distribution and seed with the rep number
+    void StartOfRep(int aRep);
+
+    // build the distribution from Data or Probabilities/Quantiles
+    void Build();
+
+    EmpiricalRNG<double> mRNG;
+    vector<double> mData;           ///< observed values
+    vector<double> mProbabilities;  ///< probability of each quantile
+    vector<double> mQuantiles;      ///< quantile values
+};
+
+
+/**
+A Class that encapsulates a TruncatedNormalRNG<double> as an object
+available to the scripting environment. Mean and StdDev are those of the
+untruncated normal, and Lower and Upper default to +/- infinity.
+*/
+class RandomTruncatedNormal {
+public:
+    // standard stuff for object register -----------------------------
+    static string class_name; // "Pump"
+    virtual const string& ClassName() const { return class_name; } 
+    string instance_name; // eg. "Turbine1"
+    const string& Name() { return instance_name; } 
+    
+    typedef boost::shared_ptr<RandomTruncatedNormal> Ptr;
+
+    // constructor taking an instance name.
+    // @param arName the name of the instance.
+    RandomTruncatedNormal(const string& arName="default");
+    
+    // Register the object's members.
+    // @param arSim The simulation to register
+    // the class instance with.
+    virtual void Register(Simulation& arSim);
+
+    double Value();
+
+    // Fill the vector with random values (as many as it has elements.)
+    void Fill(vector<double>& arValues);
+
+
+    // -----------------------------------------------------------------
+
+protected:
+    // apply the parameters and seed with the rep number
+    void StartOfRep(int aRep);
+
+    TruncatedNormalRNG<double> mRNG;
+    double mMean;       ///< mean of the untruncated distribution
+    double mStdDev;     ///< standard deviation of the untruncated distribution
+    double mLower;      ///< lower bound
+    double mUpper;      ///< upper bound
+};
+
+
+/**
+A Class that encapsulates a TruncatedLogNormalRNG<double> as an object
+available to the scripting environment. LogMean and LogStdDev are the mean
+and standard deviation of log(x); Lower and Upper bound x itself.
+*/
+class RandomTruncatedLogNormal {
+public:
+    // standard stuff for object register -----------------------------
+    static string class_name; // "Pump"
+    virtual const string& ClassName() const { return class_name; } 
+    string instance_name; // eg. "Turbine1"
+    const string& Name() { return instance_name; } 
+    
+    typedef boost::shared_ptr<RandomTruncatedLogNormal> Ptr;
+
+    // constructor taking an instance name.
+    // @param arName the name of the instance.
+    RandomTruncatedLogNormal(const string& arName="default");
+    
+    // Register the object's members.
+    // @param arSim The simulation to register
+    // the class instance with.
+    virtual void Register(Simulation& arSim);
+
+    double Value();
+
+    // Fill the vector with random values (as many as it has elements.)
+    void Fill(vector<double>& arValues);
+
+
+    // -----------------------------------------------------------------
+
+protected:
+    // apply the parameters and seed with the rep number
+    void StartOfRep(int aRep);
+
+    TruncatedLogNormalRNG<double> mRNG;
+    double mLogMean;    ///< mean of log(x)
+    double mLogStdDev;  ///< standard deviation of log(x)
+    double mLower;      ///< lower bound
+    double mUpper;      ///< upper bound
+};
 
 
+/**
+A Class that encapsulates a TruncatedGammaRNG<double> as an object
+available to the scripting environment, with parameters Shape and Scale.
+Lower and Upper default to 0 and infinity.
+*/
+class RandomTruncatedGamma {
+public:
+    // standard stuff for object register -----------------------------
+    static string class_name; // "Pump"
+    virtual const string& ClassName() const { return class_name; } 
+    string instance_name; // eg. "Turbine1"
+    const string& Name() { return instance_name; } 
+    
+    typedef boost::shared_ptr<RandomTruncatedGamma> Ptr;
+
+    // constructor taking an instance name.
+    // @param arName the name of the instance.
+    RandomTruncatedGamma(const string& arName="default");
+    
+    // Register the object's members.
+    // @param arSim The simulation to register
+    // the class instance with.
+    virtual void Register(Simulation& arSim);
+
+    double Value();
+
+    // Fill the vector with random values (as many as it has elements.)
+    void Fill(vector<double>& arValues);
+
+
+    // -----------------------------------------------------------------
+
+protected:
+    // apply the parameters and seed with the rep number
+    void StartOfRep(int aRep);
+
+    TruncatedGammaRNG<double> mRNG;
+    double mShape;      ///< shape (k)
+    double mScale;      ///< scale (theta)
+    double mLower;      ///< lower bound
+    double mUpper;      ///< upper bound
+};
+
+
+#endif
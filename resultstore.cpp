@@ -0,0 +1,616 @@
+#include "resultstore.hpp"
+
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+
+#include "fileadvice.hpp"
+#include "temsimexception.hpp"
+
+/// define boost logging stuff.
+BOOST_DEFINE_LOG(resultstore, "resultstore")
+
+/**
+\file
+Implementation of the replicate result files.
+*/
+
+const char* gResultFileMagic = "TRESULT1";
+const char* gResultPoolMagic = "TRPOOL01";
+const unsigned long long gPoolChunkFlag = 1ULL << 63;
+const unsigned long long gSparseChunkFlag = 1ULL << 62;
+
+/// current result file format version (3 added sparse chunks)
+static const unsigned gResultFileVersion = 3;
+/// oldest result file format version that can be read
+static const unsigned gOldestResultFileVersion = 2;
+
+// true if two values are the same down to the bit (so NaNs and -0 count
+// as changes)
+static inline bool SameBits(double a, double b) {
+    return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+// bytes taken by a sparse chunk of aChanges changes
+static inline size_t SparseChunkBytes(size_t aChanges) {
+    size_t steps = (aChanges * sizeof(unsigned) + sizeof(double) - 1)
+        / sizeof(double) * sizeof(double);
+    return sizeof(unsigned long long) + aChanges * sizeof(double) + steps;
+}
+
+unsigned long long HashResultChunk(const double* apValues, size_t aCount) {
+    unsigned long long h = 14695981039346656037ULL;
+    const unsigned char* p = (const unsigned char*)apValues;
+    const unsigned char* end = p + aCount * sizeof(double);
+    for (; p != end; ++p) {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+ResultChunkPool::ResultChunkPool(const string& arFileName, size_t aMaxSightings)
+:   mFileName(arFileName),
+    mEnd(0),
+    mMaxSightings(aMaxSightings),
+    mShared(0),
+    mBytesSaved(0)
+{
+    ResultPoolHeader header;
+    mFile.open(arFileName.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    if (!mFile) {
+        // new pool
+        std::ofstream create(arFileName.c_str(), std::ios::binary);
+        memset(&header, 0, sizeof(header));
+        memcpy(header.Magic, gResultPoolMagic, sizeof(header.Magic));
+        header.Id = ((unsigned long long)time(0) << 20) ^ (size_t)this ^ 1;
+        create.write((const char*)&header, sizeof(header));
+        create.close();
+        mFile.clear();
+        mFile.open(arFileName.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        if (!create || !mFile) {
+            throw TemsimException("Couldn't create chunk pool " + arFileName,
+                "ResultStore");
+        }
+        mId = header.Id;
+        mEnd = sizeof(header);
+        return;
+    }
+
+    if (!mFile.read((char*)&header, sizeof(header))
+        || memcmp(header.Magic, gResultPoolMagic, sizeof(header.Magic)) != 0) {
+        throw TemsimException("Chunk pool " + arFileName
+            + " has the wrong format", "ResultStore");
+    }
+    mId = header.Id;
+    mEnd = sizeof(header);
+    // index the chunks already there; an incomplete chunk at the end (from
+    // an interrupted run) is written over
+    mFile.seekg(0, std::ios::end);
+    unsigned long long size = (unsigned long long)mFile.tellg();
+    while (mEnd + 2 * sizeof(unsigned long long) <= size) {
+        unsigned long long record[2];
+        mFile.seekg(mEnd);
+        mFile.read((char*)record, sizeof(record));
+        unsigned long long offset = mEnd + sizeof(record);
+        if (!mFile || offset + record[1] * sizeof(double) > size) {
+            break;
+        }
+        mIndex.insert(std::make_pair(record[0],
+            std::make_pair(offset, (size_t)record[1])));
+        mEnd = offset + record[1] * sizeof(double);
+    }
+    mFile.clear();
+    BOOST_LOGL(resultstore, info) << "Chunk pool " << arFileName << " has "
+        << mIndex.size() << " chunks" << std::endl;
+}
+
+unsigned long long ResultChunkPool::Place(const double* apValues, size_t aCount) {
+    unsigned long long hash = HashResultChunk(apValues, aCount);
+    boost::mutex::scoped_lock lock(mMutex);
+
+    typedef std::multimap<unsigned long long, std::pair<unsigned long long, size_t> > Index;
+    std::pair<Index::const_iterator, Index::const_iterator> range = mIndex.equal_range(hash);
+    for (Index::const_iterator iter = range.first; iter != range.second; ++iter) {
+        if (iter->second.second == aCount && Matches(iter->second.first, apValues, aCount)) {
+            ++mShared;
+            mBytesSaved += aCount * sizeof(double);
+            return iter->second.first;
+        }
+    }
+
+    if (mSightings.erase(hash) == 0) {
+        // first sighting: the writer keeps this one
+        if (mSightings.size() < mMaxSightings) {
+            mSightings.insert(hash);
+        }
+        return 0;
+    }
+
+    // second sighting: pool it
+    unsigned long long record[2] = { hash, aCount };
+    mFile.seekp(mEnd);
+    mFile.write((const char*)record, sizeof(record));
+    mFile.write((const char*)apValues, aCount * sizeof(double));
+    if (!mFile) {
+        throw TemsimException("Error writing chunk pool " + mFileName,
+            "ResultStore");
+    }
+    unsigned long long offset = mEnd + sizeof(record);
+    mEnd = offset + aCount * sizeof(double);
+    mIndex.insert(std::make_pair(hash, std::make_pair(offset, aCount)));
+    return offset;
+}
+
+bool ResultChunkPool::Matches(unsigned long long aOffset, const double* apValues,
+                              size_t aCount) {
+    vector<double> pooled(aCount);
+    mFile.seekg(aOffset);
+    if (aCount > 0 && !mFile.read((char*)&pooled[0], aCount * sizeof(double))) {
+        mFile.clear();
+        return false;
+    }
+    return aCount == 0 || memcmp(&pooled[0], apValues, aCount * sizeof(double)) == 0;
+}
+
+void ResultChunkPool::Flush() {
+    boost::mutex::scoped_lock lock(mMutex);
+    mFile.flush();
+}
+
+MappedResultPool::MappedResultPool(const string& arFileName) {
+    try {
+        mFile.open(arFileName);
+    } catch (std::exception& e) {
+        throw TemsimException("Couldn't map chunk pool " + arFileName
+            + " (" + e.what() + ")", "ResultStore");
+    }
+    ResultPoolHeader header;
+    if (mFile.size() < sizeof(header)) {
+        throw TemsimException("Chunk pool " + arFileName + " is too short",
+            "ResultStore");
+    }
+    memcpy(&header, mFile.data(), sizeof(header));
+    if (memcmp(header.Magic, gResultPoolMagic, sizeof(header.Magic)) != 0) {
+        throw TemsimException("Chunk pool " + arFileName
+            + " has the wrong format", "ResultStore");
+    }
+    mId = header.Id;
+}
+
+ReplicateResultWriter::ReplicateResultWriter(const string& arFileName,
+                                             const vector<string>& arChannels,
+                                             long long aReplicate,
+                                             unsigned aBlockSteps,
+                                             ResultChunkPool::Ptr apPool,
+                                             bool aSparse)
+:   mFileName(arFileName),
+    mFile(arFileName.c_str(), std::ios::binary),
+    mChannels(arChannels.size()),
+    mBlockSteps(aBlockSteps),
+    mReplicate(aReplicate),
+    mBlockFill(0),
+    mSteps(0),
+    mpPool(apPool),
+    mClosed(false),
+    mSparse(aSparse),
+    mSparseChunks(0),
+    mSparseBytesSaved(0)
+{
+    if (!mFile) {
+        throw TemsimException("Couldn't write result file " + arFileName,
+            "ResultStore");
+    }
+    if (mChannels == 0 || mBlockSteps == 0) {
+        throw TemsimException("Result file " + arFileName
+            + " needs at least one channel and a block size", "ResultStore");
+    }
+    mBlock.resize(mChannels * mBlockSteps);
+
+    // the header is rewritten with the step count and table offset on Close
+    ResultFileHeader header;
+    memset(&header, 0, sizeof(header));
+    mFile.write((const char*)&header, sizeof(header));
+    for (size_t c = 0; c < mChannels; ++c) {
+        unsigned length = (unsigned)arChannels[c].size();
+        mFile.write((const char*)&length, sizeof(length));
+        mFile.write(arChannels[c].data(), length);
+    }
+    // the chunks are aligned for doubles
+    while (mFile.tellp() % sizeof(double) != 0) {
+        mFile.put('\0');
+    }
+}
+
+ReplicateResultWriter::~ReplicateResultWriter() {
+    if (!mClosed) {
+        try {
+            Close();
+        } catch (std::exception& e) {
+            BOOST_LOGL(resultstore, err) << "Error closing " << mFileName
+                << ": " << e.what() << std::endl;
+        }
+    }
+}
+
+void ReplicateResultWriter::Record(const double* apValues) {
+    for (size_t c = 0; c < mChannels; ++c) {
+        mBlock[c * mBlockSteps + mBlockFill] = apValues[c];
+    }
+    ++mSteps;
+    if (++mBlockFill == mBlockSteps) {
+        FlushBlock();
+    }
+}
+
+void ReplicateResultWriter::FlushBlock() {
+    if (mBlockFill == 0) {
+        return;
+    }
+    for (size_t c = 0; c < mChannels; ++c) {
+        const double* chunk = &mBlock[c * mBlockSteps];
+        if (mSparse && WriteSparse(chunk)) {
+            continue;
+        }
+        if (mpPool) {
+            unsigned long long offset = mpPool->Place(chunk, mBlockFill);
+            if (offset != 0) {
+                mTable.push_back(offset | gPoolChunkFlag);
+                continue;
+            }
+        }
+        mTable.push_back((unsigned long long)mFile.tellp());
+        mFile.write((const char*)chunk, mBlockFill * sizeof(double));
+    }
+    mBlockFill = 0;
+}
+
+bool ReplicateResultWriter::WriteSparse(const double* apChunk) {
+    // give up as soon as the chunk has too many changes to be worth it
+    const size_t dense = mBlockFill * sizeof(double);
+    mChangeSteps.clear();
+    mChangeSteps.push_back(0);
+    for (unsigned i = 1; i < mBlockFill; ++i) {
+        if (!SameBits(apChunk[i], apChunk[i - 1])) {
+            mChangeSteps.push_back(i);
+            if (SparseChunkBytes(mChangeSteps.size()) >= dense) {
+                return false;
+            }
+        }
+    }
+    const size_t changes = mChangeSteps.size();
+    const size_t bytes = SparseChunkBytes(changes);
+    if (bytes >= dense) {
+        return false;
+    }
+
+    mTable.push_back((unsigned long long)mFile.tellp() | gSparseChunkFlag);
+    unsigned long long count = changes;
+    mFile.write((const char*)&count, sizeof(count));
+    for (size_t j = 0; j < changes; ++j) {
+        mFile.write((const char*)&apChunk[mChangeSteps[j]], sizeof(double));
+    }
+    mFile.write((const char*)&mChangeSteps[0], changes * sizeof(unsigned));
+    for (size_t pad = sizeof(count) + changes * (sizeof(double) + sizeof(unsigned));
+         pad < bytes; ++pad) {
+        mFile.put('\0');
+    }
+    ++mSparseChunks;
+    mSparseBytesSaved += dense - bytes;
+    return true;
+}
+
+void ReplicateResultWriter::Close() {
+    if (mClosed) {
+        return;
+    }
+    mClosed = true;
+    FlushBlock();
+
+    ResultFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.Magic, gResultFileMagic, sizeof(header.Magic));
+    header.Version = gResultFileVersion;
+    header.BlockSteps = mBlockSteps;
+    header.Channels = mChannels;
+    header.Steps = mSteps;
+    header.Replicate = mReplicate;
+    header.TableOffset = (unsigned long long)mFile.tellp();
+    header.PoolId = mpPool ? mpPool->Id() : 0;
+    if (!mTable.empty()) {
+        mFile.write((const char*)&mTable[0],
+            mTable.size() * sizeof(unsigned long long));
+    }
+    mFile.seekp(0);
+    mFile.write((const char*)&header, sizeof(header));
+    mFile.close();
+    if (!mFile) {
+        throw TemsimException("Error writing result file " + mFileName,
+            "ResultStore");
+    }
+    if (mpPool) {
+        // the result file is no use without the chunks it refers to
+        mpPool->Flush();
+    }
+    BOOST_LOGL(resultstore, info) << "Wrote " << mSteps << " steps of "
+        << mChannels << " channels to " << mFileName << std::endl;
+    if (mSparseChunks > 0) {
+        BOOST_LOGL(resultstore, info) << "  " << mSparseChunks
+            << " chunks stored sparse, saving " << mSparseBytesSaved
+            << " bytes" << std::endl;
+    }
+}
+
+ReplicateResultReader::ReplicateResultReader(const string& arFileName,
+                                             MappedResultPool::Ptr apPool)
+:   mFileName(arFileName),
+    mpPool(apPool)
+{
+    try {
+        mFile.open(arFileName);
+    } catch (std::exception& e) {
+        throw TemsimException("Couldn't map result file " + arFileName
+            + " (" + e.what() + ")", "ResultStore");
+    }
+
+    ResultFileHeader header;
+    if (mFile.size() < sizeof(header)) {
+        throw TemsimException("Result file " + arFileName + " is too short",
+            "ResultStore");
+    }
+    memcpy(&header, mFile.data(), sizeof(header));
+    if (memcmp(header.Magic, gResultFileMagic, sizeof(header.Magic)) != 0
+        || header.Version < gOldestResultFileVersion
+        || header.Version > gResultFileVersion || header.BlockSteps == 0) {
+        throw TemsimException("Result file " + arFileName
+            + " has the wrong format", "ResultStore");
+    }
+    mSteps = (size_t)header.Steps;
+    mBlockSteps = header.BlockSteps;
+    mReplicate = header.Replicate;
+
+    const char* p = mFile.data() + sizeof(header);
+    const char* end = mFile.data() + mFile.size();
+    mNames.resize((size_t)header.Channels);
+    for (size_t c = 0; c < mNames.size(); ++c) {
+        unsigned length;
+        if (end - p < (ptrdiff_t)sizeof(length)) {
+            throw TemsimException("Result file " + arFileName
+                + " is truncated", "ResultStore");
+        }
+        memcpy(&length, p, sizeof(length));
+        p += sizeof(length);
+        if ((size_t)(end - p) < length) {
+            throw TemsimException("Result file " + arFileName
+                + " is truncated", "ResultStore");
+        }
+        mNames[c].assign(p, length);
+        p += length;
+    }
+
+    size_t table_size = Blocks() * Channels();
+    if (header.TableOffset % sizeof(unsigned long long) != 0
+        || mFile.size() < header.TableOffset + table_size * sizeof(unsigned long long)) {
+        throw TemsimException("Result file " + arFileName
+            + " is truncated", "ResultStore");
+    }
+    mpTable = (const unsigned long long*)(mFile.data() + header.TableOffset);
+
+    if (mpPool && mpPool->Id() != header.PoolId) {
+        throw TemsimException("Result file " + arFileName
+            + " wasn't written with the chunk pool given", "ResultStore");
+    }
+    for (size_t i = 0; i < table_size; ++i) {
+        unsigned long long offset = mpTable[i] & ~(gPoolChunkFlag | gSparseChunkFlag);
+        size_t length = BlockLength(i / Channels());
+        size_t end = offset + length * sizeof(double);
+        if (mpTable[i] & gSparseChunkFlag) {
+            // the changes must be in the file and in order
+            unsigned long long count = 0;
+            if (!(mpTable[i] & gPoolChunkFlag) && offset % sizeof(double) == 0
+                && offset + sizeof(count) <= header.TableOffset) {
+                memcpy(&count, mFile.data() + offset, sizeof(count));
+            }
+            if (count == 0 || count > length
+                || offset + SparseChunkBytes((size_t)count) > header.TableOffset) {
+                throw TemsimException("Result file " + arFileName
+                    + " has a bad sparse chunk", "ResultStore");
+            }
+            const unsigned* steps;
+            const double* values;
+            SparseChunk(i / Channels(), i % Channels(), steps, values);
+            for (size_t j = 0; j < count; ++j) {
+                bool ordered = j == 0 ? steps[j] == 0
+                    : (steps[j] > steps[j - 1] && steps[j] < length);
+                if (!ordered) {
+                    throw TemsimException("Result file " + arFileName
+                        + " has a bad sparse chunk", "ResultStore");
+                }
+            }
+        } else if (!(mpTable[i] & gPoolChunkFlag)) {
+            if (end > header.TableOffset) {
+                throw TemsimException("Result file " + arFileName
+                    + " has a bad chunk table", "ResultStore");
+            }
+        } else if (!mpPool) {
+            throw TemsimException("Result file " + arFileName
+                + " needs its chunk pool", "ResultStore");
+        } else if (end > mpPool->Size()) {
+            throw TemsimException("Result file " + arFileName
+                + " refers past the end of its chunk pool", "ResultStore");
+        }
+    }
+}
+
+size_t ReplicateResultReader::FindChannel(const string& arName) const {
+    return std::find(mNames.begin(), mNames.end(), arName) - mNames.begin();
+}
+
+size_t ReplicateResultReader::BlockLength(size_t aBlock) const {
+    return std::min(mBlockSteps, mSteps - aBlock * mBlockSteps);
+}
+
+const double* ReplicateResultReader::Chunk(size_t aBlock, size_t aChannel) const {
+    unsigned long long offset = mpTable[aBlock * Channels() + aChannel];
+    if (offset & gSparseChunkFlag) {
+        throw TemsimException("Chunk of result file " + mFileName
+            + " is sparse", "ResultStore");
+    }
+    if (offset & gPoolChunkFlag) {
+        return (const double*)(mpPool->Data() + (offset & ~gPoolChunkFlag));
+    }
+    return (const double*)(mFile.data() + offset);
+}
+
+bool ReplicateResultReader::IsSparse(size_t aBlock, size_t aChannel) const {
+    return (mpTable[aBlock * Channels() + aChannel] & gSparseChunkFlag) != 0;
+}
+
+size_t ReplicateResultReader::SparseChunk(size_t aBlock, size_t aChannel,
+                                          const unsigned*& arSteps,
+                                          const double*& arValues) const {
+    unsigned long long offset = mpTable[aBlock * Channels() + aChannel] & ~gSparseChunkFlag;
+    const char* p = mFile.data() + offset;
+    unsigned long long count;
+    memcpy(&count, p, sizeof(count));
+    arValues = (const double*)(p + sizeof(count));
+    arSteps = (const unsigned*)(arValues + count);
+    return (size_t)count;
+}
+
+void ReplicateResultReader::ChunkBytes(size_t aBlock, size_t aChannel,
+                                       const char*& arStart, const char*& arEnd) const {
+    if (IsSparse(aBlock, aChannel)) {
+        const unsigned* steps;
+        const double* values;
+        size_t count = SparseChunk(aBlock, aChannel, steps, values);
+        arStart = (const char*)values - sizeof(unsigned long long);
+        arEnd = arStart + SparseChunkBytes(count);
+    } else {
+        const double* chunk = Chunk(aBlock, aChannel);
+        arStart = (const char*)chunk;
+        arEnd = (const char*)(chunk + BlockLength(aBlock));
+    }
+}
+
+double ReplicateResultReader::Value(size_t aChannel, size_t aStep) const {
+    if (aStep >= mSteps) {
+        throw TemsimException("Read past the end of result file " + mFileName,
+            "ResultStore");
+    }
+    size_t block = aStep / mBlockSteps;
+    size_t offset = aStep % mBlockSteps;
+    if (!IsSparse(block, aChannel)) {
+        return Chunk(block, aChannel)[offset];
+    }
+    const unsigned* steps;
+    const double* values;
+    size_t count = SparseChunk(block, aChannel, steps, values);
+    size_t lower, upper;
+    NextIntervalInterp<unsigned, double>().Bracket(steps, count, (unsigned)offset,
+        lower, upper);
+    return values[lower];
+}
+
+void ReplicateResultReader::Read(size_t aChannel, size_t aFirstStep,
+                                 size_t aCount, double* apOut) const {
+    if (aFirstStep + aCount > mSteps) {
+        throw TemsimException("Read past the end of result file " + mFileName,
+            "ResultStore");
+    }
+    while (aCount > 0) {
+        size_t block = aFirstStep / mBlockSteps;
+        size_t offset = aFirstStep % mBlockSteps;
+        size_t n = std::min(aCount, BlockLength(block) - offset);
+        if (IsSparse(block, aChannel)) {
+            // each value runs to the next change
+            const unsigned* steps;
+            const double* values;
+            size_t count = SparseChunk(block, aChannel, steps, values);
+            size_t j, upper;
+            NextIntervalInterp<unsigned, double>().Bracket(steps, count,
+                (unsigned)offset, j, upper);
+            double* out = apOut;
+            for (size_t step = offset; step < offset + n; ++j) {
+                size_t next = j + 1 < count ? std::min((size_t)steps[j + 1], offset + n)
+                    : offset + n;
+                out = std::fill_n(out, next - step, values[j]);
+                step = next;
+            }
+        } else {
+            const double* chunk = Chunk(block, aChannel) + offset;
+            std::copy(chunk, chunk + n, apOut);
+        }
+        apOut += n;
+        aFirstStep += n;
+        aCount -= n;
+    }
+}
+
+void ReplicateResultReader::ReadChanges(size_t aChannel, size_t aFirstStep, size_t aCount,
+                                        vector<unsigned long long>& arSteps,
+                                        vector<double>& arValues) const {
+    if (aFirstStep + aCount > mSteps) {
+        throw TemsimException("Read past the end of result file " + mFileName,
+            "ResultStore");
+    }
+    arSteps.clear();
+    arValues.clear();
+    while (aCount > 0) {
+        size_t block = aFirstStep / mBlockSteps;
+        size_t offset = aFirstStep % mBlockSteps;
+        size_t n = std::min(aCount, BlockLength(block) - offset);
+        const unsigned long long base = (unsigned long long)block * mBlockSteps;
+        if (IsSparse(block, aChannel)) {
+            const unsigned* steps;
+            const double* values;
+            size_t count = SparseChunk(block, aChannel, steps, values);
+            size_t j, upper;
+            NextIntervalInterp<unsigned, double>().Bracket(steps, count,
+                (unsigned)offset, j, upper);
+            for (; j < count && steps[j] < offset + n; ++j) {
+                if (arValues.empty() || !SameBits(values[j], arValues.back())) {
+                    arSteps.push_back(base + std::max((size_t)steps[j], offset));
+                    arValues.push_back(values[j]);
+                }
+            }
+        } else {
+            const double* chunk = Chunk(block, aChannel);
+            for (size_t step = offset; step < offset + n; ++step) {
+                if (arValues.empty() || !SameBits(chunk[step], arValues.back())) {
+                    arSteps.push_back(base + step);
+                    arValues.push_back(chunk[step]);
+                }
+            }
+        }
+        aFirstStep += n;
+        aCount -= n;
+    }
+}
+
+void ReplicateResultReader::Release(size_t aFirstBlock, size_t aLastBlock) const {
+    if (aFirstBlock > aLastBlock || aLastBlock >= Blocks()) {
+        return;
+    }
+    // the file's own chunks of consecutive blocks are in order, so release
+    // everything from the first to the last of them
+    const char* start = 0;
+    const char* end = 0;
+    for (size_t b = aFirstBlock; b <= aLastBlock; ++b) {
+        for (size_t c = 0; c < Channels(); ++c) {
+            if (mpTable[b * Channels() + c] & gPoolChunkFlag) {
+                continue;
+            }
+            const char* chunk_start;
+            const char* chunk_end;
+            ChunkBytes(b, c, chunk_start, chunk_end);
+            if (!start) {
+                start = chunk_start;
+            }
+            end = chunk_end;
+        }
+    }
+    if (start) {
+        AdviseDontNeed(start, end - start);
+    }
+}
+
@@ -0,0 +1,340 @@
+#ifndef _RESULTSTORE_HPP_
+#define _RESULTSTORE_HPP_
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <fstream>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/log/log.hpp>
+
+#include "hugepagealloc.hpp"
+#include "interp.hpp"
+#include "logging.hpp"
+
+using std::string;
+using std::vector;
+using std::set;
+
+/// declare the boost logging stuff.
+BOOST_DECLARE_LOG(resultstore)
+
+/**
+\file
+Stored replicate results. Each replicate's bookkeeping channels (one double
+per channel per step) are written to a file of their own, divided into
+blocks of a fixed number of steps. Within a block each channel's values are
+stored contiguously as a chunk, and the chunks of a block are stored
+together, so the results for a range of steps can be read without touching
+the rest of the file.
+
+File layout (all integers little-endian as written by the host):
+- ResultFileHeader
+- channel names, each a 32 bit length followed by the characters
+- chunks, block by block, channel by channel
+- chunk table: one 64 bit file offset per (block, channel)
+
+The chunk table is at the end so the file can be written in one pass; the
+header records where it is.
+
+Many channels are the same in every replicate (deterministic inputs, fixed
+schedules), so writers can share a ResultChunkPool, a study-wide file of
+chunks identified by a hash of their contents. A chunk that is already in the
+pool isn't written again; the replicate's chunk table refers to the pool copy
+instead, with the top bit of the offset set. Such a replicate can only be read
+with the pool (see MappedResultPool.)
+
+Many other channels change rarely (unit status, rule modes, tariff bands).
+A chunk with few changes is stored sparse, as the steps at which its value
+changes and the values from then on, when that is smaller than storing every
+step; the chunk table marks it with the second bit of its offset. The choice
+is made for each chunk from the number of changes it has, so a channel that
+is busy in some blocks and quiet in others gets the cheaper form for each.
+A sparse chunk is laid out as:
+- 64 bit number of changes, n (at least 1: the value at the block's first step)
+- n values
+- n 32 bit steps within the block, ascending from 0, padded to 8 bytes
+
+A value holds until the next change, as with NextIntervalInterp, which the
+reader uses to look up a step in a sparse chunk.
+*/
+
+/// header of a replicate result file
+struct ResultFileHeader {
+    char        Magic[8];       ///< "TRESULT1"
+    unsigned    Version;        ///< format version
+    unsigned    BlockSteps;     ///< steps per block
+    unsigned long long Channels;    ///< number of channels
+    unsigned long long Steps;       ///< number of steps recorded
+    long long   Replicate;      ///< replicate number
+    unsigned long long TableOffset; ///< file offset of the chunk table
+    unsigned long long PoolId;      ///< Id() of the chunk pool used, or 0
+};
+
+/// header of a chunk pool file, which is followed by the chunks, each
+/// preceded by its 64 bit hash and its 64 bit length in values.
+struct ResultPoolHeader {
+    char        Magic[8];       ///< "TRPOOL01"
+    unsigned long long Id;      ///< identifies the pool to the result files
+};
+
+/// magic string at the start of a result file
+extern const char* gResultFileMagic;
+/// magic string at the start of a chunk pool file
+extern const char* gResultPoolMagic;
+/// chunk table offsets with this bit set are offsets into the pool
+extern const unsigned long long gPoolChunkFlag;
+/// chunk table offsets with this bit set are of sparse chunks
+extern const unsigned long long gSparseChunkFlag;
+
+/// 64 bit FNV-1a hash of a chunk's bytes.
+unsigned long long HashResultChunk(const double* apValues, size_t aCount);
+
+/**
+Study-wide store of the chunks common to several replicates. Chunks are
+offered to the pool by the writers as they are flushed:
+- a chunk already in the pool is referred to, not written;
+- a chunk seen once before, but not yet in the pool, is added to it, so the
+  first replicate that had it keeps its own copy and every later one shares;
+- any other chunk is noted and left for the writer to store itself.
+
+So replicate-specific chunks stay in the replicate files, and a chunk that
+is the same in every replicate is stored twice rather than once per
+replicate. Chunks are only shared when their contents are equal, not just
+their hashes.
+
+The pool may be shared by writers in several threads; a pool file must only
+be written by one process at a time. Reopening an existing pool file adds to
+it, so a study can be continued.
+*/
+class ResultChunkPool : boost::noncopyable {
+public:
+    typedef boost::shared_ptr<ResultChunkPool> Ptr;
+
+    /// Open a pool file, creating it if necessary.
+    /// @param arFileName the pool file.
+    /// @param aMaxSightings the number of single sightings to remember; a
+    /// chunk first seen after this many can't be pooled.
+    ResultChunkPool(const string& arFileName, size_t aMaxSightings = 1 << 22);
+
+    /// Offer a chunk to the pool.
+    /// @returns the offset of the pooled copy, or 0 if the caller should
+    /// store the chunk itself.
+    unsigned long long Place(const double* apValues, size_t aCount);
+
+    /// Write buffered chunks to the file.
+    void Flush();
+
+    /// Identifies the pool file.
+    unsigned long long Id() const { return mId; }
+    /// Number of chunks in the pool.
+    size_t Chunks() const {
+        boost::mutex::scoped_lock lock(mMutex);
+        return mIndex.size();
+    }
+    /// Number of chunks that didn't have to be written because they were
+    /// already in the pool.
+    unsigned long long ChunksShared() const {
+        boost::mutex::scoped_lock lock(mMutex);
+        return mShared;
+    }
+    /// Number of bytes not written because chunks were already in the pool.
+    unsigned long long BytesSaved() const {
+        boost::mutex::scoped_lock lock(mMutex);
+        return mBytesSaved;
+    }
+
+private:
+    /// true if the pooled chunk at aOffset holds the given values
+    bool Matches(unsigned long long aOffset, const double* apValues, size_t aCount);
+
+    string              mFileName;
+    std::fstream        mFile;
+    unsigned long long  mId;
+    unsigned long long  mEnd;       ///< size of the file
+    /// pooled chunks by hash: (offset, length) - a multimap in case of
+    /// collisions
+    std::multimap<unsigned long long, std::pair<unsigned long long, size_t> > mIndex;
+    set<unsigned long long> mSightings; ///< hashes of chunks seen once
+    size_t              mMaxSightings;
+    unsigned long long  mShared;
+    unsigned long long  mBytesSaved;
+    mutable boost::mutex mMutex;
+};
+
+/// Read-only mapping of a chunk pool, shared by the readers of a study.
+class MappedResultPool : boost::noncopyable {
+public:
+    typedef boost::shared_ptr<MappedResultPool> Ptr;
+
+    /// Map a pool file.
+    MappedResultPool(const string& arFileName);
+
+    /// Identifies the pool file.
+    unsigned long long Id() const { return mId; }
+    /// Start of the mapping.
+    const char* Data() const { return mFile.data(); }
+    /// Size of the mapping.
+    size_t Size() const { return mFile.size(); }
+
+private:
+    boost::iostreams::mapped_file_source mFile;
+    unsigned long long  mId;
+};
+
+/**
+Writes one replicate's results. Values are buffered a block at a time, so
+memory use is Channels x BlockSteps doubles however long the run.
+*/
+class ReplicateResultWriter : boost::noncopyable {
+public:
+    typedef boost::shared_ptr<ReplicateResultWriter> Ptr;
+
+    /// Create the result file.
+    /// @param arFileName the file to write.
+    /// @param arChannels the channel names, eg. "Storage.Great_Lake.Volume".
+    /// @param aReplicate the replicate number.
+    /// @param aBlockSteps number of steps per block.
+    /// @param apPool the study's chunk pool, if any.
+    /// @param aSparse store chunks with few changes sparse.
+    ReplicateResultWriter(const string& arFileName,
+                          const vector<string>& arChannels,
+                          long long aReplicate,
+                          unsigned aBlockSteps = 4096,
+                          ResultChunkPool::Ptr apPool = ResultChunkPool::Ptr(),
+                          bool aSparse = true);
+
+    /// Closes the file if Close() hasn't been called.
+    ~ReplicateResultWriter();
+
+    /// Record one step.
+    /// @param apValues one value per channel, in channel order.
+    void Record(const double* apValues);
+
+    /// Write any buffered values and the chunk table and close the file.
+    void Close();
+
+    /// Number of steps recorded so far.
+    unsigned long long Steps() const { return mSteps; }
+
+    /// Number of chunks stored sparse so far.
+    unsigned long long SparseChunks() const { return mSparseChunks; }
+    /// Number of bytes saved by storing chunks sparse.
+    unsigned long long SparseBytesSaved() const { return mSparseBytesSaved; }
+
+private:
+    /// write the buffered block
+    void FlushBlock();
+    /// write a chunk sparse if that is smaller
+    /// @returns true if it was written.
+    bool WriteSparse(const double* apChunk);
+
+    string          mFileName;
+    std::ofstream   mFile;
+    size_t          mChannels;      ///< number of channels
+    unsigned        mBlockSteps;    ///< steps per block
+    long long       mReplicate;
+    vector<double, HugePageAllocator<double> > mBlock; ///< channel-major buffer for one block
+
+    unsigned        mBlockFill;     ///< steps in the buffer
+    unsigned long long mSteps;      ///< steps recorded
+    vector<unsigned long long> mTable; ///< offsets of the chunks written
+    ResultChunkPool::Ptr mpPool;    ///< shared chunks, or NULL
+    bool            mClosed;
+    bool            mSparse;        ///< store chunks sparse where smaller
+    vector<unsigned> mChangeSteps;  ///< scratch: the changes of a chunk
+    unsigned long long mSparseChunks;
+    unsigned long long mSparseBytesSaved;
+};
+
+/**
+Read access to one replicate's results through a memory mapping.
+*/
+class ReplicateResultReader : boost::noncopyable {
+public:
+    typedef boost::shared_ptr<ReplicateResultReader> Ptr;
+
+    /// Map a result file.
+    /// @param arFileName the file.
+    /// @param apPool the chunk pool the file was written with, if any.
+    ReplicateResultReader(const string& arFileName,
+                          MappedResultPool::Ptr apPool = MappedResultPool::Ptr());
+
+    /// Number of channels.
+    size_t Channels() const { return mNames.size(); }
+    /// Channel names, in channel order.
+    const vector<string>& ChannelNames() const { return mNames; }
+    /// Index of a channel, or Channels() if there's no such channel.
+    size_t FindChannel(const string& arName) const;
+    /// Number of steps recorded.
+    size_t Steps() const { return mSteps; }
+    /// Steps per block.
+    size_t BlockSteps() const { return mBlockSteps; }
+    /// Number of blocks.
+    size_t Blocks() const { return (mSteps + mBlockSteps - 1) / mBlockSteps; }
+    /// Replicate number.
+    long long Replicate() const { return mReplicate; }
+
+    /// One channel's values for one block (BlockLength(aBlock) values.)
+    /// Throws for a sparse chunk, which has no such array; use Read().
+    const double* Chunk(size_t aBlock, size_t aChannel) const;
+
+    /// True if a chunk is stored sparse.
+    bool IsSparse(size_t aBlock, size_t aChannel) const;
+
+    /// The changes of a sparse chunk.
+    /// @param arSteps receives the steps within the block at which the
+    /// value changes, ascending from 0.
+    /// @param arValues receives the value from each of those steps.
+    /// @returns the number of changes.
+    size_t SparseChunk(size_t aBlock, size_t aChannel,
+                       const unsigned*& arSteps, const double*& arValues) const;
+
+    /// One channel's value at one step.
+    double Value(size_t aChannel, size_t aStep) const;
+
+    /// Number of steps in a block (the last block may be short.)
+    size_t BlockLength(size_t aBlock) const;
+
+    /// Copy a range of one channel's values, across blocks if necessary.
+    /// @param aChannel the channel.
+    /// @param aFirstStep the first step to copy.
+    /// @param aCount the number of steps to copy.
+    /// @param apOut receives aCount values.
+    void Read(size_t aChannel, size_t aFirstStep, size_t aCount, double* apOut) const;
+
+    /// The changes in a range of one channel's values, as points of a next
+    /// interval series: the value at a step is that of the last point at or
+    /// before it. There is always a point at aFirstStep.
+    /// @param arSteps receives the steps at which the value changes.
+    /// @param arValues receives the value from each of those steps.
+    void ReadChanges(size_t aChannel, size_t aFirstStep, size_t aCount,
+                     vector<unsigned long long>& arSteps,
+                     vector<double>& arValues) const;
+
+    /// Tell the OS the given blocks won't be read again soon. Chunks in the
+    /// pool are left alone, as other replicates share them.
+    void Release(size_t aFirstBlock, size_t aLastBlock) const;
+
+private:
+    /// the bytes a chunk takes in the mapping
+    void ChunkBytes(size_t aBlock, size_t aChannel,
+                    const char*& arStart, const char*& arEnd) const;
+
+    string          mFileName;
+    boost::iostreams::mapped_file_source mFile;
+    vector<string>  mNames;
+
+    size_t          mSteps;
+    size_t          mBlockSteps;
+    long long       mReplicate;
+    const unsigned long long* mpTable;  ///< chunk offsets in the mapping
+    MappedResultPool::Ptr mpPool;   ///< shared chunks, or NULL
+};
+
+#endif
@@ -0,0 +1,291 @@
+#include "rngfleet.hpp"
+
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+\file
+Implementation of the fleet of random number generators.
+*/
+
+string RNGFleet::class_name("RNGFleet");
+const size_t RNGFleet::StateWords;
+const size_t RNGFleet::BlockLanes;
+
+// Mersenne Twister (MT19937) parameters
+static const RNGFleet::Word gUpperMask = 0x80000000U;
+static const RNGFleet::Word gLowerMask = 0x7fffffffU;
+static const RNGFleet::Word gMatrix = 0x9908b0dfU;
+static const size_t gShift = 397;
+
+RNGFleet::RNGFleet(const string& arName)
+:   instance_name(arName),
+    mLanes(0),
+    mStride(0),
+    mInStep(true),
+    mCommon(StateWords),
+    mFreshCount(0),
+    mBlockSteps(0),
+    mLaneSteps(0)
+{
+}
+
+RNGFleet::Ptr RNGFleet::ForRegister(ObjectRegister& arReg) {
+    string key = RegisterString(class_name, "fleet");
+    RNGFleet::Ptr fleet;
+    if (arReg.HasKey(key)) {
+        arReg.Get(key, fleet);
+    } else {
+        fleet.reset(new RNGFleet("fleet"));
+        arReg.Set(key, fleet);
+    }
+    return fleet;
+}
+
+RNGFleet::Lane RNGFleet::AddLane(int aSeed) {
+    if (mLanes == mStride) {
+        // widen the rows; lanes past mLanes are never read
+        size_t stride = std::max(BlockLanes, mStride * 2);
+        vector<Word> state(StateWords * stride, 0);
+        for (size_t i = 0; i < StateWords; ++i) {
+            std::copy(mState.begin() + i * mStride, mState.begin() + (i + 1) * mStride,
+                state.begin() + i * stride);
+        }
+        mState.swap(state);
+        mStride = stride;
+        mPosition.resize(stride, StateWords);
+        mSlots.resize(stride, 0);
+        mFresh.resize(stride, 0);
+    }
+    Lane lane = mLanes++;
+    Seed(lane, aSeed);
+    return lane;
+}
+
+void RNGFleet::Seed(Lane aLane, int aSeed) {
+    Word* state = &mState[aLane];
+    // as boost::mt19937::seed
+    Word x = (Word)aSeed;
+    state[0] = x;
+    for (size_t i = 1; i < StateWords; ++i) {
+        x = 1812433253U * (x ^ (x >> 30)) + (Word)i;
+        state[i * mStride] = x;
+    }
+    Word y0 = state[(gShift - 1) * mStride] ^ state[(StateWords - 1) * mStride];
+    y0 = (y0 & gUpperMask) ? ((y0 ^ gMatrix) << 1) | 1 : y0 << 1;
+    state[0] = (state[0] & gUpperMask) | (y0 & gLowerMask);
+
+    LeaveStep();
+    mPosition[aLane] = StateWords;
+    if (mFresh[aLane]) {
+        mFresh[aLane] = 0;
+        --mFreshCount;
+    }
+}
+
+RNGFleet::Word RNGFleet::Refill(Lane aLane) {
+    if (mFreshCount == 0) {
+        // every lane has taken its value, so refill them all together
+        Advance();
+        mFresh[aLane] = 0;
+        --mFreshCount;
+        return mSlots[aLane];
+    }
+    LeaveStep();
+    ++mLaneSteps;
+    return StepLane(aLane);
+}
+
+void RNGFleet::LeaveStep() {
+    if (mInStep) {
+        std::fill(mPosition.begin(), mPosition.end(), mCommon);
+        mInStep = false;
+    }
+}
+
+// the words of the state that word i of the twist combines, without a
+// division for every word
+static inline size_t NextWord(size_t i) {
+    return i + 1 < 624 ? i + 1 : 0;
+}
+static inline size_t FarWord(size_t i) {
+    return i < 624 - gShift ? i + gShift : i + gShift - 624;
+}
+
+// one word of the twist of a lane whose words are aStride apart
+static inline void TwistWord(RNGFleet::Word* apState, size_t aStride, size_t i) {
+    RNGFleet::Word y = (apState[i * aStride] & gUpperMask)
+        | (apState[NextWord(i) * aStride] & gLowerMask);
+    apState[i * aStride] = apState[FarWord(i) * aStride]
+        ^ (y >> 1) ^ ((y & 1) ? gMatrix : 0);
+}
+
+// temper a state word into an output
+static inline RNGFleet::Word Temper(RNGFleet::Word y) {
+    y ^= y >> 11;
+    y ^= (y << 7) & 0x9d2c5680U;
+    y ^= (y << 15) & 0xefc60000U;
+    y ^= y >> 18;
+    return y;
+}
+
+#ifdef __SSE2__
+// one word of the twist of four lanes whose words are aStride apart
+static inline void TwistRow(RNGFleet::Word* apState, size_t aStride, size_t i) {
+    const __m128i upper = _mm_set1_epi32((int)gUpperMask);
+    const __m128i lower = _mm_set1_epi32((int)gLowerMask);
+    const __m128i matrix = _mm_set1_epi32((int)gMatrix);
+    const __m128i one = _mm_set1_epi32(1);
+    __m128i* row = (__m128i*)(apState + i * aStride);
+    __m128i next = _mm_loadu_si128((const __m128i*)(apState + NextWord(i) * aStride));
+    __m128i far = _mm_loadu_si128((const __m128i*)(apState + FarWord(i) * aStride));
+    __m128i y = _mm_or_si128(_mm_and_si128(_mm_loadu_si128(row), upper),
+        _mm_and_si128(next, lower));
+    // the matrix where the low bit is set: 0 - 1 is all ones
+    __m128i mag = _mm_and_si128(
+        _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(y, one)), matrix);
+    _mm_storeu_si128(row, _mm_xor_si128(_mm_xor_si128(far, _mm_srli_epi32(y, 1)), mag));
+}
+
+// temper four state words into outputs
+static inline void TemperRow(const RNGFleet::Word* apState, RNGFleet::Word* apOut) {
+    __m128i y = _mm_loadu_si128((const __m128i*)apState);
+    y = _mm_xor_si128(y, _mm_srli_epi32(y, 11));
+    y = _mm_xor_si128(y, _mm_and_si128(_mm_slli_epi32(y, 7), _mm_set1_epi32((int)0x9d2c5680U)));
+    y = _mm_xor_si128(y, _mm_and_si128(_mm_slli_epi32(y, 15), _mm_set1_epi32((int)0xefc60000U)));
+    y = _mm_xor_si128(y, _mm_srli_epi32(y, 18));
+    _mm_storeu_si128((__m128i*)apOut, y);
+}
+#endif
+
+void RNGFleet::AdvanceInStep() {
+    const size_t blocks = (mLanes + BlockLanes - 1) / BlockLanes;
+    if (mCommon >= StateWords) {
+        // twist row by row, so the state is read in order
+        for (size_t i = 0; i < StateWords; ++i) {
+#ifdef __SSE2__
+            for (size_t b = 0; b < blocks; ++b) {
+                TwistRow(&mState[b * BlockLanes], mStride, i);
+            }
+#else
+            for (size_t lane = 0; lane < mLanes; ++lane) {
+                TwistWord(&mState[lane], mStride, i);
+            }
+#endif
+        }
+        mCommon = 0;
+    }
+    const Word* row = &mState[mCommon * mStride];
+#ifdef __SSE2__
+    for (size_t b = 0; b < blocks; ++b) {
+        TemperRow(row + b * BlockLanes, &mSlots[b * BlockLanes]);
+    }
+#else
+    for (size_t lane = 0; lane < mLanes; ++lane) {
+        mSlots[lane] = Temper(row[lane]);
+    }
+#endif
+    ++mCommon;
+    mBlockSteps += blocks;
+}
+
+void RNGFleet::Advance() {
+    if (mInStep && mFreshCount == 0) {
+        AdvanceInStep();
+        std::fill(mFresh.begin(), mFresh.begin() + mLanes, 1);
+        mFreshCount = mLanes;
+        return;
+    }
+    LeaveStep();
+
+    // advance lanes four at a time where they are in step, and one at a time
+    // where they aren't
+    const size_t blocks = (mLanes + BlockLanes - 1) / BlockLanes;
+    mBlocks.clear();
+    for (size_t b = 0; b < blocks; ++b) {
+        const size_t first = b * BlockLanes;
+        const size_t used = std::min(BlockLanes, mLanes - first);
+        bool in_step = true;
+        for (size_t k = 0; k < used; ++k) {
+            if (mFresh[first + k] || mPosition[first + k] != mPosition[first]) {
+                in_step = false;
+            }
+        }
+#ifdef __SSE2__
+        if (in_step) {
+            // the unused lanes just follow along
+            for (size_t k = used; k < BlockLanes; ++k) {
+                mPosition[first + k] = mPosition[first];
+            }
+            mBlocks.push_back(b);
+            continue;
+        }
+#endif
+        for (size_t k = 0; k < used; ++k) {
+            if (!mFresh[first + k]) {
+                mSlots[first + k] = StepLane(first + k);
+                ++mLaneSteps;
+            }
+        }
+    }
+
+#ifdef __SSE2__
+    bool twist = false;
+    for (size_t j = 0; j < mBlocks.size(); ++j) {
+        twist = twist || mPosition[mBlocks[j] * BlockLanes] >= StateWords;
+    }
+    if (twist) {
+        for (size_t i = 0; i < StateWords; ++i) {
+            for (size_t j = 0; j < mBlocks.size(); ++j) {
+                const size_t first = mBlocks[j] * BlockLanes;
+                if (mPosition[first] >= StateWords) {
+                    TwistRow(&mState[first], mStride, i);
+                }
+            }
+        }
+    }
+    for (size_t j = 0; j < mBlocks.size(); ++j) {
+        const size_t first = mBlocks[j] * BlockLanes;
+        size_t position = mPosition[first] >= StateWords ? 0 : mPosition[first];
+        TemperRow(&mState[position * mStride + first], &mSlots[first]);
+        for (size_t k = 0; k < BlockLanes; ++k) {
+            mPosition[first + k] = position + 1;
+        }
+    }
+    mBlockSteps += mBlocks.size();
+#endif
+
+    for (size_t lane = 0; lane < mLanes; ++lane) {
+        if (!mFresh[lane]) {
+            mFresh[lane] = 1;
+            ++mFreshCount;
+        }
+    }
+
+    // back in step if every lane is at the same place (as they are when
+    // they were all seeded since the last refill)
+    mInStep = true;
+    for (size_t lane = 1; lane < mLanes; ++lane) {
+        if (mPosition[lane] != mPosition[0]) {
+            mInStep = false;
+            break;
+        }
+    }
+    if (mInStep) {
+        mCommon = mLanes > 0 ? mPosition[0] : StateWords;
+    }
+}
+
+RNGFleet::Word RNGFleet::StepLane(Lane aLane) {
+    if (mPosition[aLane] >= StateWords) {
+        Word* state = &mState[aLane];
+        for (size_t i = 0; i < StateWords; ++i) {
+            TwistWord(state, mStride, i);
+        }
+        mPosition[aLane] = 0;
+    }
+    return Temper(mState[mPosition[aLane]++ * mStride + aLane]);
+}
@@ -0,0 +1,154 @@
+#ifndef _RNGFLEET_HPP_
+#define _RNGFLEET_HPP_
+
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
+
+#include "objectregister.hpp"
+
+using std::string;
+using std::vector;
+
+/**
+\file
+Random number sources advanced as a fleet. A model holds hundreds of random
+number objects, each with its own Mersenne Twister drawn from once or twice
+a step. An RNGFleet holds the states of many such generators side by side
+(one lane per generator) and advances them together: word i of every
+generator's state is stored in row i, so drawing a value from every lane
+reads one contiguous row, and with SSE2 the twist and the tempering are done
+for four lanes at a time.
+
+Each lane produces exactly the sequence a boost::mt19937 seeded with the
+same value would, so a generator keeps its own stream whether it is in the
+fleet or not. The fleet draws one word ahead for every lane into a slot;
+Next() takes the lane's slot, and once every lane has taken its slot the
+next call refills all of them at once. A lane asked for more than one value
+between refills is advanced on its own, and drops out of step with the
+other lanes until it is next seeded (lanes seeded together at the start of
+a rep are back in step.)
+
+LaneEngine adapts a lane to the boost random engine interface, so any boost
+distribution can draw from it. Most (boost::normal_distribution among them)
+take a varying number of words per value, which puts the lane out of step,
+so values drawn every step are better made from one word each, as
+RandomNormal does:
+@code
+RNGFleet::Ptr fleet = RNGFleet::ForRegister(reg);
+RNGFleet::Lane lane = fleet->AddLane(seed);
+boost::normal_distribution<double> normal(0.0, 1.0);
+RNGFleet::LaneEngine engine(*fleet, lane);
+double x = normal(engine);
+@endcode
+
+A fleet isn't thread safe: each simulation (ObjectRegister) has its own.
+*/
+class RNGFleet {
+public:
+    // standard stuff for object register -----------------------------
+    static string class_name;
+    virtual const string& ClassName() const { return class_name; }
+    string instance_name;
+    const string& Name() { return instance_name; }
+    // -----------------------------------------------------------------
+
+    typedef boost::shared_ptr<RNGFleet> Ptr;
+    /// Identifies a generator in the fleet.
+    typedef size_t Lane;
+    /// The generators' output.
+    typedef boost::uint32_t Word;
+
+    /// A lane of a fleet, as a boost random number engine.
+    class LaneEngine {
+    public:
+        typedef Word result_type;
+        static const bool has_fixed_range = false;
+
+        LaneEngine(RNGFleet& arFleet, Lane aLane)
+        :   mpFleet(&arFleet), mLane(aLane) {}
+
+        static result_type min() { return 0; }
+        static result_type max() { return 0xffffffffU; }
+        result_type operator()() { return mpFleet->Next(mLane); }
+
+    private:
+        RNGFleet*   mpFleet;
+        Lane        mLane;
+    };
+
+    RNGFleet(const string& arName = "fleet");
+    virtual ~RNGFleet() {}
+
+    /// The fleet shared by the generators of a simulation, made the first
+    /// time it is asked for.
+    static Ptr ForRegister(ObjectRegister& arReg);
+
+    /// Add a generator.
+    /// @param aSeed its seed.
+    /// @returns its lane.
+    Lane AddLane(int aSeed = 1);
+
+    /// Number of generators.
+    size_t Lanes() const { return mLanes; }
+
+    /// Seed a generator, as boost::mt19937::seed would.
+    void Seed(Lane aLane, int aSeed);
+
+    /// The next output of a generator.
+    Word Next(Lane aLane) {
+        if (mFresh[aLane]) {
+            mFresh[aLane] = 0;
+            --mFreshCount;
+            return mSlots[aLane];
+        }
+        return Refill(aLane);
+    }
+
+    /// The next output of a generator as a uniform value in [0, 1), as
+    /// boost::uniform_real<double>(0, 1) gives from a boost::mt19937.
+    double Uniform(Lane aLane) {
+        return (double)Next(aLane) * (1.0 / 4294967296.0);
+    }
+
+    /// Refill the slot of every lane that has taken its value. Called by
+    /// Next() when all the lanes have, so there is no need to call it.
+    void Advance();
+
+    /// Number of times lanes were advanced four at a time.
+    unsigned long long BlockSteps() const { return mBlockSteps; }
+    /// Number of times a lane was advanced on its own.
+    unsigned long long LaneSteps() const { return mLaneSteps; }
+
+private:
+    /// words of state of each generator
+    static const size_t StateWords = 624;
+    /// lanes advanced together with SSE2
+    static const size_t BlockLanes = 4;
+
+    /// take a value when the lane's slot is empty
+    Word Refill(Lane aLane);
+    /// advance a single lane
+    Word StepLane(Lane aLane);
+    /// advance every lane, when they are all in step
+    void AdvanceInStep();
+    /// note that the lanes are no longer all in step
+    void LeaveStep();
+
+    size_t              mLanes;
+    size_t              mStride;    ///< lanes in a row of state (a multiple of BlockLanes)
+    vector<Word>        mState;     ///< StateWords rows of mStride lanes
+    bool                mInStep;    ///< true if every lane is at mCommon
+    size_t              mCommon;    ///< next state word of every lane, if in step
+    vector<size_t>      mPosition;  ///< next state word of each lane, if not
+    vector<Word>        mSlots;     ///< value drawn ahead for each lane
+    vector<char>        mFresh;     ///< true if the lane's slot hasn't been taken
+    size_t              mFreshCount;
+    vector<size_t>      mBlocks;    ///< scratch: blocks in step, for Advance()
+    unsigned long long  mBlockSteps;
+    unsigned long long  mLaneSteps;
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef _SERIESBUILDER_HPP_
+#define _SERIESBUILDER_HPP_
+
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+
+#include "interp.hpp"
+#include "hugepagealloc.hpp"
+
+using std::map;
+using std::vector;
+
+/**
+\file
+Append-optimised construction of series. Loading a series point by point
+into a std::map costs a tree search per point. A SeriesBuilder instead
+appends points to flat arrays and builds the map in a single pass at the
+end, using the end of the map as an insertion hint, which is amortised
+constant time per point when the keys arrive in order (as they almost
+always do.) Out-of-order input is sorted once before the map is built.
+
+The arrays come from the huge page allocator, as a large series load can
+run to many megabytes.
+*/
+
+template <typename KeyType, typename ValType>
+class SeriesBuilder {
+public:
+    typedef boost::shared_ptr<SeriesBuilder<KeyType, ValType> > Ptr;
+    typedef typename Interpolator<KeyType, ValType>::TSMap TSMap;
+    typedef vector<KeyType, HugePageAllocator<KeyType> > KeyArray;
+    typedef vector<ValType, HugePageAllocator<ValType> > ValArray;
+
+    SeriesBuilder() : mSorted(true) {}
+
+    /// Reserve space for the given number of points.
+    void Reserve(size_t aCount) {
+        mKeys.reserve(aCount);
+        mValues.reserve(aCount);
+    }
+
+    /// Append a point.
+    void Append(const KeyType& arKey, const ValType& arValue) {
+        if (mSorted && !mKeys.empty() && !(mKeys.back() < arKey)) {
+            mSorted = false;
+        }
+        mKeys.push_back(arKey);
+        mValues.push_back(arValue);
+    }
+
+    /// Append all the points from another builder, after our own points.
+    void Append(const SeriesBuilder<KeyType, ValType>& arOther) {
+        if (arOther.mKeys.empty()) {
+            return;
+        }
+        if (!arOther.mSorted
+            || (!mKeys.empty() && !(mKeys.back() < arOther.mKeys.front()))) {
+            mSorted = false;
+        }
+        mKeys.insert(mKeys.end(), arOther.mKeys.begin(), arOther.mKeys.end());
+        mValues.insert(mValues.end(), arOther.mValues.begin(), arOther.mValues.end());
+    }
+
+    /// Number of points appended so far.
+    size_t Size() const { return mKeys.size(); }
+
+    /// Discard all points.
+    void Clear() {
+        mKeys.clear();
+        mValues.clear();
+        mSorted = true;
+    }
+
+    /// Build the series into the given map, replacing its contents. If a
+    /// key was appended more than once, the last value appended wins, as it
+    /// would if the points were assigned to the map one at a time.
+    void Build(TSMap& arPoints) const {
+        arPoints.clear();
+        if (mSorted) {
+            for (size_t i = 0; i < mKeys.size(); ++i) {
+                arPoints.insert(arPoints.end(),
+                    typename TSMap::value_type(mKeys[i], mValues[i]));
+            }
+            return;
+        }
+
+        // sort an index so that equal keys stay in the order appended
+        vector<size_t> order(mKeys.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), KeyLess(mKeys));
+        for (size_t i = 0; i < order.size(); ++i) {
+            // skip to the last of any run of equal keys
+            if (i + 1 < order.size()
+                && !(mKeys[order[i]] < mKeys[order[i + 1]])) {
+                continue;
+            }
+            arPoints.insert(arPoints.end(),
+                typename TSMap::value_type(mKeys[order[i]], mValues[order[i]]));
+        }
+    }
+
+private:
+    /// compare indexes by the keys they refer to
+    struct KeyLess {
+        KeyLess(const KeyArray& arKeys) : mrKeys(arKeys) {}
+        bool operator()(size_t a, size_t b) const { return mrKeys[a] < mrKeys[b]; }
+        const KeyArray& mrKeys;
+    };
+
+    KeyArray        mKeys;      ///< keys in the order appended
+    ValArray        mValues;    ///< values in the order appended
+
+    bool            mSorted;    ///< true while the keys are strictly ascending
+};
+
+#endif
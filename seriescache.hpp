@@ -0,0 +1,200 @@
+#ifndef _SERIESCACHE_HPP_
+#define _SERIESCACHE_HPP_
+
+#include <vector>
+#include <cstring>
+
+#include <boost/shared_ptr.hpp>
+
+#include "interp.hpp"
+
+using std::vector;
+
+/**
+\file
+Per-step memoisation of series lookups. Within a simulation step many
+objects look up the same shared series (a regional price, a common inflow)
+at the same key, and each lookup repeats the search and interpolation. A
+StepValueCache remembers the values looked up during the current step, keyed
+on the identity of the series and the key, and forgets them all as soon as
+the simulation clock moves on.
+
+The simplest way to use it is to wrap the interpolator of a shared series in
+a CachedInterpolator, so that the objects using the series need no changes:
+@code
+StepValueCache<DateTime, double>::Ptr cache(
+    new StepValueCache<DateTime, double>(&current_time));
+Interpolator<DateTime, double>::Ptr price_interp(
+    new CachedInterpolator<DateTime, double>(
+        Interpolator<DateTime, double>::Ptr(new LinearInterp<DateTime, double>),
+        cache));
+@endcode
+
+The cache is direct-mapped with a fixed number of slots, so a lookup is a
+hash, one comparison and a copy; a collision just costs a miss. Invalidation
+is O(1), by bumping a generation number. It is not thread-safe.
+
+KeyType is hashed by its bytes, so it must be plain data without padding
+(DateTime, double and the integer types are.)
+*/
+
+template <typename KeyType, typename ValType>
+class StepValueCache {
+public:
+    typedef boost::shared_ptr<StepValueCache<KeyType, ValType> > Ptr;
+
+    /// Construct a cache.
+    /// @param apClock the simulation clock; the cache is invalidated whenever
+    /// its value changes. May be NULL, in which case call Advance() (eg. from
+    /// a time callback) at each step.
+    /// @param aSlots number of slots, rounded up to a power of 2.
+    StepValueCache(const KeyType* apClock = NULL, size_t aSlots = 4096)
+    :   mpClock(apClock),
+        mGeneration(1),
+        mHits(0),
+        mMisses(0)
+    {
+        size_t slots = 1;
+        while (slots < aSlots) {
+            slots <<= 1;
+        }
+        mSlots.resize(slots);
+        mMask = slots - 1;
+        if (mpClock) {
+            mClockStamp = *mpClock;
+        }
+    }
+
+    /// Look up a cached value.
+    /// @param apSeries identifies the series (eg. the address of its TSMap.)
+    /// @param apTag distinguishes different lookups on the same series (eg.
+    /// the interpolator used.)
+    /// @param arKey the key looked up.
+    /// @param arValue receives the value if it was cached.
+    /// @returns true if the value was cached.
+    bool Find(const void* apSeries, const void* apTag,
+              const KeyType& arKey, ValType& arValue) {
+        CheckClock();
+        const Slot& slot = mSlots[Hash(apSeries, apTag, arKey) & mMask];
+        if (slot.Generation == mGeneration && slot.pSeries == apSeries
+            && slot.pTag == apTag && slot.Key == arKey) {
+            ++mHits;
+            arValue = slot.Value;
+            return true;
+        }
+        ++mMisses;
+        return false;
+    }
+
+    /// Store a value looked up this step.
+    void Store(const void* apSeries, const void* apTag,
+               const KeyType& arKey, const ValType& arValue) {
+        Slot& slot = mSlots[Hash(apSeries, apTag, arKey) & mMask];
+        slot.Generation = mGeneration;
+        slot.pSeries = apSeries;
+        slot.pTag = apTag;
+        slot.Key = arKey;
+        slot.Value = arValue;
+    }
+
+    /// Forget everything cached so far.
+    void Invalidate() {
+        if (++mGeneration == 0) {
+            // wrapped - clear the slots so stale generations can't match
+            for (size_t i = 0; i < mSlots.size(); ++i) {
+                mSlots[i].Generation = 0;
+            }
+            mGeneration = 1;
+        }
+    }
+
+    /// Start a new step at the given time, for use as a time callback when
+    /// there is no clock to watch.
+    void Advance(const KeyType& arTime) {
+        mClockStamp = arTime;
+        Invalidate();
+    }
+
+    /// Number of lookups answered from the cache.
+    unsigned long long Hits() const { return mHits; }
+    /// Number of lookups not answered from the cache.
+    unsigned long long Misses() const { return mMisses; }
+    /// Fraction of lookups answered from the cache.
+    double HitRate() const {
+        unsigned long long total = mHits + mMisses;
+        return total == 0 ? 0.0 : (double)mHits / (double)total;
+    }
+    /// Zero the hit and miss counters.
+    void ResetCounters() { mHits = mMisses = 0; }
+
+private:
+    /// invalidate if the clock has moved since we last looked
+    void CheckClock() {
+        if (mpClock && !(*mpClock == mClockStamp)) {
+            mClockStamp = *mpClock;
+            Invalidate();
+        }
+    }
+
+    /// FNV-1a over the identity and the bytes of the key
+    static size_t Hash(const void* apSeries, const void* apTag, const KeyType& arKey) {
+        unsigned long long h = 14695981039346656037ULL;
+        const unsigned char* p = (const unsigned char*)&arKey;
+        for (size_t i = 0; i < sizeof(KeyType); ++i) {
+            h = (h ^ p[i]) * 1099511628211ULL;
+        }
+        h = (h ^ (size_t)apSeries) * 1099511628211ULL;
+        h = (h ^ (size_t)apTag) * 1099511628211ULL;
+        return (size_t)(h ^ (h >> 29));
+    }
+
+    struct Slot {
+        Slot() : Generation(0), pSeries(0), pTag(0), Key(), Value() {}
+        unsigned        Generation; ///< generation the slot was filled in
+        const void*     pSeries;
+        const void*     pTag;
+        KeyType         Key;
+        ValType         Value;
+    };
+
+    const KeyType*      mpClock;        ///< clock to watch, or NULL
+    KeyType             mClockStamp;    ///< clock value the entries belong to
+    vector<Slot>        mSlots;
+    size_t              mMask;          ///< mSlots.size() - 1
+    unsigned            mGeneration;    ///< current generation
+    unsigned long long  mHits;
+    unsigned long long  mMisses;
+};
+
+/**
+An interpolator that remembers the values found by another interpolator for
+the rest of the step. The series is identified by the address of its TSMap,
+so series that are rebuilt in place during a step must not be cached.
+*/
+template <typename KeyType, typename ValType>
+class CachedInterpolator : public Interpolator<KeyType, ValType> {
+public:
+    typedef boost::shared_ptr<CachedInterpolator<KeyType, ValType> > Ptr;
+    typedef typename Interpolator<KeyType, ValType>::TSMap TSMap;
+
+    /// @param apInterp the interpolator that does the work.
+    /// @param apCache the cache, usually shared by the whole simulation.
+    CachedInterpolator(typename Interpolator<KeyType, ValType>::Ptr apInterp,
+                       typename StepValueCache<KeyType, ValType>::Ptr apCache)
+    :   mpInterp(apInterp), mpCache(apCache) {}
+
+    ValType Value(const TSMap& arPoints, const KeyType& arKey) const {
+        ValType value;
+        if (!mpCache->Find(&arPoints, mpInterp.get(), arKey, value)) {
+            value = mpInterp->Value(arPoints, arKey);
+            mpCache->Store(&arPoints, mpInterp.get(), arKey, value);
+        }
+        return value;
+    }
+
+private:
+    typename Interpolator<KeyType, ValType>::Ptr        mpInterp;
+    typename StepValueCache<KeyType, ValType>::Ptr      mpCache;
+};
+
+#endif
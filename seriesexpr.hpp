@@ -0,0 +1,326 @@
+#ifndef _SERIESEXPR_HPP_
+#define _SERIESEXPR_HPP_
+
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "interp.hpp"
+#include "datetime.hpp"
+#include "temsimexception.hpp"
+
+using std::map;
+using std::vector;
+
+/**
+\file
+Lazy expressions over series. Instead of building a new TSMap for every
+intermediate result of a derived input such as "inflow * factor + base", an
+expression builds a small tree of nodes which is only evaluated when a value
+is asked for:
+@code
+typedef SeriesExpr<DateTime, double> Expr;
+LinearInterp<DateTime, double>::Ptr linear(new LinearInterp<DateTime, double>);
+
+Expr inflow = Expr::Series(inflow_points, linear);
+Expr demand = Expr::Series(demand_points, linear);
+Expr wind   = Expr::Series(wind_points, linear);
+
+Expr derived = inflow * 0.8 + 12.0;
+Expr residual = Max(demand - wind, 0.0);
+
+double now_value = derived.Value(now);      // evaluated at query time
+
+vector<double> values;
+residual.Materialise(step_times, values);   // one pass over the step grid
+@endcode
+
+Materialise evaluates each node once over the whole grid into a flat buffer,
+so each operator becomes a simple loop over arrays that the compiler can
+vectorise, and operations with a constant operand are fused into the loop
+over the other operand without a buffer of their own. No maps are created
+unless a TSMap is explicitly asked for.
+
+The series referred to by an expression are held by reference, so they must
+outlive the expression.
+*/
+
+/// The type of an offset between two keys, as used by Shift().
+template <typename KeyType>
+struct SeriesKeyOffset {
+    typedef KeyType Type;
+};
+
+/// DateTime keys are offset by a duration.
+template <>
+struct SeriesKeyOffset<DateTime> {
+    typedef boost::posix_time::time_duration Type;
+};
+
+/// A node in an expression tree.
+template <typename KeyType, typename ValType>
+class SeriesExprNode {
+public:
+    typedef boost::shared_ptr<SeriesExprNode<KeyType, ValType> > Ptr;
+
+    virtual ~SeriesExprNode() {}
+
+    /// Value of the expression at a single key.
+    virtual ValType Value(const KeyType& arKey) const=0;
+
+    /// Value of the expression at each of aCount keys.
+    /// @param apKeys the keys.
+    /// @param aCount the number of keys.
+    /// @param apOut receives aCount values.
+    virtual void Evaluate(const KeyType* apKeys, size_t aCount, ValType* apOut) const=0;
+
+    /// True if the node has the same value at every key.
+    virtual bool IsConstant() const { return false; }
+};
+
+/// A series stored in a map, looked up with an interpolator.
+template <typename KeyType, typename ValType>
+class SeriesLeafNode : public SeriesExprNode<KeyType, ValType> {
+public:
+    typedef typename Interpolator<KeyType, ValType>::TSMap TSMap;
+
+    SeriesLeafNode(const TSMap& arPoints,
+                   typename Interpolator<KeyType, ValType>::Ptr apInterp)
+    :   mrPoints(arPoints), mpInterp(apInterp) {}
+
+    ValType Value(const KeyType& arKey) const {
+        return mpInterp->Value(mrPoints, arKey);
+    }
+
+    void Evaluate(const KeyType* apKeys, size_t aCount, ValType* apOut) const {
+        const Interpolator<KeyType, ValType>& interp = *mpInterp;
+        for (size_t i = 0; i < aCount; ++i) {
+            apOut[i] = interp.Value(mrPoints, apKeys[i]);
+        }
+    }
+
+private:
+    const TSMap&                                    mrPoints;
+    typename Interpolator<KeyType, ValType>::Ptr    mpInterp;
+};
+
+/// A constant.
+template <typename KeyType, typename ValType>
+class ConstantNode : public SeriesExprNode<KeyType, ValType> {
+public:
+    ConstantNode(const ValType& arValue) : mValue(arValue) {}
+
+    ValType Value(const KeyType&) const { return mValue; }
+
+    void Evaluate(const KeyType*, size_t aCount, ValType* apOut) const {
+        std::fill(apOut, apOut + aCount, mValue);
+    }
+
+    bool IsConstant() const { return true; }
+
+private:
+    ValType mValue;
+};
+
+/// Operations for BinaryNode.
+struct AddOp { template <typename T> static T Apply(const T& a, const T& b) { return a + b; } };
+struct SubtractOp { template <typename T> static T Apply(const T& a, const T& b) { return a - b; } };
+struct MultiplyOp { template <typename T> static T Apply(const T& a, const T& b) { return a * b; } };
+struct DivideOp { template <typename T> static T Apply(const T& a, const T& b) { return a / b; } };
+struct MinOp { template <typename T> static T Apply(const T& a, const T& b) { return b < a ? b : a; } };
+struct MaxOp { template <typename T> static T Apply(const T& a, const T& b) { return a < b ? b : a; } };
+
+/// Combines two sub-expressions point by point.
+template <typename KeyType, typename ValType, typename Op>
+class BinaryNode : public SeriesExprNode<KeyType, ValType> {
+public:
+    typedef typename SeriesExprNode<KeyType, ValType>::Ptr NodePtr;
+
+    BinaryNode(NodePtr apLeft, NodePtr apRight)
+    :   mpLeft(apLeft), mpRight(apRight) {}
+
+    ValType Value(const KeyType& arKey) const {
+        return Op::Apply(mpLeft->Value(arKey), mpRight->Value(arKey));
+    }
+
+    void Evaluate(const KeyType* apKeys, size_t aCount, ValType* apOut) const {
+        if (aCount == 0) {
+            return;
+        }
+        if (mpRight->IsConstant()) {
+            // fuse the constant into the loop over the left operand
+            mpLeft->Evaluate(apKeys, aCount, apOut);
+            const ValType right = mpRight->Value(apKeys[0]);
+            for (size_t i = 0; i < aCount; ++i) {
+                apOut[i] = Op::Apply(apOut[i], right);
+            }
+        } else if (mpLeft->IsConstant()) {
+            mpRight->Evaluate(apKeys, aCount, apOut);
+            const ValType left = mpLeft->Value(apKeys[0]);
+            for (size_t i = 0; i < aCount; ++i) {
+                apOut[i] = Op::Apply(left, apOut[i]);
+            }
+        } else {
+            mpLeft->Evaluate(apKeys, aCount, apOut);
+            vector<ValType> right(aCount);
+            mpRight->Evaluate(apKeys, aCount, &right[0]);
+            for (size_t i = 0; i < aCount; ++i) {
+                apOut[i] = Op::Apply(apOut[i], right[i]);
+            }
+        }
+    }
+
+    bool IsConstant() const {
+        return mpLeft->IsConstant() && mpRight->IsConstant();
+    }
+
+private:
+    NodePtr mpLeft;
+    NodePtr mpRight;
+};
+
+/// A sub-expression shifted along the key axis: the value at key k is the
+/// value of the sub-expression at k - offset (so a positive offset delays.)
+template <typename KeyType, typename ValType>
+class ShiftNode : public SeriesExprNode<KeyType, ValType> {
+public:
+    typedef typename SeriesExprNode<KeyType, ValType>::Ptr NodePtr;
+    typedef typename SeriesKeyOffset<KeyType>::Type OffsetType;
+
+    ShiftNode(NodePtr apChild, const OffsetType& arOffset)
+    :   mpChild(apChild), mOffset(arOffset) {}
+
+    ValType Value(const KeyType& arKey) const {
+        return mpChild->Value(arKey - mOffset);
+    }
+
+    void Evaluate(const KeyType* apKeys, size_t aCount, ValType* apOut) const {
+        if (aCount == 0) {
+            return;
+        }
+        if (mpChild->IsConstant()) {
+            mpChild->Evaluate(apKeys, aCount, apOut);
+            return;
+        }
+        vector<KeyType> shifted(apKeys, apKeys + aCount);
+        for (size_t i = 0; i < aCount; ++i) {
+            shifted[i] = apKeys[i] - mOffset;
+        }
+        mpChild->Evaluate(&shifted[0], aCount, apOut);
+    }
+
+    bool IsConstant() const { return mpChild->IsConstant(); }
+
+private:
+    NodePtr     mpChild;
+    OffsetType  mOffset;
+};
+
+/**
+Value-semantics handle to an expression tree. Copying a SeriesExpr shares the
+tree, which is never modified once built.
+*/
+template <typename KeyType, typename ValType>
+class SeriesExpr {
+public:
+    typedef SeriesExprNode<KeyType, ValType> Node;
+    typedef typename Node::Ptr NodePtr;
+    typedef typename Interpolator<KeyType, ValType>::TSMap TSMap;
+    typedef typename SeriesKeyOffset<KeyType>::Type OffsetType;
+
+    /// A constant expression (so scalars convert implicitly.)
+    SeriesExpr(const ValType& arValue = ValType())
+    :   mpNode(new ConstantNode<KeyType, ValType>(arValue)) {}
+
+    /// Wrap an existing node.
+    explicit SeriesExpr(NodePtr apNode) : mpNode(apNode) {}
+
+    /// An expression that looks up a series.
+    /// @param arPoints the series - must outlive the expression.
+    /// @param apInterp the interpolator to use.
+    static SeriesExpr Series(const TSMap& arPoints,
+                             typename Interpolator<KeyType, ValType>::Ptr apInterp) {
+        return SeriesExpr(NodePtr(
+            new SeriesLeafNode<KeyType, ValType>(arPoints, apInterp)));
+    }
+
+    /// Value of the expression at a key.
+    ValType Value(const KeyType& arKey) const {
+        return mpNode->Value(arKey);
+    }
+
+    /// Evaluate the expression at every key of a grid.
+    /// @param arKeys the grid, eg. the simulation step times.
+    /// @param arValues receives one value per key.
+    void Materialise(const vector<KeyType>& arKeys, vector<ValType>& arValues) const {
+        arValues.resize(arKeys.size());
+        if (!arKeys.empty()) {
+            mpNode->Evaluate(&arKeys[0], arKeys.size(), &arValues[0]);
+        }
+    }
+
+    /// Evaluate the expression at every key of a grid into a series, for
+    /// code that needs a TSMap.
+    void Materialise(const vector<KeyType>& arKeys, TSMap& arPoints) const {
+        vector<ValType> values;
+        Materialise(arKeys, values);
+        arPoints.clear();
+        for (size_t i = 0; i < arKeys.size(); ++i) {
+            arPoints.insert(arPoints.end(),
+                typename TSMap::value_type(arKeys[i], values[i]));
+        }
+    }
+
+    /// The root of the tree.
+    NodePtr Root() const { return mpNode; }
+
+    friend SeriesExpr operator+(const SeriesExpr& a, const SeriesExpr& b) {
+        return Combine<AddOp>(a, b);
+    }
+    friend SeriesExpr operator-(const SeriesExpr& a, const SeriesExpr& b) {
+        return Combine<SubtractOp>(a, b);
+    }
+    friend SeriesExpr operator*(const SeriesExpr& a, const SeriesExpr& b) {
+        return Combine<MultiplyOp>(a, b);
+    }
+    friend SeriesExpr operator/(const SeriesExpr& a, const SeriesExpr& b) {
+        return Combine<DivideOp>(a, b);
+    }
+    friend SeriesExpr operator-(const SeriesExpr& a) {
+        return Combine<SubtractOp>(SeriesExpr(ValType()), a);
+    }
+
+    /// Point by point minimum.
+    friend SeriesExpr Min(const SeriesExpr& a, const SeriesExpr& b) {
+        return Combine<MinOp>(a, b);
+    }
+    /// Point by point maximum.
+    friend SeriesExpr Max(const SeriesExpr& a, const SeriesExpr& b) {
+        return Combine<MaxOp>(a, b);
+    }
+    /// Shift along the key axis: Shift(e, d).Value(k) == e.Value(k - d).
+    friend SeriesExpr Shift(const SeriesExpr& a, const OffsetType& arOffset) {
+        return SeriesExpr(NodePtr(
+            new ShiftNode<KeyType, ValType>(a.mpNode, arOffset)));
+    }
+
+private:
+    template <typename Op>
+    static SeriesExpr Combine(const SeriesExpr& a, const SeriesExpr& b) {
+        if (a.mpNode->IsConstant() && b.mpNode->IsConstant()) {
+            // fold constants when the tree is built; any key will do as
+            // constant nodes ignore it
+            KeyType key = KeyType();
+            return SeriesExpr(Op::Apply(a.Value(key), b.Value(key)));
+        }
+        return SeriesExpr(NodePtr(
+            new BinaryNode<KeyType, ValType, Op>(a.mpNode, b.mpNode)));
+    }
+
+    NodePtr mpNode;   ///< root of the tree
+};
+
+#endif
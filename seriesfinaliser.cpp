@@ -0,0 +1,174 @@
+#include "seriesfinaliser.hpp"
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+/// define boost logging stuff.
+BOOST_DEFINE_LOG(seriesfinaliser, "seriesfinaliser")
+
+/**
+\file
+Implementation of the parallel finalisation of registered series.
+*/
+
+/// objects each thread takes at a time
+static const size_t gFinaliseBatch = 16;
+
+const char* FinaliseStageName(FinaliseStage aStage) {
+    switch (aStage) {
+    case eSortStage:        return "sort";
+    case eDedupeStage:      return "dedupe";
+    case eSlopeStage:       return "slopes";
+    case eIndexStage:       return "index";
+    case ePrefixSumStage:   return "prefix sums";
+    default:                return "unknown";
+    }
+}
+
+double FinaliseClock() {
+#ifndef _WIN32
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+#else
+    using boost::posix_time::ptime;
+    using boost::posix_time::microsec_clock;
+    static const ptime start = microsec_clock::universal_time();
+    return (microsec_clock::universal_time() - start).total_microseconds() * 1e-6;
+#endif
+}
+
+namespace {
+
+/// the objects to finalise and the progress through them, shared by the
+/// threads
+struct FinaliseWork {
+    FinaliseWork(const vector<Finalisable*>& arObjects)
+    :   mrObjects(arObjects),
+        mNext(0),
+        mFailed(false)
+    {
+        for (size_t s = 0; s < eFinaliseStages; ++s) {
+            mStageSeconds[s] = 0.0;
+        }
+    }
+
+    /// finalise batches until there are none left
+    void Run() {
+        double seconds[eFinaliseStages] = { 0.0 };
+        try {
+            size_t first, end;
+            while (Take(first, end)) {
+                for (size_t i = first; i < end; ++i) {
+                    mrObjects[i]->Finalise(seconds);
+                }
+            }
+        } catch (std::exception& e) {
+            boost::mutex::scoped_lock lock(mMutex);
+            if (!mFailed) {
+                mFailed = true;
+                mError = e.what();
+            }
+            // let the other threads stop
+            mNext = mrObjects.size();
+        }
+        boost::mutex::scoped_lock lock(mMutex);
+        for (size_t s = 0; s < eFinaliseStages; ++s) {
+            mStageSeconds[s] += seconds[s];
+        }
+    }
+
+    /// the next batch, if any
+    bool Take(size_t& arFirst, size_t& arEnd) {
+        boost::mutex::scoped_lock lock(mMutex);
+        if (mNext >= mrObjects.size()) {
+            return false;
+        }
+        arFirst = mNext;
+        arEnd = std::min(mNext + gFinaliseBatch, mrObjects.size());
+        mNext = arEnd;
+        return true;
+    }
+
+    const vector<Finalisable*>& mrObjects;
+    size_t          mNext;
+    bool            mFailed;
+    string          mError;     ///< the first failure
+    double          mStageSeconds[eFinaliseStages];
+    boost::mutex    mMutex;
+};
+
+/// finalises a register's series once they are loaded
+void FinaliseHook(ObjectRegister& arReg) {
+    FinaliseRegisteredSeries(arReg);
+}
+
+/// adds FinaliseHook to every register; this file is always linked where
+/// FlatSeries is used, as Finalise() calls FinaliseClock()
+struct AddFinaliseHook {
+    AddFinaliseHook() {
+        ObjectRegister::AddFinaliseHook(&FinaliseHook);
+    }
+} gAddFinaliseHook;
+
+} // namespace
+
+FinaliseReport FinaliseRegisteredSeries(ObjectRegister& arReg, unsigned aThreads) {
+    double start = FinaliseClock();
+    vector<Finalisable*> registered;
+    arReg.CollectFinalisable(registered);
+    vector<Finalisable*> objects;
+    for (size_t i = 0; i < registered.size(); ++i) {
+        if (!registered[i]->IsFinalised()) {
+            objects.push_back(registered[i]);
+        }
+    }
+
+    if (aThreads == 0) {
+        aThreads = std::max(boost::thread::hardware_concurrency(), 1u);
+    }
+    // no point in threads that would have nothing to do
+    size_t batches = (objects.size() + gFinaliseBatch - 1) / gFinaliseBatch;
+    aThreads = (unsigned)std::max((size_t)1, std::min((size_t)aThreads, batches));
+
+    FinaliseWork work(objects);
+    if (aThreads == 1) {
+        work.Run();
+    } else {
+        boost::thread_group threads;
+        for (unsigned t = 0; t < aThreads; ++t) {
+            threads.create_thread(boost::bind(&FinaliseWork::Run, &work));
+        }
+        threads.join_all();
+    }
+    if (work.mFailed) {
+        throw TemsimException("Failed finalising series (" + work.mError + ")",
+            "SeriesFinaliser");
+    }
+
+    FinaliseReport report;
+    report.Series = objects.size();
+    report.Threads = aThreads;
+    for (size_t s = 0; s < eFinaliseStages; ++s) {
+        report.StageSeconds[s] = work.mStageSeconds[s];
+    }
+    report.ElapsedSeconds = FinaliseClock() - start;
+
+    if (!objects.empty()) {
+        BOOST_LOGL(seriesfinaliser, info) << "Finalised " << report.Series
+            << " series on " << report.Threads << " threads in "
+            << report.ElapsedSeconds << "s" << std::endl;
+        for (size_t s = 0; s < eFinaliseStages; ++s) {
+            BOOST_LOGL(seriesfinaliser, info) << "  "
+                << FinaliseStageName((FinaliseStage)s) << ": "
+                << report.StageSeconds[s] << "s" << std::endl;
+        }
+    }
+    return report;
+}
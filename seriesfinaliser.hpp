@@ -0,0 +1,351 @@
+#ifndef _SERIESFINALISER_HPP_
+#define _SERIESFINALISER_HPP_
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/tokenizer.hpp>
+#include <boost/log/log.hpp>
+
+#include "objectregister.hpp"
+#include "interp.hpp"
+#include "batchinterp.hpp"
+#include "logging.hpp"
+#include "temsimexception.hpp"
+
+using std::string;
+using std::vector;
+
+/// declare the boost logging stuff.
+BOOST_DECLARE_LOG(seriesfinaliser)
+
+/**
+\file
+Finalisation of series at model load. A FlatSeries collects its points in
+whatever order they arrive and, once they are all in, is finalised: the
+points are sorted, duplicate keys removed (the last value appended wins, as
+with SeriesBuilder) and the tables used for lookups built, namely the slope
+of each segment, a guide index over the keys and prefix sums of the area
+under the series.
+
+Models with thousands of series would spend a noticeable part of the load
+doing this one series at a time, so the series registered in an
+ObjectRegister are finalised together on a pool of threads. This module adds
+a finalise hook to ObjectRegister, which runs it once the objects have been
+made (for series their constructors fill) and after each Reset (for series
+set from strings, which ResetFromString only fills):
+@code
+class Catchment {
+    ...
+    FlatSeries<DateTime> mInflow;   // set from the INI file
+};
+...
+arReg.Set(*this, "Inflow", &mInflow);
+...
+reg.Reset();    // loads every series, then finalises them in parallel
+@endcode
+Only the series that have changed since they were last finalised are done,
+so a Reset that sets no series costs little more than finding them.
+
+FinaliseRegisteredSeries() logs the time spent in each stage, summed over
+the threads, and the elapsed time of the whole. Anything registered as a
+pointer to a Finalisable is included, so other kinds of series can join in
+by deriving from it.
+*/
+
+/// Stages of finalising a series, for timing.
+enum FinaliseStage {
+    eSortStage,         ///< sorting the points by key
+    eDedupeStage,       ///< removing duplicate keys
+    eSlopeStage,        ///< the slope of each segment
+    eIndexStage,        ///< the search keys and guide index
+    ePrefixSumStage,    ///< cumulative area under the series
+    eFinaliseStages     ///< number of stages
+};
+
+/// Name of a stage, for reports.
+const char* FinaliseStageName(FinaliseStage aStage);
+
+/// A monotonic clock in seconds, for timing the stages.
+double FinaliseClock();
+
+/// What finalising the registered series took.
+struct FinaliseReport {
+    size_t      Series;                         ///< objects finalised
+    unsigned    Threads;                        ///< threads used
+    double      StageSeconds[eFinaliseStages];  ///< time in each stage, summed over threads
+    double      ElapsedSeconds;                 ///< time for the whole
+};
+
+/**
+A series of double values held in flat arrays, built from points appended in
+any order and then finalised. Lookups before Finalise() throw.
+
+Value() gives the same results as LinearInterp::Value on the same points.
+The keys are converted to double by BatchKeyTraits for the guide index,
+slopes and areas, so slopes and areas are per unit of converted key (per
+tick for DateTime keys.)
+*/
+template <typename KeyType>
+class FlatSeries : public Finalisable {
+public:
+    typedef boost::shared_ptr<FlatSeries<KeyType> > Ptr;
+    typedef map<KeyType, double> TSMap;
+
+    FlatSeries() : mFinalised(false), mGuideLower(0.0), mGuideScale(0.0) {}
+
+    /// Add a point. Makes the series unfinalised.
+    void Append(const KeyType& arKey, double aValue) {
+        mRawKeys.push_back(arKey);
+        mRawValues.push_back(aValue);
+        mFinalised = false;
+    }
+
+    /// Add the points of a map. Makes the series unfinalised.
+    void Append(const TSMap& arPoints) {
+        for (typename TSMap::const_iterator iter = arPoints.begin();
+             iter != arPoints.end(); ++iter) {
+            Append(iter->first, iter->second);
+        }
+    }
+
+    /// Discard all points.
+    void Clear() {
+        *this = FlatSeries<KeyType>();
+    }
+
+    /// True once finalised, until more points are appended.
+    virtual bool IsFinalised() const { return mFinalised; }
+
+    /// Sort, dedupe and build the lookup tables. Points appended since the
+    /// last Finalise() are merged with the finalised ones.
+    void Finalise(double* apStageSeconds) {
+        if (mFinalised) {
+            return;
+        }
+        // points already finalised go first, so later ones win ties
+        mRawKeys.insert(mRawKeys.begin(), mKeys.begin(), mKeys.end());
+        mRawValues.insert(mRawValues.begin(), mValues.begin(), mValues.end());
+        const size_t raw = mRawKeys.size();
+
+        double start = FinaliseClock();
+        vector<size_t> order(raw);
+        bool sorted = true;
+        for (size_t i = 0; i < raw; ++i) {
+            order[i] = i;
+            if (i > 0 && mRawKeys[i] < mRawKeys[i - 1]) {
+                sorted = false;
+            }
+        }
+        if (!sorted) {
+            // stable, so that equal keys stay in the order appended
+            std::stable_sort(order.begin(), order.end(), KeyLess(mRawKeys));
+        }
+        double now = FinaliseClock();
+        apStageSeconds[eSortStage] += now - start;
+        start = now;
+
+        mKeys.clear();
+        mValues.clear();
+        mKeys.reserve(raw);
+        mValues.reserve(raw);
+        for (size_t i = 0; i < raw; ++i) {
+            // skip to the last of any run of equal keys
+            if (i + 1 < raw && !(mRawKeys[order[i]] < mRawKeys[order[i + 1]])) {
+                continue;
+            }
+            mKeys.push_back(mRawKeys[order[i]]);
+            mValues.push_back(mRawValues[order[i]]);
+        }
+        vector<KeyType>().swap(mRawKeys);
+        vector<double>().swap(mRawValues);
+        const size_t n = mKeys.size();
+        now = FinaliseClock();
+        apStageSeconds[eDedupeStage] += now - start;
+        start = now;
+
+        mSearch.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            mSearch[i] = BatchKeyTraits<KeyType>::ToDouble(mKeys[i]);
+        }
+        mSlopes.assign(n > 1 ? n - 1 : 0, 0.0);
+        for (size_t i = 0; i + 1 < n; ++i) {
+            mSlopes[i] = (mValues[i + 1] - mValues[i]) / (mSearch[i + 1] - mSearch[i]);
+        }
+        now = FinaliseClock();
+        apStageSeconds[eSlopeStage] += now - start;
+        start = now;
+
+        // guide index: one bucket per point, each holding the first key in
+        // that bucket or a later one, found with the same arithmetic as
+        // Segment() so that it is never past the lower_bound of a key
+        mGuide.resize(n + 1);
+        mGuideLower = n > 0 ? mSearch[0] : 0.0;
+        mGuideScale = n > 1 && mSearch[n - 1] > mSearch[0]
+            ? (double)n / (mSearch[n - 1] - mSearch[0]) : 0.0;
+        size_t b = 0;
+        for (size_t i = 0; i < n; ++i) {
+            size_t bucket = Bucket(mSearch[i]);
+            while (b <= bucket) {
+                mGuide[b++] = i;
+            }
+        }
+        while (b <= n) {
+            mGuide[b++] = n;
+        }
+        now = FinaliseClock();
+        apStageSeconds[eIndexStage] += now - start;
+        start = now;
+
+        mArea.assign(n, 0.0);
+        for (size_t i = 0; i + 1 < n; ++i) {
+            mArea[i + 1] = mArea[i]
+                + 0.5 * (mValues[i] + mValues[i + 1]) * (mSearch[i + 1] - mSearch[i]);
+        }
+        apStageSeconds[ePrefixSumStage] += FinaliseClock() - start;
+
+        mFinalised = true;
+    }
+
+    /// Finalise without timing.
+    void Finalise() {
+        double seconds[eFinaliseStages] = { 0.0 };
+        Finalise(seconds);
+    }
+
+    /// Number of points (once finalised.)
+    size_t Size() const { return mKeys.size(); }
+    /// The keys, ascending (once finalised.)
+    const vector<KeyType>& Keys() const { return mKeys; }
+    /// The value at each key (once finalised.)
+    const vector<double>& Values() const { return mValues; }
+
+    /// The value at a key, as LinearInterp would find it.
+    double Value(const KeyType& arKey) const {
+        size_t lower = Segment(arKey);
+        if (mKeys[lower] == arKey) {
+            return mValues[lower];
+        }
+        if (mKeys[lower + 1] == arKey) {
+            return mValues[lower + 1];
+        }
+        return CalcInterpolatedValue<KeyType, double>::Value(
+            mKeys[lower], mValues[lower], mKeys[lower + 1], mValues[lower + 1], arKey);
+    }
+
+    /// The slope of the segment Value() would interpolate in at a key.
+    double Slope(const KeyType& arKey) const {
+        return mSlopes[Segment(arKey)];
+    }
+
+    /// The area under the series between two keys, extrapolating from the
+    /// end segments outside the series.
+    double Integral(const KeyType& arFrom, const KeyType& arTo) const {
+        return Area(arTo) - Area(arFrom);
+    }
+
+    /// The mean of the series between two keys, or the value if they are
+    /// the same.
+    double Mean(const KeyType& arFrom, const KeyType& arTo) const {
+        double width = BatchKeyTraits<KeyType>::ToDouble(arTo)
+            - BatchKeyTraits<KeyType>::ToDouble(arFrom);
+        if (width == 0.0) {
+            return Value(arFrom);
+        }
+        return Integral(arFrom, arTo) / width;
+    }
+
+private:
+    /// compare indexes by the keys they refer to
+    struct KeyLess {
+        KeyLess(const vector<KeyType>& arKeys) : mrKeys(arKeys) {}
+        bool operator()(size_t a, size_t b) const { return mrKeys[a] < mrKeys[b]; }
+        const vector<KeyType>& mrKeys;
+    };
+
+    /// the first point of the pair LinearInterp would use for a key
+    size_t Segment(const KeyType& arKey) const {
+        if (!mFinalised) {
+            throw TemsimException("Series used before it was finalised",
+                "FlatSeries");
+        }
+        const size_t n = mKeys.size();
+        if (n <= 1) {
+            // don't have enough points to interpolate
+            throw TemsimException("Error evaluating time series - at most 1 point in time series.");
+        }
+        double x = BatchKeyTraits<KeyType>::ToDouble(arKey);
+        // lower_bound, starting from the guide
+        size_t index = x > mGuideLower ? mGuide[Bucket(x)] : 0;
+        while (index < n && mSearch[index] < x) {
+            ++index;
+        }
+        // extrapolating from the end pairs
+        return index == 0 ? 0 : std::min(index - 1, n - 2);
+    }
+
+    /// the guide bucket of a key above the first
+    size_t Bucket(double aX) const {
+        double bucket = (aX - mGuideLower) * mGuideScale;
+        return bucket < (double)mKeys.size() ? (size_t)bucket : mKeys.size();
+    }
+
+    /// the area under the series from the first key to a key
+    double Area(const KeyType& arKey) const {
+        size_t lower = Segment(arKey);
+        double dx = BatchKeyTraits<KeyType>::ToDouble(arKey) - mSearch[lower];
+        return mArea[lower] + dx * (mValues[lower] + 0.5 * mSlopes[lower] * dx);
+    }
+
+    vector<KeyType>     mRawKeys;       ///< points appended since finalising
+    vector<double>      mRawValues;
+    bool                mFinalised;
+
+    vector<KeyType>     mKeys;          ///< ascending, unique
+    vector<double>      mValues;
+    vector<double>      mSearch;        ///< keys as doubles
+    vector<double>      mSlopes;        ///< slope of each segment
+    vector<double>      mArea;          ///< area from the first key to each key
+    vector<size_t>      mGuide;         ///< first key in or after each bucket
+    double              mGuideLower;    ///< key at the start of the first bucket
+    double              mGuideScale;    ///< buckets per unit of key
+};
+
+/**
+Finalise everything registered in an ObjectRegister as a pointer to a
+Finalisable that isn't finalised already, on a pool of threads, and log the
+time taken by each stage.
+@param arReg the register.
+@param aThreads threads to use, or 0 for one per processor.
+@returns what was done and how long it took.
+*/
+FinaliseReport FinaliseRegisteredSeries(ObjectRegister& arReg, unsigned aThreads = 0);
+
+/** Set a flat series from a string representation. The series is left to
+be finalised, with the others set by the same Reset, by the register's
+finalise hook.
+@param arReg Ref to an object register.
+@param p Pointer to the series to set.
+@param s Alternating keys and values, eg "[0, 1.5, 10, 2.5]".
+*/
+template <typename KeyType>
+void ResetFromString(ObjectRegister& arReg, FlatSeries<KeyType>* p, string s) {
+    vector<string> words;
+    ResetFromString(arReg, &words, s);
+    if (words.size() % 2 != 0) {
+        throw TemsimException("Series needs a value for every key: " + s,
+            "ObjectRegister");
+    }
+    p->Clear();
+    for (size_t i = 0; i < words.size(); i += 2) {
+        KeyType key;
+        double value;
+        ResetFromString(arReg, &key, words[i]);
+        ResetFromString(arReg, &value, words[i + 1]);
+        p->Append(key, value);
+    }
+}
+
+#endif
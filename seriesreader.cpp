@@ -0,0 +1,314 @@
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <fstream>
+
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "seriesreader.hpp"
+#include "temsimexception.hpp"
+
+/// define boost logging stuff.
+BOOST_DEFINE_LOG(seriesreader, "seriesreader")
+
+/**
+\file
+Implementation of bulk text time series loading.
+*/
+
+// files smaller than this are parsed on the calling thread
+static const size_t gMinBytesPerThread = 1 << 20;
+
+// DateTime::FromString isn't known to be thread-safe, so the fallback path
+// is serialised.
+static boost::mutex gFromStringMutex;
+
+// read exactly aDigits decimal digits
+static bool ReadDigits(const char*& arP, const char* apEnd, int aDigits, int& arValue) {
+    arValue = 0;
+    for (int i = 0; i < aDigits; ++i, ++arP) {
+        if (arP == apEnd || *arP < '0' || *arP > '9') {
+            return false;
+        }
+        arValue = arValue * 10 + (*arP - '0');
+    }
+    return true;
+}
+
+// split a fixed format timestamp into its fields
+static bool ParseFixedFields(const char* apBegin, const char* apEnd,
+                             int& arYear, int& arMonth, int& arDay,
+                             int& arHour, int& arMinute, int& arSecond) {
+    const char* p = apBegin;
+    if (apEnd - p >= 10 && p[4] == '-') {
+        // YYYY-MM-DD
+        if (!ReadDigits(p, apEnd, 4, arYear) || *p++ != '-'
+            || !ReadDigits(p, apEnd, 2, arMonth) || p == apEnd || *p++ != '-'
+            || !ReadDigits(p, apEnd, 2, arDay)) {
+            return false;
+        }
+    } else if (apEnd - p >= 10 && p[2] == '/') {
+        // DD/MM/YYYY
+        if (!ReadDigits(p, apEnd, 2, arDay) || *p++ != '/'
+            || !ReadDigits(p, apEnd, 2, arMonth) || p == apEnd || *p++ != '/'
+            || !ReadDigits(p, apEnd, 4, arYear)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+
+    arHour = arMinute = arSecond = 0;
+    if (p != apEnd) {
+        if (*p != 'T' && *p != ' ') {
+            return false;
+        }
+        ++p;
+        if (!ReadDigits(p, apEnd, 2, arHour) || p == apEnd || *p++ != ':'
+            || !ReadDigits(p, apEnd, 2, arMinute)) {
+            return false;
+        }
+        if (p != apEnd) {
+            if (*p++ != ':' || !ReadDigits(p, apEnd, 2, arSecond) || p != apEnd) {
+                return false;
+            }
+        }
+    }
+
+    return arMonth >= 1 && arMonth <= 12 && arDay >= 1 && arDay <= 31
+        && arHour < 24 && arMinute < 60 && arSecond < 60;
+}
+
+bool ParseFixedDateTime(const char* apBegin, const char* apEnd, DateTime& arTime) {
+    int year, month, day, hour, minute, second;
+    if (!ParseFixedFields(apBegin, apEnd, year, month, day, hour, minute, second)) {
+        return false;
+    }
+    try {
+        arTime = DateTime(year, month, day)
+            + boost::posix_time::time_duration(hour, minute, second);
+    } catch (std::exception&) {
+        // eg. 30th February - let FromString report it
+        return false;
+    }
+    return true;
+}
+
+/// Parses one line-aligned chunk of the file into its own builder.
+class SeriesChunkParser {
+public:
+    SeriesChunkParser()
+    :   mLines(0), mErrorLine(0),
+        mpBegin(0), mpEnd(0), mpSim(0), mFirstChunk(false),
+        mDayYear(0), mDayMonth(0), mDayDay(0)
+    {}
+
+    /// Set the text to parse.
+    void Init(const char* apBegin, const char* apEnd, Simulation* apSim,
+              bool aFirstChunk) {
+        mpBegin = apBegin;
+        mpEnd = apEnd;
+        mpSim = apSim;
+        mFirstChunk = aFirstChunk;
+        // a rough guess at the line length saves most reallocation
+        mBuilder.Reserve((apEnd - apBegin) / 24);
+    }
+
+    /// Parse the chunk. Stops at the first bad line, recording the error.
+    void Run() {
+        const char* line = mpBegin;
+        while (line < mpEnd) {
+            const char* eol = (const char*)memchr(line, '\n', mpEnd - line);
+            if (eol == 0) {
+                eol = mpEnd;
+            }
+            ++mLines;
+            try {
+                ParseLine(line, eol);
+            } catch (std::exception& e) {
+                mError = e.what();
+                mErrorLine = mLines;
+                return;
+            }
+            line = eol + 1;
+        }
+    }
+
+    SeriesBuilder<DateTime, double> mBuilder;   ///< the parsed points
+    size_t  mLines;         ///< lines parsed
+    string  mError;         ///< first error, or empty
+    size_t  mErrorLine;     ///< line of the first error within the chunk
+
+private:
+    void ParseLine(const char* apBegin, const char* apEnd) {
+        // trim whitespace (including any '\r') from both ends
+        while (apBegin < apEnd && isspace((unsigned char)*apBegin)) {
+            ++apBegin;
+        }
+        while (apEnd > apBegin && isspace((unsigned char)apEnd[-1])) {
+            --apEnd;
+        }
+        if (apBegin == apEnd || *apBegin == '#') {
+            return;
+        }
+        if (mFirstChunk && mLines == 1 && !isdigit((unsigned char)*apBegin)) {
+            // column header
+            return;
+        }
+
+        // the value is the last field; the timestamp is everything before it
+        // (it may contain a space)
+        const char* value = apEnd;
+        while (value > apBegin && !IsSeparator(value[-1])) {
+            --value;
+        }
+        const char* time_end = value;
+        while (time_end > apBegin && IsSeparator(time_end[-1])) {
+            --time_end;
+        }
+        if (time_end == apBegin) {
+            throw TemsimException("expected a timestamp and a value");
+        }
+
+        char buffer[64];
+        size_t length = apEnd - value;
+        if (length >= sizeof(buffer)) {
+            throw TemsimException("value too long");
+        }
+        memcpy(buffer, value, length);
+        buffer[length] = '\0';
+        char* number_end = 0;
+        double number = strtod(buffer, &number_end);
+        if (number_end != buffer + length) {
+            throw TemsimException("bad value '" + string(buffer) + "'");
+        }
+
+        mBuilder.Append(ParseTime(apBegin, time_end), number);
+    }
+
+    DateTime ParseTime(const char* apBegin, const char* apEnd) {
+        int year, month, day, hour, minute, second;
+        if (ParseFixedFields(apBegin, apEnd, year, month, day, hour, minute, second)) {
+            // consecutive lines are nearly always on the same day, so only
+            // work out the date when it changes
+            if (year != mDayYear || month != mDayMonth || day != mDayDay) {
+                try {
+                    mDay = DateTime(year, month, day);
+                    mDayYear = year;
+                    mDayMonth = month;
+                    mDayDay = day;
+                } catch (std::exception&) {
+                    return ParseOddTime(apBegin, apEnd);
+                }
+            }
+            return mDay + boost::posix_time::time_duration(hour, minute, second);
+        }
+        return ParseOddTime(apBegin, apEnd);
+    }
+
+    DateTime ParseOddTime(const char* apBegin, const char* apEnd) {
+        boost::mutex::scoped_lock lock(gFromStringMutex);
+        return DateTime::FromString(string(apBegin, apEnd), mpSim);
+    }
+
+    static bool IsSeparator(char c) {
+        return c == ',' || c == ' ' || c == '\t' || c == ';';
+    }
+
+    const char* mpBegin;    ///< start of the chunk
+    const char* mpEnd;      ///< end of the chunk
+    Simulation* mpSim;      ///< for DateTime::FromString
+    bool        mFirstChunk; ///< true if the chunk starts the file
+
+    DateTime    mDay;       ///< midnight of the last date parsed
+    int         mDayYear, mDayMonth, mDayDay; ///< fields of mDay
+};
+
+void ReadSeriesText(const string& arFileName,
+                    SeriesBuilder<DateTime, double>& arBuilder,
+                    Simulation* apSim,
+                    unsigned aThreads) {
+
+    // mapped_file_source refuses empty files, so check first
+    {
+        std::ifstream in(arFileName.c_str(), std::ios::binary | std::ios::ate);
+        if (!in) {
+            throw TemsimException("Couldn't open series file " + arFileName,
+                "SeriesReader");
+        }
+        if (in.tellg() == std::streampos(0)) {
+            return;
+        }
+    }
+
+    boost::iostreams::mapped_file_source file;
+    try {
+        file.open(arFileName);
+    } catch (std::exception& e) {
+        throw TemsimException("Couldn't map series file " + arFileName
+            + " (" + e.what() + ")", "SeriesReader");
+    }
+    const char* begin = file.data();
+    const char* end = begin + file.size();
+
+    if (aThreads == 0) {
+        aThreads = std::max(boost::thread::hardware_concurrency(), 1u);
+    }
+    size_t max_threads = file.size() / gMinBytesPerThread + 1;
+    if (aThreads > max_threads) {
+        aThreads = (unsigned)max_threads;
+    }
+
+    // split into chunks that start at the beginning of a line
+    vector<SeriesChunkParser> parsers(aThreads);
+    const char* chunk_begin = begin;
+    for (unsigned i = 0; i < aThreads; ++i) {
+        const char* chunk_end = end;
+        if (i + 1 < aThreads) {
+            chunk_end = begin + file.size() / aThreads * (i + 1);
+            if (chunk_end < chunk_begin) {
+                chunk_end = chunk_begin;
+            }
+            const char* eol = (const char*)memchr(chunk_end, '\n', end - chunk_end);
+            chunk_end = eol ? eol + 1 : end;
+        }
+        parsers[i].Init(chunk_begin, chunk_end, apSim, i == 0);
+        chunk_begin = chunk_end;
+    }
+
+    if (aThreads == 1) {
+        parsers[0].Run();
+    } else {
+        boost::thread_group threads;
+        for (unsigned i = 0; i < aThreads; ++i) {
+            threads.create_thread(boost::bind(&SeriesChunkParser::Run, &parsers[i]));
+        }
+        threads.join_all();
+    }
+
+    // report the first error in file order, then join the chunks
+    size_t lines = 0;
+    for (unsigned i = 0; i < aThreads; ++i) {
+        if (!parsers[i].mError.empty()) {
+            throw TemsimException(str(format("%s, line %d: %s")
+                % arFileName % (lines + parsers[i].mErrorLine)
+                % parsers[i].mError), "SeriesReader");
+        }
+        lines += parsers[i].mLines;
+    }
+    size_t total = 0;
+    for (unsigned i = 0; i < aThreads; ++i) {
+        total += parsers[i].mBuilder.Size();
+    }
+    arBuilder.Reserve(arBuilder.Size() + total);
+    for (unsigned i = 0; i < aThreads; ++i) {
+        arBuilder.Append(parsers[i].mBuilder);
+    }
+
+    BOOST_LOGL(seriesreader, info) << "Read " << total << " points from "
+        << arFileName << " using " << aThreads << " threads" << std::endl;
+}
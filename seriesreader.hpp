@@ -0,0 +1,55 @@
+#ifndef _SERIESREADER_HPP_
+#define _SERIESREADER_HPP_
+
+#include <string>
+
+#include <boost/log/log.hpp>
+
+#include "datetime.hpp"
+#include "seriesbuilder.hpp"
+#include "logging.hpp"
+
+using std::string;
+
+/// declare the boost logging stuff.
+BOOST_DECLARE_LOG(seriesreader)
+
+class Simulation;
+
+/**
+\file
+Bulk loading of time series from text files.
+
+The file is memory-mapped and split into line-aligned chunks which are parsed
+in parallel, each into its own SeriesBuilder; the builders are then joined in
+file order. Each line holds a timestamp and a value separated by a comma, tab
+or spaces. Blank lines and lines starting with '#' are ignored, as is a first
+line that doesn't start with a digit (a column header.)
+
+Timestamps in the common fixed formats
+- YYYY-MM-DD[(T| )HH:MM[:SS]]
+- DD/MM/YYYY[ HH:MM[:SS]]
+
+are recognised by a specialised parser. Anything else is handed to
+DateTime::FromString, so odd formats still work, just more slowly.
+*/
+
+/// Parse a timestamp in one of the fixed formats above.
+/// @param apBegin start of the text.
+/// @param apEnd end of the text.
+/// @param arTime receives the parsed time.
+/// @returns false if the text isn't in one of the fixed formats.
+bool ParseFixedDateTime(const char* apBegin, const char* apEnd, DateTime& arTime);
+
+/// Read a text time series file into a builder, appending to any points the
+/// builder already holds.
+/// @param arFileName the file to read.
+/// @param arBuilder receives the points.
+/// @param apSim simulation used by DateTime::FromString for odd formats.
+/// @param aThreads number of parser threads, or 0 for one per core.
+void ReadSeriesText(const string& arFileName,
+                    SeriesBuilder<DateTime, double>& arBuilder,
+                    Simulation* apSim,
+                    unsigned aThreads = 0);
+
+#endif
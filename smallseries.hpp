@@ -0,0 +1,187 @@
+#ifndef _SMALLSERIES_HPP_
+#define _SMALLSERIES_HPP_
+
+#include <map>
+#include <limits>
+
+#include <boost/shared_ptr.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "interp.hpp"
+#include "batchinterp.hpp"
+#include "temsimexception.hpp"
+
+using std::map;
+
+/**
+\file
+Small series without the map. Most curves (level-from-volume, efficiency,
+monthly profiles) have only a handful of points, yet a TSMap puts each point
+in its own heap node and finds brackets by walking a tree. A SmallSeries
+holds up to N points inline, in arrays inside the object, and finds the
+bracket by comparing the key with every stored key at once (SSE2) and
+counting the keys below it, which for a few dozen points is quicker than any
+search.
+
+A CompactSeries chooses the representation by size: inline up to N points,
+otherwise a map looked up with LinearInterp.
+@code
+CompactSeries<double, double> level(level_points);  // from a TSMap
+double metres = level.Value(volume);                // == LinearInterp
+@endcode
+
+Both give results identical to LinearInterp::Value on the same points: the
+same pair of points is chosen, exact keys return the stored value and the
+interpolation is done by the same CalcInterpolatedValue. The search compares
+keys converted with BatchKeyTraits, so the conversion must be exact (see
+batchinterp.hpp.)
+*/
+
+template <typename KeyType, typename ValType = double, size_t N = 32>
+class SmallSeries {
+public:
+    typedef typename Interpolator<KeyType, ValType>::TSMap TSMap;
+    /// Most points a small series can hold.
+    static const size_t Capacity = N;
+
+    SmallSeries() : mCount(0) {
+        Pad();
+    }
+
+    /// Copy the points of a map, which must have at most N points.
+    explicit SmallSeries(const TSMap& arPoints) : mCount(0) {
+        Assign(arPoints);
+    }
+
+    /// Replace the points with those of a map, which must have at most N points.
+    void Assign(const TSMap& arPoints) {
+        if (arPoints.size() > N) {
+            throw TemsimException("Too many points for a small series",
+                "SmallSeries");
+        }
+        mCount = 0;
+        for (typename TSMap::const_iterator iter = arPoints.begin();
+             iter != arPoints.end(); ++iter, ++mCount) {
+            mKeys[mCount] = iter->first;
+            mValues[mCount] = iter->second;
+            mSearch[mCount] = BatchKeyTraits<KeyType>::ToDouble(iter->first);
+        }
+        Pad();
+    }
+
+    /// Number of points.
+    size_t Size() const { return mCount; }
+
+    /// The value at a key, as LinearInterp would find it.
+    ValType Value(const KeyType& arKey) const {
+        if (mCount <= 1) {
+            // don't have enough points to interpolate
+            throw TemsimException("Error evaluating time series - at most 1 point in time series.");
+        }
+        size_t index = CountBelow(BatchKeyTraits<KeyType>::ToDouble(arKey));
+        // the pair LinearInterp uses, extrapolating from the end pairs
+        size_t lower = index == 0 ? 0 : std::min(index - 1, mCount - 2);
+        if (mKeys[lower] == arKey) {
+            return mValues[lower];
+        }
+        if (mKeys[lower + 1] == arKey) {
+            return mValues[lower + 1];
+        }
+        return CalcInterpolatedValue<KeyType, ValType>::Value(
+            mKeys[lower], mValues[lower], mKeys[lower + 1], mValues[lower + 1], arKey);
+    }
+
+private:
+    /// fill the unused search keys with +inf, which is never below a key
+    void Pad() {
+        for (size_t i = mCount; i < SearchSize; ++i) {
+            mSearch[i] = std::numeric_limits<double>::infinity();
+        }
+    }
+
+    /// number of keys below aX: the index std::lower_bound would return
+    size_t CountBelow(double aX) const {
+        // only look at the blocks of four that hold points
+        const size_t end = (mCount + 3) & ~(size_t)3;
+#ifdef __SSE2__
+        const __m128d x = _mm_set1_pd(aX);
+        __m128i count = _mm_setzero_si128();
+        for (size_t i = 0; i < end; i += 4) {
+            // a true comparison is all ones, ie. -1, so subtract to count
+            __m128d a = _mm_cmplt_pd(_mm_loadu_pd(mSearch + i), x);
+            __m128d b = _mm_cmplt_pd(_mm_loadu_pd(mSearch + i + 2), x);
+            count = _mm_sub_epi64(count, _mm_castpd_si128(a));
+            count = _mm_sub_epi64(count, _mm_castpd_si128(b));
+        }
+        long long lanes[2];
+        _mm_storeu_si128((__m128i*)lanes, count);
+        return (size_t)(lanes[0] + lanes[1]);
+#else
+        size_t count = 0;
+        for (size_t i = 0; i < end; ++i) {
+            count += mSearch[i] < aX ? 1 : 0;
+        }
+        return count;
+#endif
+    }
+
+    /// search keys are held in whole blocks of four
+    static const size_t SearchSize = (N + 3) & ~(size_t)3;
+
+    size_t      mCount;
+    double      mSearch[SearchSize];    ///< keys as doubles, padded with +inf
+    KeyType     mKeys[N];
+    ValType     mValues[N];
+};
+
+/**
+A series held inline if it is small, or in a map if it isn't, evaluated as
+LinearInterp would.
+*/
+template <typename KeyType, typename ValType = double, size_t N = 32>
+class CompactSeries {
+public:
+    typedef typename Interpolator<KeyType, ValType>::TSMap TSMap;
+
+    CompactSeries() {}
+
+    /// Copy the points of a map.
+    explicit CompactSeries(const TSMap& arPoints) {
+        Assign(arPoints);
+    }
+
+    /// Replace the points with those of a map.
+    void Assign(const TSMap& arPoints) {
+        if (arPoints.size() <= N) {
+            mSmall.Assign(arPoints);
+            mpLarge.reset();
+        } else {
+            mSmall.Assign(TSMap());
+            mpLarge.reset(new TSMap(arPoints));
+        }
+    }
+
+    /// True if the points are held inline.
+    bool IsSmall() const { return !mpLarge; }
+
+    /// Number of points.
+    size_t Size() const { return mpLarge ? mpLarge->size() : mSmall.Size(); }
+
+    /// The value at a key, as LinearInterp would find it.
+    ValType Value(const KeyType& arKey) const {
+        if (mpLarge) {
+            return mLinear.Value(*mpLarge, arKey);
+        }
+        return mSmall.Value(arKey);
+    }
+
+private:
+    SmallSeries<KeyType, ValType, N>    mSmall;
+    boost::shared_ptr<const TSMap>      mpLarge;    ///< the points, if too many for mSmall
+    LinearInterp<KeyType, ValType>      mLinear;
+};
+
+#endif
@@ -0,0 +1,306 @@
+#include "statistics.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <istream>
+#include <ostream>
+
+/**
+\file
+Implementation of the reproducible accumulators.
+*/
+
+/// adds between carries, well inside what the 64 bit digits can hold
+static const unsigned gCarryEvery = 1U << 29;
+
+// the sign bit of a double (so that -0 can be told from +0)
+static inline bool SignBit(double aValue) {
+    boost::uint64_t bits;
+    std::memcpy(&bits, &aValue, sizeof(bits));
+    return (bits >> 63) != 0;
+}
+
+void ExactSum::Clear() {
+    for (int k = 0; k < Digits; ++k) {
+        mDigits[k] = 0;
+    }
+    mPending = 0;
+    mPositiveInfinities = 0;
+    mNegativeInfinities = 0;
+    mNaNs = 0;
+}
+
+void ExactSum::Add(double aValue) {
+    boost::uint64_t bits;
+    std::memcpy(&bits, &aValue, sizeof(bits));
+    const unsigned exponent = (unsigned)((bits >> 52) & 0x7ff);
+    boost::uint64_t mantissa = bits & 0xfffffffffffffULL;
+    if (exponent == 0x7ff) {
+        if (mantissa != 0) {
+            ++mNaNs;
+        } else if (SignBit(aValue)) {
+            ++mNegativeInfinities;
+        } else {
+            ++mPositiveInfinities;
+        }
+        return;
+    }
+    if (exponent != 0) {
+        mantissa |= 1ULL << 52;
+    }
+    if (mantissa == 0) {
+        return;
+    }
+    // the value is mantissa * 2^(position - 1074)
+    const unsigned position = exponent != 0 ? exponent - 1 : 0;
+    const int k = (int)(position / 32);
+    const unsigned shift = position % 32;
+    const boost::uint64_t low = (mantissa & 0xffffffffULL) << shift;
+    const boost::uint64_t high = (mantissa >> 32) << shift;
+    const boost::int64_t d0 = (boost::int64_t)(low & 0xffffffffULL);
+    const boost::int64_t d1 = (boost::int64_t)((low >> 32) + (high & 0xffffffffULL));
+    const boost::int64_t d2 = (boost::int64_t)(high >> 32);
+    if (SignBit(aValue)) {
+        mDigits[k] -= d0;
+        mDigits[k + 1] -= d1;
+        mDigits[k + 2] -= d2;
+    } else {
+        mDigits[k] += d0;
+        mDigits[k + 1] += d1;
+        mDigits[k + 2] += d2;
+    }
+    if (++mPending >= gCarryEvery) {
+        Normalise();
+    }
+}
+
+void ExactSum::Merge(const ExactSum& arOther) {
+    ExactSum other(arOther);
+    other.Normalise();
+    Normalise();
+    for (int k = 0; k < Digits; ++k) {
+        mDigits[k] += other.mDigits[k];
+    }
+    Normalise();
+    mPositiveInfinities += arOther.mPositiveInfinities;
+    mNegativeInfinities += arOther.mNegativeInfinities;
+    mNaNs += arOther.mNaNs;
+}
+
+void ExactSum::Normalise() {
+    for (int k = 0; k + 1 < Digits; ++k) {
+        // floor division by 2^32, so the digit left is in [0, 2^32)
+        boost::int64_t carry = mDigits[k] >= 0
+            ? mDigits[k] / 4294967296LL
+            : -((-mDigits[k] + 4294967295LL) / 4294967296LL);
+        mDigits[k] -= carry * 4294967296LL;
+        mDigits[k + 1] += carry;
+    }
+    mPending = 0;
+}
+
+double ExactSum::Value() const {
+    if (mNaNs > 0 || (mPositiveInfinities > 0 && mNegativeInfinities > 0)) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    if (mPositiveInfinities > 0) {
+        return std::numeric_limits<double>::infinity();
+    }
+    if (mNegativeInfinities > 0) {
+        return -std::numeric_limits<double>::infinity();
+    }
+
+    ExactSum sum(*this);
+    sum.Normalise();
+    int top = Digits - 1;
+    while (top >= 0 && sum.mDigits[top] == 0) {
+        --top;
+    }
+    if (top < 0) {
+        return 0.0;
+    }
+    // all but the top digit are positive, so the top one gives the sign
+    const bool negative = sum.mDigits[top] < 0;
+    if (negative) {
+        for (int k = 0; k < Digits; ++k) {
+            sum.mDigits[k] = -sum.mDigits[k];
+        }
+        sum.Normalise();
+        while (sum.mDigits[top] == 0) {
+            --top;
+        }
+    }
+    if (32 * top - 1074 >= 1024) {
+        return negative ? -std::numeric_limits<double>::infinity()
+            : std::numeric_limits<double>::infinity();
+    }
+
+    // the top 53 bits, rounded to nearest (ties to even) on the rest
+    const boost::uint64_t head = (boost::uint64_t)sum.mDigits[top];
+    const boost::uint64_t next = top >= 1 ? (boost::uint64_t)sum.mDigits[top - 1] : 0;
+    const boost::uint64_t last = top >= 2 ? (boost::uint64_t)sum.mDigits[top - 2] : 0;
+    const boost::uint64_t tail = (next << 32) | last;
+    int length = 0;
+    while (length < 32 && (head >> length) != 0) {
+        ++length;
+    }
+    const int drop = length + 11;   // bits of tail below the 53 kept
+    boost::uint64_t mantissa = (head << (64 - drop)) | (tail >> drop);
+    const boost::uint64_t rest = tail & ((1ULL << drop) - 1);
+    const boost::uint64_t half = 1ULL << (drop - 1);
+    bool sticky = false;
+    for (int k = top - 3; k >= 0 && !sticky; --k) {
+        sticky = sum.mDigits[k] != 0;
+    }
+    if (rest > half || (rest == half && (sticky || (mantissa & 1)))) {
+        ++mantissa;
+    }
+    double value = std::ldexp((double)mantissa, 32 * (top - 2) - 1074 + drop);
+    return negative ? -value : value;
+}
+
+// the streams hold the bytes of each field as they are in memory
+template<class T>
+static inline void WriteField(std::ostream& arOut, const T& arValue) {
+    arOut.write((const char*)&arValue, sizeof(arValue));
+}
+template<class T>
+static inline void ReadField(std::istream& arIn, T& arValue) {
+    arIn.read((char*)&arValue, sizeof(arValue));
+}
+
+void ExactSum::Write(std::ostream& arOut) const {
+    // carried, so a sum read back has the digits a merge would give
+    ExactSum sum(*this);
+    sum.Normalise();
+    for (int k = 0; k < Digits; ++k) {
+        WriteField(arOut, sum.mDigits[k]);
+    }
+    WriteField(arOut, mPositiveInfinities);
+    WriteField(arOut, mNegativeInfinities);
+    WriteField(arOut, mNaNs);
+}
+
+bool ExactSum::Read(std::istream& arIn) {
+    for (int k = 0; k < Digits; ++k) {
+        ReadField(arIn, mDigits[k]);
+    }
+    ReadField(arIn, mPositiveInfinities);
+    ReadField(arIn, mNegativeInfinities);
+    ReadField(arIn, mNaNs);
+    mPending = 0;
+    if (!arIn) {
+        Clear();
+        return false;
+    }
+    return true;
+}
+
+// a * b as the exact sum of two doubles (Dekker's product)
+static void TwoProduct(double a, double b, double& arProduct, double& arError) {
+    const double split = 134217729.0;   // 2^27 + 1
+    double ca = split * a;
+    double a_high = ca - (ca - a);
+    double a_low = a - a_high;
+    double cb = split * b;
+    double b_high = cb - (cb - b);
+    double b_low = b - b_high;
+    arProduct = a * b;
+    arError = ((a_high * b_high - arProduct) + a_high * b_low + a_low * b_high)
+        + a_low * b_low;
+}
+
+void ReplicateStatistics::Clear() {
+    mCount = 0;
+    mMissing = 0;
+    mSum.Clear();
+    mSquares.Clear();
+    mMin = 0.0;
+    mMax = 0.0;
+}
+
+void ReplicateStatistics::Add(double aValue) {
+    if (aValue != aValue) {
+        ++mMissing;
+        return;
+    }
+    if (mCount == 0 || aValue < mMin || (aValue == mMin && SignBit(aValue))) {
+        mMin = aValue;
+    }
+    if (mCount == 0 || aValue > mMax || (aValue == mMax && !SignBit(aValue))) {
+        mMax = aValue;
+    }
+    ++mCount;
+    mSum.Add(aValue);
+    double square, error;
+    TwoProduct(aValue, aValue, square, error);
+    mSquares.Add(square);
+    mSquares.Add(error);
+}
+
+void ReplicateStatistics::Merge(const ReplicateStatistics& arOther) {
+    if (arOther.mCount > 0) {
+        if (mCount == 0 || arOther.mMin < mMin
+            || (arOther.mMin == mMin && SignBit(arOther.mMin))) {
+            mMin = arOther.mMin;
+        }
+        if (mCount == 0 || arOther.mMax > mMax
+            || (arOther.mMax == mMax && !SignBit(arOther.mMax))) {
+            mMax = arOther.mMax;
+        }
+    }
+    mCount += arOther.mCount;
+    mMissing += arOther.mMissing;
+    mSum.Merge(arOther.mSum);
+    mSquares.Merge(arOther.mSquares);
+}
+
+double ReplicateStatistics::Mean() const {
+    if (mCount == 0) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    return mSum.Value() / (double)mCount;
+}
+
+double ReplicateStatistics::Variance() const {
+    if (mCount < 2) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    // sum of squares less sum * mean, taken exactly
+    double sum = mSum.Value();
+    double mean = sum / (double)mCount;
+    double product, error;
+    TwoProduct(sum, mean, product, error);
+    ExactSum deviations(mSquares);
+    deviations.Add(-product);
+    deviations.Add(-error);
+    double squares = deviations.Value();
+    // rounding can leave a tiny negative for values that are all the same
+    return (squares < 0.0 ? 0.0 : squares) / (double)(mCount - 1);
+}
+
+double ReplicateStatistics::StdDev() const {
+    return std::sqrt(Variance());
+}
+
+void ReplicateStatistics::Write(std::ostream& arOut) const {
+    WriteField(arOut, mCount);
+    WriteField(arOut, mMissing);
+    WriteField(arOut, mMin);
+    WriteField(arOut, mMax);
+    mSum.Write(arOut);
+    mSquares.Write(arOut);
+}
+
+bool ReplicateStatistics::Read(std::istream& arIn) {
+    ReadField(arIn, mCount);
+    ReadField(arIn, mMissing);
+    ReadField(arIn, mMin);
+    ReadField(arIn, mMax);
+    if (!mSum.Read(arIn) || !mSquares.Read(arIn)) {
+        Clear();
+        return false;
+    }
+    return true;
+}
+
@@ -0,0 +1,131 @@
+#ifndef _STATISTICS_HPP_
+#define _STATISTICS_HPP_
+
+#include <limits>
+#include <iosfwd>
+
+#include <boost/cstdint.hpp>
+
+/**
+\file
+Reproducible sums and statistics. A floating point total depends on the
+order the values are added in, so a statistic merged from the partial
+results of several threads changes with the number of threads and the way
+the work happened to be split. These accumulators give bit-identical results
+however the values are grouped and merged:
+@code
+ReplicateStatistics total;
+for (size_t t = 0; t < threads; ++t) {
+    total.Merge(partial[t]);    // partials in any order, over any split
+}
+double mean = total.Mean();     // the same as a serial run gives
+@endcode
+
+ExactSum is a superaccumulator: every double added is held exactly, as an
+integer multiple of the smallest subnormal spread over 32 bit digits, and
+the total is rounded to the nearest double only when it is asked for. Adding
+a value costs a few integer additions; merging is a digit-by-digit addition.
+
+ReplicateStatistics keeps exact sums of the values and of their squares
+(each square is split into two doubles that sum to it exactly), so its mean
+and variance don't depend on order either. The variance is found from the
+exact sums with a single rounding of the mean, so it is accurate unless the
+spread is many orders of magnitude smaller than the mean.
+
+Both can be written to a binary stream and read back exactly, so partial
+results saved by one run merge with those of another just as if they had
+never left memory.
+*/
+
+/// An exact sum of doubles, rounded to the nearest double on request.
+class ExactSum {
+public:
+    ExactSum() { Clear(); }
+
+    /// Start again from zero.
+    void Clear();
+
+    /// Add a value. Infinities and NaNs are counted, and give the usual
+    /// infinite or NaN total.
+    void Add(double aValue);
+
+    /// Add every value added to another sum.
+    void Merge(const ExactSum& arOther);
+
+    /// The sum, correctly rounded.
+    double Value() const;
+
+    /// Write the exact sum to a binary stream.
+    void Write(std::ostream& arOut) const;
+
+    /// Replace this sum with one written by Write().
+    /// @returns false if the stream failed.
+    bool Read(std::istream& arIn);
+
+private:
+    /// 32 bit digits covering every double and a few more, for sums beyond
+    /// the largest double
+    static const int Digits = 70;
+
+    /// carry the digits so that all but the top one are in [0, 2^32)
+    void Normalise();
+
+    boost::int64_t  mDigits[Digits];    ///< digit k has weight 2^(32k - 1074)
+    unsigned        mPending;           ///< adds since the digits were carried
+    unsigned        mPositiveInfinities;
+    unsigned        mNegativeInfinities;
+    unsigned        mNaNs;
+};
+
+/// Count, sum, mean, variance and range of a set of values, which can be
+/// merged with other such sets in any order with the same results. NaN
+/// values are counted as missing and otherwise ignored.
+class ReplicateStatistics {
+public:
+    ReplicateStatistics() { Clear(); }
+
+    /// Start again with no values.
+    void Clear();
+
+    /// Add a value.
+    void Add(double aValue);
+
+    /// Add the values of another set.
+    void Merge(const ReplicateStatistics& arOther);
+
+    /// Number of values (not counting NaNs.)
+    boost::uint64_t Count() const { return mCount; }
+    /// Number of NaN values.
+    boost::uint64_t Missing() const { return mMissing; }
+    /// The sum of the values.
+    double Sum() const { return mSum.Value(); }
+    /// The mean, or NaN if there are no values.
+    double Mean() const;
+    /// The sample variance (divided by n - 1), or NaN if there are fewer
+    /// than 2 values.
+    double Variance() const;
+    /// The sample standard deviation.
+    double StdDev() const;
+    /// The smallest value, or NaN if there are none.
+    double Min() const { return mCount ? mMin : std::numeric_limits<double>::quiet_NaN(); }
+    /// The largest value, or NaN if there are none.
+    double Max() const { return mCount ? mMax : std::numeric_limits<double>::quiet_NaN(); }
+
+    /// Write the set to a binary stream.
+    void Write(std::ostream& arOut) const;
+
+    /// Replace this set with one written by Write().
+    /// @returns false if the stream failed.
+    bool Read(std::istream& arIn);
+
+private:
+
+    boost::uint64_t mCount;
+    boost::uint64_t mMissing;
+    ExactSum        mSum;
+    ExactSum        mSquares;
+    double          mMin;
+    double          mMax;
+};
+
+#endif
@@ -0,0 +1,245 @@
+#include "steplatency.hpp"
+#include "simulation.hpp"
+
+#include <sstream>
+#include <cmath>
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/// define boost logging stuff.
+BOOST_DEFINE_LOG(steplatency, "steplatency")
+
+/**
+\file
+Implementation of the step latency histograms.
+*/
+
+const unsigned LatencyHistogram::SubBucketBits;
+const unsigned LatencyHistogram::LongestBits;
+const size_t LatencyHistogram::Buckets;
+
+unsigned long long LatencyNow() {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (unsigned long long)((double)now.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+#endif
+}
+
+LatencyHistogram::LatencyHistogram()
+:   mCounts(Buckets, 0),
+    mCount(0),
+    mMin(0),
+    mMax(0),
+    mTotal(0.0)
+{
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& arOther) {
+    if (arOther.mCount == 0) {
+        return;
+    }
+    for (size_t b = 0; b < Buckets; ++b) {
+        mCounts[b] += arOther.mCounts[b];
+    }
+    if (mCount == 0 || arOther.mMin < mMin) {
+        mMin = arOther.mMin;
+    }
+    if (arOther.mMax > mMax) {
+        mMax = arOther.mMax;
+    }
+    mCount += arOther.mCount;
+    mTotal += arOther.mTotal;
+}
+
+void LatencyHistogram::Clear() {
+    std::fill(mCounts.begin(), mCounts.end(), 0);
+    mCount = 0;
+    mMin = 0;
+    mMax = 0;
+    mTotal = 0.0;
+}
+
+unsigned long long LatencyHistogram::LongestIn(size_t aBucket) {
+    if (aBucket < (2U << SubBucketBits)) {
+        return aBucket;
+    }
+    unsigned shift = (unsigned)(aBucket >> SubBucketBits) - 1;
+    unsigned long long mantissa = aBucket - ((size_t)shift << SubBucketBits);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+unsigned long long LatencyHistogram::Percentile(double aPercent) const {
+    if (mCount == 0) {
+        return 0;
+    }
+    // the rank of the duration wanted, from 1
+    unsigned long long rank = (unsigned long long)std::ceil(aPercent / 100.0 * (double)mCount);
+    rank = std::max(1ULL, std::min(rank, mCount));
+    unsigned long long seen = 0;
+    for (size_t b = 0; b < Buckets; ++b) {
+        seen += mCounts[b];
+        if (seen >= rank) {
+            return std::max(mMin, std::min(LongestIn(b), mMax));
+        }
+    }
+    return mMax;
+}
+
+StepLatencyRecorder::StepLatencyRecorder(size_t aOutliers)
+:   mOutliers(aOutliers),
+    mRepNumber(0),
+    mInRep(false),
+    mStep(0),
+    mStepStart(0),
+    mReps(0)
+{
+}
+
+void StepLatencyRecorder::Register(Simulation& arSim) {
+    Event::Ptr start_of_rep = arSim.PreDispatchEvents()->FindEvent("start_of_rep");
+    start_of_rep->AddAction(MakeVoidAction(
+        boost::bind(
+            &StepLatencyRecorder::StartOfRep,
+            this,
+            boost::ref(
+                arSim.RepControl().RefCurrentRep()
+            )
+        )
+    ));
+}
+
+void StepLatencyRecorder::StartOfRep(int aRep) {
+    if (mInRep) {
+        EndOfRep();
+    }
+    mRepNumber = aRep;
+    mInRep = true;
+    mStep = 0;
+}
+
+void StepLatencyRecorder::RecordCallbacks(const string& arGroup,
+                                          unsigned long long aNanoseconds) {
+    map<string, LatencyHistogram>::iterator i = mRep.Callbacks.find(arGroup);
+    if (i == mRep.Callbacks.end()) {
+        i = mRep.Callbacks.insert(std::make_pair(arGroup, LatencyHistogram())).first;
+    }
+    i->second.Record(aNanoseconds);
+}
+
+// slowest first
+static bool Slower(const LatencyOutlier& a, const LatencyOutlier& b) {
+    return a.Nanoseconds > b.Nanoseconds;
+}
+
+void StepLatencyRecorder::AddOutlier(unsigned long long aNanoseconds,
+                                     const DateTime& arTime) {
+    if (mOutliers == 0) {
+        return;
+    }
+    LatencyOutlier outlier;
+    outlier.Nanoseconds = aNanoseconds;
+    outlier.Rep = mRepNumber;
+    outlier.Step = mStep;
+    outlier.Time = arTime;
+    vector<LatencyOutlier>& outliers = mRep.Outliers;
+    outliers.insert(std::upper_bound(outliers.begin(), outliers.end(), outlier, Slower),
+        outlier);
+    if (outliers.size() > mOutliers) {
+        outliers.pop_back();
+    }
+}
+
+void StepLatencyRecorder::MergeOutliers(vector<LatencyOutlier>& arInto,
+                                        const vector<LatencyOutlier>& arFrom) const {
+    arInto.insert(arInto.end(), arFrom.begin(), arFrom.end());
+    std::stable_sort(arInto.begin(), arInto.end(), Slower);
+    if (arInto.size() > mOutliers) {
+        arInto.resize(mOutliers);
+    }
+}
+
+void StepLatencyRecorder::EndOfRep() {
+    if (!mInRep) {
+        return;
+    }
+    mInRep = false;
+    if (mRep.Steps.Count() > 0 || !mRep.Callbacks.empty()) {
+        BOOST_LOGL(steplatency, info) << "Step latency, replicate " << mRepNumber
+            << ":\n" << Report(mRep) << std::endl;
+    }
+    mStudy.Steps.Merge(mRep.Steps);
+    for (map<string, LatencyHistogram>::const_iterator i = mRep.Callbacks.begin();
+         i != mRep.Callbacks.end(); ++i) {
+        mStudy.Callbacks[i->first].Merge(i->second);
+    }
+    MergeOutliers(mStudy.Outliers, mRep.Outliers);
+    ++mReps;
+
+    mRep.Steps.Clear();
+    for (map<string, LatencyHistogram>::iterator i = mRep.Callbacks.begin();
+         i != mRep.Callbacks.end(); ++i) {
+        // kept, so the next replicate doesn't allocate them again
+        i->second.Clear();
+    }
+    mRep.Outliers.clear();
+}
+
+void StepLatencyRecorder::EndOfStudy() {
+    EndOfRep();
+    BOOST_LOGL(steplatency, info) << "Step latency, study of " << mReps
+        << " replicates:\n" << Report(mStudy) << std::endl;
+}
+
+// a duration in microseconds
+static string Micro(unsigned long long aNanoseconds) {
+    return str(boost::format("%.1fus") % (aNanoseconds * 1e-3));
+}
+
+// one line of the report
+static void ReportLine(std::ostream& arOut, const string& arName,
+                       const LatencyHistogram& arHistogram) {
+    arOut << "  " << arName << ": " << arHistogram.Count() << " timed, mean "
+        << Micro((unsigned long long)arHistogram.Mean())
+        << ", p50 " << Micro(arHistogram.Percentile(50.0))
+        << ", p99 " << Micro(arHistogram.Percentile(99.0))
+        << ", p99.9 " << Micro(arHistogram.Percentile(99.9))
+        << ", max " << Micro(arHistogram.Max()) << "\n";
+}
+
+string StepLatencyRecorder::Report(const Latencies& arLatencies) {
+    std::ostringstream report;
+    ReportLine(report, "steps", arLatencies.Steps);
+    for (map<string, LatencyHistogram>::const_iterator i = arLatencies.Callbacks.begin();
+         i != arLatencies.Callbacks.end(); ++i) {
+        if (i->second.Count() > 0) {
+            ReportLine(report, "callbacks " + i->first, i->second);
+        }
+    }
+    if (!arLatencies.Outliers.empty()) {
+        report << "  slowest steps:\n";
+        for (size_t i = 0; i < arLatencies.Outliers.size(); ++i) {
+            const LatencyOutlier& outlier = arLatencies.Outliers[i];
+            report << "    " << Micro(outlier.Nanoseconds) << " replicate "
+                << outlier.Rep << " step " << outlier.Step << " at "
+                << outlier.Time << "\n";
+        }
+    }
+    return report.str();
+}
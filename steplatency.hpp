@@ -0,0 +1,219 @@
+#ifndef _STEPLATENCY_HPP_
+#define _STEPLATENCY_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
+#include <boost/log/log.hpp>
+
+#include "datetime.hpp"
+#include "logging.hpp"
+
+using std::string;
+using std::vector;
+using std::map;
+
+/// declare the boost logging stuff.
+BOOST_DECLARE_LOG(steplatency)
+
+/**
+\file
+Per-step latency. The average step time hides the occasional very slow
+step: a rare callback path, a Reset fallback, an exception caught in an
+interpolator. A StepLatencyRecorder records the wall time of every step,
+and of every named group of callbacks run through the ObjectRegister, in
+histograms cheap enough to leave on:
+@code
+StepLatencyRecorder latency;
+latency.Register(sim);                      // starts each replicate
+sim.Objects().SetLatencyRecorder(&latency); // times Do*Callbacks groups
+for (...) {                                 // each replicate
+    for (...) {                             // each step
+        latency.BeginStep();
+        // ... the step ...
+        latency.EndStep(now);
+    }
+    latency.EndOfRep();
+}
+latency.EndOfStudy();
+@endcode
+
+At the end of each replicate and of the study the recorder logs the 50th,
+99th and 99.9th percentiles and the maximum of the step times and of each
+callback group's times, with the step index and simulation time of the
+slowest steps. A replicate not ended with EndOfRep() is reported when the
+next one starts, or by EndOfStudy().
+
+LatencyHistogram is in the style of an HDR histogram: a value is counted in
+one of 128 linear buckets within its power of two, so recording is a few
+integer operations and percentiles are within 1% of the exact value, over a
+range from a nanosecond to a quarter of an hour.
+*/
+
+class Simulation;
+
+/// Nanoseconds on a monotonic clock.
+unsigned long long LatencyNow();
+
+/// A histogram of durations in nanoseconds, to within 1%.
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    /// Count a duration.
+    void Record(unsigned long long aNanoseconds) {
+        ++mCounts[BucketOf(aNanoseconds)];
+        if (mCount == 0 || aNanoseconds < mMin) {
+            mMin = aNanoseconds;
+        }
+        if (aNanoseconds > mMax) {
+            mMax = aNanoseconds;
+        }
+        ++mCount;
+        mTotal += (double)aNanoseconds;
+    }
+
+    /// Add the counts of another histogram.
+    void Merge(const LatencyHistogram& arOther);
+
+    /// Forget everything counted.
+    void Clear();
+
+    /// Number of durations counted.
+    unsigned long long Count() const { return mCount; }
+    /// The shortest duration, or 0 if there are none.
+    unsigned long long Min() const { return mMin; }
+    /// The longest duration, or 0 if there are none.
+    unsigned long long Max() const { return mMax; }
+    /// The mean duration, or 0 if there are none.
+    double Mean() const { return mCount ? mTotal / (double)mCount : 0.0; }
+
+    /// The duration that aPercent percent of those counted are at or
+    /// below (to within 1%, and never more than Max().)
+    unsigned long long Percentile(double aPercent) const;
+
+private:
+    /// linear buckets in each power of two
+    static const unsigned SubBucketBits = 7;
+    /// durations above 2^LongestBits ns are counted as that
+    static const unsigned LongestBits = 40;
+    /// number of buckets
+    static const size_t Buckets = (LongestBits - SubBucketBits + 1) << SubBucketBits;
+
+    /// the bucket a duration is counted in
+    static size_t BucketOf(unsigned long long aNanoseconds) {
+        if (aNanoseconds >= (1ULL << LongestBits)) {
+            aNanoseconds = (1ULL << LongestBits) - 1;
+        }
+        if (aNanoseconds < (1ULL << SubBucketBits)) {
+            return (size_t)aNanoseconds;
+        }
+        unsigned shift = HighestBit(aNanoseconds) - SubBucketBits;
+        return ((size_t)shift << SubBucketBits) + (size_t)(aNanoseconds >> shift);
+    }
+    /// the longest duration counted in a bucket
+    static unsigned long long LongestIn(size_t aBucket);
+    /// the index of the highest bit set
+    static unsigned HighestBit(unsigned long long aValue) {
+#ifdef __GNUC__
+        return 63 - __builtin_clzll(aValue);
+#else
+        unsigned bit = 0;
+        while (aValue >>= 1) {
+            ++bit;
+        }
+        return bit;
+#endif
+    }
+
+    vector<unsigned long long> mCounts;
+    unsigned long long  mCount;
+    unsigned long long  mMin;
+    unsigned long long  mMax;
+    double              mTotal;
+};
+
+/// One of the slowest steps.
+struct LatencyOutlier {
+    unsigned long long  Nanoseconds;
+    int                 Rep;    ///< replicate number
+    long long           Step;   ///< step index within the replicate
+    DateTime            Time;   ///< simulation time of the step
+};
+
+/// Records the wall time of the steps of a simulation and of its callback
+/// groups. Not thread safe: each simulation has its own.
+class StepLatencyRecorder : boost::noncopyable {
+public:
+    typedef boost::shared_ptr<StepLatencyRecorder> Ptr;
+
+    /// Histograms of one replicate, or of a whole study.
+    struct Latencies {
+        LatencyHistogram    Steps;
+        map<string, LatencyHistogram> Callbacks;    ///< by callback group name
+        vector<LatencyOutlier> Outliers;            ///< slowest steps, slowest first
+    };
+
+    /// @param aOutliers the number of slowest steps to keep.
+    StepLatencyRecorder(size_t aOutliers = 10);
+
+    /// Have StartOfRep() called at the start of each rep of a simulation.
+    void Register(Simulation& arSim);
+
+    /// Finish the previous replicate, if any, and start another.
+    void StartOfRep(int aRep);
+
+    /// Note the start of a step.
+    void BeginStep() { mStepStart = LatencyNow(); }
+
+    /// Note the end of a step.
+    /// @param arTime the simulation time of the step.
+    void EndStep(const DateTime& arTime) {
+        unsigned long long ns = LatencyNow() - mStepStart;
+        mRep.Steps.Record(ns);
+        if (mOutliers > 0 && (mRep.Outliers.size() < mOutliers
+            || (!mRep.Outliers.empty() && ns > mRep.Outliers.back().Nanoseconds))) {
+            AddOutlier(ns, arTime);
+        }
+        ++mStep;
+    }
+
+    /// Record the time taken by a group of callbacks.
+    void RecordCallbacks(const string& arGroup, unsigned long long aNanoseconds);
+
+    /// Log the replicate's latencies and add them to the study's. Does
+    /// nothing if the replicate has already been ended.
+    void EndOfRep();
+
+    /// Finish the last replicate and log the study's latencies.
+    void EndOfStudy();
+
+    /// The current replicate's latencies.
+    const Latencies& Replicate() const { return mRep; }
+    /// The latencies of the replicates finished so far.
+    const Latencies& Study() const { return mStudy; }
+
+    /// A readable summary of some latencies.
+    static string Report(const Latencies& arLatencies);
+
+private:
+    /// keep a step among the slowest
+    void AddOutlier(unsigned long long aNanoseconds, const DateTime& arTime);
+    /// add outliers to a list, keeping the slowest
+    void MergeOutliers(vector<LatencyOutlier>& arInto,
+                       const vector<LatencyOutlier>& arFrom) const;
+
+    size_t              mOutliers;      ///< number of slowest steps kept
+    int                 mRepNumber;
+    bool                mInRep;         ///< true if a replicate has started
+    long long           mStep;          ///< steps so far in the replicate
+    unsigned long long  mStepStart;
+    Latencies           mRep;
+    Latencies           mStudy;
+    size_t              mReps;          ///< replicates in the study so far
+};
+
+#endif
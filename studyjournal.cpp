@@ -0,0 +1,337 @@
+#include "studyjournal.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+/// define boost logging stuff.
+BOOST_DEFINE_LOG(studyjournal, "studyjournal")
+
+/**
+\file
+Implementation of the study journal.
+*/
+
+/// magic string at the start of the study file
+static const char* gStudyMagic = "TSTUDY01";
+/// magic string at the start of a replicate record
+static const char* gRecordMagic = "TJRNL001";
+/// result size recorded for a replicate without a result file
+static const unsigned long long gNoResultFile = ~0ULL;
+/// longest statistic name read back, to stop at damaged data
+static const unsigned gLongestName = 1U << 16;
+
+void MergeStudyStatistics(StudyStatistics& arInto, const StudyStatistics& arFrom) {
+    for (StudyStatistics::const_iterator i = arFrom.begin(); i != arFrom.end(); ++i) {
+        arInto[i->first].Merge(i->second);
+    }
+}
+
+namespace {
+
+template<class T>
+void WriteField(std::ostream& arOut, const T& arValue) {
+    arOut.write((const char*)&arValue, sizeof(arValue));
+}
+template<class T>
+void ReadField(std::istream& arIn, T& arValue) {
+    arIn.read((char*)&arValue, sizeof(arValue));
+}
+
+// 64 bit FNV-1a hash of a record's bytes
+unsigned long long HashRecord(const string& arBytes) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i < arBytes.size(); ++i) {
+        h = (h ^ (unsigned char)arBytes[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+bool FileExists(const string& arFileName) {
+    struct stat info;
+    return stat(arFileName.c_str(), &info) == 0;
+}
+
+unsigned long long FileSize(const string& arFileName) {
+    struct stat info;
+    if (stat(arFileName.c_str(), &info) != 0) {
+        return gNoResultFile;
+    }
+    return (unsigned long long)info.st_size;
+}
+
+// write a file's data through to the disk
+bool SyncFile(const string& arFileName) {
+#ifdef _WIN32
+    int fd = _open(arFileName.c_str(), _O_RDWR | _O_BINARY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = _commit(fd) == 0;
+    _close(fd);
+#else
+    int fd = open(arFileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+#endif
+    return ok;
+}
+
+// make the renames in a directory durable (a rename is written through on
+// Windows)
+void SyncDirectory(const string& arDirectory) {
+#ifndef _WIN32
+    int fd = open(arDirectory.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+#endif
+}
+
+// rename a file over another, atomically
+bool ReplaceFile(const string& arFrom, const string& arTo) {
+#ifdef _WIN32
+    return MoveFileExA(arFrom.c_str(), arTo.c_str(),
+        MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(arFrom.c_str(), arTo.c_str()) == 0;
+#endif
+}
+
+void MakeDirectory(const string& arDirectory) {
+#ifdef _WIN32
+    _mkdir(arDirectory.c_str());
+#else
+    mkdir(arDirectory.c_str(), 0777);
+#endif
+}
+
+// write a file so that it either appears whole or not at all
+void WriteAtomically(const string& arDirectory, const string& arFileName,
+                     const string& arBytes) {
+    string temporary = arFileName + ".tmp";
+    {
+        std::ofstream file(temporary.c_str(), std::ios::binary | std::ios::trunc);
+        file.write(arBytes.data(), arBytes.size());
+        file.close();
+        if (!file) {
+            throw TemsimException("Couldn't write " + temporary, "StudyJournal");
+        }
+    }
+    if (!SyncFile(temporary) || !ReplaceFile(temporary, arFileName)) {
+        throw TemsimException("Couldn't commit " + arFileName, "StudyJournal");
+    }
+    SyncDirectory(arDirectory);
+}
+
+bool ReadFile(const string& arFileName, string& arBytes) {
+    std::ifstream file(arFileName.c_str(), std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::ostringstream bytes;
+    bytes << file.rdbuf();
+    arBytes = bytes.str();
+    return true;
+}
+
+} // namespace
+
+void WriteStudyStatistics(std::ostream& arOut, const StudyStatistics& arStatistics) {
+    WriteField(arOut, (unsigned long long)arStatistics.size());
+    for (StudyStatistics::const_iterator i = arStatistics.begin();
+         i != arStatistics.end(); ++i) {
+        WriteField(arOut, (unsigned)i->first.size());
+        arOut.write(i->first.data(), i->first.size());
+        i->second.Write(arOut);
+    }
+}
+
+bool ReadStudyStatistics(std::istream& arIn, StudyStatistics& arStatistics) {
+    arStatistics.clear();
+    unsigned long long count;
+    ReadField(arIn, count);
+    for (unsigned long long i = 0; arIn && i < count; ++i) {
+        unsigned length;
+        ReadField(arIn, length);
+        if (!arIn || length > gLongestName) {
+            arStatistics.clear();
+            return false;
+        }
+        string name(length, '\0');
+        if (length > 0) {
+            arIn.read(&name[0], length);
+        }
+        if (!arStatistics[name].Read(arIn)) {
+            arStatistics.clear();
+            return false;
+        }
+    }
+    if (!arIn) {
+        arStatistics.clear();
+        return false;
+    }
+    return true;
+}
+
+StudyJournal::StudyJournal(const string& arDirectory, const string& arStudy)
+:   mDirectory(arDirectory),
+    mStudy(arStudy)
+{
+    MakeDirectory(mDirectory);
+    string study_file = Path("study.journal");
+    string expected = string(gStudyMagic) + mStudy;
+    string found;
+    if (ReadFile(study_file, found)) {
+        if (found != expected) {
+            throw TemsimException("Journal " + mDirectory
+                + " belongs to another study", "StudyJournal");
+        }
+    } else {
+        WriteAtomically(mDirectory, study_file, expected);
+    }
+}
+
+string StudyJournal::Path(const string& arName) const {
+    if (mDirectory.empty()) {
+        return arName;
+    }
+    char last = mDirectory[mDirectory.size() - 1];
+    if (last == '/' || last == '\\') {
+        return mDirectory + arName;
+    }
+    return mDirectory + "/" + arName;
+}
+
+string StudyJournal::ResultFile(long long aReplicate) const {
+    std::ostringstream name;
+    name << "replicate-" << aReplicate << ".result";
+    return Path(name.str());
+}
+
+string StudyJournal::PendingFile(long long aReplicate) const {
+    return ResultFile(aReplicate) + ".pending";
+}
+
+string StudyJournal::RecordFile(long long aReplicate) const {
+    std::ostringstream name;
+    name << "replicate-" << aReplicate << ".journal";
+    return Path(name.str());
+}
+
+bool StudyJournal::IsComplete(long long aReplicate) const {
+    return FileExists(RecordFile(aReplicate));
+}
+
+bool StudyJournal::Load(long long aReplicate, StudyStatistics& arContribution) const {
+    arContribution.clear();
+    string bytes;
+    if (!ReadFile(RecordFile(aReplicate), bytes)) {
+        return false;
+    }
+    const size_t magic = strlen(gRecordMagic);
+    unsigned long long hash;
+    if (bytes.size() < magic + sizeof(hash)
+        || bytes.compare(0, magic, gRecordMagic) != 0) {
+        BOOST_LOGL(studyjournal, info) << "Replicate " << aReplicate
+            << " has a damaged record and will be run again" << std::endl;
+        return false;
+    }
+    memcpy(&hash, bytes.data() + bytes.size() - sizeof(hash), sizeof(hash));
+    bytes.resize(bytes.size() - sizeof(hash));
+    if (HashRecord(bytes) != hash) {
+        BOOST_LOGL(studyjournal, info) << "Replicate " << aReplicate
+            << " has a damaged record and will be run again" << std::endl;
+        return false;
+    }
+
+    std::istringstream in(bytes.substr(magic));
+    long long replicate;
+    unsigned long long result_size;
+    ReadField(in, replicate);
+    ReadField(in, result_size);
+    if (!in || replicate != aReplicate) {
+        return false;
+    }
+    if (result_size != gNoResultFile && FileSize(ResultFile(aReplicate)) != result_size) {
+        BOOST_LOGL(studyjournal, info) << "Replicate " << aReplicate
+            << " is missing its result file and will be run again" << std::endl;
+        return false;
+    }
+    return ReadStudyStatistics(in, arContribution);
+}
+
+vector<long long> StudyJournal::Resume(const vector<long long>& arReplicates,
+                                       StudyStatistics& arTotals) const {
+    vector<long long> todo;
+    size_t done = 0;
+    StudyStatistics contribution;
+    for (size_t i = 0; i < arReplicates.size(); ++i) {
+        if (Load(arReplicates[i], contribution)) {
+            MergeStudyStatistics(arTotals, contribution);
+            ++done;
+        } else {
+            todo.push_back(arReplicates[i]);
+        }
+    }
+    if (done > 0) {
+        BOOST_LOGL(studyjournal, info) << "Resuming study in " << mDirectory
+            << ": " << done << " replicates already complete, "
+            << todo.size() << " to run" << std::endl;
+    }
+    return todo;
+}
+
+string StudyJournal::Begin(long long aReplicate) {
+    // a damaged record counts as not committed, so goes with the rest
+    std::remove(RecordFile(aReplicate).c_str());
+    std::remove((RecordFile(aReplicate) + ".tmp").c_str());
+    std::remove(ResultFile(aReplicate).c_str());
+    std::remove(PendingFile(aReplicate).c_str());
+    return PendingFile(aReplicate);
+}
+
+void StudyJournal::Commit(long long aReplicate, const StudyStatistics& arContribution) {
+    unsigned long long result_size = gNoResultFile;
+    string pending = PendingFile(aReplicate);
+    if (FileExists(pending)) {
+        string result = ResultFile(aReplicate);
+        if (!SyncFile(pending) || !ReplaceFile(pending, result)) {
+            throw TemsimException("Couldn't commit result file " + result,
+                "StudyJournal");
+        }
+        result_size = FileSize(result);
+    }
+    if (!mPoolFile.empty() && !SyncFile(mPoolFile)) {
+        throw TemsimException("Couldn't sync chunk pool " + mPoolFile,
+            "StudyJournal");
+    }
+
+    std::ostringstream out;
+    out.write(gRecordMagic, strlen(gRecordMagic));
+    WriteField(out, aReplicate);
+    WriteField(out, result_size);
+    WriteStudyStatistics(out, arContribution);
+    string bytes = out.str();
+
+    unsigned long long hash = HashRecord(bytes);
+    bytes.append((const char*)&hash, sizeof(hash));
+    WriteAtomically(mDirectory, RecordFile(aReplicate), bytes);
+}
@@ -0,0 +1,142 @@
+#ifndef _STUDYJOURNAL_HPP_
+#define _STUDYJOURNAL_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
+#include <boost/log/log.hpp>
+
+#include "statistics.hpp"
+#include "logging.hpp"
+#include "temsimexception.hpp"
+
+using std::string;
+using std::vector;
+using std::map;
+
+/// declare the boost logging stuff.
+BOOST_DECLARE_LOG(studyjournal)
+
+/**
+\file
+Resumable studies. A study of many replicates can run for days; if it is
+stopped part way through, the replicates already finished shouldn't have to
+be run again. A StudyJournal keeps a directory with a record for every
+replicate that has been completed, written only once the replicate's result
+file and its contribution to the study statistics are safely on disk.
+
+A replicate is committed in this order, so a crash at any point leaves it
+either complete or not started:
+- the result file, written under a pending name, is synced and renamed to
+  its final name;
+- the chunk pool, if there is one, is synced;
+- the record, holding the replicate's statistics, is written under a
+  temporary name, synced and renamed, and the directory synced.
+
+The record is the commit: a result file without one is left over from an
+interrupted replicate and is overwritten when the replicate is run again.
+
+Each replicate is seeded from its own number (see RandomDouble::StartOfRep),
+so the replicates still to run give the same results whether or not the
+others ran in the same process, and as the study statistics are exact sums
+(see ReplicateStatistics) the totals reloaded from the records and merged
+with those of the remaining replicates are bit for bit those of an
+uninterrupted run:
+@code
+StudyJournal journal("results/journal", studyFingerprint);
+StudyStatistics totals;
+vector<long long> todo = journal.Resume(replicates, totals);
+for (size_t i = 0; i < todo.size(); ++i) {
+    string file = journal.Begin(todo[i]);
+    StudyStatistics contribution;
+    // ... run replicate todo[i], writing its results to file and
+    // adding to contribution ...
+    journal.Commit(todo[i], contribution);
+    MergeStudyStatistics(totals, contribution);
+}
+@endcode
+
+Different replicates may be begun and committed from different threads. A
+journal directory must only be used by one process at a time.
+*/
+
+/// Named statistics accumulated over a study, eg. "Storage.Great_Lake.Volume".
+typedef map<string, ReplicateStatistics> StudyStatistics;
+
+/// Add the statistics of arFrom to those of arInto, by name.
+void MergeStudyStatistics(StudyStatistics& arInto, const StudyStatistics& arFrom);
+
+/// Write statistics to a binary stream, exactly.
+void WriteStudyStatistics(std::ostream& arOut, const StudyStatistics& arStatistics);
+
+/// Read statistics written by WriteStudyStatistics().
+/// @returns false if the stream failed or was damaged.
+bool ReadStudyStatistics(std::istream& arIn, StudyStatistics& arStatistics);
+
+/// The record of the replicates of a study that have been completed.
+class StudyJournal : boost::noncopyable {
+public:
+    typedef boost::shared_ptr<StudyJournal> Ptr;
+
+    /// Open a journal, creating its directory if necessary.
+    /// @param arDirectory the journal directory, which also holds the
+    /// replicates' result files.
+    /// @param arStudy identifies the study, eg. a hash of its model and
+    /// settings. A journal can only be resumed by the same study; opening
+    /// one kept by another throws.
+    StudyJournal(const string& arDirectory, const string& arStudy);
+
+    /// The journal directory.
+    const string& Directory() const { return mDirectory; }
+
+    /// Identifies the study.
+    const string& Study() const { return mStudy; }
+
+    /// Sync a study-wide chunk pool file before each commit, as the result
+    /// files refer to it.
+    void SetPoolFile(const string& arFileName) { mPoolFile = arFileName; }
+
+    /// The result file of a committed replicate.
+    string ResultFile(long long aReplicate) const;
+
+    /// The file a replicate's results are written to before it is committed.
+    string PendingFile(long long aReplicate) const;
+
+    /// True if the replicate has been committed.
+    bool IsComplete(long long aReplicate) const;
+
+    /// Read the statistics committed by a replicate.
+    /// @returns false if the replicate hasn't been committed, or its record
+    /// or result file is damaged.
+    bool Load(long long aReplicate, StudyStatistics& arContribution) const;
+
+    /// Reload the statistics of the replicates already committed.
+    /// @param arReplicates the replicates of the study.
+    /// @param arTotals the committed replicates' statistics are merged in.
+    /// @returns the replicates still to run, in the given order.
+    vector<long long> Resume(const vector<long long>& arReplicates,
+                             StudyStatistics& arTotals) const;
+
+    /// Start a replicate, clearing anything left by an earlier attempt.
+    /// @returns the file to write its results to (PendingFile().)
+    string Begin(long long aReplicate);
+
+    /// Commit a replicate whose result file has been closed.
+    /// @param arContribution its statistics.
+    void Commit(long long aReplicate, const StudyStatistics& arContribution);
+
+private:
+    /// the record of a replicate
+    string RecordFile(long long aReplicate) const;
+    /// a file in the directory
+    string Path(const string& arName) const;
+
+    string  mDirectory;
+    string  mStudy;
+    string  mPoolFile;  ///< synced before each commit, if set
+};
+
+#endif
@@ -0,0 +1,251 @@
+#include "tabulatedfunction.hpp"
+
+#include <cmath>
+#include <sstream>
+#include <algorithm>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "temsimexception.hpp"
+
+/// define boost logging stuff.
+BOOST_DEFINE_LOG(tabulatedfunction, "tabulatedfunction")
+
+/**
+\file
+Implementation of tabulated functions.
+*/
+
+/// intervals in the grid before refinement
+static const size_t gInitialIntervals = 16;
+/// fractions of an interval at which the fit is tested
+static const double gTestPoints[] = { 0.125, 0.25, 0.375, 0.5, 0.625, 0.75, 0.875 };
+/// guide table buckets per interval
+static const size_t gGuidePerInterval = 2;
+
+TabulatedFunction::TabulatedFunction(const Function& arFunction,
+                                     double aLower, double aUpper,
+                                     double aTolerance,
+                                     TabulationMethod aMethod,
+                                     size_t aMaxPoints)
+:   mpTable(new Table),
+    mMethod(aMethod)
+{
+    if (!arFunction) {
+        throw TemsimException("Can't tabulate an empty function",
+            "TabulatedFunction");
+    }
+    if (!(aLower < aUpper) || !(aTolerance > 0.0)) {
+        throw TemsimException(str(format(
+            "Can't tabulate over [%g, %g] with tolerance %g")
+            % aLower % aUpper % aTolerance), "TabulatedFunction");
+    }
+    Table& table = *mpTable;
+    const TabulatedFunction* tabulated = arFunction.target<TabulatedFunction>();
+    table.Original = tabulated ? tabulated->Original() : arFunction;
+    table.Lower = aLower;
+    table.Upper = aUpper;
+    table.Tolerance = aTolerance;
+
+    // refine each interval of a uniform starting grid
+    Node left = MakeNode(aLower);
+    for (size_t i = 1; i <= gInitialIntervals; ++i) {
+        Node right = MakeNode(i == gInitialIntervals ? aUpper
+            : aLower + (aUpper - aLower) * (double)i / (double)gInitialIntervals);
+        Refine(left, right, aMaxPoints);
+        left = right;
+    }
+    table.Knots.push_back(aUpper);
+
+    // guide table: the interval at (or just before) the start of each bucket
+    size_t intervals = table.Knots.size() - 1;
+    size_t buckets = intervals * gGuidePerInterval;
+    table.GuideScale = (double)buckets / (aUpper - aLower);
+    table.Guide.resize(buckets + 1);
+    for (size_t b = 0; b <= buckets; ++b) {
+        double x = aLower + (double)b / table.GuideScale;
+        size_t i = std::upper_bound(table.Knots.begin(), table.Knots.end(), x)
+            - table.Knots.begin();
+        // step back one so that rounding in operator() can't skip an interval
+        i = i >= 2 ? i - 2 : 0;
+        table.Guide[b] = std::min(i, intervals - 1);
+    }
+}
+
+TabulatedFunction::Node TabulatedFunction::MakeNode(double aX) const {
+    const Table& table = *mpTable;
+    Node node;
+    node.X = aX;
+    node.Y = table.Original(aX);
+    node.Slope = 0.0;
+    if (node.Y != node.Y) {
+        throw TemsimException(str(format(
+            "Function to tabulate is NaN at %g") % aX), "TabulatedFunction");
+    }
+    if (mMethod == eCubicTable) {
+        // numerical slope, one-sided (second order) at the ends of the domain
+        const double h = (table.Upper - table.Lower) * 1e-6;
+        if (aX - h < table.Lower) {
+            node.Slope = (-3.0 * node.Y + 4.0 * table.Original(aX + h)
+                - table.Original(aX + 2.0 * h)) / (2.0 * h);
+        } else if (aX + h > table.Upper) {
+            node.Slope = (3.0 * node.Y - 4.0 * table.Original(aX - h)
+                + table.Original(aX - 2.0 * h)) / (2.0 * h);
+        } else {
+            node.Slope = (table.Original(aX + h) - table.Original(aX - h)) / (2.0 * h);
+        }
+    }
+    return node;
+}
+
+void TabulatedFunction::Fit(const Node& arLeft, const Node& arRight,
+                            double* apCoeffs) const {
+    const double h = arRight.X - arLeft.X;
+    const double secant = (arRight.Y - arLeft.Y) / h;
+    apCoeffs[0] = arLeft.Y;
+    if (mMethod == eCubicTable) {
+        apCoeffs[1] = arLeft.Slope;
+        apCoeffs[2] = (3.0 * secant - 2.0 * arLeft.Slope - arRight.Slope) / h;
+        apCoeffs[3] = (arLeft.Slope + arRight.Slope - 2.0 * secant) / (h * h);
+    } else {
+        apCoeffs[1] = secant;
+        apCoeffs[2] = 0.0;
+        apCoeffs[3] = 0.0;
+    }
+}
+
+void TabulatedFunction::Refine(const Node& arLeft, const Node& arRight,
+                               size_t aMaxPoints) {
+    Table& table = *mpTable;
+    double coeffs[4];
+    Fit(arLeft, arRight, coeffs);
+
+    const double h = arRight.X - arLeft.X;
+    double error = 0.0;
+    for (size_t i = 0; i < sizeof(gTestPoints) / sizeof(gTestPoints[0]); ++i) {
+        double t = h * gTestPoints[i];
+        double fitted = coeffs[0] + t * (coeffs[1] + t * (coeffs[2] + t * coeffs[3]));
+        error = std::max(error, std::fabs(fitted - table.Original(arLeft.X + t)));
+    }
+
+    double middle = arLeft.X + 0.5 * h;
+    if (error > table.Tolerance) {
+        if (!(middle > arLeft.X && middle < arRight.X)) {
+            // eg. a step in the function
+            throw TemsimException(str(format(
+                "Can't tabulate to within %g near %g: the error is %g where the "
+                "interval can't be split any further")
+                % table.Tolerance % arLeft.X % error), "TabulatedFunction");
+        }
+        if (table.Knots.size() + 2 > aMaxPoints) {
+            throw TemsimException(str(format(
+                "Tabulating to within %g needs more than %d points (near %g)")
+                % table.Tolerance % aMaxPoints % middle), "TabulatedFunction");
+        }
+        Node node = MakeNode(middle);
+        Refine(arLeft, node, aMaxPoints);
+        Refine(node, arRight, aMaxPoints);
+        return;
+    }
+    table.Knots.push_back(arLeft.X);
+    table.Coeffs.insert(table.Coeffs.end(), coeffs, coeffs + 4);
+}
+
+TabulationReport TabulatedFunction::Measure(size_t aSamples) const {
+    const Table& table = *mpTable;
+    aSamples = std::max(aSamples, (size_t)2);
+    vector<double> xs(aSamples);
+    for (size_t i = 0; i < aSamples; ++i) {
+        xs[i] = table.Lower + (table.Upper - table.Lower) * (double)i / (double)(aSamples - 1);
+    }
+
+    TabulationReport report;
+    report.Points = Points();
+    report.Tolerance = table.Tolerance;
+    report.MaxError = 0.0;
+    for (size_t i = 0; i < aSamples; ++i) {
+        report.MaxError = std::max(report.MaxError,
+            std::fabs((*this)(xs[i]) - table.Original(xs[i])));
+    }
+
+    using boost::posix_time::ptime;
+    using boost::posix_time::microsec_clock;
+    // the sums are kept so the calls can't be optimised away
+    static volatile double sink;
+    double sum = 0.0;
+    ptime start = microsec_clock::universal_time();
+    for (size_t i = 0; i < aSamples; ++i) {
+        sum += table.Original(xs[i]);
+    }
+    ptime middle = microsec_clock::universal_time();
+    for (size_t i = 0; i < aSamples; ++i) {
+        sum += (*this)(xs[i]);
+    }
+    ptime end = microsec_clock::universal_time();
+    sink = sum;
+
+    report.OriginalSeconds = (middle - start).total_microseconds() * 1e-6;
+    report.TabulatedSeconds = (end - middle).total_microseconds() * 1e-6;
+    report.Speedup = report.TabulatedSeconds > 0.0
+        ? report.OriginalSeconds / report.TabulatedSeconds : 0.0;
+    return report;
+}
+
+// log how a tabulation went
+static void LogTabulation(const string& arName, double aLower, double aUpper,
+                          const TabulationReport& arReport) {
+    BOOST_LOGL(tabulatedfunction, info) << "Tabulated " << arName << " over ["
+        << aLower << ", " << aUpper << "] with " << arReport.Points
+        << " points: max error " << arReport.MaxError << " (tolerance "
+        << arReport.Tolerance << "), " << arReport.Speedup << " times faster"
+        << std::endl;
+}
+
+TabulationReport TabulateRegisteredFunction(ObjectRegister& arReg,
+                                            const string& arKey,
+                                            double aLower, double aUpper,
+                                            double aTolerance,
+                                            TabulationMethod aMethod) {
+    TabulatedFunction::Function* function =
+        arReg.Get<TabulatedFunction::Function*>(arKey);
+    if (!*function) {
+        throw TemsimException("Function " + arKey + " isn't set, so can't "
+            "be tabulated", "TabulatedFunction");
+    }
+    TabulatedFunction table(*function, aLower, aUpper, aTolerance, aMethod);
+    *function = table;
+
+    TabulationReport report = table.Measure();
+    LogTabulation(arKey, aLower, aUpper, report);
+    return report;
+}
+
+void ResetFromString(ObjectRegister& arReg, boost::function<double (double)>* p, string s) {
+    std::istringstream in(s);
+    string word, method;
+    double lower, upper, tolerance;
+    if (!(in >> word >> lower >> upper >> tolerance) || word != "tabulate") {
+        throw TemsimException("Couldn't reset function to " + s, "ObjectRegister");
+    }
+    in >> method;
+    TabulationMethod how = eCubicTable;
+    if (method == "linear") {
+        how = eLinearTable;
+    } else if (method != "" && method != "cubic") {
+        throw TemsimException("Unknown tabulation method " + method, "ObjectRegister");
+    }
+    if (!*p) {
+        throw TemsimException("Function isn't set, so can't be tabulated ("
+            + s + ")", "ObjectRegister");
+    }
+    // a later Reset finds the table made by an earlier one
+    const TabulatedFunction* tabulated = p->target<TabulatedFunction>();
+    if (tabulated && tabulated->Lower() == lower && tabulated->Upper() == upper
+        && tabulated->Tolerance() == tolerance && tabulated->Method() == how) {
+        return;
+    }
+    TabulatedFunction table(*p, lower, upper, tolerance, how);
+    *p = table;
+
+    LogTabulation("function", lower, upper, table.Measure());
+}
@@ -0,0 +1,160 @@
+#ifndef _TABULATEDFUNCTION_HPP_
+#define _TABULATEDFUNCTION_HPP_
+
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/log/log.hpp>
+
+#include "objectregister.hpp"
+#include "logging.hpp"
+
+using std::string;
+using std::vector;
+
+/// declare the boost logging stuff.
+BOOST_DECLARE_LOG(tabulatedfunction)
+
+/**
+\file
+Tabulation of expensive curve functions. Analytic curves such as hill-chart
+efficiencies or evaporation formulae are often called with a scalar argument
+at every step; a TabulatedFunction samples such a function once, over a
+declared domain, and afterwards answers calls by interpolating in a table.
+
+The grid is adaptive: the domain is split until the interpolant agrees with
+the function to within the tolerance at seven evenly spaced test points
+inside every interval, so the table is fine where the curve bends and coarse
+where it doesn't. The tolerance is therefore a sampled estimate, not a bound:
+a feature narrower than the spacing of the test points (a spike, or a kink
+between them) can go unnoticed. Measure() compares the table with the
+function on a much finer grid, and is worth checking for curves that aren't
+smooth. Intervals are interpolated linearly or by cubic Hermite polynomials
+through the function's values and (numerical) slopes; cubic tables usually
+need far fewer points for the same tolerance.
+
+Lookups use a guide table over the domain to jump straight to the interval,
+then evaluate a polynomial held in a flat array, so a call costs a few
+multiplications whatever the original function does. Arguments outside the
+domain are passed to the original function.
+
+A TabulatedFunction is itself a double (double) function object, so it can
+replace the function it tabulates wherever that is held in a
+boost::function:
+@code
+boost::function<double (double)> efficiency = ...;
+efficiency = TabulatedFunction(efficiency, 0.0, 500.0, 1e-6);
+@endcode
+
+Curve functions registered in an ObjectRegister as
+boost::function<double (double)>* can be tabulated by name with
+TabulateRegisteredFunction(), or from the ini file with a value of the form
+"tabulate <lower> <upper> <tolerance> [linear|cubic]".
+*/
+
+/// Interpolation used by a TabulatedFunction.
+enum TabulationMethod {
+    eLinearTable,   ///< piecewise linear
+    eCubicTable     ///< piecewise cubic Hermite
+};
+
+/// Accuracy and speed of a tabulated function compared with the original.
+struct TabulationReport {
+    size_t  Points;             ///< points in the table
+    double  Tolerance;          ///< tolerance asked for
+    double  MaxError;           ///< largest absolute error found
+    double  OriginalSeconds;    ///< time for the test calls to the original
+    double  TabulatedSeconds;   ///< time for the test calls to the table
+    double  Speedup;            ///< OriginalSeconds / TabulatedSeconds
+};
+
+class TabulatedFunction {
+public:
+    typedef boost::function<double (double)> Function;
+
+    /// Tabulate a function. If it is already a TabulatedFunction, the
+    /// function it tabulates is tabulated instead, so tables don't nest.
+    /// @param arFunction the function.
+    /// @param aLower the lower end of the domain.
+    /// @param aUpper the upper end of the domain.
+    /// @param aTolerance the largest absolute error allowed at the test
+    /// points (see above).
+    /// @param aMethod the interpolation to use.
+    /// @param aMaxPoints give up if the table would need more points.
+    TabulatedFunction(const Function& arFunction,
+                      double aLower, double aUpper, double aTolerance,
+                      TabulationMethod aMethod = eCubicTable,
+                      size_t aMaxPoints = 1 << 20);
+
+    /// The tabulated value, or the original function's value outside the
+    /// domain.
+    double operator()(double aX) const {
+        const Table& table = *mpTable;
+        if (!(aX >= table.Lower && aX <= table.Upper)) {
+            return table.Original(aX);
+        }
+        size_t bucket = (size_t)((aX - table.Lower) * table.GuideScale);
+        size_t i = table.Guide[bucket];
+        while (i + 2 < table.Knots.size() && aX >= table.Knots[i + 1]) {
+            ++i;
+        }
+        const double t = aX - table.Knots[i];
+        const double* c = &table.Coeffs[i * 4];
+        return c[0] + t * (c[1] + t * (c[2] + t * c[3]));
+    }
+
+    /// Number of points in the table.
+    size_t Points() const { return mpTable->Knots.size(); }
+    /// Lower end of the domain.
+    double Lower() const { return mpTable->Lower; }
+    /// Upper end of the domain.
+    double Upper() const { return mpTable->Upper; }
+    /// Largest absolute error allowed.
+    double Tolerance() const { return mpTable->Tolerance; }
+    /// The interpolation used.
+    TabulationMethod Method() const { return mMethod; }
+    /// The function tabulated.
+    const Function& Original() const { return mpTable->Original; }
+
+    /// Compare the table with the original function at aSamples points
+    /// evenly spread over the domain, for accuracy and for speed.
+    TabulationReport Measure(size_t aSamples = 100000) const;
+
+private:
+    /// the table, shared by copies
+    struct Table {
+        Function        Original;
+        double          Lower;
+        double          Upper;
+        double          Tolerance;
+        vector<double>  Knots;      ///< interval boundaries, ascending
+        vector<double>  Coeffs;     ///< 4 polynomial coefficients per interval
+        vector<size_t>  Guide;      ///< first interval of each guide bucket
+        double          GuideScale; ///< guide buckets per unit of x
+    };
+
+    /// a sample of the function
+    struct Node {
+        double X, Y, Slope;
+    };
+
+    Node MakeNode(double aX) const;
+    void Fit(const Node& arLeft, const Node& arRight, double* apCoeffs) const;
+    void Refine(const Node& arLeft, const Node& arRight, size_t aMaxPoints);
+
+    boost::shared_ptr<Table>    mpTable;
+    TabulationMethod            mMethod;
+};
+
+/// Replace a boost::function<double (double)> registered by pointer under
+/// arKey with a tabulated version of itself.
+/// @returns the accuracy and speed of the table.
+TabulationReport TabulateRegisteredFunction(ObjectRegister& arReg,
+                                            const string& arKey,
+                                            double aLower, double aUpper,
+                                            double aTolerance,
+                                            TabulationMethod aMethod = eCubicTable);
+
+#endif
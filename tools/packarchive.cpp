@@ -0,0 +1,61 @@
+#include "../archivefilesystem.hpp"
+
+#include <iostream>
+#include <fstream>
+
+/**
+\file
+Packs a model's files into an archive for ArchiveFileSystem.
+
+Usage: packarchive archive directory [list]
+
+Packs the files under the directory, or, if a list file is given, the files
+it names (one per line, relative to the directory) in that order. Listing
+the files in the order the model reads them makes its start-up reads
+sequential. The archive is checked after it is written.
+*/
+
+int main(int argc, char* argv[]) {
+    if (argc < 3 || argc > 4) {
+        std::cerr << "usage: packarchive archive directory [list]" << std::endl;
+        return 2;
+    }
+    string archive = argv[1];
+    string root = argv[2];
+    try {
+        vector<string> files;
+        if (argc == 4) {
+            std::ifstream list(argv[3]);
+            if (!list) {
+                std::cerr << "Couldn't read " << argv[3] << std::endl;
+                return 1;
+            }
+            string line;
+            while (std::getline(list, line)) {
+                if (!line.empty() && line[line.size() - 1] == '\r') {
+                    line.erase(line.size() - 1);
+                }
+                if (!line.empty() && line[0] != '#') {
+                    files.push_back(line);
+                }
+            }
+        } else {
+            files = ListArchiveFiles(root);
+        }
+        unsigned long long bytes = PackArchive(archive, root, files);
+
+        ArchiveFileSystem packed(archive);
+        vector<string> damaged = packed.Verify();
+        if (!damaged.empty()) {
+            std::cerr << archive << ": " << damaged.size()
+                << " files don't match, first " << damaged[0] << std::endl;
+            return 1;
+        }
+        std::cout << archive << ": " << packed.Files() << " files, "
+            << bytes << " bytes" << std::endl;
+    } catch (TemsimException& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,11 @@
+#include "windowedseries.hpp"
+
+/// define boost logging stuff.
+BOOST_DEFINE_LOG(windowedseries, "windowedseries")
+
+/**
+\file
+Implementation of the windowed series.
+*/
+
+const char* gSeriesFileMagic = "TSERIES1";
@@ -0,0 +1,536 @@
+#ifndef _WINDOWEDSERIES_HPP_
+#define _WINDOWEDSERIES_HPP_
+
+#include <map>
+#include <vector>
+#include <deque>
+#include <string>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/format.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/log/log.hpp>
+
+#include "interp.hpp"
+#include "hugepagealloc.hpp"
+#include "fileadvice.hpp"
+#include "temsimexception.hpp"
+#include "logging.hpp"
+
+using std::map;
+using std::vector;
+using std::deque;
+using std::string;
+
+/// declare the boost logging stuff.
+BOOST_DECLARE_LOG(windowedseries)
+
+/**
+\file
+Out-of-core time series. A WindowedSeries keeps only a sliding window of
+chunks of a (possibly very long) series in memory, around the key most
+recently asked for. Chunks ahead of the window are read by a background
+thread before they are needed, and chunks that have been passed are evicted,
+so memory use is bounded by the window size however long the input is.
+
+The window is held in an ordinary TSMap, so any of the interpolators in
+interp.hpp can be used with it unchanged:
+@code
+MappedSeriesFile<DateTime, double>::Ptr file(
+    new MappedSeriesFile<DateTime, double>("inflows.tsb"));
+WindowedSeries<DateTime, double> inflow(file);
+LinearInterp<DateTime, double> interp;
+double v = inflow.Value(interp, now);
+@endcode
+*/
+
+/// A contiguous run of points from a series, loaded and evicted as a unit.
+template <typename KeyType, typename ValType>
+struct SeriesChunk {
+    typedef boost::shared_ptr<SeriesChunk<KeyType, ValType> > Ptr;
+
+    vector<KeyType, HugePageAllocator<KeyType> > Keys;    ///< keys, in ascending order
+    vector<ValType, HugePageAllocator<ValType> > Values;  ///< value for each key
+};
+
+/**
+Abstract source of chunks for a WindowedSeries. Load() is called from the
+prefetch thread as well as the simulation thread, so implementations must be
+safe to call concurrently.
+*/
+template <typename KeyType, typename ValType>
+class SeriesChunkSource {
+public:
+    typedef boost::shared_ptr<SeriesChunkSource<KeyType, ValType> > Ptr;
+    typedef SeriesChunk<KeyType, ValType> Chunk;
+
+    virtual ~SeriesChunkSource() {}
+
+    /// Number of chunks in the series.
+    virtual size_t NumChunks() const=0;
+
+    /// First key of the given chunk. Called once per chunk when a window is
+    /// constructed.
+    virtual KeyType FirstKey(size_t aChunk) const=0;
+
+    /// Read the given chunk.
+    virtual typename Chunk::Ptr Load(size_t aChunk) const=0;
+
+    /// Hint that the given chunk will be loaded soon.
+    virtual void WillNeed(size_t aChunk) const {}
+
+    /// Hint that the given chunk will not be needed again soon.
+    virtual void DontNeed(size_t aChunk) const {}
+};
+
+/**
+Chunk source reading the binary series format from a memory-mapped file.
+The file is a SeriesFileHeader followed by Count (key, value) records, with
+the raw bytes of the key immediately followed by the raw bytes of the value.
+KeyType and ValType must therefore be plain data (DateTime and double are.)
+*/
+struct SeriesFileHeader {
+    char        Magic[8];   ///< "TSERIES1"
+    unsigned    KeySize;    ///< sizeof(KeyType) when written
+    unsigned    ValSize;    ///< sizeof(ValType) when written
+    unsigned long long Count; ///< number of records
+};
+
+/// magic string at the start of a binary series file
+extern const char* gSeriesFileMagic;
+
+template <typename KeyType, typename ValType>
+class MappedSeriesFile : public SeriesChunkSource<KeyType, ValType> {
+public:
+    typedef boost::shared_ptr<MappedSeriesFile<KeyType, ValType> > Ptr;
+    typedef SeriesChunk<KeyType, ValType> Chunk;
+
+    /// Map the named file.
+    /// @param arFileName the binary series file.
+    /// @param aChunkPoints number of points per chunk.
+    MappedSeriesFile(const string& arFileName, size_t aChunkPoints = 65536)
+    :   mFileName(arFileName),
+        mChunkPoints(aChunkPoints)
+    {
+        try {
+            mFile.open(arFileName);
+        } catch (std::exception& e) {
+            throw TemsimException("Couldn't map series file " + arFileName
+                + " (" + e.what() + ")", "WindowedSeries");
+        }
+        if (mFile.size() < sizeof(SeriesFileHeader)) {
+            throw TemsimException("Series file " + arFileName
+                + " is too short", "WindowedSeries");
+        }
+        SeriesFileHeader header;
+        memcpy(&header, mFile.data(), sizeof(header));
+        if (memcmp(header.Magic, gSeriesFileMagic, sizeof(header.Magic)) != 0
+            || header.KeySize != sizeof(KeyType)
+            || header.ValSize != sizeof(ValType)) {
+            throw TemsimException("Series file " + arFileName
+                + " has the wrong format", "WindowedSeries");
+        }
+        if (mFile.size() < sizeof(header) + header.Count * RecordSize()) {
+            throw TemsimException("Series file " + arFileName
+                + " is truncated", "WindowedSeries");
+        }
+        if (mChunkPoints == 0) {
+            mChunkPoints = 1;
+        }
+        mCount = (size_t)header.Count;
+        mpRecords = mFile.data() + sizeof(header);
+    }
+
+    size_t NumChunks() const {
+        return (mCount + mChunkPoints - 1) / mChunkPoints;
+    }
+
+    KeyType FirstKey(size_t aChunk) const {
+        KeyType key;
+        memcpy(&key, mpRecords + aChunk * mChunkPoints * RecordSize(),
+               sizeof(KeyType));
+        return key;
+    }
+
+    typename Chunk::Ptr Load(size_t aChunk) const {
+        size_t first = aChunk * mChunkPoints;
+        size_t last = std::min(first + mChunkPoints, mCount);
+
+        typename Chunk::Ptr chunk(new Chunk);
+        chunk->Keys.resize(last - first);
+        chunk->Values.resize(last - first);
+        const char* p = mpRecords + first * RecordSize();
+        for (size_t i = 0; i < last - first; ++i) {
+            memcpy(&chunk->Keys[i], p, sizeof(KeyType));
+            memcpy(&chunk->Values[i], p + sizeof(KeyType), sizeof(ValType));
+            p += RecordSize();
+        }
+        return chunk;
+    }
+
+    void WillNeed(size_t aChunk) const {
+        AdviseWillNeed(ChunkStart(aChunk), ChunkBytes(aChunk));
+    }
+
+    void DontNeed(size_t aChunk) const {
+        AdviseDontNeed(ChunkStart(aChunk), ChunkBytes(aChunk));
+    }
+
+    /// Write a series to a file in the binary series format.
+    /// @param arFileName the file to (over)write.
+    /// @param arPoints the series.
+    static void Write(const string& arFileName,
+                      const map<KeyType, ValType>& arPoints) {
+        std::ofstream out(arFileName.c_str(), std::ios::binary);
+        if (!out) {
+            throw TemsimException("Couldn't write series file " + arFileName,
+                "WindowedSeries");
+        }
+        SeriesFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.Magic, gSeriesFileMagic, sizeof(header.Magic));
+        header.KeySize = sizeof(KeyType);
+        header.ValSize = sizeof(ValType);
+        header.Count = arPoints.size();
+        out.write((const char*)&header, sizeof(header));
+        for (typename map<KeyType, ValType>::const_iterator iter = arPoints.begin();
+            iter != arPoints.end();
+            ++iter) {
+            out.write((const char*)&iter->first, sizeof(KeyType));
+            out.write((const char*)&iter->second, sizeof(ValType));
+        }
+    }
+
+private:
+    static size_t RecordSize() { return sizeof(KeyType) + sizeof(ValType); }
+
+    const char* ChunkStart(size_t aChunk) const {
+        return mpRecords + aChunk * mChunkPoints * RecordSize();
+    }
+
+    size_t ChunkBytes(size_t aChunk) const {
+        size_t first = aChunk * mChunkPoints;
+        return (std::min(first + mChunkPoints, mCount) - first) * RecordSize();
+    }
+
+    string      mFileName;      ///< name of the mapped file
+    size_t      mChunkPoints;   ///< points per chunk
+    size_t      mCount;         ///< total number of points
+    const char* mpRecords;      ///< first record in the mapping
+    boost::iostreams::mapped_file_source mFile; ///< the mapping
+};
+
+/**
+A series that holds only a window of chunks around the current key. The
+window always contains the chunk holding the key plus aChunksBehind chunks
+before it and one after it, so interpolators can see the neighbouring points
+at chunk boundaries. Up to aChunksAhead further chunks are read in the
+background. Moving backwards (eg. at the start of a replicate) works, but
+will block while the earlier chunks are read.
+*/
+template <typename KeyType, typename ValType>
+class WindowedSeries {
+public:
+    typedef boost::shared_ptr<WindowedSeries<KeyType, ValType> > Ptr;
+    typedef typename Interpolator<KeyType, ValType>::TSMap TSMap;
+    typedef SeriesChunkSource<KeyType, ValType> Source;
+    typedef typename Source::Chunk Chunk;
+
+    /// Construct a window over the given source.
+    /// @param apSource where the chunks come from.
+    /// @param aChunksAhead number of chunks to prefetch past the window.
+    /// @param aChunksBehind number of passed chunks to keep in the window.
+    WindowedSeries(typename Source::Ptr apSource,
+                   size_t aChunksAhead = 2,
+                   size_t aChunksBehind = 1);
+
+    ~WindowedSeries();
+
+    /// Get the value at the given key using the supplied interpolator.
+    /// @param arInterp interpolation policy, eg. LinearInterp.
+    /// @param arKey the key to look up.
+    /// @returns the interpolated value.
+    ValType Value(const Interpolator<KeyType, ValType>& arInterp,
+                  const KeyType& arKey) {
+        return arInterp.Value(Points(arKey), arKey);
+    }
+
+    /// Get the points in the window, after moving the window so that it
+    /// covers the given key.
+    const TSMap& Points(const KeyType& arKey);
+
+    /// Number of chunks read so far (including prefetched chunks.)
+    size_t ChunksLoaded() const {
+        boost::mutex::scoped_lock lock(mMutex);
+        return mChunksLoaded;
+    }
+
+    /// Number of times the window had to wait for a chunk to be read.
+    size_t Stalls() const {
+        boost::mutex::scoped_lock lock(mMutex);
+        return mStalls;
+    }
+
+private:
+    /// find the chunk whose key range contains the key
+    size_t ChunkFor(const KeyType& arKey) const;
+
+    /// move the window so that it is centred on the given chunk
+    void MoveTo(size_t aChunk);
+
+    /// get a chunk, waiting for the prefetch thread if it is in flight
+    typename Chunk::Ptr Acquire(size_t aChunk);
+
+    /// queue the chunks after the window for prefetching
+    void SchedulePrefetch(size_t aChunk);
+
+    /// prefetch thread main loop
+    void PrefetchLoop();
+
+    typename Source::Ptr    mpSource;       ///< where the chunks come from
+    size_t                  mChunksAhead;   ///< chunks to prefetch
+    size_t                  mChunksBehind;  ///< passed chunks to keep
+    vector<KeyType>         mFirstKeys;     ///< first key of each chunk
+
+    TSMap                   mPoints;        ///< points in the window
+    size_t                  mFirst;         ///< first chunk in the window
+    size_t                  mLast;          ///< one past the last chunk in the window
+    size_t                  mCurrent;       ///< chunk containing the last key
+    bool                    mValid;         ///< false until a window is complete
+
+    // shared with the prefetch thread - guarded by mMutex
+    mutable boost::mutex    mMutex;
+    boost::condition        mWork;          ///< signalled when work is queued
+    boost::condition        mDone;          ///< signalled when a chunk is read
+    deque<size_t>           mQueue;         ///< chunks to read
+    map<size_t, typename Chunk::Ptr> mReady; ///< chunks read ahead of use
+    size_t                  mInFlight;      ///< chunk being read, or NumChunks
+    bool                    mStop;          ///< tells the thread to finish
+    size_t                  mChunksLoaded;
+    size_t                  mStalls;
+
+    boost::thread*          mpThread;       ///< the prefetch thread
+};
+
+template <typename K, typename V>
+WindowedSeries<K, V>::WindowedSeries(typename Source::Ptr apSource,
+                                     size_t aChunksAhead,
+                                     size_t aChunksBehind)
+:   mpSource(apSource),
+    mChunksAhead(aChunksAhead),
+    mChunksBehind(aChunksBehind),
+    mFirst(0),
+    mLast(0),
+    mCurrent(0),
+    mValid(false),
+    mInFlight(apSource->NumChunks()),
+    mStop(false),
+    mChunksLoaded(0),
+    mStalls(0),
+    mpThread(0)
+{
+    if (mpSource->NumChunks() == 0) {
+        throw TemsimException("Windowed series has no data", "WindowedSeries");
+    }
+    mFirstKeys.reserve(mpSource->NumChunks());
+    for (size_t i = 0; i < mpSource->NumChunks(); ++i) {
+        mFirstKeys.push_back(mpSource->FirstKey(i));
+    }
+    mpThread = new boost::thread(
+        boost::bind(&WindowedSeries<K, V>::PrefetchLoop, this));
+}
+
+// stop and join the prefetch thread
+template <typename K, typename V>
+WindowedSeries<K, V>::~WindowedSeries() {
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        mStop = true;
+        mWork.notify_all();
+    }
+    if (mpThread) {
+        mpThread->join();
+        delete mpThread;
+        mpThread = 0;
+    }
+}
+
+template <typename K, typename V>
+const typename WindowedSeries<K, V>::TSMap&
+WindowedSeries<K, V>::Points(const K& arKey) {
+    size_t chunk = ChunkFor(arKey);
+    if (!mValid || chunk != mCurrent) {
+        MoveTo(chunk);
+    }
+    return mPoints;
+}
+
+template <typename K, typename V>
+size_t WindowedSeries<K, V>::ChunkFor(const K& arKey) const {
+    // fast path - still in the same chunk as last time
+    if (mValid && !(arKey < mFirstKeys[mCurrent])
+        && (mCurrent + 1 == mFirstKeys.size()
+            || arKey < mFirstKeys[mCurrent + 1])) {
+        return mCurrent;
+    }
+    typename vector<K>::const_iterator iter =
+        std::upper_bound(mFirstKeys.begin(), mFirstKeys.end(), arKey);
+    if (iter == mFirstKeys.begin()) {
+        // before the first point - use the first chunk to extrapolate
+        return 0;
+    }
+    return (iter - mFirstKeys.begin()) - 1;
+}
+
+template <typename K, typename V>
+void WindowedSeries<K, V>::MoveTo(size_t aChunk) {
+    size_t first = aChunk > mChunksBehind ? aChunk - mChunksBehind : 0;
+    size_t last = std::min(aChunk + 2, mFirstKeys.size());
+
+    // the window is incomplete until every chunk is in, so if a read
+    // throws, the next move starts again from nothing
+    bool valid = mValid;
+    mValid = false;
+    if (!valid) {
+        mPoints.clear();
+    }
+
+    // evict the chunks that have dropped out of the window
+    for (size_t i = mFirst; valid && i < mLast; ++i) {
+        if (i >= first && i < last) {
+            continue;
+        }
+        typename TSMap::iterator lower = mPoints.lower_bound(mFirstKeys[i]);
+        typename TSMap::iterator upper = (i + 1 < mFirstKeys.size())
+            ? mPoints.lower_bound(mFirstKeys[i + 1])
+            : mPoints.end();
+        mPoints.erase(lower, upper);
+        mpSource->DontNeed(i);
+    }
+
+    // bring in the chunks that are new to the window
+    for (size_t i = first; i < last; ++i) {
+        if (valid && i >= mFirst && i < mLast) {
+            continue;
+        }
+        typename Chunk::Ptr chunk = Acquire(i);
+        typename TSMap::iterator hint = mPoints.lower_bound(mFirstKeys[i]);
+        for (size_t j = 0; j < chunk->Keys.size(); ++j) {
+            hint = mPoints.insert(hint,
+                typename TSMap::value_type(chunk->Keys[j], chunk->Values[j]));
+            ++hint;
+        }
+    }
+
+    BOOST_LOGL(windowedseries, info) << "Window moved to chunks ["
+        << first << ", " << last << ")" << std::endl;
+
+    mFirst = first;
+    mLast = last;
+    mCurrent = aChunk;
+    mValid = true;
+    SchedulePrefetch(aChunk);
+}
+
+template <typename K, typename V>
+typename WindowedSeries<K, V>::Chunk::Ptr
+WindowedSeries<K, V>::Acquire(size_t aChunk) {
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        // don't read it twice if it's queued but not started
+        deque<size_t>::iterator queued =
+            std::find(mQueue.begin(), mQueue.end(), aChunk);
+        if (queued != mQueue.end()) {
+            mQueue.erase(queued);
+        }
+        bool waited = mInFlight == aChunk;
+        while (mInFlight == aChunk) {
+            mDone.wait(lock);
+        }
+        typename map<size_t, typename Chunk::Ptr>::iterator ready =
+            mReady.find(aChunk);
+        if (ready != mReady.end()) {
+            typename Chunk::Ptr chunk = ready->second;
+            mReady.erase(ready);
+            if (waited) {
+                ++mStalls;
+            }
+            return chunk;
+        }
+        // we block on the read below, whether or not we waited for the
+        // prefetch thread first; count it as one stall
+        ++mStalls;
+        ++mChunksLoaded;
+    }
+    // not prefetched - read it ourselves
+    return mpSource->Load(aChunk);
+}
+
+template <typename K, typename V>
+void WindowedSeries<K, V>::SchedulePrefetch(size_t aChunk) {
+    size_t first = std::min(aChunk + 2, mFirstKeys.size());
+    size_t last = std::min(first + mChunksAhead, mFirstKeys.size());
+
+    boost::mutex::scoped_lock lock(mMutex);
+    // drop anything read ahead that is no longer ahead of the window
+    for (typename map<size_t, typename Chunk::Ptr>::iterator iter = mReady.begin();
+        iter != mReady.end();
+        ) {
+        if (iter->first < first || iter->first >= last) {
+            mReady.erase(iter++);
+        } else {
+            ++iter;
+        }
+    }
+    mQueue.clear();
+    for (size_t i = first; i < last; ++i) {
+        if (mReady.find(i) == mReady.end() && mInFlight != i) {
+            mpSource->WillNeed(i);
+            mQueue.push_back(i);
+        }
+    }
+    if (!mQueue.empty()) {
+        mWork.notify_one();
+    }
+}
+
+template <typename K, typename V>
+void WindowedSeries<K, V>::PrefetchLoop() {
+    boost::mutex::scoped_lock lock(mMutex);
+    while (true) {
+        while (!mStop && mQueue.empty()) {
+            mWork.wait(lock);
+        }
+        if (mStop) {
+            return;
+        }
+        size_t chunk = mQueue.front();
+        mQueue.pop_front();
+        mInFlight = chunk;
+
+        lock.unlock();
+        typename Chunk::Ptr loaded;
+        try {
+            loaded = mpSource->Load(chunk);
+        } catch (...) {
+            // leave it for Acquire to read (and report) synchronously
+        }
+        lock.lock();
+
+        mInFlight = mFirstKeys.size();
+        if (loaded) {
+            mReady[chunk] = loaded;
+            ++mChunksLoaded;
+        }
+        mDone.notify_all();
+    }
+}
+
+#endif